@@ -5,6 +5,8 @@
 %include "carrays.i"
 
 %array_class(char, charArray);
+%array_class(int, intArray);
+%array_class(uint32_t, uint32Array);
 
 %apply int *OUTPUT { int *sock };
 %apply int *OUTPUT { int *count };
@@ -12,9 +14,11 @@
 %apply int *OUTPUT { int *mode };
 %apply uint8_t *OUTPUT { uint8_t *version_major };
 %apply uint8_t *OUTPUT { uint8_t *version_minor };
+%apply uint32_t *OUTPUT { uint32_t *ticket };
 
 %{
 #define ILM_DRIVE_MAX_NUM       512
+#define ILM_LOCK_BATCH_MAX_NUM  1024
 
 struct idm_lock_id {
         char vg_uuid[32];
@@ -30,12 +34,113 @@ struct idm_lock_op {
         int timeout; /* -1 means unlimited timeout */
 };
 
+struct ilm_completion {
+        uint32_t ticket;
+        int result;
+};
+
+#define ILM_STATS_OP_LOCK       0
+#define ILM_STATS_OP_UNLOCK     1
+#define ILM_STATS_OP_REFRESH    2
+#define ILM_STATS_OP_BREAK      3
+#define ILM_STATS_OP_DESTROY    4
+#define ILM_STATS_OP_READ_GROUP 5
+#define ILM_STATS_OP_INQUIRY    6
+#define ILM_STATS_OP_NUM        7
+#define ILM_STATS_ERR_NUM       8
+#define ILM_STATS_BUCKET_NUM    96
+#define ILM_STATS_PATH_LEN      64
+
+struct ilm_drive_stats {
+        uint64_t wwn;
+        char path[ILM_STATS_PATH_LEN];
+        uint64_t count[ILM_STATS_OP_NUM];
+        uint64_t total_us[ILM_STATS_OP_NUM];
+        uint64_t max_us[ILM_STATS_OP_NUM];
+        uint64_t error[ILM_STATS_OP_NUM][ILM_STATS_ERR_NUM];
+        uint64_t hist[ILM_STATS_OP_NUM][ILM_STATS_BUCKET_NUM];
+};
+
+#define ILM_STAGE_QUEUE         0
+#define ILM_STAGE_LOCK_WAIT     1
+#define ILM_STAGE_ISSUE         2
+#define ILM_STAGE_DRIVE         3
+#define ILM_STAGE_QUORUM        4
+#define ILM_STAGE_REPLY         5
+#define ILM_STAGE_TOTAL         6
+#define ILM_STAGE_NUM           7
+
+struct ilm_stage_stats {
+        uint64_t slow;
+        uint64_t count[ILM_STAGE_NUM];
+        uint64_t total_us[ILM_STAGE_NUM];
+        uint64_t max_us[ILM_STAGE_NUM];
+        uint64_t hist[ILM_STAGE_NUM][ILM_STATS_BUCKET_NUM];
+};
+
+#define ILM_LOCK_STATS_NUM      64
+
+struct ilm_lock_stats {
+        struct idm_lock_id id;
+        uint64_t contention;
+        uint64_t error;
+        uint64_t attempts;
+        uint64_t acquired;
+        uint64_t majority_total_us;
+        uint64_t majority_max_us;
+        uint64_t retries;
+        uint64_t busy;
+        uint64_t again;
+        uint64_t breaks;
+        uint64_t convert_fail;
+        uint64_t renew_fail;
+};
+
+#define ILM_RENEW_STATS_DRIVE   0
+#define ILM_RENEW_STATS_LOCK    1
+
+#define ILM_RENEW_STATS_LOCK_NUM        64
+
+#define ILM_RENEW_LEVEL_OK      0
+#define ILM_RENEW_LEVEL_WARN    1
+#define ILM_RENEW_LEVEL_CRIT    2
+
+struct ilm_renew_stats {
+        uint32_t type;
+        uint32_t level;
+        struct idm_lock_id id;
+        uint64_t wwn;
+        char path[ILM_STATS_PATH_LEN];
+        uint64_t period_ms;
+        int64_t margin_ms;
+        int64_t min_margin_ms;
+        uint64_t warnings;
+        uint64_t count;
+        uint64_t max_gap_ms;
+        uint64_t hist[ILM_STATS_BUCKET_NUM];
+};
+
 int ilm_connect(int *sock);
 int ilm_disconnect(int sock);
 int ilm_version(int sock, char *drive, uint8_t *version_major, uint8_t *version_minor);
 int ilm_lock(int sock, struct idm_lock_id *id, struct idm_lock_op *op);
+int ilm_lock_deadline(int sock, struct idm_lock_id *id,
+                      struct idm_lock_op *op, int deadline);
+int ilm_lock_cancel(int sock, struct idm_lock_id *id);
 int ilm_unlock(int sock, struct idm_lock_id *id);
 int ilm_convert(int sock, struct idm_lock_id *id, uint32_t mode);
+int ilm_lock_many(int sock, struct idm_lock_id *ids, uint32_t *modes, int num,
+                  struct idm_lock_op *op, int *results);
+int ilm_unlock_many(int sock, struct idm_lock_id *ids, int num, int *results);
+int ilm_convert_many(int sock, struct idm_lock_id *ids, uint32_t *modes,
+                     int num, int *results);
+int ilm_lock_submit(int sock, struct idm_lock_id *id, struct idm_lock_op *op,
+                    uint32_t *ticket);
+int ilm_unlock_submit(int sock, struct idm_lock_id *id, uint32_t *ticket);
+int ilm_convert_submit(int sock, struct idm_lock_id *id, uint32_t mode,
+                       uint32_t *ticket);
+int ilm_async_fd(int sock);
+int ilm_reap(int sock, struct ilm_completion *comp, int max);
 int ilm_write_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len);
 int ilm_read_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len);
 int ilm_get_host_count(int sock, struct idm_lock_id *id,
@@ -46,9 +151,14 @@ int ilm_set_host_id(int sock, char *id, int id_len);
 int ilm_stop_renew(int sock);
 int ilm_start_renew(int sock);
 int ilm_inject_fault(int sock, int percentage);
+int ilm_get_stats(int sock, struct ilm_drive_stats *stats, int num);
+int ilm_get_stage_stats(int sock, struct ilm_stage_stats *stats);
+int ilm_get_lock_stats(int sock, struct ilm_lock_stats *stats, int num);
+int ilm_get_renew_stats(int sock, struct ilm_renew_stats *stats, int num);
 %}
 
 #define ILM_DRIVE_MAX_NUM       512
+#define ILM_LOCK_BATCH_MAX_NUM  1024
 
 //TODO: Replace with common include?
 #define IDM_MODE_UNLOCK         0
@@ -69,12 +179,113 @@ struct idm_lock_op {
         int timeout; /* -1 means unlimited timeout */
 };
 
+struct ilm_completion {
+        uint32_t ticket;
+        int result;
+};
+
+#define ILM_STATS_OP_LOCK       0
+#define ILM_STATS_OP_UNLOCK     1
+#define ILM_STATS_OP_REFRESH    2
+#define ILM_STATS_OP_BREAK      3
+#define ILM_STATS_OP_DESTROY    4
+#define ILM_STATS_OP_READ_GROUP 5
+#define ILM_STATS_OP_INQUIRY    6
+#define ILM_STATS_OP_NUM        7
+#define ILM_STATS_ERR_NUM       8
+#define ILM_STATS_BUCKET_NUM    96
+#define ILM_STATS_PATH_LEN      64
+
+struct ilm_drive_stats {
+        uint64_t wwn;
+        char path[ILM_STATS_PATH_LEN];
+        uint64_t count[ILM_STATS_OP_NUM];
+        uint64_t total_us[ILM_STATS_OP_NUM];
+        uint64_t max_us[ILM_STATS_OP_NUM];
+        uint64_t error[ILM_STATS_OP_NUM][ILM_STATS_ERR_NUM];
+        uint64_t hist[ILM_STATS_OP_NUM][ILM_STATS_BUCKET_NUM];
+};
+
+#define ILM_STAGE_QUEUE         0
+#define ILM_STAGE_LOCK_WAIT     1
+#define ILM_STAGE_ISSUE         2
+#define ILM_STAGE_DRIVE         3
+#define ILM_STAGE_QUORUM        4
+#define ILM_STAGE_REPLY         5
+#define ILM_STAGE_TOTAL         6
+#define ILM_STAGE_NUM           7
+
+struct ilm_stage_stats {
+        uint64_t slow;
+        uint64_t count[ILM_STAGE_NUM];
+        uint64_t total_us[ILM_STAGE_NUM];
+        uint64_t max_us[ILM_STAGE_NUM];
+        uint64_t hist[ILM_STAGE_NUM][ILM_STATS_BUCKET_NUM];
+};
+
+#define ILM_LOCK_STATS_NUM      64
+
+struct ilm_lock_stats {
+        struct idm_lock_id id;
+        uint64_t contention;
+        uint64_t error;
+        uint64_t attempts;
+        uint64_t acquired;
+        uint64_t majority_total_us;
+        uint64_t majority_max_us;
+        uint64_t retries;
+        uint64_t busy;
+        uint64_t again;
+        uint64_t breaks;
+        uint64_t convert_fail;
+        uint64_t renew_fail;
+};
+
+#define ILM_RENEW_STATS_DRIVE   0
+#define ILM_RENEW_STATS_LOCK    1
+
+#define ILM_RENEW_STATS_LOCK_NUM        64
+
+#define ILM_RENEW_LEVEL_OK      0
+#define ILM_RENEW_LEVEL_WARN    1
+#define ILM_RENEW_LEVEL_CRIT    2
+
+struct ilm_renew_stats {
+        uint32_t type;
+        uint32_t level;
+        struct idm_lock_id id;
+        uint64_t wwn;
+        char path[ILM_STATS_PATH_LEN];
+        uint64_t period_ms;
+        int64_t margin_ms;
+        int64_t min_margin_ms;
+        uint64_t warnings;
+        uint64_t count;
+        uint64_t max_gap_ms;
+        uint64_t hist[ILM_STATS_BUCKET_NUM];
+};
+
 int ilm_connect(int *sock);
 int ilm_disconnect(int sock);
 int ilm_version(int sock, char *drive, uint8_t *version_major, uint8_t *version_minor);
 int ilm_lock(int sock, struct idm_lock_id *id, struct idm_lock_op *op);
+int ilm_lock_deadline(int sock, struct idm_lock_id *id,
+                      struct idm_lock_op *op, int deadline);
+int ilm_lock_cancel(int sock, struct idm_lock_id *id);
 int ilm_unlock(int sock, struct idm_lock_id *id);
 int ilm_convert(int sock, struct idm_lock_id *id, uint32_t mode);
+int ilm_lock_many(int sock, struct idm_lock_id *ids, uint32_t *modes, int num,
+                  struct idm_lock_op *op, int *results);
+int ilm_unlock_many(int sock, struct idm_lock_id *ids, int num, int *results);
+int ilm_convert_many(int sock, struct idm_lock_id *ids, uint32_t *modes,
+                     int num, int *results);
+int ilm_lock_submit(int sock, struct idm_lock_id *id, struct idm_lock_op *op,
+                    uint32_t *ticket);
+int ilm_unlock_submit(int sock, struct idm_lock_id *id, uint32_t *ticket);
+int ilm_convert_submit(int sock, struct idm_lock_id *id, uint32_t mode,
+                       uint32_t *ticket);
+int ilm_async_fd(int sock);
+int ilm_reap(int sock, struct ilm_completion *comp, int max);
 int ilm_write_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len);
 int ilm_read_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len);
 int ilm_get_host_count(int sock, struct idm_lock_id *id,
@@ -85,6 +296,16 @@ int ilm_set_host_id(int sock, char *id, int id_len);
 int ilm_stop_renew(int sock);
 int ilm_start_renew(int sock);
 int ilm_inject_fault(int sock, int percentage);
+int ilm_get_stats(int sock, struct ilm_drive_stats *stats, int num);
+int ilm_get_stage_stats(int sock, struct ilm_stage_stats *stats);
+int ilm_get_lock_stats(int sock, struct ilm_lock_stats *stats, int num);
+int ilm_get_renew_stats(int sock, struct ilm_renew_stats *stats, int num);
+
+%array_class(struct idm_lock_id, idmLockIdArray);
+%array_class(struct ilm_completion, ilmCompletionArray);
+%array_class(struct ilm_drive_stats, ilmDriveStatsArray);
+%array_class(struct ilm_lock_stats, ilmLockStatsArray);
+%array_class(struct ilm_renew_stats, ilmRenewStatsArray);
 
 %extend idm_lock_op {
         void set_drive_names(int i, char *path) {
@@ -101,3 +322,43 @@ int ilm_inject_fault(int sock, int percentage);
                 memcpy($self->lv_uuid, id, 32);
         }
 }
+
+%extend ilm_drive_stats {
+        uint64_t get_count(int op) {
+                return $self->count[op];
+        }
+
+        uint64_t get_total_us(int op) {
+                return $self->total_us[op];
+        }
+
+        uint64_t get_max_us(int op) {
+                return $self->max_us[op];
+        }
+
+        uint64_t get_error(int op, int err) {
+                return $self->error[op][err];
+        }
+
+        uint64_t get_hist(int op, int bucket) {
+                return $self->hist[op][bucket];
+        }
+}
+
+%extend ilm_stage_stats {
+        uint64_t get_count(int stage) {
+                return $self->count[stage];
+        }
+
+        uint64_t get_total_us(int stage) {
+                return $self->total_us[stage];
+        }
+
+        uint64_t get_max_us(int stage) {
+                return $self->max_us[stage];
+        }
+
+        uint64_t get_hist(int stage, int bucket) {
+                return $self->hist[stage][bucket];
+        }
+}
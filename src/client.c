@@ -14,73 +14,53 @@
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/eventfd.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include "client.h"
 #include "cmd.h"
+#include "ilm.h"
 #include "ilm_internal.h"
 #include "list.h"
 #include "log.h"
 #include "lockspace.h"
+#include "trace.h"
 
 #define CLIENT_STATE_RUN	1
 #define CLIENT_STATE_SUSPEND	2
 #define CLIENT_STATE_EXIT	3
 
-static struct list_head client_list = LIST_HEAD_INIT(client_list);
-static pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int client_efd;
-static int client_updated = 0;
-static int client_num = 0;
-static int sock_fd;
-static int lock_fd;
-
-static int _client_is_valid(struct client *cl)
-{
-        struct client *pos;
-	int ret = 0;
-
-	pthread_mutex_lock(&client_list_mutex);
+/* Enough for the drive paths of a request with four drives in ILM_PROTO_V1 */
+#define CLIENT_RX_BUF_LEN	(4 * PATH_MAX)
 
-	list_for_each_entry(pos, &client_list, list) {
+/* The longest request is to acquire a lock with all drives in ILM_PROTO_V1 */
+#define CLIENT_MSG_MAX_LEN	(ILM_DRIVE_MAX_NUM * PATH_MAX + 4096)
 
-		if (pos == cl) {
-			ret = 1;
-			break;
-		}
-	}
+/* Milliseconds a legacy client may stall in the middle of a request */
+#define CLIENT_RECV_TIMEOUT	10000
 
-	pthread_mutex_unlock(&client_list_mutex);
-	return ret;
-}
+/* Milliseconds to wait for the part of the killpath it doesn't send */
+#define CLIENT_RECV_SHORT_WAIT	20
 
-static struct client *_fd_to_client(int fd)
-{
-        struct client *cl;
-	int found = 0;
+/* Maximum events handled by one round of the main loop */
+#define CLIENT_EPOLL_EVENTS	64
 
-	pthread_mutex_lock(&client_list_mutex);
-
-	list_for_each_entry(cl, &client_list, list) {
-
-		if (cl->fd == fd) {
-			found = 1;
-			break;
-		}
-	}
-
-	pthread_mutex_unlock(&client_list_mutex);
+static struct list_head client_list = LIST_HEAD_INIT(client_list);
+static pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int client_epfd = -1;
+static int sock_fd;
+static int lock_fd;
 
-	if (found)
-		return cl;
+/* Connected clients, read by the metrics exporter without the mutex */
+static int client_num;
 
-	return NULL;
-}
+static int ilm_client_request(struct client *cl);
 
 static int ilm_get_peer_pid(int fd)
 {
@@ -93,102 +73,79 @@ static int ilm_get_peer_pid(int fd)
 	return cred.pid;
 }
 
-int ilm_client_is_updated(void)
+/*
+ * Every client is polled with EPOLLONESHOT, so the main thread handles one
+ * event of a client at a time, and the client is armed again once the
+ * event is done.  A client which is suspended is simply not armed until
+ * it's resumed.
+ */
+static void ilm_client_arm_unsafe(struct client *cl)
 {
-	int updated;
-
-	pthread_mutex_lock(&client_list_mutex);
+	struct epoll_event ev;
 
-	updated = client_updated;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = cl;
 
-	if (client_updated)
-		client_updated = 0;
-
-	pthread_mutex_unlock(&client_list_mutex);
-	return updated;
+	if (epoll_ctl(client_epfd, EPOLL_CTL_MOD, cl->fd, &ev) < 0)
+		ilm_log_err("Fail to arm client fd %d errno %d",
+			    cl->fd, errno);
 }
 
-int ilm_client_alloc_pollfd(struct pollfd **poll_fd, int *num)
+static void ilm_client_arm(struct client *cl)
 {
-	int i, ret = 0;
-        struct client *cl;
-
-	pthread_mutex_lock(&client_list_mutex);
-
-	*poll_fd = malloc(sizeof(struct pollfd) * (client_num + 1));
-	if (!*poll_fd) {
-		ilm_log_err("Cannot allcoate pollfd array\n");
-		ret = -1;
-		goto out;
-	}
-
-	i = 0;
-	list_for_each_entry(cl, &client_list, list) {
-		pthread_mutex_lock(&cl->mutex);
-		if (cl->state == CLIENT_STATE_RUN) {
-			(*poll_fd)[i].fd = cl->fd;
-			(*poll_fd)[i].events = POLLIN;
-			i++;
-		}
-		pthread_mutex_unlock(&cl->mutex);
-	}
-
-	(*poll_fd)[i].fd = client_efd;
-	(*poll_fd)[i].events = POLLIN;
-	i++;
-
-	*num = i;
-
-out:
-	pthread_mutex_unlock(&client_list_mutex);
-	return ret;
+	pthread_mutex_lock(&cl->mutex);
+	if (cl->state == CLIENT_STATE_RUN)
+		ilm_client_arm_unsafe(cl);
+	pthread_mutex_unlock(&cl->mutex);
 }
 
-int ilm_client_handle_request(struct pollfd *poll_fd, int num)
+/**
+ * ilm_client_poll - Wait for the clients' events and handle them
+ * @timeout:	Timeout in milliseconds.
+ *
+ * The event carries the client pointer, so the dispatch cost doesn't
+ * depend on the number of connected clients.
+ *
+ * Returns the number of handled events, or a negative errno.
+ */
+int ilm_client_poll(int timeout)
 {
+	struct epoll_event events[CLIENT_EPOLL_EVENTS];
 	struct client *cl;
-	int i;
-	uint64_t event_data;
+	int num, i, ret;
 
-	for (i = 0; i < num; i++) {
+	num = epoll_wait(client_epfd, events, CLIENT_EPOLL_EVENTS, timeout);
+	if (num < 0)
+		return -errno;
 
-		if (poll_fd[i].fd == client_efd &&
-		    poll_fd[i].revents & POLLIN) {
-			eventfd_read(client_efd, &event_data);
-			continue;
-		}
+	for (i = 0; i < num; i++) {
+		cl = events[i].data.ptr;
 
-		cl = _fd_to_client(poll_fd[i].fd);
+		if (events[i].events & EPOLLIN) {
+			ret = cl->workfn ? cl->workfn(cl) : 0;
 
-		/*
-		 * Failed to find client, handle next one.
-		 */
-		if (!cl)
-			continue;
-
-		if (poll_fd[i].revents & POLLIN) {
-			if (cl->workfn)
-				cl->workfn(cl);
+			/* The client has been deleted */
+			if (ret < 0)
+				continue;
 		}
 
-		if (poll_fd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		if (events[i].events & (EPOLLERR | EPOLLHUP)) {
 			if (cl->deadfn)
 				cl->deadfn(cl);
+			continue;
 		}
+
+		ilm_client_arm(cl);
 	}
 
-	return 0;
+	return num;
 }
 
 int ilm_client_suspend(struct client *cl)
 {
         int ret = 0;
 
-	if (!_client_is_valid(cl)) {
-		ilm_log_err("Cannot suspend client which is invalid\n");
-		return -1;
-	}
-
         pthread_mutex_lock(&cl->mutex);
 
 	if (cl->state != CLIENT_STATE_RUN) {
@@ -200,11 +157,6 @@ int ilm_client_suspend(struct client *cl)
 	}
 
         pthread_mutex_unlock(&cl->mutex);
-
-	pthread_mutex_lock(&client_list_mutex);
-	client_updated = 1;
-	pthread_mutex_unlock(&client_list_mutex);
-
 	return ret;
 }
 
@@ -212,11 +164,6 @@ int ilm_client_resume(struct client *cl)
 {
         int ret = 0;
 
-	if (!_client_is_valid(cl)) {
-		ilm_log_err("Cannot resume client which is invalid\n");
-		return -1;
-	}
-
         pthread_mutex_lock(&cl->mutex);
 
 	if (cl->state != CLIENT_STATE_SUSPEND) {
@@ -225,31 +172,58 @@ int ilm_client_resume(struct client *cl)
 		ret = -1;
 	} else {
 		cl->state = CLIENT_STATE_RUN;
+
+		/* Let the main thread poll the client again */
+		ilm_client_arm_unsafe(cl);
 	}
 
         pthread_mutex_unlock(&cl->mutex);
+	return ret;
+}
 
-	pthread_mutex_lock(&client_list_mutex);
-	client_updated = 1;
-	pthread_mutex_unlock(&client_list_mutex);
+static void ilm_client_get(struct client *cl)
+{
+	pthread_mutex_lock(&cl->mutex);
+	cl->refcount++;
+	pthread_mutex_unlock(&cl->mutex);
+}
 
-	/* Notify main poll that the client resumes back */
-	eventfd_write(client_efd, 1);
+/*
+ * Drop a reference of the client, the last one is dropped by the main
+ * thread when the client hangs up or by the worker thread which handles
+ * the last outstanding command of the client, so the lockspace is not
+ * terminated underneath a command which is still in flight.
+ */
+static void ilm_client_put(struct client *cl)
+{
+	int refcount;
 
-	return ret;
+	pthread_mutex_lock(&cl->mutex);
+	refcount = --cl->refcount;
+	pthread_mutex_unlock(&cl->mutex);
+
+	if (refcount)
+		return;
+
+	ilm_lockspace_terminate(cl->ls);
+
+	/* Cleanup client */
+	if (cl->fd != -1)
+		close(cl->fd);
+	if (cl->rx_cmd) {
+		free(cl->rx_cmd->data);
+		free(cl->rx_cmd);
+	}
+	free(cl->rx_buf);
+	free(cl);
 }
 
 static int ilm_client_del(struct client *cl)
 {
-	if (!_client_is_valid(cl)) {
-		ilm_log_err("Cannot delete client which is invalid\n");
-		return -1;
-	}
-
-	/* Change client state from RUN to EXIT */
+	/* Change client state to EXIT */
 	pthread_mutex_lock(&cl->mutex);
 
-	if (cl->state != CLIENT_STATE_RUN) {
+	if (cl->state == CLIENT_STATE_EXIT) {
 		ilm_log_err("Cannot delete client with state: %d\n",
 			    cl->state);
 		pthread_mutex_unlock(&cl->mutex);
@@ -257,22 +231,23 @@ static int ilm_client_del(struct client *cl)
 	}
 	cl->state = CLIENT_STATE_EXIT;
 
+	/*
+	 * Stop polling before the fd is closed with the last reference,
+	 * and under the mutex so a racing resume cannot arm it again.
+	 */
+	epoll_ctl(client_epfd, EPOLL_CTL_DEL, cl->fd, NULL);
+
 	pthread_mutex_unlock(&cl->mutex);
 
 	/* Remove client from list */
 	pthread_mutex_lock(&client_list_mutex);
 	list_del(&cl->list);
-	client_updated = 1;
-	client_num--;
 	pthread_mutex_unlock(&client_list_mutex);
 
-	ilm_lockspace_terminate(cl->ls);
-
-	/* Cleanup client */
-	if (cl->fd != -1)
-		close(cl->fd);
-	free(cl);
+	if (cl->workfn == ilm_client_request)
+		__atomic_sub_fetch(&client_num, 1, __ATOMIC_RELAXED);
 
+	ilm_client_put(cl);
 	return 0;
 }
 
@@ -280,6 +255,7 @@ static int ilm_client_add(int fd,
 			  int (*workfn)(struct client *),
 			  int (*deadfn)(struct client *))
 {
+	struct epoll_event ev;
         struct client *cl;
 
 	cl = malloc(sizeof(struct client));
@@ -289,77 +265,421 @@ static int ilm_client_add(int fd,
 	}
 
 	cl->state = CLIENT_STATE_RUN;
+	cl->proto = ILM_PROTO_V1;
+	cl->rx_buf_len = CLIENT_RX_BUF_LEN;
+	cl->rx_buf = malloc(cl->rx_buf_len);
+	if (!cl->rx_buf) {
+		ilm_log_err("Failed to allocate client buffer\n");
+		free(cl);
+		return -1;
+	}
+	memset(&cl->rx_hdr, 0, sizeof(struct ilm_msg_header));
+	cl->rx_hdr_pos = 0;
+	cl->rx_cmd = NULL;
+	cl->rx_len = 0;
+
 	cl->fd = fd;
 	cl->pid = ilm_get_peer_pid(fd);
+	cl->ls = NULL;
+	cl->refcount = 1;
+	INIT_LIST_HEAD(&cl->cmd_list);
+	cl->running = 0;
 	cl->workfn = workfn;
 	cl->deadfn = deadfn ? deadfn : ilm_client_del;
 	pthread_mutex_init(&cl->mutex, NULL);
+	pthread_mutex_init(&cl->send_mutex, NULL);
 
 	/* Add client into list */
 	pthread_mutex_lock(&client_list_mutex);
 	list_add(&cl->list, &client_list);
-	client_updated = 1;
-	client_num++;
 	pthread_mutex_unlock(&client_list_mutex);
 
+	if (workfn == ilm_client_request)
+		__atomic_add_fetch(&client_num, 1, __ATOMIC_RELAXED);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = cl;
+
+	if (epoll_ctl(client_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		ilm_log_err("Fail to poll client fd %d errno %d", fd, errno);
+		pthread_mutex_lock(&client_list_mutex);
+		list_del(&cl->list);
+		pthread_mutex_unlock(&client_list_mutex);
+		if (workfn == ilm_client_request)
+			__atomic_sub_fetch(&client_num, 1, __ATOMIC_RELAXED);
+		free(cl->rx_buf);
+		free(cl);
+		return -1;
+	}
+
 	return 0;
 }
 
-void ilm_send_result(int fd, int result, char *data, int data_len)
+static int ilm_client_sendmsg(int fd, struct msghdr *msg)
 {
+	ssize_t ret;
+
+	while (msg->msg_iovlen) {
+		ret = sendmsg(fd, msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* Skip the sent part for a partial write */
+		while (msg->msg_iovlen &&
+		       (size_t)ret >= msg->msg_iov->iov_len) {
+			ret -= msg->msg_iov->iov_len;
+			msg->msg_iov++;
+			msg->msg_iovlen--;
+		}
+
+		if (msg->msg_iovlen) {
+			msg->msg_iov->iov_base =
+				(char *)msg->msg_iov->iov_base + ret;
+			msg->msg_iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * ilm_send_result - Send the reply of a command
+ * @cmd:	Command to reply.
+ * @result:	Result of the command.
+ * @data:	Data to append to the reply, or NULL.
+ * @data_len:	Length of data.
+ *
+ * The reply uses the same header layout as the request and carries the
+ * request ID, header and data are sent with one call under the client's
+ * send mutex so replies of concurrent commands never interleave.
+ */
+void ilm_send_result(struct ilm_cmd *cmd, int result, char *data,
+		     int data_len)
+{
+	struct client *cl = cmd->cl;
 	struct ilm_msg_header h;
+	struct iovec iov[2];
+	struct msghdr msg;
+	int ret;
 
+	memset(&h, 0, sizeof(h));
 	h.magic  = ILM_MSG_MAGIC;
-	h.length = sizeof(h) + data_len;
+	h.cmd = cmd->cmd;
+	h.length = cmd->hdr_len + data_len;
 	h.result = result;
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+	h.req_id = cmd->req_id;
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = cmd->hdr_len;
+	iov[1].iov_base = data;
+	iov[1].iov_len = data_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = data_len ? 2 : 1;
+
+	pthread_mutex_lock(&cl->send_mutex);
+	ret = ilm_client_sendmsg(cl->fd, &msg);
+	pthread_mutex_unlock(&cl->send_mutex);
+
+	ilm_req_trace_reply(&cmd->trace);
+
+	if (ret < 0)
+		ilm_log_err("client fd %d send reply errno %d", cl->fd, -ret);
+}
+
+/*
+ * Receive the request data of a legacy client, blocking for the announced
+ * length.  The killpath message of the legacy library announces more than
+ * it really sends, so with @short_ok a quiet socket ends the message and
+ * the handler sees a short one; otherwise a client stalling for
+ * CLIENT_RECV_TIMEOUT has lost the stream.
+ */
+static int ilm_client_recv_data(struct client *cl, char *buf, int len,
+				int short_ok)
+{
+	struct pollfd pfd;
+	int pos = 0, ret;
+
+	while (pos < len) {
+		ret = recv(cl->fd, buf + pos, len - pos, MSG_DONTWAIT);
+		if (ret > 0) {
+			pos += ret;
+			continue;
+		}
+
+		if (!ret)
+			return -EPIPE;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -errno;
+
+		pfd.fd = cl->fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, short_ok ? CLIENT_RECV_SHORT_WAIT :
+			   CLIENT_RECV_TIMEOUT);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+
+		if (!ret) {
+			if (short_ok)
+				break;
+			return -ETIMEDOUT;
+		}
+	}
+
+	if (pos != len)
+		ilm_log_dbg("%s: fd %d pid %d short message %d vs %d",
+			    __func__, cl->fd, cl->pid, pos, len);
+
+	return pos;
+}
+
+/**
+ * ilm_client_cmd_recv - Receive the data of a legacy request
+ * @cmd:	Command of a suspended client.
+ *
+ * The client is not polled while it's suspended, so the worker owns the
+ * socket, and waiting for a slow client doesn't hold up the main thread.
+ * If the data can't be received the stream is out of sync, so the socket
+ * is shut down for the main thread to drop the client once it's resumed,
+ * and the empty message is left to the handler to reject.
+ */
+void ilm_client_cmd_recv(struct ilm_cmd *cmd)
+{
+	struct client *cl = cmd->cl;
+	int ret;
+
+	ret = ilm_client_recv_data(cl, cmd->data, cmd->data_recv,
+				   cmd->cmd == ILM_CMD_SET_KILLPATH);
+	if (ret < 0) {
+		ilm_log_err("client fd %d recv %d bytes errno %d",
+			    cl->fd, cmd->data_recv, -ret);
+		shutdown(cl->fd, SHUT_RDWR);
+		ret = 0;
+	}
+
+	cmd->data_len = ret;
+	cmd->data_recv = 0;
+}
+
+/*
+ * Receive whatever the socket has of the pending request data, the main
+ * thread never waits for the rest but picks it up on the next event.
+ * Returns 1 when the data is complete, 0 if more is to come, or a negative
+ * errno.
+ */
+static int ilm_client_recv_pending(struct client *cl)
+{
+	struct ilm_cmd *cmd = cl->rx_cmd;
+	int ret;
+
+	while (cmd->data_len < cl->rx_len) {
+		ret = recv(cl->fd, cmd->data + cmd->data_len,
+			   cl->rx_len - cmd->data_len, MSG_DONTWAIT);
+		if (ret > 0) {
+			cmd->data_len += ret;
+			continue;
+		}
+
+		if (!ret)
+			return -EPIPE;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		return -errno;
+	}
+
+	cl->rx_cmd = NULL;
+	return 1;
+}
 
-	if (data_len)
-		send(fd, data, data_len, MSG_NOSIGNAL);
+/*
+ * Set up the buffer of the request data.  A concurrent client keeps the
+ * data with every command until it is done, and the main thread receives
+ * it across as many events as it takes.  A legacy client is suspended
+ * while its command runs, so it reuses its receive buffer and the worker
+ * receives the data.
+ */
+static int ilm_client_cmd_data(struct client *cl, struct ilm_cmd *cmd,
+			       int len)
+{
+	char *tmp;
+
+	if (!len)
+		return 0;
+
+	if (cl->proto >= ILM_PROTO_V3) {
+		cmd->data = malloc(len);
+		if (!cmd->data)
+			return -ENOMEM;
+		cmd->data_alloc = 1;
+
+		cl->rx_cmd = cmd;
+		cl->rx_len = len;
+		return 0;
+	}
+
+	if (len > cl->rx_buf_len) {
+		tmp = realloc(cl->rx_buf, len);
+		if (!tmp)
+			return -ENOMEM;
+
+		cl->rx_buf = tmp;
+		cl->rx_buf_len = len;
+	}
+
+	cmd->data = cl->rx_buf;
+	cmd->data_recv = len;
+	return 0;
+}
+
+static void ilm_cmd_release_data(struct ilm_cmd *cmd)
+{
+	if (cmd->data_alloc)
+		free(cmd->data);
+	cmd->data = NULL;
+	cmd->data_alloc = 0;
 }
 
 static int ilm_client_request(struct client *cl)
 {
 	struct ilm_msg_header hdr;
 	struct ilm_cmd *cmd;
-	int ret;
+	int hdr_len, ret;
 
-	memset(&hdr, 0, sizeof(struct ilm_msg_header));
+	/* Carry on with the data of the last request */
+	if (cl->rx_cmd) {
+		cmd = cl->rx_cmd;
+		goto recv;
+	}
 
-	ret = recv(cl->fd, &hdr, sizeof(hdr), MSG_WAITALL);
-	if (!ret)
-		return 0;
+	hdr_len = ilm_msg_header_len(cl->proto);
 
-	if (ret != sizeof(hdr)) {
-		ilm_log_err("client fd %d recv errno %d",
-			    cl->fd, errno);
+	/* A header split across events is kept until the rest arrives */
+	while (cl->rx_hdr_pos < hdr_len) {
+		ret = recv(cl->fd, (char *)&cl->rx_hdr + cl->rx_hdr_pos,
+			   hdr_len - cl->rx_hdr_pos, MSG_DONTWAIT);
+		if (ret > 0) {
+			cl->rx_hdr_pos += ret;
+			continue;
+		}
+
+		/* The client has closed the connection */
+		if (!ret)
+			goto dead;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+
+		ilm_log_err("client fd %d recv errno %d", cl->fd, errno);
 		goto dead;
 	}
 
+	hdr = cl->rx_hdr;
+	memset(&cl->rx_hdr, 0, sizeof(struct ilm_msg_header));
+	cl->rx_hdr_pos = 0;
+
 	if (hdr.magic != ILM_MSG_MAGIC) {
 	        ilm_log_err("client fd %d ret %d magic %x vs %x",
 			    cl->fd, ret, hdr.magic, ILM_MSG_MAGIC);
 		goto dead;
 	}
 
-	cmd = malloc(sizeof(struct ilm_cmd));
+	if (hdr.length < (uint32_t)hdr_len ||
+	    hdr.length - hdr_len > CLIENT_MSG_MAX_LEN) {
+	        ilm_log_err("client fd %d invalid message length %u",
+			    cl->fd, hdr.length);
+		goto dead;
+	}
+
+	cmd = calloc(1, sizeof(struct ilm_cmd));
 	if (!cmd) {
 	        ilm_log_err("Fail to allocate struct ilm_cmd\n");
 		goto dead;
 	}
 
+	ilm_req_trace_init(&cmd->trace);
+
+	INIT_LIST_HEAD(&cmd->cl_list);
 	cmd->cmd = hdr.cmd;
+	cmd->version = hdr.version;
+	cmd->req_id = hdr.req_id;
+	cmd->hdr_len = hdr_len;
 	cmd->cl = cl;
-	cmd->sock_msg_len = hdr.length;
 
-	ret = ilm_client_suspend(cl);
+	ret = ilm_client_cmd_data(cl, cmd, hdr.length - hdr_len);
 	if (ret < 0) {
+		ilm_log_err("client fd %d no memory for %u bytes data",
+			    cl->fd, hdr.length - hdr_len);
 		free(cmd);
 		goto dead;
 	}
 
+recv:
+	if (cl->rx_cmd) {
+		ret = ilm_client_recv_pending(cl);
+		if (!ret)
+			return 0;
+
+		/* The command is freed with the client */
+		if (ret < 0) {
+			ilm_log_err("client fd %d recv %d bytes errno %d",
+				    cl->fd, cl->rx_len, -ret);
+			goto dead;
+		}
+	}
+
+	/*
+	 * The data has been consumed, so the stream is still in sync.  The
+	 * data of a legacy request is left to the worker, whose dispatcher
+	 * rejects the command after receiving it.
+	 */
+	if (cmd->cmd >= ILM_CMD_MAX && !cmd->data_recv) {
+		ilm_log_err("client fd %d pid %d unknown command %u",
+			    cl->fd, cl->pid, cmd->cmd);
+		ilm_send_result(cmd, -EINVAL, NULL, 0);
+		ilm_cmd_release_data(cmd);
+		free(cmd);
+		return 0;
+	}
+
+	/*
+	 * Before ILM_PROTO_V3 the replies carry no request ID, so stop
+	 * polling the client until its command is done.
+	 */
+	if (cl->proto < ILM_PROTO_V3) {
+		ret = ilm_client_suspend(cl);
+		if (ret < 0) {
+			ilm_cmd_release_data(cmd);
+			free(cmd);
+			goto dead;
+		}
+		cmd->suspended = 1;
+	}
+
+	ilm_client_get(cl);
+
+	ilm_trace4(client_request, cmd, cmd->cmd, cl->pid, cmd->req_id);
+
 	ret = ilm_cmd_queue_add_work(cmd);
 	if (ret < 0) {
+		ilm_client_put(cl);
+		ilm_cmd_release_data(cmd);
 		free(cmd);
 		goto dead;
 	}
@@ -372,43 +692,22 @@ dead:
 	return -1;
 }
 
-void ilm_client_recv_all(struct client *cl, int msg_len, int pos)
+/**
+ * ilm_client_cmd_done - Release a command's resources of the client
+ * @cmd:	Command which has been handled.
+ *
+ * Resume the client if it was suspended for the command and drop the
+ * client reference taken when the command was queued.
+ */
+void ilm_client_cmd_done(struct ilm_cmd *cmd)
 {
-        char trash[64];
-        int left = msg_len - sizeof(struct ilm_msg_header) - pos;
-        int ret = 0, retries = 0, trash_len;
-
-	ilm_log_dbg("%s: msg_len %d pos %d left %d", __func__,
-		    msg_len, pos, left);
-
-        while (left > 0) {
-		/* The read length should always less or equal than left */
-		trash_len = sizeof(trash);
-		if (trash_len > left)
-			trash_len = left;
-
-                ret = recv(cl->fd, trash, trash_len, MSG_DONTWAIT);
-
-		/* Read successfully */
-		if (ret > 0)
-			left -= ret;
-
-		/* Failed, but can try again */
-                if (ret == -1 && errno == EAGAIN) {
-                        usleep(1000);
-                        if (retries < 20) {
-                                retries++;
-                                continue;
-			}
-		}
+	struct client *cl = cmd->cl;
 
-		/* Failed and cannot fixup, bail out */
-		if (ret <= 0)
-			break;
-	}
+	if (cmd->suspended)
+		ilm_client_resume(cl);
 
-        ilm_log_dbg("%s: fd %d pid %d pos %d ret %d errno %d retries %d left %d",
-		    __func__, cl->fd, cl->pid, pos, ret, errno, retries, left);
+	ilm_cmd_release_data(cmd);
+	ilm_client_put(cl);
 }
 
 static int ilm_client_connect(struct client *cl)
@@ -416,15 +715,16 @@ static int ilm_client_connect(struct client *cl)
 	int fd, on = 1;
 	int ret;
 
+	/* The listener keeps running even if it fails to accept a client */
 	fd = accept(cl->fd, NULL, NULL);
 	if (fd < 0)
-		return -1;
+		return 0;
 
 	setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
 
 	ret = ilm_client_add(fd, ilm_client_request, NULL);
 	if (ret < 0)
-		return -1;
+		close(fd);
 
 	return 0;
 }
@@ -524,27 +824,35 @@ int ilm_client_listener_init(void)
 
 	fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL, 0) | O_NONBLOCK);
 
-	/* Initialize eventfd for client notification */
-	if ((client_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
-		ilm_log_err("Cannot create eventfd");
+	client_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (client_epfd < 0) {
+		ilm_log_err("Cannot create epoll fd");
 		goto out;
 	}
 
 	ret = ilm_client_add(sock_fd, ilm_client_connect, NULL);
 	if (ret < 0)
-		goto out;
+		goto epoll_fail;
 
 	return 0;
 
-sock_fail:
-	close(lock_fd);
+epoll_fail:
+	close(client_epfd);
 out:
 	close(sock_fd);
+sock_fail:
+	close(lock_fd);
 	return -1;
 }
 
 void ilm_client_listener_exit(void)
 {
+	close(client_epfd);
 	close(lock_fd);
 	close(sock_fd);
 }
+
+int ilm_client_count(void)
+{
+	return __atomic_load_n(&client_num, __ATOMIC_RELAXED);
+}
@@ -6,7 +6,6 @@
 #ifndef __CLIENT_H__
 #define __CLIENT_H__
 
-#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
@@ -15,34 +14,87 @@
 
 struct ilm_lockspace;
 
+#define ILM_MSG_MAGIC		0x494C4D00
+
+/*
+ * Wire protocol versions:
+ *
+ * ILM_PROTO_V1: every drive path is sent in a PATH_MAX sized buffer.
+ * ILM_PROTO_V2: drive paths are sent back to back, every path is prefixed
+ *               by a 16-bit length which includes the terminating NUL.
+ * ILM_PROTO_V3: the header is extended with a request ID which is echoed
+ *               back in the reply, so a client can have multiple requests
+ *               in flight on one connection and the replies can come back
+ *               out of order.
+ *
+ * The version is negotiated by ILM_CMD_ADD_LOCKSPACE: the client puts the
+ * highest version it supports into the header, and the daemon replies with
+ * the selected version as a 32-bit data.  Legacy clients send zero and get
+ * a reply without data, legacy daemons ignore the field and don't send any
+ * data back, so both sides fall back to ILM_PROTO_V1.
+ */
+#define ILM_PROTO_V1		1
+#define ILM_PROTO_V2		2
+#define ILM_PROTO_V3		3
+#define ILM_PROTO_VERSION	ILM_PROTO_V3
+
+struct ilm_msg_header {
+	uint32_t magic;
+	uint32_t cmd;
+	uint32_t length;
+	union {
+		uint32_t result;	/* Reply */
+		uint32_t version;	/* ILM_CMD_ADD_LOCKSPACE request */
+	};
+	uint32_t req_id;		/* ILM_PROTO_V3 and later */
+	uint32_t reserved;
+};
+
+/* Header length used before ILM_PROTO_V3, without request ID */
+#define ILM_MSG_HEADER_V1_LEN	16
+
+static inline int ilm_msg_header_len(int proto)
+{
+	if (proto >= ILM_PROTO_V3)
+		return sizeof(struct ilm_msg_header);
+
+	return ILM_MSG_HEADER_V1_LEN;
+}
+
 struct client {
 	struct list_head list;
 	int fd;  /* unset is -1 */
 	int pid; /* unset is -1 */
 	int state;
+	int proto;		/* Negotiated wire protocol version */
+	struct ilm_msg_header rx_hdr; /* Partly received header */
+	int rx_hdr_pos;
+	char *rx_buf;		/* Receive buffer for request data */
+	int rx_buf_len;
+	struct ilm_cmd *rx_cmd;	/* Request whose data is partly received */
+	int rx_len;		/* Data length of the request */
+	int refcount;		/* List reference plus one per command */
+	struct list_head cmd_list; /* Outstanding commands, protected by
+				      the command queue mutex */
+	int running;		/* Running commands, same protection */
 	struct ilm_lockspace *ls;
 	pthread_mutex_t mutex;
+	pthread_mutex_t send_mutex;
 	int (*workfn)(struct client *);
 	int (*deadfn)(struct client *);
 };
 
-#define ILM_MSG_MAGIC		0x494C4D00
-
-struct ilm_msg_header {
-	uint32_t magic;
-	uint32_t cmd;
-	uint32_t length;
-	uint32_t result;
-};
+struct ilm_cmd;
 
-int ilm_client_is_updated(void);
-int ilm_client_alloc_pollfd(struct pollfd **poll_fd, int *num);
-int ilm_client_handle_request(struct pollfd *poll_fd, int num);
-void ilm_send_result(int fd, int result, char *data, int data_len);
-void ilm_client_recv_all(struct client *cl, int msg_len, int pos);
+int ilm_client_poll(int timeout);
+void ilm_send_result(struct ilm_cmd *cmd, int result, char *data,
+		     int data_len);
+void ilm_client_cmd_recv(struct ilm_cmd *cmd);
+void ilm_client_cmd_done(struct ilm_cmd *cmd);
 int ilm_client_listener_init(void);
 void ilm_client_listener_exit(void);
 int ilm_client_suspend(struct client *cl);
 int ilm_client_resume(struct client *cl);
+int ilm_client_count(void);
 
 #endif
@@ -6,27 +6,38 @@
  * Derived from the sanlock file of the same name.
  */
 
+#include <errno.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "client.h"
 #include "cmd.h"
+#include "ilm_internal.h"
 #include "inject_fault.h"
 #include "list.h"
 #include "lockspace.h"
 #include "lock.h"
 #include "log.h"
+#include "margin.h"
+#include "stats.h"
+#include "status.h"
+#include "trace.h"
 #include "util.h"
 
+/* Default worker number, can be changed by the daemon options -w/-W */
 #define ILM_MIN_WORKER_THREADS		2
-#define ILM_MAX_WORKER_THREADS		8
+#define ILM_MAX_WORKER_THREADS		64
 
-const char *CMD_NAMES[16] = {
+/* An idle worker above the minimum exits after this many seconds */
+#define ILM_WORKER_IDLE_TIMEOUT		30
+
+const char *CMD_NAMES[ILM_CMD_MAX] = {
 	"ILM_CMD_VERSION",
 	"ILM_CMD_ADD_LOCKSPACE",
 	"ILM_CMD_DEL_LOCKSPACE",
@@ -42,9 +53,28 @@ const char *CMD_NAMES[16] = {
 	"ILM_CMD_SET_HOST_ID",
 	"ILM_CMD_STOP_RENEW",
 	"ILM_CMD_START_RENEW",
-	"ILM_CMD_INJECT_FAULT"
+	"ILM_CMD_INJECT_FAULT",
+	"ILM_CMD_ACQUIRE_MANY",
+	"ILM_CMD_RELEASE_MANY",
+	"ILM_CMD_CONVERT_MANY",
+	"ILM_CMD_ACQUIRE_DEADLINE",
+	"ILM_CMD_CANCEL",
+	"ILM_CMD_GET_STATUS",
+	"ILM_CMD_STATS",
+	"ILM_CMD_STAGE_STATS",
+	"ILM_CMD_LOCK_STATS",
+	"ILM_CMD_RENEW_STATS"
 };
 
+/* The command comes from the client, so it must be checked before use */
+const char *ilm_cmd_name(uint32_t cmd)
+{
+	if (cmd >= ILM_CMD_MAX)
+		return "ILM_CMD_UNKNOWN";
+
+	return CMD_NAMES[cmd];
+}
+
 struct ilm_cmd_queue {
 	int exit;
 	struct list_head list;
@@ -53,12 +83,155 @@ struct ilm_cmd_queue {
 	pthread_cond_t exit_wait;
 
 	int num_workers;
+	int min_workers;
 	int max_workers;
 	int free_workers;
+	int wakeups;		/* Free workers signaled but not woken yet */
+
+	/* Updated atomically, so the metrics are read without the mutex */
+	int pending;		/* Queued commands not picked up yet */
+	int busy;		/* Workers handling a command */
+	uint64_t handled;
+	uint64_t busy_us;	/* Time spent by workers in the handlers */
 };
 
 static struct ilm_cmd_queue cmd_queue;
 
+/**
+ * ilm_cmd_read - Copy request data of a command
+ * @cmd:	Command which carries the data.
+ * @buf:	Buffer to copy the data into.
+ * @len:	Length to copy.
+ *
+ * Returns the copied length, which is shorter than @len if the request
+ * doesn't contain enough data; the caller can treat it like recv(2).
+ */
+int ilm_cmd_read(struct ilm_cmd *cmd, void *buf, int len)
+{
+	int left = ilm_cmd_data_left(cmd);
+
+	if (len > left)
+		len = left;
+
+	memcpy(buf, cmd->data + cmd->data_pos, len);
+	cmd->data_pos += len;
+	return len;
+}
+
+/**
+ * ilm_cmd_data - Get request data of a command without copying
+ * @cmd:	Command which carries the data.
+ * @len:	Length of data to consume.
+ * @buf:	Returned pointer to the data, valid until command is done.
+ *
+ * Returns @len on success, -EIO if the request is too short.
+ */
+int ilm_cmd_data(struct ilm_cmd *cmd, int len, char **buf)
+{
+	if (len > ilm_cmd_data_left(cmd))
+		return -EIO;
+
+	*buf = cmd->data + cmd->data_pos;
+	cmd->data_pos += len;
+	return len;
+}
+
+int ilm_cmd_data_left(struct ilm_cmd *cmd)
+{
+	return cmd->data_len - cmd->data_pos;
+}
+
+/*
+ * Commands from one client may run concurrently when they work on
+ * different locks.  Commands for the same lock keep the order in which
+ * they were sent, and any command that works on the whole lockspace
+ * waits for all earlier commands and blocks all later ones.
+ */
+static void ilm_cmd_classify(struct ilm_cmd *cmd)
+{
+	int off = offsetof(struct ilm_lock_payload, lock_id);
+
+	switch (cmd->cmd) {
+	case ILM_CMD_VERSION:
+	case ILM_CMD_GET_STATUS:
+	case ILM_CMD_STATS:
+	case ILM_CMD_STAGE_STATS:
+	case ILM_CMD_LOCK_STATS:
+	case ILM_CMD_RENEW_STATS:
+		break;
+	/* Must not wait for the acquisition which it's going to cancel */
+	case ILM_CMD_CANCEL:
+		break;
+	case ILM_CMD_ACQUIRE:
+	case ILM_CMD_ACQUIRE_DEADLINE:
+	case ILM_CMD_RELEASE:
+	case ILM_CMD_CONVERT:
+	case ILM_CMD_WRITE_LVB:
+	case ILM_CMD_READ_LVB:
+	case ILM_CMD_LOCK_HOST_COUNT:
+	case ILM_CMD_LOCK_MODE:
+		if (cmd->data_len >= off + IDM_LOCK_ID_LEN) {
+			cmd->key = cmd->data + off;
+			break;
+		}
+		cmd->barrier = 1;
+		break;
+	default:
+		cmd->barrier = 1;
+		break;
+	}
+}
+
+static int ilm_cmd_is_runnable(struct ilm_cmd *cmd)
+{
+	struct ilm_cmd *prev;
+
+	list_for_each_entry(prev, &cmd->cl->cmd_list, cl_list) {
+		if (prev == cmd)
+			return 1;
+
+		if (prev->barrier || cmd->barrier)
+			return 0;
+
+		if (prev->key && cmd->key &&
+		    !memcmp(prev->key, cmd->key, IDM_LOCK_ID_LEN))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Pick the runnable command of the client with the fewest running
+ * commands, and the oldest one among them.  So a client with many
+ * commands blocked on a contended lock cannot take all workers, and the
+ * other clients keep being served.
+ */
+static struct ilm_cmd *ilm_cmd_queue_next(void)
+{
+	struct ilm_cmd *cmd, *next = NULL;
+
+	list_for_each_entry(cmd, &cmd_queue.list, list) {
+		if (next && cmd->cl->running >= next->cl->running)
+			continue;
+
+		if (!ilm_cmd_is_runnable(cmd))
+			continue;
+
+		next = cmd;
+		if (!next->cl->running)
+			break;
+	}
+
+	if (next) {
+		list_del(&next->list);
+		__atomic_sub_fetch(&cmd_queue.pending, 1, __ATOMIC_RELAXED);
+		next->cl->running++;
+	}
+
+	return next;
+}
+
 static void ilm_cmd_version(struct ilm_cmd *cmd)
 {
 	int ret;
@@ -140,6 +313,60 @@ static void ilm_cmd_acquire(struct ilm_cmd *cmd)
 		ilm_log_err("Fail to acquire IDM\n");
 }
 
+static void ilm_cmd_cancel(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_lock_cancel_acquire(cmd, cmd->cl->ls);
+	if (ret < 0)
+		ilm_log_err("Fail to cancel IDM\n");
+}
+
+static void ilm_cmd_get_status(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_status_get_token(cmd, cmd->cl->ls);
+	if (ret < 0)
+		ilm_log_dbg("Status region is not supported\n");
+}
+
+static void ilm_cmd_stats(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_stats_get(cmd);
+	if (ret < 0)
+		ilm_log_err("Fail to get statistics\n");
+}
+
+static void ilm_cmd_stage_stats(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_stats_get_stage(cmd);
+	if (ret < 0)
+		ilm_log_err("Fail to get stage statistics\n");
+}
+
+static void ilm_cmd_lock_stats(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_stats_get_lock(cmd);
+	if (ret < 0)
+		ilm_log_err("Fail to get lock statistics\n");
+}
+
+static void ilm_cmd_renew_stats(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_margin_get(cmd);
+	if (ret < 0)
+		ilm_log_err("Fail to get renewal statistics\n");
+}
+
 static void ilm_cmd_release(struct ilm_cmd *cmd)
 {
 	int ret;
@@ -158,6 +385,33 @@ static void ilm_cmd_convert(struct ilm_cmd *cmd)
 		ilm_log_err("Fail to convert IDM mode\n");
 }
 
+static void ilm_cmd_acquire_many(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_lock_acquire_many(cmd, cmd->cl->ls);
+	if (ret < 0)
+		ilm_log_err("Fail to acquire IDMs\n");
+}
+
+static void ilm_cmd_release_many(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_lock_release_many(cmd, cmd->cl->ls);
+	if (ret < 0)
+		ilm_log_err("Fail to release IDMs\n");
+}
+
+static void ilm_cmd_convert_many(struct ilm_cmd *cmd)
+{
+	int ret;
+
+	ret = ilm_lock_convert_many(cmd, cmd->cl->ls);
+	if (ret < 0)
+		ilm_log_err("Fail to convert IDMs mode\n");
+}
+
 static void ilm_cmd_lvb_write(struct ilm_cmd *cmd)
 {
 	int ret;
@@ -205,7 +459,10 @@ static void ilm_cmd_inject_fault(struct ilm_cmd *cmd)
 
 static void ilm_cmd_handle(struct ilm_cmd *cmd)
 {
-	ilm_log_dbg("cmd=%d (%s)", cmd->cmd, CMD_NAMES[cmd->cmd]);
+	if (cmd->data_recv)
+		ilm_client_cmd_recv(cmd);
+
+	ilm_log_dbg("cmd=%d (%s)", cmd->cmd, ilm_cmd_name(cmd->cmd));
 
 	switch (cmd->cmd) {
 	case ILM_CMD_VERSION:
@@ -218,6 +475,7 @@ static void ilm_cmd_handle(struct ilm_cmd *cmd)
 		ilm_cmd_del_lockspace(cmd);
 		break;
 	case ILM_CMD_ACQUIRE:
+	case ILM_CMD_ACQUIRE_DEADLINE:
 		ilm_cmd_acquire(cmd);
 		break;
 	case ILM_CMD_RELEASE:
@@ -256,60 +514,145 @@ static void ilm_cmd_handle(struct ilm_cmd *cmd)
 	case ILM_CMD_INJECT_FAULT:
 		ilm_cmd_inject_fault(cmd);
 		break;
+	case ILM_CMD_ACQUIRE_MANY:
+		ilm_cmd_acquire_many(cmd);
+		break;
+	case ILM_CMD_RELEASE_MANY:
+		ilm_cmd_release_many(cmd);
+		break;
+	case ILM_CMD_CONVERT_MANY:
+		ilm_cmd_convert_many(cmd);
+		break;
+	case ILM_CMD_CANCEL:
+		ilm_cmd_cancel(cmd);
+		break;
+	case ILM_CMD_GET_STATUS:
+		ilm_cmd_get_status(cmd);
+		break;
+	case ILM_CMD_STATS:
+		ilm_cmd_stats(cmd);
+		break;
+	case ILM_CMD_STAGE_STATS:
+		ilm_cmd_stage_stats(cmd);
+		break;
+	case ILM_CMD_LOCK_STATS:
+		ilm_cmd_lock_stats(cmd);
+		break;
+	case ILM_CMD_RENEW_STATS:
+		ilm_cmd_renew_stats(cmd);
+		break;
 	default:
+		/* Don't leave the client waiting for a reply */
+		ilm_send_result(cmd, -EINVAL, NULL, 0);
 		break;
 	}
+}
+
+/* Returns true if the worker has been idle long enough to exit */
+static int ilm_cmd_worker_wait(void)
+{
+	struct timespec ts;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += ILM_WORKER_IDLE_TIMEOUT;
 
-	ilm_client_resume(cmd->cl);
-	return;
+	cmd_queue.free_workers++;
+	ret = pthread_cond_timedwait(&cmd_queue.cond, &cmd_queue.mutex, &ts);
+	cmd_queue.free_workers--;
+
+	if (cmd_queue.wakeups)
+		cmd_queue.wakeups--;
+
+	/* Shrink the pool after it's idle for a while */
+	return ret == ETIMEDOUT &&
+	       cmd_queue.num_workers > cmd_queue.min_workers;
 }
 
 static void *ilm_cmd_thread(void *data)
 {
 	struct ilm_cmd *cmd;
-
-	/*
-	 * TODO: AIO setting
-	 */
+	uint64_t start;
 
 	pthread_mutex_lock(&cmd_queue.mutex);
 
 	while (1) {
-		while (!cmd_queue.exit && list_empty(&cmd_queue.list)) {
-			cmd_queue.free_workers++;
-			pthread_cond_wait(&cmd_queue.cond, &cmd_queue.mutex);
-			cmd_queue.free_workers--;
+		while (!cmd_queue.exit && !(cmd = ilm_cmd_queue_next())) {
+			if (ilm_cmd_worker_wait())
+				goto out;
 		}
 
-		while (!list_empty(&cmd_queue.list)) {
-			cmd = list_first_entry(&cmd_queue.list,
-					       struct ilm_cmd, list);
-			list_del(&cmd->list);
+		while (cmd) {
 			pthread_mutex_unlock(&cmd_queue.mutex);
 
+			ilm_trace2(cmd_dispatch, cmd, cmd->cmd);
+			ilm_req_trace_begin(&cmd->trace);
+			__atomic_add_fetch(&cmd_queue.busy, 1, __ATOMIC_RELAXED);
+			start = ilm_stats_now();
 			ilm_cmd_handle(cmd);
-			free(cmd);
+			__atomic_add_fetch(&cmd_queue.busy_us,
+					   ilm_stats_now() - start,
+					   __ATOMIC_RELAXED);
+			__atomic_add_fetch(&cmd_queue.handled, 1,
+					   __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&cmd_queue.busy, 1, __ATOMIC_RELAXED);
+			ilm_req_trace_end(&cmd->trace,
+					  ilm_cmd_name(cmd->cmd));
+			ilm_trace2(cmd_done, cmd, cmd->cmd);
 
 			pthread_mutex_lock(&cmd_queue.mutex);
+
+			/* Commands queued behind this one may run now */
+			list_del(&cmd->cl_list);
+			cmd->cl->running--;
+			if (!list_empty(&cmd_queue.list))
+				pthread_cond_broadcast(&cmd_queue.cond);
+
+			pthread_mutex_unlock(&cmd_queue.mutex);
+			ilm_client_cmd_done(cmd);
+			free(cmd);
+			pthread_mutex_lock(&cmd_queue.mutex);
+
+			cmd = ilm_cmd_queue_next();
 		}
 
 		if (cmd_queue.exit)
 			break;
 	}
 
-	cmd_queue.num_workers--;
-	if (!cmd_queue.num_workers)
+out:
+	if (!__atomic_sub_fetch(&cmd_queue.num_workers, 1, __ATOMIC_RELAXED))
 		pthread_cond_signal(&cmd_queue.exit_wait);
 	pthread_mutex_unlock(&cmd_queue.mutex);
 
 	return NULL;
 }
 
-int ilm_cmd_queue_add_work(struct ilm_cmd *cmd)
+/* Called with the queue mutex held */
+static int ilm_cmd_worker_create(void)
 {
+	pthread_attr_t attr;
 	pthread_t th;
 	int ret;
 
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&th, &attr, ilm_cmd_thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		ilm_log_err("Fail to create thread for cmd queue\n");
+		return -ret;
+	}
+
+	__atomic_add_fetch(&cmd_queue.num_workers, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int ilm_cmd_queue_add_work(struct ilm_cmd *cmd)
+{
+	int ret;
+
 	pthread_mutex_lock(&cmd_queue.mutex);
 
 	if (cmd_queue.exit) {
@@ -317,27 +660,54 @@ int ilm_cmd_queue_add_work(struct ilm_cmd *cmd)
 		return -1;
 	}
 
+	ilm_cmd_classify(cmd);
 	list_add_tail(&cmd->list, &cmd_queue.list);
+	list_add_tail(&cmd->cl_list, &cmd->cl->cmd_list);
+	__atomic_add_fetch(&cmd_queue.pending, 1, __ATOMIC_RELAXED);
 
-	if (!cmd_queue.free_workers &&
-	    cmd_queue.num_workers < ILM_MAX_WORKER_THREADS) {
+	/*
+	 * A command which waits for earlier commands of the same client is
+	 * picked up by the worker finishing them, otherwise wake up an idle
+	 * worker, or grow the pool if all workers are busy.
+	 */
+	if (!ilm_cmd_is_runnable(cmd))
+		goto out;
 
-		ret = pthread_create(&th, NULL, ilm_cmd_thread,
-				     (void *)(long)cmd_queue.num_workers);
-		if (ret < 0) {
-			ilm_log_err("Fail to create thread for cmd queue\n");
+	if (cmd_queue.free_workers > cmd_queue.wakeups) {
+		cmd_queue.wakeups++;
+		pthread_cond_signal(&cmd_queue.cond);
+		goto out;
+	}
+
+	if (cmd_queue.num_workers < cmd_queue.max_workers) {
+		ret = ilm_cmd_worker_create();
+		if (ret < 0 && !cmd_queue.num_workers) {
 			list_del(&cmd->list);
+			list_del(&cmd->cl_list);
+			__atomic_sub_fetch(&cmd_queue.pending, 1,
+					   __ATOMIC_RELAXED);
 			pthread_mutex_unlock(&cmd_queue.mutex);
 			return ret;
 		}
-		cmd_queue.num_workers++;
 	}
 
-	pthread_cond_signal(&cmd_queue.cond);
+out:
 	pthread_mutex_unlock(&cmd_queue.mutex);
 	return 0;
 }
 
+/* Snapshot of the queue for the metrics, doesn't take the queue mutex */
+void ilm_cmd_queue_metrics(struct ilm_cmd_queue_metrics *m)
+{
+	m->pending = __atomic_load_n(&cmd_queue.pending, __ATOMIC_RELAXED);
+	m->workers = __atomic_load_n(&cmd_queue.num_workers,
+				     __ATOMIC_RELAXED);
+	m->max_workers = cmd_queue.max_workers;
+	m->busy = __atomic_load_n(&cmd_queue.busy, __ATOMIC_RELAXED);
+	m->handled = __atomic_load_n(&cmd_queue.handled, __ATOMIC_RELAXED);
+	m->busy_us = __atomic_load_n(&cmd_queue.busy_us, __ATOMIC_RELAXED);
+}
+
 void ilm_cmd_queue_free(void)
 {
 	pthread_mutex_lock(&cmd_queue.mutex);
@@ -351,22 +721,37 @@ void ilm_cmd_queue_free(void)
 
 int ilm_cmd_queue_create(void)
 {
-	pthread_t th;
-	int i, ret;
+	pthread_condattr_t attr;
+	int i, ret = 0;
 
 	memset(&cmd_queue, 0, sizeof(cmd_queue));
 	INIT_LIST_HEAD(&cmd_queue.list);
 	pthread_mutex_init(&cmd_queue.mutex, NULL);
-	pthread_cond_init(&cmd_queue.cond, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cmd_queue.cond, &attr);
+	pthread_condattr_destroy(&attr);
 	pthread_cond_init(&cmd_queue.exit_wait, NULL);
 
-	for (i = 0; i < ILM_MIN_WORKER_THREADS; i++) {
-		ret = pthread_create(&th, NULL, ilm_cmd_thread,
-				     (void *)(long)cmd_queue.num_workers);
+	cmd_queue.min_workers = env.min_workers ? env.min_workers :
+				ILM_MIN_WORKER_THREADS;
+	cmd_queue.max_workers = env.max_workers ? env.max_workers :
+				ILM_MAX_WORKER_THREADS;
+	if (!env.min_workers && cmd_queue.min_workers > cmd_queue.max_workers)
+		cmd_queue.min_workers = cmd_queue.max_workers;
+	if (cmd_queue.max_workers < cmd_queue.min_workers)
+		cmd_queue.max_workers = cmd_queue.min_workers;
+
+	ilm_log_dbg("cmd queue workers min %d max %d",
+		    cmd_queue.min_workers, cmd_queue.max_workers);
+
+	pthread_mutex_lock(&cmd_queue.mutex);
+	for (i = 0; i < cmd_queue.min_workers; i++) {
+		ret = ilm_cmd_worker_create();
 		if (ret < 0)
-			ilm_log_err("Fail to create thread for cmd queue\n");
-		cmd_queue.num_workers++;
+			break;
 	}
+	pthread_mutex_unlock(&cmd_queue.mutex);
 
 	if (ret < 0)
 		ilm_cmd_queue_free();
@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include "list.h"
+#include "req_trace.h"
 
 enum {
 	ILM_CMD_VERSION,
@@ -27,16 +28,62 @@ enum {
 	ILM_CMD_STOP_RENEW,	/* For testing purpose */
 	ILM_CMD_START_RENEW,	/* For testing purpose */
 	ILM_CMD_INJECT_FAULT,	/* For testing purpose */
+	ILM_CMD_ACQUIRE_MANY,
+	ILM_CMD_RELEASE_MANY,
+	ILM_CMD_CONVERT_MANY,
+	ILM_CMD_ACQUIRE_DEADLINE,
+	ILM_CMD_CANCEL,
+	ILM_CMD_GET_STATUS,
+	ILM_CMD_STATS,
+	ILM_CMD_STAGE_STATS,
+	ILM_CMD_LOCK_STATS,
+	ILM_CMD_RENEW_STATS,
+	ILM_CMD_MAX,		/* Number of commands, not a command */
 };
 
 struct ilm_cmd {
 	struct list_head list; /* thread_pool data */
+	struct list_head cl_list; /* client's outstanding commands */
 	struct client *cl;
 	uint32_t cmd;
-	int sock_msg_len;
+	uint32_t version;	/* Protocol version requested by client */
+	uint32_t req_id;	/* Echoed back in the reply */
+	int hdr_len;		/* Header length, the reply uses the same */
+	int suspended;		/* Client is suspended until command is done */
+
+	/* Ordering against other commands from the same client */
+	int barrier;
+	char *key;		/* Lock ID, NULL if not keyed */
+
+	/*
+	 * Request data, received by the main thread, or by the worker for a
+	 * legacy client which is suspended anyway.
+	 */
+	char *data;
+	int data_len;
+	int data_pos;
+	int data_alloc;		/* Data is owned by the command */
+	int data_recv;		/* Data still to be received by the worker */
+
+	struct ilm_req_trace trace;
+};
+
+const char *ilm_cmd_name(uint32_t cmd);
+int ilm_cmd_read(struct ilm_cmd *cmd, void *buf, int len);
+int ilm_cmd_data(struct ilm_cmd *cmd, int len, char **buf);
+int ilm_cmd_data_left(struct ilm_cmd *cmd);
+
+struct ilm_cmd_queue_metrics {
+	int pending;
+	int workers;
+	int max_workers;
+	int busy;
+	uint64_t handled;
+	uint64_t busy_us;
 };
 
 int ilm_cmd_queue_add_work(struct ilm_cmd *cmd);
+void ilm_cmd_queue_metrics(struct ilm_cmd_queue_metrics *m);
 void ilm_cmd_queue_free(void);
 int ilm_cmd_queue_create(void);
 
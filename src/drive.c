@@ -6,7 +6,9 @@
 #include <blkid/blkid.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libudev.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -25,6 +27,7 @@
 #include "drive.h"
 #include "list.h"
 #include "log.h"
+#include "util.h"
 #include "utils_nvme.h"
 #include "utils_scsi.h"
 
@@ -49,49 +52,148 @@ struct ilm_hw_drive_node {
 	struct ilm_hw_drive drive;
 };
 
+/*
+ * Immutable view of the drive list.  Lookups from the lock path read the
+ * currently published snapshot without taking any lock; the udev thread and
+ * rescans modify drive_list under drive_list_mutex and then publish a new
+ * snapshot.  The old snapshot is reclaimed only after every reader which
+ * might still reference it has left its read section (see the two reader
+ * counters below, this is the same scheme as kernel's SRCU).
+ */
+struct ilm_drive_snap_entry {
+	unsigned long wwn;
+	int path_num;
+	char **blk_path;
+	char **sg_path;
+};
+
+struct ilm_drive_snapshot {
+	int version;
+	int drive_num;
+	struct ilm_drive_snap_entry drive[];	/* Sorted by WWN */
+};
+
 static pthread_t drive_thd;
 static unsigned int drive_thd_done;
 static struct list_head drive_list;
 static pthread_mutex_t drive_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 static unsigned int drive_list_version = 0;
 
+static struct ilm_drive_snapshot *drive_snap;
+static unsigned int drive_snap_epoch;
+static int drive_snap_readers[2];
+
+struct ilm_drive_cache_entry {
+	unsigned long wwn;
+	char *blk_path;
+	char *sg_path;
+	dev_t blk_rdev;
+	ino_t blk_ino;
+	dev_t sg_rdev;
+	ino_t sg_ino;
+};
+
+static struct ilm_drive_cache_entry *drive_cache;
+static int drive_cache_num;
+static pthread_mutex_t drive_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int drive_thd_reconcile;
+
+/*
+ * Cache for the mapping from the path passed by user (e.g. a device mapper
+ * node) to SG path; it's consulted when the path cannot be resolved by
+ * walking sysfs.  Entries are hashed by user path and bounded with LRU
+ * eviction, stale entries are dropped when udev reports the SG path is gone.
+ */
+#define ILM_DEV_MAP_HASH_SIZE	256
+#define ILM_DEV_MAP_MAX_NUM	1024
+
 struct ilm_device_map {
-	struct list_head list;
+	struct list_head hash_list;
+	struct list_head lru_list;
 	char *dev_map;
 	char *sg_path;
 	unsigned long wwn;
 };
 
-static struct list_head dev_map_list = LIST_HEAD_INIT(dev_map_list);
+static struct list_head dev_map_hash[ILM_DEV_MAP_HASH_SIZE];
+static struct list_head dev_map_lru = LIST_HEAD_INIT(dev_map_lru);
 static int dev_map_num = 0;
 static pthread_mutex_t dev_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ilm_dev_map_stats dev_map_stats;
+
+static struct list_head *ilm_dev_map_bucket(char *dev_map)
+{
+	unsigned int hash = 2166136261u;	/* FNV-1a */
+	unsigned char *c;
+
+	for (c = (unsigned char *)dev_map; *c; c++)
+		hash = (hash ^ *c) * 16777619u;
+
+	return &dev_map_hash[hash % ILM_DEV_MAP_HASH_SIZE];
+}
+
+static void ilm_dev_map_init(void)
+{
+	int i;
+
+	for (i = 0; i < ILM_DEV_MAP_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&dev_map_hash[i]);
+}
+
+static struct ilm_device_map *ilm_dev_map_lookup_unsafe(char *dev_map)
+{
+	struct list_head *head = ilm_dev_map_bucket(dev_map);
+	struct ilm_device_map *pos;
+
+	list_for_each_entry(pos, head, hash_list) {
+		if (!strcmp(dev_map, pos->dev_map))
+			return pos;
+	}
+
+	return NULL;
+}
+
+static void ilm_dev_map_free_unsafe(struct ilm_device_map *map)
+{
+	list_del(&map->hash_list);
+	list_del(&map->lru_list);
+	free(map->dev_map);
+	free(map->sg_path);
+	free(map);
+	dev_map_num--;
+	dev_map_stats.evict++;
+}
 
 char *ilm_find_cached_device_mapping(char *dev_map, unsigned long *wwn)
 {
 	struct ilm_device_map *pos;
-	char *path;
+	char *path = NULL;
 
 	pthread_mutex_lock(&dev_map_mutex);
 
-	list_for_each_entry(pos, &dev_map_list, list) {
-		if (!strcmp(dev_map, pos->dev_map)) {
-			ilm_log_dbg("Find cached device mapping %s->%s",
-				    dev_map, pos->sg_path);
-			*wwn = pos->wwn;
-			path = strdup(pos->sg_path);
-			pthread_mutex_unlock(&dev_map_mutex);
-			return path;
-		}
+	pos = ilm_dev_map_lookup_unsafe(dev_map);
+	if (!pos) {
+		dev_map_stats.miss++;
+		goto out;
 	}
 
+	ilm_log_dbg("Find cached device mapping %s->%s",
+		    dev_map, pos->sg_path);
+	*wwn = pos->wwn;
+	path = strdup(pos->sg_path);
+	list_move_tail(&pos->lru_list, &dev_map_lru);
+	dev_map_stats.hit++;
+
+out:
 	pthread_mutex_unlock(&dev_map_mutex);
-	return NULL;
+	return path;
 }
 
 int ilm_add_cached_device_mapping(char *dev_map, char *sg_path,
 				  unsigned long wwn)
 {
 	struct ilm_device_map *pos, *tmp;
+	char *path;
 
 	if (!wwn) {
 		ilm_log_err("%s: cannot cache for %s with wwn is zero\n",
@@ -101,44 +203,67 @@ int ilm_add_cached_device_mapping(char *dev_map, char *sg_path,
 
 	pthread_mutex_lock(&dev_map_mutex);
 
-	list_for_each_entry(pos, &dev_map_list, list) {
-		if (!strcmp(dev_map, pos->dev_map)) {
-			if (strcmp(sg_path, pos->sg_path)) {
-				ilm_log_warn("Find stale cached device mapping old=%s new=%s",
-					     pos->sg_path, sg_path);
-				/* Free the old sg path */
-				free(pos->sg_path);
+	pos = ilm_dev_map_lookup_unsafe(dev_map);
+	if (pos) {
+		if (strcmp(sg_path, pos->sg_path)) {
+			ilm_log_warn("Find stale cached device mapping old=%s new=%s",
+				     pos->sg_path, sg_path);
 
-				/* Update for new found device mapping */
-				pos->sg_path = strdup(sg_path);
+			/* Update for new found device mapping */
+			path = strdup(sg_path);
+			if (path) {
+				free(pos->sg_path);
+				pos->sg_path = path;
 				pos->wwn = wwn;
 			}
-
-			/* Find existed cached item, bail out */
-			pthread_mutex_unlock(&dev_map_mutex);
-			return 0;
 		}
+
+		/* Find existed cached item, bail out */
+		list_move_tail(&pos->lru_list, &dev_map_lru);
+		pthread_mutex_unlock(&dev_map_mutex);
+		return 0;
 	}
 
-	if (dev_map_num > 100) {
-		tmp = list_first_entry(&dev_map_list,
-				       struct ilm_device_map, list);
-		if (tmp) {
-			free(tmp->dev_map);
-			free(tmp->sg_path);
-			free(tmp);
-		}
-		dev_map_num--;
+	/* Evict the least recently used item */
+	if (dev_map_num >= ILM_DEV_MAP_MAX_NUM) {
+		tmp = list_first_entry(&dev_map_lru,
+				       struct ilm_device_map, lru_list);
+		ilm_dev_map_free_unsafe(tmp);
 	}
 
 	tmp = malloc(sizeof(struct ilm_device_map));
+	if (!tmp)
+		goto fail;
+
 	tmp->dev_map = strdup(dev_map);
 	tmp->sg_path = strdup(sg_path);
+	if (!tmp->dev_map || !tmp->sg_path) {
+		free(tmp->dev_map);
+		free(tmp->sg_path);
+		free(tmp);
+		goto fail;
+	}
+
 	tmp->wwn = wwn;
-	list_add_tail(&tmp->list, &dev_map_list);
+	list_add_tail(&tmp->hash_list, ilm_dev_map_bucket(dev_map));
+	list_add_tail(&tmp->lru_list, &dev_map_lru);
+	dev_map_num++;
 
 	pthread_mutex_unlock(&dev_map_mutex);
 	return 0;
+
+fail:
+	pthread_mutex_unlock(&dev_map_mutex);
+	ilm_log_err("%s: no memory to cache %s", __func__, dev_map);
+	return -1;
+}
+
+void ilm_get_device_mapping_stats(struct ilm_dev_map_stats *stats)
+{
+	pthread_mutex_lock(&dev_map_mutex);
+	*stats = dev_map_stats;
+	stats->num = dev_map_num;
+	pthread_mutex_unlock(&dev_map_mutex);
 }
 
 int ilm_read_blk_uuid(char *dev, uuid_t *uuid)
@@ -183,7 +308,7 @@ int ilm_read_blk_uuid(char *dev, uuid_t *uuid)
 int ilm_read_parttable_id(char *dev, uuid_t *uuid)
 {
 #ifdef IDM_PTHREAD_EMULATION
-	*id = malloc(sizeof(uuid_t));
+	uuid_t id;
 
 	uuid_generate(id);
 	memcpy(uuid, &id, sizeof(uuid_t));
@@ -229,6 +354,27 @@ int ilm_read_parttable_id(char *dev, uuid_t *uuid)
 #endif
 }
 
+#ifdef IDM_PTHREAD_EMULATION
+static int ilm_add_drive_path(char *dev_node, char *sg_node,
+			      unsigned long wwn);
+
+/*
+ * There is no udev database for the emulated drives, derive a stable WWN
+ * from the device path and register the drive on its first use so later
+ * lookups by WWN can find it.
+ */
+int ilm_read_device_wwn(char *dev, unsigned long *wwn)
+{
+	unsigned long hash = 14695981039346656037UL;	/* FNV-1a */
+	unsigned char *c;
+
+	for (c = (unsigned char *)dev; *c; c++)
+		hash = (hash ^ *c) * 1099511628211UL;
+
+	*wwn = hash;
+	return ilm_add_drive_path(dev, dev, hash);
+}
+#else
 int ilm_read_device_wwn(char *dev, unsigned long *wwn)
 {
 	char cmd[128];
@@ -277,6 +423,49 @@ int ilm_read_device_wwn(char *dev, unsigned long *wwn)
 
         return 0;
 }
+#endif
+
+/*
+ * Find the SG node of a SCSI device folder in sysfs.  The node is normally
+ * named after the scsi_generic folder, check it before walking /dev.
+ */
+static int ilm_find_sg_node(char *dev_path, char *sg_node)
+{
+	char sg_dir[PATH_MAX];
+	char value[64];
+	unsigned int maj, min;
+	struct stat a_stat;
+	char *name;
+	int ret;
+
+	if (ilm_scsi_get_sg_folder(dev_path, sg_dir) < 0) {
+		ilm_log_err("fail to find sg folder of %s", dev_path);
+		return -1;
+	}
+
+	if (ilm_scsi_get_value(sg_dir, "dev", value, sizeof(value)) < 0) {
+		ilm_log_err("fail to get device value");
+		return -1;
+	}
+
+	if (sscanf(value, "%u:%u", &maj, &min) != 2) {
+		ilm_log_err("invalid device value %s", value);
+		return -1;
+	}
+
+	name = strrchr(sg_dir, '/');
+	ret = snprintf(sg_node, PATH_MAX, "/dev/%s", name ? name + 1 : sg_dir);
+	if (ret < PATH_MAX && !stat(sg_node, &a_stat) &&
+	    S_ISCHR(a_stat.st_mode) && a_stat.st_rdev == makedev(maj, min))
+		return 0;
+
+	if (ilm_scsi_parse_sg_node(maj, min, sg_node) < 0) {
+		ilm_log_err("fail to find blk node %d:%d", maj, min);
+		return -1;
+	}
+
+	return 0;
+}
 
 #ifndef IDM_PTHREAD_EMULATION
 static char *ilm_find_sg_scsi(char *blk_dev)
@@ -285,10 +474,9 @@ static char *ilm_find_sg_scsi(char *blk_dev)
 	char devs_path[PATH_MAX];
 	char dev_path[PATH_MAX];
 	char blk_path[PATH_MAX];
+	char sg_node[PATH_MAX];
 	int i, num;
 	int ret;
-	char value[64];
-	unsigned int maj, min;
         struct stat a_stat;
 	char *tmp = NULL;
 
@@ -320,32 +508,10 @@ static char *ilm_find_sg_scsi(char *blk_dev)
 		if ((stat(blk_path, &a_stat) < 0))
 			continue;
 
-		ret = ilm_scsi_change_sg_folder(dev_path);
-		if (ret < 0) {
-			ilm_log_err("fail to change sg folder");
-			goto out;
-		}
-
-		if (NULL == getcwd(blk_path, sizeof(blk_path))) {
-			ilm_log_err("generic_dev error");
-			goto out;
-		}
-
-		ret = ilm_scsi_get_value(blk_path, "dev", value, sizeof(value));
-		if (ret < 0) {
-			ilm_log_err("fail to get device value");
-			goto out;
-		}
-
-		sscanf(value, "%u:%u", &maj, &min);
-
-		ret = ilm_scsi_parse_sg_node(maj, min, value);
-		if (ret < 0) {
-			ilm_log_err("fail to find blk node %d:%d\n", maj, min);
+		if (ilm_find_sg_node(dev_path, sg_node) < 0)
 			goto out;
-		}
 
-		tmp = strdup(value);
+		tmp = strdup(sg_node);
 	}
 
 out:
@@ -558,37 +724,200 @@ char *ilm_convert_sg(char *blk_dev)
 // 	return tmp;
 // }
 
-/* Read out the SG path strings */
-int ilm_drive_get_all_sgs(unsigned long wwn, char **sg_node, int sg_num)
+static void ilm_drive_snapshot_free(struct ilm_drive_snapshot *snap)
 {
-	struct ilm_hw_drive_node *pos, *found = NULL;
-	int i;
+	struct ilm_drive_snap_entry *entry;
+	int i, j;
 
-	pthread_mutex_lock(&drive_list_mutex);
+	if (!snap)
+		return;
+
+	for (i = 0; i < snap->drive_num; i++) {
+		entry = &snap->drive[i];
+		for (j = 0; j < entry->path_num; j++) {
+			free(entry->blk_path[j]);
+			free(entry->sg_path[j]);
+		}
+		free(entry->blk_path);
+		free(entry->sg_path);
+	}
+
+	free(snap);
+}
+
+static int ilm_drive_snap_entry_cmp(const void *a, const void *b)
+{
+	const struct ilm_drive_snap_entry *x = a, *y = b;
+
+	if (x->wwn < y->wwn)
+		return -1;
+	if (x->wwn > y->wwn)
+		return 1;
+	return 0;
+}
+
+static struct ilm_drive_snapshot *ilm_drive_snapshot_build_unsafe(void)
+{
+	struct ilm_drive_snapshot *snap;
+	struct ilm_drive_snap_entry *entry;
+	struct ilm_hw_drive_node *pos;
+	int num = 0, i;
+
+	list_for_each_entry(pos, &drive_list, list)
+		num++;
+
+	snap = malloc(sizeof(*snap) + num * sizeof(*entry));
+	if (!snap)
+		return NULL;
+
+	snap->version = drive_list_version;
+	snap->drive_num = 0;
 
 	list_for_each_entry(pos, &drive_list, list) {
-		if (pos->drive.wwn == wwn) {
-			found = pos;
-			break;
+		entry = &snap->drive[snap->drive_num];
+		entry->wwn = pos->drive.wwn;
+		entry->path_num = 0;
+		entry->blk_path = calloc(pos->drive.path_num, sizeof(char *));
+		entry->sg_path = calloc(pos->drive.path_num, sizeof(char *));
+		snap->drive_num++;
+
+		if (!entry->blk_path || !entry->sg_path)
+			goto fail;
+
+		for (i = 0; i < pos->drive.path_num; i++) {
+			entry->blk_path[i] = strdup(pos->drive.path[i].blk_path);
+			entry->sg_path[i] = strdup(pos->drive.path[i].sg_path);
+			entry->path_num++;
+
+			if (!entry->blk_path[i] || !entry->sg_path[i])
+				goto fail;
 		}
 	}
 
-	if (!found) {
-		sg_num = 0;
-		goto out;
+	qsort(snap->drive, snap->drive_num, sizeof(*entry),
+	      ilm_drive_snap_entry_cmp);
+	return snap;
+
+fail:
+	ilm_drive_snapshot_free(snap);
+	return NULL;
+}
+
+/*
+ * Wait until no reader can reference a snapshot retired before this call.
+ * Flip the epoch twice so a reader which sampled the epoch just before a
+ * flip is still waited on by the second pass.
+ */
+static void ilm_drive_snapshot_synchronize(void)
+{
+	unsigned int idx;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		idx = __atomic_fetch_add(&drive_snap_epoch, 1,
+					 __ATOMIC_SEQ_CST) & 1;
+		while (__atomic_load_n(&drive_snap_readers[idx],
+				       __ATOMIC_SEQ_CST))
+			usleep(100);
 	}
+}
+
+/* Must be called with drive_list_mutex held */
+static int ilm_drive_snapshot_publish_unsafe(void)
+{
+	struct ilm_drive_snapshot *snap, *old;
+
+	snap = ilm_drive_snapshot_build_unsafe();
+	if (!snap) {
+		ilm_log_err("%s: fail to build drive list snapshot", __func__);
+		return -ENOMEM;
+	}
+
+	old = __atomic_exchange_n(&drive_snap, snap, __ATOMIC_SEQ_CST);
+	if (old) {
+		ilm_drive_snapshot_synchronize();
+		ilm_drive_snapshot_free(old);
+	}
+
+	return 0;
+}
+
+/**
+ * ilm_drive_snapshot_get - Enter read section of drive list snapshot
+ * @idx:	Cookie which must be passed to ilm_drive_snapshot_put().
+ *
+ * Never blocks; the returned snapshot stays valid until the read section
+ * is left, so the caller must not sleep or rescan drives in between.
+ *
+ * Returns the current snapshot, NULL if the drive list is not initialized.
+ */
+struct ilm_drive_snapshot *ilm_drive_snapshot_get(int *idx)
+{
+	*idx = __atomic_load_n(&drive_snap_epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&drive_snap_readers[*idx], 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&drive_snap, __ATOMIC_SEQ_CST);
+}
+
+void ilm_drive_snapshot_put(int idx)
+{
+	__atomic_sub_fetch(&drive_snap_readers[idx], 1, __ATOMIC_SEQ_CST);
+}
+
+int ilm_drive_snapshot_version(struct ilm_drive_snapshot *snap)
+{
+	if (!snap)
+		return -1;
+
+	return snap->version;
+}
+
+/* Read out the SG path strings */
+int ilm_drive_snapshot_get_sgs(struct ilm_drive_snapshot *snap,
+			       unsigned long wwn, char **sg_node, int sg_num)
+{
+	struct ilm_drive_snap_entry key, *found;
+	int i;
+
+	if (!snap)
+		return 0;
+
+	key.wwn = wwn;
+	found = bsearch(&key, snap->drive, snap->drive_num, sizeof(key),
+			ilm_drive_snap_entry_cmp);
+	if (!found)
+		return 0;
 
-	if (sg_num > found->drive.path_num)
-		sg_num = found->drive.path_num;
+	if (sg_num > found->path_num)
+		sg_num = found->path_num;
 
 	for (i = 0; i < sg_num; i++)
-		sg_node[i] = strdup(found->drive.path[i].sg_path);
+		sg_node[i] = strdup(found->sg_path[i]);
 
-out:
-	pthread_mutex_unlock(&drive_list_mutex);
 	return sg_num;
 }
 
+/* Find the drive's WWN by its path, returns zero if it's not found */
+unsigned long ilm_drive_snapshot_find_wwn(struct ilm_drive_snapshot *snap,
+					  char *path)
+{
+	struct ilm_drive_snap_entry *entry;
+	int i, j;
+
+	if (!snap)
+		return 0;
+
+	for (i = 0; i < snap->drive_num; i++) {
+		entry = &snap->drive[i];
+		for (j = 0; j < entry->path_num; j++) {
+			if (!strcmp(entry->sg_path[j], path) ||
+			    !strcmp(entry->blk_path[j], path))
+				return entry->wwn;
+		}
+	}
+
+	return 0;
+}
+
 #if 0
 //SCSI-specific function found unused during NVMe implementation
 int ilm_scsi_get_part_table_uuid(char *dev, uuid_t *id)
@@ -620,35 +949,95 @@ int ilm_scsi_get_part_table_uuid(char *dev, uuid_t *id)
 }
 #endif
 
-static void ilm_drive_list_dump(void)
+static int ilm_drive_snapshot_has_sg(struct ilm_drive_snapshot *snap,
+				     unsigned long wwn, char *sg_path)
 {
-	struct ilm_hw_drive_node *pos;
-	int i, ver;
+	struct ilm_drive_snap_entry key, *found;
+	int i;
 
-	ver = ilm_drive_list_version();
+	key.wwn = wwn;
+	found = bsearch(&key, snap->drive, snap->drive_num, sizeof(key),
+			ilm_drive_snap_entry_cmp);
+	if (!found)
+		return 0;
 
-	pthread_mutex_lock(&drive_list_mutex);
+	for (i = 0; i < found->path_num; i++) {
+		if (!strcmp(found->sg_path[i], sg_path))
+			return 1;
+	}
 
-	ilm_log_dbg("Device List Version: %d", ver);
-	list_for_each_entry(pos, &drive_list, list) {
-		ilm_log_dbg(" Device WWN: 0x%lx", pos->drive.wwn);
+	return 0;
+}
 
-		for (i = 0; i < pos->drive.path_num; i++) {
-			ilm_log_dbg("  blk_path %s", pos->drive.path[i].blk_path);
-			ilm_log_dbg("  sg_path %s", pos->drive.path[i].sg_path);
+/*
+ * Drop cached device mappings which point to an SG path that doesn't
+ * belong to the drive anymore; this is invoked after udev removes or
+ * changes a device so the cache cannot hand out a stale SG path.
+ */
+static void ilm_evict_stale_device_mapping(void)
+{
+	struct ilm_drive_snapshot *snap;
+	struct ilm_device_map *pos, *next;
+	int idx;
+
+	pthread_mutex_lock(&dev_map_mutex);
+	snap = ilm_drive_snapshot_get(&idx);
+	if (!snap)
+		goto out;
+
+	list_for_each_entry_safe(pos, next, &dev_map_lru, lru_list) {
+		if (ilm_drive_snapshot_has_sg(snap, pos->wwn, pos->sg_path))
+			continue;
+
+		ilm_log_dbg("Evict stale device mapping %s->%s",
+			    pos->dev_map, pos->sg_path);
+		ilm_dev_map_free_unsafe(pos);
+	}
+
+out:
+	ilm_drive_snapshot_put(idx);
+	pthread_mutex_unlock(&dev_map_mutex);
+}
+
+static void ilm_drive_list_dump(void)
+{
+	struct ilm_drive_snapshot *snap;
+	struct ilm_drive_snap_entry *entry;
+	struct ilm_dev_map_stats stats;
+	int i, j, idx;
+
+	snap = ilm_drive_snapshot_get(&idx);
+	if (!snap)
+		goto out;
+
+	ilm_log_dbg("Device List Version: %d", snap->version);
+	for (i = 0; i < snap->drive_num; i++) {
+		entry = &snap->drive[i];
+		ilm_log_dbg(" Device WWN: 0x%lx", entry->wwn);
+
+		for (j = 0; j < entry->path_num; j++) {
+			ilm_log_dbg("  blk_path %s", entry->blk_path[j]);
+			ilm_log_dbg("  sg_path %s", entry->sg_path[j]);
 		}
 	}
 
-	pthread_mutex_unlock(&drive_list_mutex);
+out:
+	ilm_drive_snapshot_put(idx);
+
+	ilm_get_device_mapping_stats(&stats);
+	ilm_log_dbg("Device mapping cache: num=%d hit=%" PRIu64
+		    " miss=%" PRIu64 " evict=%" PRIu64,
+		    stats.num, stats.hit, stats.miss, stats.evict);
 }
 
 int ilm_drive_list_version(void)
 {
-	int version;
+	struct ilm_drive_snapshot *snap;
+	int version, idx;
 
-	pthread_mutex_lock(&drive_list_mutex);
-	version = drive_list_version;
-	pthread_mutex_unlock(&drive_list_mutex);
+	snap = ilm_drive_snapshot_get(&idx);
+	version = ilm_drive_snapshot_version(snap);
+	ilm_drive_snapshot_put(idx);
 
 	return version;
 }
@@ -707,6 +1096,8 @@ static int ilm_add_drive_path(char *dev_node, char *sg_node,
 
 	pthread_mutex_lock(&drive_list_mutex);
 	ret = ilm_add_drive_path_unsafe(dev_node, sg_node, wwn);
+	if (!ret)
+		ret = ilm_drive_snapshot_publish_unsafe();
 	pthread_mutex_unlock(&drive_list_mutex);
 
 	return ret;
@@ -767,6 +1158,8 @@ static int ilm_del_drive_path(char *dev_node)
 
 	pthread_mutex_lock(&drive_list_mutex);
 	ret = ilm_del_drive_path_unsafe(dev_node);
+	if (!ret)
+		ret = ilm_drive_snapshot_publish_unsafe();
 	pthread_mutex_unlock(&drive_list_mutex);
 
 	return ret;
@@ -785,19 +1178,20 @@ static int ilm_replace_drive_path(char *dev_node, char *sg_node,
 	/* Add the block device with updated SG and WWN */
 	ret = ilm_add_drive_path_unsafe(dev_node, sg_node, wwn);
 
+	/* Publish even on failure, the old path has been removed */
+	ilm_drive_snapshot_publish_unsafe();
+
 	pthread_mutex_unlock(&drive_list_mutex);
 
 	return ret;
 }
 
-static int ilm_drive_list_release(void)
+static void ilm_drive_list_release_unsafe(void)
 {
 	struct ilm_hw_drive_node *pos, *next;
 	struct ilm_hw_drive *drive;
 	int i;
 
-	pthread_mutex_lock(&drive_list_mutex);
-
 	list_for_each_entry_safe(pos, next, &drive_list, list) {
 		list_del(&pos->list);
 
@@ -810,8 +1204,20 @@ static int ilm_drive_list_release(void)
 		free(pos);
 	}
 
-	pthread_mutex_unlock(&drive_list_mutex);
-	return 0;
+	drive_list_version++;
+}
+
+static void ilm_drive_cache_save(void);
+
+/* Replace the drive list loaded from the cache with a full scan */
+static void ilm_drive_list_reconcile(void)
+{
+	if (!drive_thd_reconcile)
+		return;
+
+	drive_thd_reconcile = 0;
+	if (ilm_drive_list_refresh())
+		ilm_log_err("%s: keep the cached drive list", __func__);
 }
 
 static void *drive_thd_fn(void *arg __maybe_unused)
@@ -834,6 +1240,9 @@ static void *drive_thd_fn(void *arg __maybe_unused)
 	udev_monitor_enable_receiving(mon);
 	fd = udev_monitor_get_fd(mon);
 
+	/* Changes during the scan are caught by the monitor afterwards */
+	ilm_drive_list_reconcile();
+
 	while (1) {
 		fd_set fds;
 		struct timeval tv;
@@ -902,7 +1311,7 @@ static void *drive_thd_fn(void *arg __maybe_unused)
 
 			if (!strcmp(action, "add")) {
 
-				sg = ilm_find_sg(dev_name);
+				sg = ilm_convert_sg(dev_name);
 				if (!sg) {
 					ilm_log_warn("%s: Fail to find sg for %s",
 					             __func__, dev_name);
@@ -919,9 +1328,10 @@ static void *drive_thd_fn(void *arg __maybe_unused)
 				ilm_add_drive_path(dev_node, sg, wwn);
 			} else if (!strcmp(action, "remove")) {
 				ilm_del_drive_path(dev_node);
+				ilm_evict_stale_device_mapping();
 			} else if (!strcmp(action, "change")) {
 
-				sg = ilm_find_sg(dev_name);
+				sg = ilm_convert_sg(dev_name);
 				if (!sg) {
 					ilm_log_warn("%s: Fail to find sg for %s",
 					             __func__, dev_name);
@@ -936,9 +1346,11 @@ static void *drive_thd_fn(void *arg __maybe_unused)
 
 				/* Repalce the block device with updated SG and WWN */
 				ilm_replace_drive_path(dev_node, sg, wwn);
+				ilm_evict_stale_device_mapping();
 			}
 
 			ilm_drive_list_dump();
+			ilm_drive_cache_save();
 
 free_dev_ref:
 			if (sg)
@@ -953,60 +1365,357 @@ free_dev_ref:
 	udev_unref(udev);
 
 out:
+	ilm_drive_list_reconcile();
 	pthread_exit(NULL);
 }
 
 static int ilm_sg_mod_is_loaded(void)
 {
-	FILE *fp;
+#ifdef IDM_PTHREAD_EMULATION
+	/* The emulated drives don't go through SG nodes */
+	return 1;
+#endif
+
+	/* Both the loadable and the built-in module are listed in sysfs */
+	return !access(SYSFS_ROOT "/module/sg", F_OK);
+}
+
+/*
+ * Topology cache: the drive paths found by the last scan are saved in
+ * ILM_DRIVE_CACHE_NAME under the run directory together with the device
+ * number and inode of their nodes.  A path whose nodes still have the same
+ * device number and inode hasn't been recreated since, so its WWN can be
+ * taken from the cache instead of asking udev again.
+ */
+static int ilm_drive_cache_path(char *path, size_t len)
+{
+	int ret;
+
+#ifdef IDM_PTHREAD_EMULATION
+	/* The emulated drives have no device nodes */
+	return -ENOENT;
+#endif
+
+	ret = snprintf(path, len, "%s/%s", env.run_dir, ILM_DRIVE_CACHE_NAME);
+	if (ret < 0 || (size_t)ret >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static void ilm_drive_cache_free_unsafe(void)
+{
+	int i;
+
+	for (i = 0; i < drive_cache_num; i++) {
+		free(drive_cache[i].blk_path);
+		free(drive_cache[i].sg_path);
+	}
+
+	free(drive_cache);
+	drive_cache = NULL;
+	drive_cache_num = 0;
+}
+
+static int ilm_drive_cache_stat(struct ilm_drive_cache_entry *entry)
+{
+	struct stat blk, sg;
+
+	if (stat(entry->blk_path, &blk) || stat(entry->sg_path, &sg))
+		return -1;
+
+	entry->blk_rdev = blk.st_rdev;
+	entry->blk_ino = blk.st_ino;
+	entry->sg_rdev = sg.st_rdev;
+	entry->sg_ino = sg.st_ino;
+	return 0;
+}
+
+static int ilm_drive_cache_is_valid(struct ilm_drive_cache_entry *entry)
+{
+	struct ilm_drive_cache_entry now;
+
+	now.blk_path = entry->blk_path;
+	now.sg_path = entry->sg_path;
+	if (ilm_drive_cache_stat(&now))
+		return 0;
+
+	return now.blk_rdev == entry->blk_rdev &&
+	       now.blk_ino == entry->blk_ino &&
+	       now.sg_rdev == entry->sg_rdev &&
+	       now.sg_ino == entry->sg_ino;
+}
+
+/* Look up the WWN of a path which is still the same device */
+static int ilm_drive_cache_find_wwn(char *blk_path, char *sg_path,
+				    unsigned long *wwn)
+{
+	struct ilm_drive_cache_entry *entry;
+	int i, ret = -ENOENT;
+
+	pthread_mutex_lock(&drive_cache_mutex);
+
+	for (i = 0; i < drive_cache_num; i++) {
+		entry = &drive_cache[i];
+		if (strcmp(entry->blk_path, blk_path) ||
+		    strcmp(entry->sg_path, sg_path))
+			continue;
+
+		if (ilm_drive_cache_is_valid(entry)) {
+			*wwn = entry->wwn;
+			ret = 0;
+		}
+		break;
+	}
+
+	pthread_mutex_unlock(&drive_cache_mutex);
+	return ret;
+}
+
+/*
+ * Read the cache of the last run and add its valid paths into the drive
+ * list, so the lock requests can be served before the drives are scanned.
+ *
+ * Returns the number of added paths.
+ */
+static int ilm_drive_cache_load(void)
+{
+	struct ilm_drive_cache_entry entry, *tmp;
+	char path[PATH_MAX], blk[PATH_MAX], sg[PATH_MAX];
+	unsigned long blk_rdev, blk_ino, sg_rdev, sg_ino;
 	char *line = NULL;
 	size_t len = 0;
-	ssize_t read;
-	char tmp[128], tmp1[128];
-	int num, num1;
-	int ret, found = 0;
+	int num = 0;
+	FILE *fp;
 
-	fp = fopen("/proc/modules", "r");
-	if (fp == NULL)
+	if (ilm_drive_cache_path(path, sizeof(path)))
 		return 0;
 
-	while ((read = getline(&line, &len, fp)) != -1) {
-		/*
-		 * Detect if it contains the line:
-		 *   sg 40719 0 - Live 0xffffffffc07d1000
-		 */
-		ret = sscanf(line, "sg %u %u %s Live %s\n",
-			     &num, &num1, tmp, tmp1);
-		if (ret == 4) {
-			found = 1;
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+
+	pthread_mutex_lock(&drive_cache_mutex);
+	pthread_mutex_lock(&drive_list_mutex);
+
+	while (getline(&line, &len, fp) != -1) {
+		if (line[0] == '#')
+			continue;
+
+		if (sscanf(line, "%lx %4095s %4095s %lx %lu %lx %lu",
+			   &entry.wwn, blk, sg, &blk_rdev, &blk_ino,
+			   &sg_rdev, &sg_ino) != 7)
+			continue;
+
+		entry.blk_path = blk;
+		entry.sg_path = sg;
+		entry.blk_rdev = blk_rdev;
+		entry.blk_ino = blk_ino;
+		entry.sg_rdev = sg_rdev;
+		entry.sg_ino = sg_ino;
+
+		if (!ilm_drive_cache_is_valid(&entry)) {
+			ilm_log_dbg("%s: drop stale path %s", __func__, blk);
+			continue;
+		}
+
+		tmp = realloc(drive_cache,
+			      sizeof(*tmp) * (drive_cache_num + 1));
+		if (!tmp)
+			break;
+		drive_cache = tmp;
+
+		entry.blk_path = strdup(blk);
+		entry.sg_path = strdup(sg);
+		if (!entry.blk_path || !entry.sg_path) {
+			free(entry.blk_path);
+			free(entry.sg_path);
 			break;
 		}
+		drive_cache[drive_cache_num++] = entry;
+
+		if (!ilm_add_drive_path_unsafe(blk, sg, entry.wwn))
+			num++;
 	}
 
+	if (num)
+		ilm_drive_snapshot_publish_unsafe();
+
+	pthread_mutex_unlock(&drive_list_mutex);
+	pthread_mutex_unlock(&drive_cache_mutex);
+
+	free(line);
 	fclose(fp);
-	if (line)
-		free(line);
 
-	if (found)
-		return 1;
+	ilm_log_dbg("%s: %d paths from %s", __func__, num, path);
+	return num;
+}
 
+/* Save the current drive list with the identity of every path's nodes */
+static void ilm_drive_cache_save(void)
+{
+	struct ilm_drive_cache_entry *cache = NULL, *entry;
+	struct ilm_drive_snapshot *snap;
+	struct ilm_drive_snap_entry *drive;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int i, j, idx, num = 0, max = 0;
+	FILE *fp;
+
+	if (ilm_drive_cache_path(path, sizeof(path)) ||
+	    snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return;
+
+	pthread_mutex_lock(&drive_cache_mutex);
+
+	snap = ilm_drive_snapshot_get(&idx);
+	for (i = 0; snap && i < snap->drive_num; i++)
+		max += snap->drive[i].path_num;
+
+	if (max)
+		cache = calloc(max, sizeof(*cache));
+
+	for (i = 0; cache && i < snap->drive_num; i++) {
+		drive = &snap->drive[i];
+		for (j = 0; j < drive->path_num; j++) {
+			entry = &cache[num];
+			entry->wwn = drive->wwn;
+			entry->blk_path = strdup(drive->blk_path[j]);
+			entry->sg_path = strdup(drive->sg_path[j]);
+			num++;
+
+			if (!entry->blk_path || !entry->sg_path ||
+			    ilm_drive_cache_stat(entry)) {
+				free(entry->blk_path);
+				free(entry->sg_path);
+				num--;
+			}
+		}
+	}
+	ilm_drive_snapshot_put(idx);
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		ilm_log_warn("%s: fail to open %s %d", __func__, tmp, errno);
+		goto out;
+	}
+
+	fprintf(fp, "# wwn blk_path sg_path blk_rdev blk_ino sg_rdev sg_ino\n");
+	for (i = 0; i < num; i++) {
+		entry = &cache[i];
+		fprintf(fp, "%lx %s %s %lx %lu %lx %lu\n", entry->wwn,
+			entry->blk_path, entry->sg_path,
+			(unsigned long)entry->blk_rdev,
+			(unsigned long)entry->blk_ino,
+			(unsigned long)entry->sg_rdev,
+			(unsigned long)entry->sg_ino);
+	}
+
+	if (fflush(fp) || fsync(fileno(fp))) {
+		ilm_log_warn("%s: fail to write %s %d", __func__, tmp, errno);
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+	fclose(fp);
+
+	if (rename(tmp, path)) {
+		ilm_log_warn("%s: fail to rename %s %d", __func__, tmp, errno);
+		unlink(tmp);
+	}
+
+out:
+	/* The cache in memory follows the drive list even if it's not saved */
+	ilm_drive_cache_free_unsafe();
+	drive_cache = cache;
+	drive_cache_num = num;
+	pthread_mutex_unlock(&drive_cache_mutex);
+}
+
+/*
+ * A scan first lists the block devices from sysfs and /dev, which is cheap;
+ * finding the SG node and reading the WWN of every device is slow (the WWN
+ * comes from udevadm) and is spread over up to ILM_DRIVE_SCAN_THREADS
+ * threads.  Neither step touches the drive list, so lookups and the udev
+ * thread aren't blocked while a scan runs.
+ */
+#define ILM_DRIVE_SCAN_THREADS		16
+
+/*
+ * Scans are serialized, so an older scan is never applied after a newer
+ * one.  A udev event which changes the drive list during a refresh makes
+ * it scan again, and the last try merges the scan into the list instead
+ * of replacing it, so the change is never wiped out.
+ */
+#define ILM_DRIVE_SCAN_RETRIES		3
+
+static pthread_mutex_t drive_scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct ilm_drive_scan_item {
+	char *dev_path;		/* SCSI device in sysfs, NULL for NVMe */
+	char *dev_node;
+	char sg_node[PATH_MAX];
+	unsigned long wwn;
+	int ret;
+};
+
+struct ilm_drive_scan {
+	struct ilm_drive_scan_item *item;
+	int num;
+	int max;
+	int next;
+};
+
+static int ilm_drive_scan_add(struct ilm_drive_scan *scan, char *dev_path,
+			      char *dev_node)
+{
+	struct ilm_drive_scan_item *item;
+
+	if (scan->num == scan->max) {
+		item = realloc(scan->item,
+			       sizeof(*item) * (scan->max + 32));
+		if (!item)
+			return -ENOMEM;
+
+		scan->item = item;
+		scan->max += 32;
+	}
+
+	item = &scan->item[scan->num];
+	memset(item, 0, sizeof(*item));
+	item->dev_path = dev_path ? strdup(dev_path) : NULL;
+	item->dev_node = strdup(dev_node);
+	if ((dev_path && !item->dev_path) || !item->dev_node) {
+		free(item->dev_path);
+		free(item->dev_node);
+		return -ENOMEM;
+	}
+
+	scan->num++;
 	return 0;
 }
 
-static int ilm_drive_list_rescan_scsi(void)
+static void ilm_drive_scan_free(struct ilm_drive_scan *scan)
+{
+	int i;
+
+	for (i = 0; i < scan->num; i++) {
+		free(scan->item[i].dev_path);
+		free(scan->item[i].dev_node);
+	}
+
+	free(scan->item);
+}
+
+static int ilm_drive_list_rescan_scsi(struct ilm_drive_scan *scan)
 {
 	struct dirent **namelist;
 	char devs_path[PATH_MAX];
 	char dev_path[PATH_MAX];
 	char blk_path[PATH_MAX];
 	char dev_node[PATH_MAX];
-	char sg_node[PATH_MAX];
 	char *blk_str = NULL;
 	int i, num;
 	int ret = 0;
-	char value[64];
-	unsigned int maj, min;
-	unsigned long wwn;
 
 	snprintf(devs_path, sizeof(devs_path), "%s%s",
 		 SYSFS_ROOT, BUS_SCSI_DEVS);
@@ -1041,41 +1750,7 @@ static int ilm_drive_list_rescan_scsi(void)
 		snprintf(dev_node, sizeof(dev_node), "/dev/%s", blk_str);
 		free(blk_str);
 
-		ret = ilm_scsi_change_sg_folder(dev_path);
-		if (ret < 0) {
-			ilm_log_err("fail to change sg folder");
-			continue;
-		}
-
-		if (NULL == getcwd(blk_path, sizeof(blk_path))) {
-			ilm_log_err("generic_dev error");
-			continue;
-		}
-
-		ret = ilm_scsi_get_value(blk_path, "dev", value, sizeof(value));
-		if (ret < 0) {
-			ilm_log_err("fail to get device value");
-			continue;
-		}
-
-		sscanf(value, "%u:%u", &maj, &min);
-
-		ret = ilm_scsi_parse_sg_node(maj, min, sg_node);
-		if (ret < 0) {
-			ilm_log_err("fail to find blk node %d:%d", maj, min);
-			continue;
-		}
-
-		ilm_log_dbg("%s: dev_node=%s sg_node=%s", __func__,
-			    dev_node, sg_node);
-
-		ret = ilm_read_device_wwn(dev_node, &wwn);
-		if (ret < 0) {
-			ilm_log_err("fail to read parttable id");
-			continue;
-		}
-
-		ret = ilm_add_drive_path(dev_node, sg_node, wwn);
+		ret = ilm_drive_scan_add(scan, dev_path, dev_node);
 		if (ret < 0) {
 			ilm_log_err("fail to add scsi node");
 			goto out;
@@ -1091,14 +1766,13 @@ out:
 	return ret;
 }
 
-static int ilm_drive_list_rescan_nvme(void)
+static int ilm_drive_list_rescan_nvme(struct ilm_drive_scan *scan)
 {
 	struct dirent **namelist;
 	char devs_path[PATH_MAX];
 	char dev_node[PATH_MAX];
 	int i, num;
 	int ret = 0;
-	unsigned long wwn;
 
 	snprintf(devs_path, sizeof(devs_path), "/dev");
 
@@ -1116,17 +1790,9 @@ static int ilm_drive_list_rescan_nvme(void)
 			goto out;
 		}
 
-		ilm_log_dbg("%s: dev_node=%s ", __func__, dev_node);
-
-		ret = ilm_read_device_wwn(dev_node, &wwn);
-		if (ret < 0) {
-			ilm_log_err("fail to read parttable id");
-			continue;
-		}
-
-		ret = ilm_add_drive_path(dev_node, dev_node, wwn);
+		ret = ilm_drive_scan_add(scan, NULL, dev_node);
 		if (ret < 0) {
-			ilm_log_err("fail to add scsi node");
+			ilm_log_err("fail to add nvme node");
 			goto out;
 		}
 	}
@@ -1141,38 +1807,163 @@ out:
 	return ret;
 }
 
-int ilm_drive_list_rescan(void)
+static void ilm_drive_scan_resolve(struct ilm_drive_scan_item *item)
 {
+	if (item->dev_path) {
+		item->ret = ilm_find_sg_node(item->dev_path, item->sg_node);
+		if (item->ret < 0)
+			return;
+	} else {
+		/* NVMe uses the block device as SG path */
+		snprintf(item->sg_node, sizeof(item->sg_node), "%s",
+			 item->dev_node);
+	}
+
+	ilm_log_dbg("%s: dev_node=%s sg_node=%s", __func__,
+		    item->dev_node, item->sg_node);
+
+	if (!ilm_drive_cache_find_wwn(item->dev_node, item->sg_node,
+				      &item->wwn))
+		return;
+
+	item->ret = ilm_read_device_wwn(item->dev_node, &item->wwn);
+	if (item->ret < 0)
+		ilm_log_err("fail to read wwn of %s", item->dev_node);
+}
+
+static void *ilm_drive_scan_worker(void *data)
+{
+	struct ilm_drive_scan *scan = data;
+	int i;
+
+	while ((i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED)) <
+	       scan->num)
+		ilm_drive_scan_resolve(&scan->item[i]);
+
+	return NULL;
+}
+
+static void ilm_drive_scan_run(struct ilm_drive_scan *scan)
+{
+	pthread_t thd[ILM_DRIVE_SCAN_THREADS];
+	int i, num;
+
+	num = scan->num < ILM_DRIVE_SCAN_THREADS ?
+		scan->num : ILM_DRIVE_SCAN_THREADS;
+
+	/* This thread resolves the devices too, so a failure is harmless */
+	for (i = 1; i < num; i++) {
+		if (pthread_create(&thd[i], NULL, ilm_drive_scan_worker, scan))
+			break;
+	}
+	num = i;
+
+	ilm_drive_scan_worker(scan);
+
+	for (i = 1; i < num; i++)
+		pthread_join(thd[i], NULL);
+}
+
+/* Scan the drives without holding drive_list_mutex */
+static int ilm_drive_list_scan(struct ilm_drive_scan *scan)
+{
+	uint64_t start = ilm_curr_time();
 	int ret;
 
-	ret = ilm_drive_list_rescan_scsi();
+	memset(scan, 0, sizeof(*scan));
+
+#ifdef IDM_PTHREAD_EMULATION
+	/* Emulated drives are registered when they are resolved */
+	return 0;
+#endif
+
+	ret = ilm_drive_list_rescan_scsi(scan);
 	if (ret) {
 		ilm_log_err("%s: drive list rescan(scsi) failure: %d",
 		            __func__, ret);
 		goto EXIT;
 	}
 
-	ret = ilm_drive_list_rescan_nvme();
+	ret = ilm_drive_list_rescan_nvme(scan);
 	if (ret) {
 		ilm_log_err("%s: drive list rescan(nvme) failure: %d",
 		            __func__, ret);
 		goto EXIT;
 	}
 
-	ilm_drive_list_dump();
+EXIT:
+	ilm_drive_scan_run(scan);
 
-	if (ret)
-		ilm_drive_list_release();
+	ilm_log_dbg("%s: %d devices in %lu ms", __func__, scan->num,
+		    ilm_curr_time() - start);
+	return ret;
+}
 
-EXIT:
+/* Must be called with drive_list_mutex held */
+static int ilm_drive_list_apply_unsafe(struct ilm_drive_scan *scan)
+{
+	struct ilm_drive_scan_item *item;
+	int i, ret = 0;
+
+	for (i = 0; i < scan->num; i++) {
+		item = &scan->item[i];
+		if (item->ret < 0)
+			continue;
+
+		ret = ilm_add_drive_path_unsafe(item->dev_node, item->sg_node,
+						item->wwn);
+		if (ret < 0) {
+			ilm_log_err("fail to add drive node %s",
+				    item->dev_node);
+			break;
+		}
+	}
+
+	/* Publish what has been found so far even if the scan failed */
+	ilm_drive_snapshot_publish_unsafe();
+	return ret;
+}
+
+int ilm_drive_list_rescan(void)
+{
+	struct ilm_drive_scan scan;
+	int ret, ret2;
+
+	pthread_mutex_lock(&drive_scan_mutex);
+
+	ret = ilm_drive_list_scan(&scan);
+
+	pthread_mutex_lock(&drive_list_mutex);
+	ret2 = ilm_drive_list_apply_unsafe(&scan);
+	pthread_mutex_unlock(&drive_list_mutex);
+
+	ilm_drive_scan_free(&scan);
+
+	if (!ret)
+		ret = ret2;
+
+	if (!ret) {
+		ilm_drive_cache_save();
+		ilm_drive_list_dump();
+	}
+
+	pthread_mutex_unlock(&drive_scan_mutex);
 	return ret;
 }
 
+static void ilm_drive_list_release(void)
+{
+	pthread_mutex_lock(&drive_list_mutex);
+	ilm_drive_list_release_unsafe();
+	pthread_mutex_unlock(&drive_list_mutex);
+}
+
 int ilm_drive_list_init(void)
 {
 	int ret;
 
 	INIT_LIST_HEAD(&drive_list);
+	ilm_dev_map_init();
 
 	if (!ilm_sg_mod_is_loaded()) {
 		ilm_log_err("Kernel module \"sg\" hasn't been loaded?!");
@@ -1182,10 +1973,19 @@ int ilm_drive_list_init(void)
 		return -1;
 	}
 
-	ret = ilm_drive_list_rescan();
-	if (ret) {
-		ilm_log_err("Fail to scan drive list: %d", ret);
-		goto EXIT;
+	/*
+	 * Start with the topology of the last run if it's still valid, the
+	 * drive thread reconciles it with a full scan in the background.
+	 */
+	if (ilm_drive_cache_load() > 0) {
+		drive_thd_reconcile = 1;
+	} else {
+		ret = ilm_drive_list_rescan();
+		if (ret) {
+			ilm_log_err("Fail to scan drive list: %d", ret);
+			ilm_drive_list_release();
+			goto EXIT;
+		}
 	}
 
 	ret = pthread_create(&drive_thd, NULL, drive_thd_fn, NULL);
@@ -1199,20 +1999,67 @@ EXIT:
 	return ret;
 }
 
+/*
+ * Rebuild the drive list from scratch.  The old snapshot stays visible to
+ * readers until the rescan has completed, so lookups never observe an
+ * empty or partially populated drive list.
+ */
 int ilm_drive_list_refresh(void)
 {
-	int ret;
+	struct ilm_drive_scan scan;
+	unsigned int version;
+	int retries = 0, ret, ret2;
+
+	pthread_mutex_lock(&drive_scan_mutex);
+
+again:
+	pthread_mutex_lock(&drive_list_mutex);
+	version = drive_list_version;
+	pthread_mutex_unlock(&drive_list_mutex);
+
+	ret = ilm_drive_list_scan(&scan);
+
+	pthread_mutex_lock(&drive_list_mutex);
+
+	/* The scan may or may not have seen a change made meanwhile */
+	if (version != drive_list_version) {
+		if (retries++ < ILM_DRIVE_SCAN_RETRIES) {
+			pthread_mutex_unlock(&drive_list_mutex);
+			ilm_drive_scan_free(&scan);
+			goto again;
+		}
 
-	ilm_drive_list_release();
-	ret = ilm_drive_list_rescan();
-	if (ret)
+		ilm_log_warn("%s: drive list keeps changing, merge the scan",
+			     __func__);
+	} else {
+#ifndef IDM_PTHREAD_EMULATION
+		ilm_drive_list_release_unsafe();
+#endif
+	}
+
+	ret2 = ilm_drive_list_apply_unsafe(&scan);
+	pthread_mutex_unlock(&drive_list_mutex);
+
+	ilm_drive_scan_free(&scan);
+
+	if (!ret)
+		ret = ret2;
+
+	if (ret) {
 		ilm_log_err("Fail to scan drive list: %d", ret);
+	} else {
+		ilm_drive_cache_save();
+		ilm_drive_list_dump();
+	}
 
+	pthread_mutex_unlock(&drive_scan_mutex);
 	return ret;
 }
 
 void ilm_drive_list_exit(void)
 {
+	struct ilm_drive_snapshot *old;
+
 	/* Notify drive thread to exit */
 	pthread_mutex_lock(&drive_list_mutex);
 	drive_thd_done = 1;
@@ -1221,5 +2068,14 @@ void ilm_drive_list_exit(void)
 	/* Wait for drive thread to exit */
 	pthread_join(drive_thd, NULL);
 
-	ilm_drive_list_release();
+	pthread_mutex_lock(&drive_list_mutex);
+	ilm_drive_list_release_unsafe();
+	old = __atomic_exchange_n(&drive_snap, NULL, __ATOMIC_SEQ_CST);
+	ilm_drive_snapshot_synchronize();
+	ilm_drive_snapshot_free(old);
+	pthread_mutex_unlock(&drive_list_mutex);
+
+	pthread_mutex_lock(&drive_cache_mutex);
+	ilm_drive_cache_free_unsafe();
+	pthread_mutex_unlock(&drive_cache_mutex);
 }
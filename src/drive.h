@@ -9,10 +9,18 @@
 #include <stdint.h>
 #include <uuid/uuid.h>
 
+struct ilm_dev_map_stats {
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t evict;
+	int num;
+};
+
 char *ilm_find_cached_device_mapping(char *dev_map,
 				     unsigned long *wwn);
 int ilm_add_cached_device_mapping(char *dev_map, char *sg_path,
 				  unsigned long wwn);
+void ilm_get_device_mapping_stats(struct ilm_dev_map_stats *stats);
 
 int ilm_read_blk_uuid(char *dev, uuid_t *uuid);
 char *ilm_convert_sg(char *blk_dev);
@@ -21,7 +29,17 @@ int ilm_read_device_wwn(char *dev, unsigned long *wwn);
 // char *ilm_scsi_get_first_sg(char *dev);
 char *ilm_drive_convert_blk_name(char *blk_dev);
 //int ilm_scsi_get_part_table_uuid(char *dev, uuid_t *id);
-int ilm_drive_get_all_sgs(unsigned long wwn, char **sg_node, int sg_num);
+
+struct ilm_drive_snapshot;
+
+struct ilm_drive_snapshot *ilm_drive_snapshot_get(int *idx);
+void ilm_drive_snapshot_put(int idx);
+int ilm_drive_snapshot_version(struct ilm_drive_snapshot *snap);
+int ilm_drive_snapshot_get_sgs(struct ilm_drive_snapshot *snap,
+			       unsigned long wwn, char **sg_node, int sg_num);
+unsigned long ilm_drive_snapshot_find_wwn(struct ilm_drive_snapshot *snap,
+					  char *path);
+
 int ilm_drive_list_init(void);
 void ilm_drive_list_exit(void);
 int ilm_drive_list_rescan(void);
@@ -30,6 +30,7 @@
 #include "failure.h"
 #include "log.h"
 #include "ilm_internal.h"
+#include "recorder.h"
 
 #define MAX_AV_COUNT 8
 
@@ -103,7 +104,7 @@ exec_prog:
 
 int ilm_failure_handler(struct ilm_lockspace *ls)
 {
-	int ret;
+	int ret = 0;
 	char cmd[512];
 
 	if (ls->kill_path) {
@@ -112,15 +113,17 @@ int ilm_failure_handler(struct ilm_lockspace *ls)
 		if (ret < 0 || ret == sizeof(cmd)) {
 			ilm_log_err("%s: Fail to generate kill path cmd %d",
 				    __func__, ret);
-			return -1;
+			ret = -1;
+			goto out;
 		}
 
 		ilm_log_warn("%s: kill command=%s", __func__, cmd);
 
+		ret = 0;
 		if (!(popen(cmd, "r"))) {
 			ilm_log_err("%s: Fail to execute kill path cmd %s",
 				    __func__, cmd);
-			return -1;
+			ret = -1;
 		}
 	} else if (ls->kill_sig) {
 		ilm_log_warn("%s: kill_pid=%d kill_sig=%d",
@@ -128,5 +131,12 @@ int ilm_failure_handler(struct ilm_lockspace *ls)
 		kill(ls->kill_pid, ls->kill_sig);
 	}
 
-	return 0;
+out:
+	/*
+	 * Keep the drive commands which led to the failure, it's dumped
+	 * after the kill so doesn't delay it, and only once per failure.
+	 */
+	if (!ls->failed)
+		ilm_recorder_dump("failure");
+	return ret;
 }
@@ -672,6 +672,26 @@ int idm_drive_whitelist(char *drive, char **whitelist, int *whitelist_num)
 	return FAILURE;
 }
 
+/**
+ * idm_drive_read_mutex_num - Read back the number of mutexes in the drive
+ *
+ * @drive:	Drive path name.
+ * @num:	Returned mutex number.
+ *
+ * Returns zero or a negative error (ie. EINVAL, ENOMEM, EBUSY, etc).
+ */
+int idm_drive_read_mutex_num(char *drive, unsigned int *num)
+{
+	int ret;
+
+	if (strstr(drive, NVME_DEVICE_TAG))
+		ret = nvme_idm_sync_read_mutex_num(drive, num);
+	else
+		ret = scsi_idm_sync_read_mutex_num(drive, num);
+
+	return ret;
+}
+
 /**
  * idm_drive_read_group - Read back mutex group for all IDM in the drives
  *
@@ -1139,6 +1139,23 @@ EXIT_FAIL:
 	return ret;
 }
 
+/**
+ * nvme_idm_sync_read_mutex_num - Synchronously read the number of mutexes
+ * present on the drive.
+ *
+ * @drive:      Drive path name.
+ * @mutex_num:  Returned number of mutexes present on the drive.
+ *
+ * Returns zero or a negative error (ie. EINVAL, ENOMEM, EBUSY, etc).
+ */
+int nvme_idm_sync_read_mutex_num(char *drive, unsigned int *mutex_num)
+{
+	if (!drive || !mutex_num)
+		return -EINVAL;
+
+	return _idm_sync_read_mutex_num(drive, mutex_num);
+}
+
 /**
  * nvme_idm_sync_read_mutex_group - Synchronously read back mutex group info
  * for all IDM in the drives
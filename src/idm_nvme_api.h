@@ -68,6 +68,7 @@ int nvme_idm_sync_read_lock_count(char *lock_id, char *host_id, int *count,
 int nvme_idm_sync_read_lock_mode(char *lock_id, int *mode, char *drive);
 int nvme_idm_sync_read_lvb(char *lock_id, char *host_id, char *lvb,
                            int lvb_size, char *drive);
+int nvme_idm_sync_read_mutex_num(char *drive, unsigned int *mutex_num);
 int nvme_idm_sync_read_mutex_group(char *drive, struct idm_info **info_ptr,
                                    int *info_num);
 int nvme_idm_sync_unlock(char *lock_id, int mode, char *host_id,
@@ -67,6 +67,10 @@ Setup to be gcc-defined (-D) in make file */
 #include "idm_nvme_io.h"
 #include "idm_nvme_utils.h"
 #include "log.h"
+#include "recorder.h"
+#include "req_trace.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -80,6 +84,9 @@ static int _idm_cmd_init(struct idm_nvme_request *request_idm,
                          uint8_t opcode_nvme);
 static int _idm_data_init_wrt(struct idm_nvme_request *request_idm);
 static int _sync_idm_cmd_send(struct idm_nvme_request *request_idm);
+static int _idm_stats_op(struct idm_nvme_request *request_idm);
+static void _idm_stats_record(struct idm_nvme_request *request_idm,
+                              uint64_t start, int result);
 
 ////////////////////////////////////////////////////////////////////////////////
 // FUNCTIONS
@@ -109,6 +116,11 @@ int nvme_idm_async_data_rcv(struct idm_nvme_request *request_idm, int *result)
 		ilm_log_err("%s: _async_idm_data_rcv fail %d", __func__, ret);
 	}
 
+	_idm_stats_record(request_idm, request_idm->stats_start,
+	                  ret < 0 ? ret : *result);
+	ilm_trace4(nvme_complete, request_idm, request_idm->drive,
+	           _idm_stats_op(request_idm), ret < 0 ? ret : *result);
+
 	close(request_idm->fd_nvme);
 	return ret;
 }
@@ -374,6 +386,12 @@ static int _async_idm_cmd_send(struct idm_nvme_request *request_idm)
 	dumpIdmDataStruct(request_idm->data_idm);
 	#endif
 
+	request_idm->stats_start = ilm_stats_now();
+	request_idm->trace_id = ilm_req_trace_id();
+	request_idm->status_nvme = 0;
+	ilm_trace4(nvme_submit, request_idm, request_idm->drive,
+	           _idm_stats_op(request_idm), request_idm->trace_id);
+
 	fd_nvme = open(request_idm->drive, O_RDONLY);
 	if (fd_nvme < 0) {
 		ilm_log_err("%s: error opening drive %s fd %d",
@@ -389,6 +407,11 @@ static int _async_idm_cmd_send(struct idm_nvme_request *request_idm)
 		ilm_log_err("%s: send failed: %d(0x%X)", __func__, ret, ret);
 	}
 EXIT:
+	if (ret) {
+		_idm_stats_record(request_idm, request_idm->stats_start, ret);
+		ilm_trace4(nvme_complete, request_idm, request_idm->drive,
+		           _idm_stats_op(request_idm), ret);
+	}
 	return ret;
 }
 
@@ -425,6 +448,8 @@ static int _async_idm_data_rcv(struct idm_nvme_request *request_idm,
 		goto EXIT;
 	}
 
+	if (result_ani > 0)
+		request_idm->status_nvme = result_ani & 0x7FF;
 	*result = _idm_cmd_check_status(result_ani, request_idm->opcode_idm);
 
 	#ifdef DBG__DUMP_STRUCTS
@@ -673,6 +698,7 @@ static int _sync_idm_cmd_send(struct idm_nvme_request *request_idm)
 	struct nvme_passthru_cmd cmd_nvme_passthru;
 	int fd_nvme;
 	int ret = FAILURE;
+	uint64_t start = ilm_stats_now();
 
 	#ifdef DBG__DUMP_STRUCTS
 	dumpNvmeCmdStruct(&request_idm->cmd_nvme, 1, 1);
@@ -681,10 +707,18 @@ static int _sync_idm_cmd_send(struct idm_nvme_request *request_idm)
 
 	memset(&cmd_nvme_passthru, 0, sizeof(struct nvme_passthru_cmd));
 
+	request_idm->trace_id = ilm_req_trace_id();
+	request_idm->status_nvme = 0;
+	ilm_trace4(nvme_submit, NULL, request_idm->drive,
+	           _idm_stats_op(request_idm), request_idm->trace_id);
+
 	fd_nvme = open(request_idm->drive, O_RDONLY);
 	if (fd_nvme < 0) {
 		ilm_log_err("%s: error opening drive %s fd %d",
 		            __func__, request_idm->drive, fd_nvme);
+		_idm_stats_record(request_idm, start, fd_nvme);
+		ilm_trace4(nvme_complete, NULL, request_idm->drive,
+		           _idm_stats_op(request_idm), fd_nvme);
 		return fd_nvme;
 	}
 
@@ -716,13 +750,58 @@ static int _sync_idm_cmd_send(struct idm_nvme_request *request_idm)
 	if(ret) {
 		ilm_log_err("%s: ioctl failed: %d(0x%X)", __func__, ret, ret);
 	}
+	if (ret > 0)
+		request_idm->status_nvme = ret & 0x7FF;
 
 	ret = _idm_cmd_check_status(ret, request_idm->opcode_idm);
 
 	close(fd_nvme);
+	_idm_stats_record(request_idm, start, ret);
+	ilm_trace4(nvme_complete, NULL, request_idm->drive,
+	           _idm_stats_op(request_idm), ret);
 	return ret;
 }
 
+/**
+ * _idm_stats_op - Maps an NVMe IDM command to the statistics opcode.
+ *
+ * @request_idm:    Struct containing all NVMe-specific command info for the
+ *                  requested IDM action.
+ *
+ * Returns ILM_STATS_OP_* or -1 if the command isn't accounted.
+ */
+static int _idm_stats_op(struct idm_nvme_request *request_idm)
+{
+	int write = request_idm->cmd_nvme.opcode_nvme ==
+	            NVME_IDM_VENDOR_CMD_OP_WRITE;
+
+	return ilm_stats_op(write, request_idm->opcode_idm,
+	                    request_idm->group_idm);
+}
+
+/**
+ * _idm_stats_record - Accounts a completed NVMe IDM command into the
+ * per-drive statistics and the flight recorder.  The lock ID is only
+ * recorded for write commands.
+ *
+ * @request_idm:    Struct containing all NVMe-specific command info for the
+ *                  requested IDM action.
+ * @start:          Time when the command was sent.
+ * @result:         Zero or a negative error of the command.
+ */
+static void _idm_stats_record(struct idm_nvme_request *request_idm,
+                              uint64_t start, int result)
+{
+	int write = request_idm->cmd_nvme.opcode_nvme ==
+	            NVME_IDM_VENDOR_CMD_OP_WRITE;
+	int op = _idm_stats_op(request_idm);
+
+	ilm_stats_record(request_idm->drive, op, start, result);
+	ilm_recorder_add(request_idm->drive, ILM_RECORDER_NVME, op,
+	                 write ? request_idm->lock_id : NULL, start, result,
+	                 request_idm->status_nvme, request_idm->trace_id);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // DEBUG MAIN
 ////////////////////////////////////////////////////////////////////////////////
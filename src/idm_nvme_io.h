@@ -118,6 +118,9 @@ struct idm_nvme_request {
 	unsigned int        data_num;      //Note: Currently, this also corresponds to # of mutexes (ie: mutex_num).  //TODO: uint64_t?
 	uint64_t            class;
 	int                 fd_nvme;
+	uint64_t            stats_start;   //Sent time of async command, for statistics
+	uint64_t            trace_id;      //Client request, see req_trace.h
+	uint16_t            status_nvme;   //SCT/SC of the last command, for the flight recorder
 
 	//Variables used by custom asynchronous NVMe IO code (ANI)
 	uuid_t                      uuid_async_job;
@@ -18,9 +18,9 @@
 #include "log.h"
 #include "util.h"
 
-#define IDM_STATE_INIT			0
-#define IDM_STATE_RUN			1
-#define IDM_STATE_TIMEOUT		2
+#define IDM_HOST_INIT			0
+#define IDM_HOST_RUN			1
+#define IDM_HOST_TIMEOUT		2
 
 struct idm_async_op {
 	int fd;
@@ -227,7 +227,7 @@ static struct idm_host *_idm_host_get(struct idm_emulation *idm,
 	memcpy(host->id, host_id, IDM_HOST_ID_LEN);
 	host->countdown = timeout;
 	host->last_renew_time = ilm_curr_time();
-	host->state = IDM_STATE_INIT;
+	host->state = IDM_HOST_INIT;
 	INIT_LIST_HEAD(&host->list);
 
 	list_add(&host->list, &idm->host_list);
@@ -307,7 +307,7 @@ static int idm_host_count(struct idm_emulation *idm)
 	int count = 0;
 
 	list_for_each_entry(host, &idm->host_list, list) {
-		if (host->state == IDM_STATE_TIMEOUT ||
+		if (host->state == IDM_HOST_TIMEOUT ||
 		    idm_host_is_expired(host))
 			continue;
 
@@ -324,7 +324,7 @@ static int idm_self_count(struct idm_emulation *idm, char *host_id)
 	assert(host_id);
 
 	list_for_each_entry(host, &idm->host_list, list) {
-		if (host->state == IDM_STATE_TIMEOUT ||
+		if (host->state == IDM_HOST_TIMEOUT ||
 		    idm_host_is_expired(host))
 			continue;
 
@@ -423,7 +423,7 @@ int idm_drive_lock(char *lock_id, int mode, char *host_id,
 	idm->mode = mode;
 
 	/* Update the host state */
-	host->state = IDM_STATE_RUN;
+	host->state = IDM_HOST_RUN;
 	host->last_renew_time = ilm_curr_time();
 
 	pthread_mutex_unlock(&idm->mutex);
@@ -582,10 +582,12 @@ int idm_drive_unlock_async(char *lock_id, int mode, char *host_id,
  * @mode:		Lock mode (unlock, shareable, exclusive).
  * @host_id:		Host ID (32 bytes).
  * @drive:		Drive path name.
+ * @timeout:		Timeout for membership (unit: millisecond).
  *
  * Returns zero or a negative error (ie. EINVAL, ETIME).
  */
-int idm_drive_convert_lock(char *lock_id, int mode, char *host_id, char *drive)
+int idm_drive_convert_lock(char *lock_id, int mode, char *host_id, char *drive,
+			   uint64_t timeout)
 {
 	struct idm_emulation *idm;
 	struct idm_host *host;
@@ -610,7 +612,7 @@ int idm_drive_convert_lock(char *lock_id, int mode, char *host_id, char *drive)
 	pthread_mutex_lock(&idm->mutex);
 
 	if (idm_host_is_expired(host)) {
-		host->state = IDM_STATE_TIMEOUT;
+		host->state = IDM_HOST_TIMEOUT;
 		ret = -ETIME;
 		goto out;
 	}
@@ -668,18 +670,21 @@ out:
  * @mode:		Lock mode (unlock, shareable, exclusive).
  * @host_id:		Host ID (32 bytes).
  * @drive:		Drive path name.
- * @fd:			File descriptor (emulated with index).
+ * @timeout:		Timeout for membership (unit: millisecond).
+ * @handle:		Handle (emulated with index).
  *
  * Returns zero or a negative error (ie. EINVAL, ETIME).
  */
 int idm_drive_convert_lock_async(char *lock_id, int mode, char *host_id,
-				 char *drive, uint64_t *handle)
+				 char *drive, uint64_t timeout,
+				 uint64_t *handle)
 {
 	struct idm_async_op *async;
 
 	async = malloc(sizeof(struct idm_async_op));
 
-	async->result = idm_drive_convert_lock(lock_id, mode, host_id, drive);
+	async->result = idm_drive_convert_lock(lock_id, mode, host_id, drive,
+					       timeout);
 
 	pthread_mutex_lock(&idm_async_list_mutex);
 	*handle = idm_async_index;
@@ -697,10 +702,12 @@ int idm_drive_convert_lock_async(char *lock_id, int mode, char *host_id,
  * @mode:		Lock mode (unlock, shareable, exclusive).
  * @host_id:		Host ID (32 bytes).
  * @drive:		Drive path name.
+ * @timeout:		Timeout for membership (unit: millisecond).
  *
  * Returns zero or a negative error (ie. EINVAL, ETIME).
  */
-int idm_drive_renew_lock(char *lock_id, int mode, char *host_id, char *drive)
+int idm_drive_renew_lock(char *lock_id, int mode, char *host_id, char *drive,
+			 uint64_t timeout)
 {
 	struct idm_emulation *idm;
 	struct idm_host *host;
@@ -725,7 +732,7 @@ int idm_drive_renew_lock(char *lock_id, int mode, char *host_id, char *drive)
 	pthread_mutex_lock(&idm->mutex);
 
 	if (idm_host_is_expired(host)) {
-		host->state = IDM_STATE_TIMEOUT;
+		host->state = IDM_HOST_TIMEOUT;
 		ret = -ETIME;
 		goto out;
 	}
@@ -735,6 +742,7 @@ int idm_drive_renew_lock(char *lock_id, int mode, char *host_id, char *drive)
 		goto out;
 	}
 
+	host->countdown = timeout;
 	host->last_renew_time = ilm_curr_time();
 
 out:
@@ -751,18 +759,20 @@ out:
  * @mode:		Lock mode (unlock, shareable, exclusive).
  * @host_id:		Host ID (32 bytes).
  * @drive:		Drive path name.
- * @fd:			File descriptor (emulated with index).
+ * @timeout:		Timeout for membership (unit: millisecond).
+ * @handle:		Handle (emulated with index).
  *
  * Returns zero or a negative error (ie. EINVAL, ETIME).
  */
-int idm_drive_renew_lock_async(char *lock_id, int mode,
-			       char *host_id, char *drive, uint64_t *handle)
+int idm_drive_renew_lock_async(char *lock_id, int mode, char *host_id,
+			       char *drive, uint64_t timeout, uint64_t *handle)
 {
 	struct idm_async_op *async;
 
 	async = malloc(sizeof(struct idm_async_op));
 
-	async->result = idm_drive_renew_lock(lock_id, mode, host_id, drive);
+	async->result = idm_drive_renew_lock(lock_id, mode, host_id, drive,
+					     timeout);
 
 	pthread_mutex_lock(&idm_async_list_mutex);
 	*handle = idm_async_index;
@@ -822,7 +832,7 @@ int idm_drive_break_lock(char *lock_id, int mode, char *host_id,
 	can_break = 1;
 	list_for_each_entry_safe(host, next, &idm->host_list, list) {
 		/* If the host is timeout, remove it from the host list. */
-		if (host->state == IDM_STATE_TIMEOUT ||
+		if (host->state == IDM_HOST_TIMEOUT ||
 		    idm_host_is_expired(host)) {
 			list_del(&host->list);
 			free(host);
@@ -874,7 +884,7 @@ int idm_drive_break_lock(char *lock_id, int mode, char *host_id,
 	idm->mode = mode;
 
 	/* Update the host state */
-	host->state = IDM_STATE_RUN;
+	host->state = IDM_HOST_RUN;
 	host->last_renew_time = ilm_curr_time();
 
 fail_break:
@@ -953,13 +963,13 @@ int idm_drive_write_lvb(char *lock_id, char *host_id,
 	pthread_mutex_lock(&idm->mutex);
 
 	if (idm_host_is_expired(host)) {
-		host->state = IDM_STATE_TIMEOUT;
+		host->state = IDM_HOST_TIMEOUT;
 		ret = -ETIME;
 		goto out;
 	}
 
 	/* The host is not running state? */
-	if (host->state != IDM_STATE_RUN) {
+	if (host->state != IDM_HOST_RUN) {
 		ret = -ETIME;
 		goto out;
 	}
@@ -1043,13 +1053,13 @@ int idm_drive_read_lvb(char *lock_id, char *host_id,
 	pthread_mutex_lock(&idm->mutex);
 
 	if (idm_host_is_expired(host)) {
-		host->state = IDM_STATE_TIMEOUT;
+		host->state = IDM_HOST_TIMEOUT;
 		ret = -ETIME;
 		goto out;
 	}
 
 	/* The host is not running state? */
-	if (host->state != IDM_STATE_RUN) {
+	if (host->state != IDM_HOST_RUN) {
 		ret = -EINVAL;
 		goto out;
 	}
@@ -1095,15 +1105,16 @@ int idm_drive_read_lvb_async(char *lock_id, char *host_id, char *drive, uint64_t
 /**
  * idm_drive_read_lvb_async_result - Read the result for read_lvb operation with
  * 				     async mode.
- * @fd:			File descriptor (emulated with index).
+ * @drive:		Drive path name.
+ * @handle:		Handle (emulated with index).
  * @lvb:		Lock value block pointer.
  * @lvb_size:		Lock value block size.
  * @result:		Returned result for the operation.
  *
  * Returns zero or a negative error (ie. EINVAL).
  */
-int idm_drive_read_lvb_async_result(uint64_t handle, char *lvb, int lvb_size,
-				    int *result)
+int idm_drive_read_lvb_async_result(char *drive, uint64_t handle, char *lvb,
+				    int lvb_size, int *result)
 {
 	struct idm_async_op *async, *next;
 
@@ -1193,15 +1204,16 @@ int idm_drive_lock_count_async(char *lock_id, char *host_id,
 
 /**
  * idm_drive_lock_count_async_result - Read the result for host count.
- * @fd:			File descriptor (emulated with index).
+ * @drive:		Drive path name.
+ * @handle:		Handle (emulated with index).
  * @count:		Returned count value's pointer.
  * @self:		Returned self count value's pointer.
  * @result:		Returned result for the operation.
  *
  * Returns zero or a negative error (ie. EINVAL).
  */
-int idm_drive_lock_count_async_result(uint64_t handle, int *count, int *self,
-				      int *result)
+int idm_drive_lock_count_async_result(char *drive, uint64_t handle, int *count,
+				      int *self, int *result)
 {
 	struct idm_async_op *async, *next;
 
@@ -1283,13 +1295,15 @@ int idm_drive_lock_mode_async(char *lock_id, char *drive, uint64_t *handle)
 
 /**
  * idm_drive_lock_mode_async_result - Read the result for lock mode.
- * @fd:			File descriptor (emulated with index).
+ * @drive:		Drive path name.
+ * @handle:		Handle (emulated with index).
  * @mode:		Returned mode's pointer.
  * @result:		Returned result for the operation.
  *
  * Returns zero or a negative error (ie. EINVAL).
  */
-int idm_drive_lock_mode_async_result(uint64_t handle, int *mode, int *result)
+int idm_drive_lock_mode_async_result(char *drive, uint64_t handle, int *mode,
+				     int *result)
 {
 	struct idm_async_op *async, *next;
 
@@ -1313,12 +1327,13 @@ int idm_drive_lock_mode_async_result(uint64_t handle, int *mode, int *result)
 
 /**
  * idm_drive_async_result - Read the result for normal operations.
- * @fd:			File descriptor (emulated with index).
+ * @drive:		Drive path name.
+ * @handle:		Handle (emulated with index).
  * @result:		Returned result for the operation.
  *
  * Returns zero or a negative error (ie. EINVAL).
  */
-int idm_drive_async_result(uint64_t handle, int *result)
+int idm_drive_async_result(char *drive, uint64_t handle, int *result)
 {
 	struct idm_async_op *async, *next;
 
@@ -1475,6 +1490,35 @@ int idm_drive_whitelist(char *drive, char **whitelist, int *whitelist_num)
 	return 0;
 }
 
+/**
+ * idm_drive_read_mutex_num - Read back the number of IDMs in the drive
+ * @drive:		Drive path name.
+ * @num:		Returned mutex number.
+ *
+ * Returns zero or a negative error (ie. EINVAL).
+ */
+int idm_drive_read_mutex_num(char *drive, unsigned int *num)
+{
+	struct idm_emulation *idm;
+
+	if (ilm_inject_fault_is_hit())
+		return -EIO;
+
+	if (!drive || !num)
+		return -EINVAL;
+
+	*num = 0;
+
+	pthread_mutex_lock(&idm_list_mutex);
+	list_for_each_entry(idm, &idm_list, list) {
+		if (!strcmp(idm->drive_path, drive))
+			(*num)++;
+	}
+	pthread_mutex_unlock(&idm_list_mutex);
+
+	return 0;
+}
+
 /**
  * idm_drive_read_group - Read back mutex group for all IDM in the drives
  * @drive:		Drive path name.
@@ -1489,7 +1533,7 @@ int idm_drive_read_group(char *drive, struct idm_info **info_ptr, int *info_num)
 	struct idm_emulation *idm;
 	struct idm_host *host;
 	int i = 0, max_alloc = 8;
-	int ret;
+	int ret = 0;
 
 	/* Let's firstly assume to allocet for 8 items */
 	info_list = malloc(sizeof(struct idm_info) * max_alloc);
@@ -1508,6 +1552,19 @@ int idm_drive_read_group(char *drive, struct idm_info **info_ptr, int *info_num)
 
 		/* Generate an item if without host */
 		if (list_empty(&idm->host_list)) {
+			if (i >= max_alloc) {
+				max_alloc += 8;
+
+				info = realloc(info_list,
+					sizeof(struct idm_info) * max_alloc);
+				if (!info) {
+					pthread_mutex_unlock(&idm->mutex);
+					ret = -ENOMEM;
+					break;
+				}
+				info_list = info;
+			}
+
 			info = info_list + i;
 
 			/* Copy host ID */
@@ -1516,8 +1573,9 @@ int idm_drive_read_group(char *drive, struct idm_info **info_ptr, int *info_num)
 
 			memset(info->host_id, 0, IDM_HOST_ID_LEN);
 			info->last_renew_time = 0;
-			info->timeout = 1;
+			info->state = IDM_STATE_UNINIT;
 			i++;
+			pthread_mutex_unlock(&idm->mutex);
 			continue;
 		}
 
@@ -1542,7 +1600,10 @@ int idm_drive_read_group(char *drive, struct idm_info **info_ptr, int *info_num)
 
 			memcpy(info->host_id, host->id, IDM_HOST_ID_LEN);
 			info->last_renew_time = host->last_renew_time;
-			info->timeout = idm_host_is_expired(host);
+			if (idm_host_is_expired(host))
+				info->state = IDM_STATE_TIMEOUT;
+			else
+				info->state = IDM_STATE_LOCKED;
 			i++;
 		}
 
@@ -1568,11 +1629,13 @@ int idm_drive_read_group(char *drive, struct idm_info **info_ptr, int *info_num)
 /**
  * idm_drive_destroy_lock - Destroy an IDM and release all associated resource.
  * @lock_id:		Lock ID (64 bytes).
+ * @mode:		Lock mode (unlock, shareable, exclusive).
+ * @host_id:		Host ID (32 bytes).
  * @drive:		Drive path name.
  *
  * Returns zero or a negative error (ie. EINVAL).
  */
-int idm_drive_destroy_lock(char *lock_id, char *drive)
+int idm_drive_destroy_lock(char *lock_id, int mode, char *host_id, char *drive)
 {
 	struct idm_emulation *idm;
 	struct idm_host *host, *next;
@@ -1598,7 +1661,7 @@ int idm_drive_destroy_lock(char *lock_id, char *drive)
 
 	list_for_each_entry_safe(host, next, &idm->host_list, list) {
 		/* If the host is timeout, remove it from the host list. */
-		if (host->state == IDM_STATE_TIMEOUT ||
+		if (host->state == IDM_HOST_TIMEOUT ||
 		    idm_host_is_expired(host)) {
 			list_del(&host->list);
 			free(host);
@@ -1613,10 +1676,10 @@ int idm_drive_destroy_lock(char *lock_id, char *drive)
 	}
 
 	list_del(&idm->list);
-	free(idm);
 
 	pthread_mutex_unlock(&idm->mutex);
 	pthread_mutex_unlock(&idm_list_mutex);
+	free(idm);
 	return 0;
 
 fail:
@@ -1626,7 +1689,50 @@ fail:
 	return ret;
 }
 
-int idm_drive_get_fd(uint64_t handle)
+/**
+ * idm_drive_destroy_lock_async - Destroy an IDM with async mode.
+ * @lock_id:		Lock ID (64 bytes).
+ * @mode:		Lock mode (unlock, shareable, exclusive).
+ * @host_id:		Host ID (32 bytes).
+ * @drive:		Drive path name.
+ * @handle:		Handle (emulated with index).
+ *
+ * Returns zero or a negative error (ie. EINVAL).
+ */
+int idm_drive_destroy_lock_async(char *lock_id, int mode, char *host_id,
+				 char *drive, uint64_t *handle)
+{
+	struct idm_async_op *async;
+
+	async = malloc(sizeof(struct idm_async_op));
+
+	async->result = idm_drive_destroy_lock(lock_id, mode, host_id, drive);
+
+	pthread_mutex_lock(&idm_async_list_mutex);
+	*handle = idm_async_index;
+	async->fd = idm_async_index;
+	idm_async_index++;
+	list_add_tail(&async->list, &idm_async_list);
+	pthread_mutex_unlock(&idm_async_list_mutex);
+
+	return 0;
+}
+
+int idm_drive_get_fd(char *drive, uint64_t handle)
 {
 	return (int)handle;
 }
+
+/* The results are released when they are read out */
+void idm_drive_free_async_result(char *drive, uint64_t handle)
+{
+}
+
+int idm_environ_init(void)
+{
+	return 0;
+}
+
+void idm_environ_destroy(void)
+{
+}
@@ -23,6 +23,10 @@
 #include "inject_fault.h"
 #include "list.h"
 #include "log.h"
+#include "recorder.h"
+#include "req_trace.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 #define IDM_MUTEX_OP_NORMAL		0x0
@@ -103,6 +107,10 @@ struct idm_scsi_request {
 	uint8_t sense[SCSI_SENSE_LEN];
 	struct idm_data *data;
 	int data_len;
+
+	uint64_t stats_start;	/* Sent time of asynchronous command */
+	uint64_t trace_id;	/* Client request, see req_trace.h */
+	int sense_key;		/* Sense key of asynchronous command */
 };
 
 static char sense_invalid_opcode[32] = {
@@ -213,21 +221,76 @@ static void _scsi_generate_read_cdb(uint8_t *cdb, uint8_t group, int num)
 	cdb[15] = 0;			/* Reserved */
 }
 
-static int _scsi_sg_io(char *drive, uint8_t *cdb, int cdb_len,
+/* Statistics opcode of the command, see ilm_stats_op() */
+static int _scsi_stats_op(uint8_t *cdb, int direction)
+{
+	if (cdb[0] != IDM_SCSI_WRITE)
+		return ILM_STATS_OP_INQUIRY;
+
+	if (direction == SG_DXFER_TO_DEV)
+		return ilm_stats_op(1, cdb[1] >> 4, 0);
+
+	return ilm_stats_op(0, 0, cdb[14]);
+}
+
+/* Sense key from the fixed or descriptor format sense data */
+static int _scsi_sense_key(uint8_t *sense, int len)
+{
+	if (len < 3)
+		return 0;
+
+	switch (sense[0] & 0x7f) {
+	case 0x70:
+	case 0x71:
+		return sense[2] & 0xf;
+	case 0x72:
+	case 0x73:
+		return sense[1] & 0xf;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Account a completed command into the statistics and the flight
+ * recorder, the lock ID is only recorded for mutex write commands.
+ */
+static void _scsi_record(char *drive, uint8_t *cdb, int direction,
+			 char *lock_id, uint64_t start, int result,
+			 int sense_key, uint64_t trace_id)
+{
+	int op = _scsi_stats_op(cdb, direction);
+
+	ilm_stats_record(drive, op, start, result);
+	ilm_recorder_add(drive, ILM_RECORDER_SCSI, op,
+			 direction == SG_DXFER_TO_DEV ? lock_id : NULL,
+			 start, result, sense_key, trace_id);
+}
+
+static int _scsi_sg_io(char *drive, char *lock_id, uint8_t *cdb, int cdb_len,
 		       uint8_t *sense, int sense_len,
 		       uint8_t *data, int data_len, int direction)
 {
 	sg_io_hdr_t io_hdr;
 	int sg_fd;
-	int ret, status;
+	int ret, status, sense_key = 0;
 	uint8_t op = cdb[1];
+	uint64_t start = ilm_stats_now();
+	uint64_t trace_id = ilm_req_trace_id();
 
 	if (direction == SG_DXFER_TO_DEV)
 		op = op>>4;
 
+	ilm_trace4(sg_submit, NULL, drive, _scsi_stats_op(cdb, direction),
+		   trace_id);
+
 	if ((sg_fd = open(drive, O_RDWR | O_NONBLOCK)) < 0) {
 		ilm_log_err("%s: error opening drive %s fd %d",
 			    __func__, drive, sg_fd);
+		_scsi_record(drive, cdb, direction, lock_id, start, sg_fd, 0,
+			     trace_id);
+		ilm_trace4(sg_complete, NULL, drive,
+			   _scsi_stats_op(cdb, direction), sg_fd);
 		return sg_fd;
 	}
 
@@ -259,6 +322,7 @@ static int _scsi_sg_io(char *drive, uint8_t *cdb, int cdb_len,
 	}
 
 	status = io_hdr.masked_status;
+	sense_key = _scsi_sense_key(sense, io_hdr.sb_len_wr);
 
 	if (status != GOOD) {
 		ilm_log_array_warn("SCSI CDB:", (char *)cdb, cdb_len);
@@ -379,6 +443,10 @@ static int _scsi_sg_io(char *drive, uint8_t *cdb, int cdb_len,
 
 out:
 	close(sg_fd);
+	_scsi_record(drive, cdb, direction, lock_id, start, ret, sense_key,
+		     trace_id);
+	ilm_trace4(sg_complete, NULL, drive, _scsi_stats_op(cdb, direction),
+		   ret);
 	return ret;
 }
 
@@ -388,9 +456,20 @@ static int _scsi_write(struct idm_scsi_request *request, int direction)
 	int sg_fd;
 	int ret;
 
+	request->stats_start = ilm_stats_now();
+	request->trace_id = ilm_req_trace_id();
+	request->sense_key = 0;
+	ilm_trace4(sg_submit, request, request->drive,
+		   _scsi_stats_op(request->cdb, direction), request->trace_id);
+
 	if ((sg_fd = open(request->drive, O_RDWR | O_NONBLOCK)) < 0) {
 		ilm_log_err("%s: error opening drive %s fd %d",
 			    __func__, request->drive, sg_fd);
+		_scsi_record(request->drive, request->cdb, direction,
+			     request->lock_id, request->stats_start, sg_fd, 0,
+			     request->trace_id);
+		ilm_trace4(sg_complete, request, request->drive,
+			   _scsi_stats_op(request->cdb, direction), sg_fd);
 		return sg_fd;
 	}
 
@@ -413,6 +492,11 @@ static int _scsi_write(struct idm_scsi_request *request, int direction)
 	if (ret < 0) {
 		close(sg_fd);
 		ilm_log_err("%s: fail to write %d", __func__, ret);
+		_scsi_record(request->drive, request->cdb, direction,
+			     request->lock_id, request->stats_start, ret, 0,
+			     request->trace_id);
+		ilm_trace4(sg_complete, request, request->drive,
+			   _scsi_stats_op(request->cdb, direction), ret);
 		return ret;
 	}
 
@@ -440,6 +524,7 @@ static int _scsi_read(struct idm_scsi_request *request, int direction)
 		return 0;
 
 	status = io_hdr.masked_status;
+	request->sense_key = _scsi_sense_key(request->sense, io_hdr.sb_len_wr);
 
 	if (status != GOOD) {
 		ilm_log_array_warn("SCSI CDB:", (char *)request->cdb, SCSI_CDB_LEN);
@@ -591,7 +676,7 @@ static int _scsi_xfer_sync(struct idm_scsi_request *request)
 
 	ilm_log_array_dbg("resrouce_ver", data->resource_ver, IDM_VALUE_LEN);
 
-	return _scsi_sg_io(request->drive, cdb, SCSI_CDB_LEN,
+	return _scsi_sg_io(request->drive, request->lock_id, cdb, SCSI_CDB_LEN,
 			   sense, SCSI_SENSE_LEN,
 			   (uint8_t *)data, request->data_len,
 			   SG_DXFER_TO_DEV);
@@ -629,7 +714,7 @@ static int _scsi_recv_sync(struct idm_scsi_request *request, char group, int num
 
 	_scsi_generate_read_cdb(cdb, group, num);
 
-	return _scsi_sg_io(request->drive, cdb, SCSI_CDB_LEN,
+	return _scsi_sg_io(request->drive, NULL, cdb, SCSI_CDB_LEN,
 			   sense, SCSI_SENSE_LEN,
 			   (uint8_t *)data, request->data_len,
 			   SG_DXFER_FROM_DEV);
@@ -657,6 +742,11 @@ static int _scsi_get_async_result(struct idm_scsi_request *request,
 
 	ret = _scsi_read(request, direction);
         close(request->fd);
+	_scsi_record(request->drive, request->cdb, direction, request->lock_id,
+		     request->stats_start, ret, request->sense_key,
+		     request->trace_id);
+	ilm_trace4(sg_complete, request, request->drive,
+		   _scsi_stats_op(request->cdb, direction), ret);
 	return ret;
 }
 
@@ -676,7 +766,7 @@ int scsi_idm_read_version(char *drive, uint8_t *version_major, uint8_t *version_
 
 	_scsi_generate_version_inquiry_cdb(ver_request);
 
-	_scsi_sg_io(drive, ver_request, SCSI_VER_INQ_LEN, sense, SCSI_SENSE_LEN, data, SCSI_VER_DATA_LEN, SG_DXFER_FROM_DEV);
+	_scsi_sg_io(drive, NULL, ver_request, SCSI_VER_INQ_LEN, sense, SCSI_SENSE_LEN, data, SCSI_VER_DATA_LEN, SG_DXFER_FROM_DEV);
 
 	ilm_log_array_warn("SCSI CDB:", (char *)ver_request, SCSI_VER_INQ_LEN);
 	ilm_log_array_warn("SCSI DATA:", (char *)data, SCSI_VER_DATA_LEN);
@@ -1331,6 +1421,21 @@ out:
 	return ret;
 }
 
+/**
+ * scsi_idm_sync_read_mutex_num - Read the number of mutexes on the drive.
+ * @drive:		Drive path name.
+ * @num:		Returned mutex number.
+ *
+ * Returns zero or a negative error (ie. EIO, ENOMEM).
+ */
+int scsi_idm_sync_read_mutex_num(char *drive, unsigned int *num)
+{
+	if (!drive || !num)
+		return -EINVAL;
+
+	return scsi_idm_drive_read_mutex_num(drive, num);
+}
+
 /**
  * scsi_idm_sync_read_lvb - Read value block which is associated to an IDM.
  * @lock_id:		Lock ID (64 bytes).
@@ -11,6 +11,7 @@
 #include <uuid/uuid.h>
 
 #define ILM_DRIVE_MAX_NUM		512
+#define ILM_LOCK_BATCH_MAX_NUM		1024
 
 #define IDM_MODE_UNLOCK			0
 #define IDM_MODE_EXCLUSIVE		1
@@ -35,13 +36,148 @@ struct idm_lock_op {
 	int timeout; /* -1 means unlimited timeout */
 };
 
+/* Drive commands accounted by ilm_get_stats() */
+#define ILM_STATS_OP_LOCK		0
+#define ILM_STATS_OP_UNLOCK		1
+#define ILM_STATS_OP_REFRESH		2
+#define ILM_STATS_OP_BREAK		3
+#define ILM_STATS_OP_DESTROY		4
+#define ILM_STATS_OP_READ_GROUP		5
+#define ILM_STATS_OP_INQUIRY		6
+#define ILM_STATS_OP_NUM		7
+
+/* Errors of drive commands */
+#define ILM_STATS_ERR_BUSY		0	/* -EBUSY */
+#define ILM_STATS_ERR_AGAIN		1	/* -EAGAIN */
+#define ILM_STATS_ERR_TIME		2	/* -ETIME */
+#define ILM_STATS_ERR_NOENT		3	/* -ENOENT */
+#define ILM_STATS_ERR_NOMEM		4	/* -ENOMEM */
+#define ILM_STATS_ERR_INVAL		5	/* -EINVAL */
+#define ILM_STATS_ERR_PERM		6	/* -EPERM */
+#define ILM_STATS_ERR_OTHER		7
+#define ILM_STATS_ERR_NUM		8
+
+/*
+ * Latency histogram in microseconds.  Bucket i below 4 counts the latency
+ * i, above that every power of two is split into 4 buckets, so bucket i
+ * counts from (4 + i % 4) << (i / 4 - 1); the last bucket counts all the
+ * longer latencies as well.
+ */
+#define ILM_STATS_BUCKET_NUM		96
+
+#define ILM_STATS_PATH_LEN		64
+
+struct ilm_drive_stats {
+	uint64_t wwn;			/* Zero if the drive isn't known */
+	char path[ILM_STATS_PATH_LEN];
+	uint64_t count[ILM_STATS_OP_NUM];
+	uint64_t total_us[ILM_STATS_OP_NUM];
+	uint64_t max_us[ILM_STATS_OP_NUM];
+	uint64_t error[ILM_STATS_OP_NUM][ILM_STATS_ERR_NUM];
+	uint64_t hist[ILM_STATS_OP_NUM][ILM_STATS_BUCKET_NUM];
+};
+
+/* Stages of the requests accounted by ilm_get_stage_stats() */
+#define ILM_STAGE_QUEUE			0	/* Received until handled */
+#define ILM_STAGE_LOCK_WAIT		1	/* Lock mutex and local queue */
+#define ILM_STAGE_ISSUE			2	/* A round on drives */
+#define ILM_STAGE_DRIVE			3	/* A request on a drive */
+#define ILM_STAGE_QUORUM		4	/* Handled until last quorum */
+#define ILM_STAGE_REPLY			5	/* Handled until replied */
+#define ILM_STAGE_TOTAL			6	/* Received until replied */
+#define ILM_STAGE_NUM			7
+
+struct ilm_stage_stats {
+	uint64_t slow;			/* Requests above slow threshold */
+	uint64_t count[ILM_STAGE_NUM];
+	uint64_t total_us[ILM_STAGE_NUM];
+	uint64_t max_us[ILM_STAGE_NUM];
+	uint64_t hist[ILM_STAGE_NUM][ILM_STATS_BUCKET_NUM];
+};
+
+/*
+ * Contention of the lock IDs accounted by ilm_get_lock_stats().  Only the
+ * ILM_LOCK_STATS_NUM most contended lock IDs are tracked; a lock ID which
+ * enters the tracking evicts the least contended one and inherits its
+ * contention as the error bound, the other counters start from zero.
+ */
+#define ILM_LOCK_STATS_NUM		64
+
+struct ilm_lock_stats {
+	struct idm_lock_id id;
+	uint64_t contention;		/* Sum of the contention events below */
+	uint64_t error;			/* Contention is overestimated by it */
+	uint64_t attempts;		/* Acquisitions */
+	uint64_t acquired;
+	uint64_t majority_total_us;	/* Acquisition until majority */
+	uint64_t majority_max_us;
+	uint64_t retries;		/* Rounds without majority, contention */
+	uint64_t busy;			/* -EBUSY from a drive, contention */
+	uint64_t again;			/* -EAGAIN from a drive, contention */
+	uint64_t breaks;		/* Broken holder on a drive, contention */
+	uint64_t convert_fail;		/* Contention */
+	uint64_t renew_fail;		/* Contention */
+};
+
+/*
+ * Renewal margin accounted by ilm_get_renew_stats(): the gap between two
+ * successful renewals and the margin left until the quiescent period runs
+ * out, when the lockspace is killed.  The drives come first, then at most
+ * ILM_RENEW_STATS_LOCK_NUM held locks with the lowest margin first.  The
+ * level is raised when the margin is below the thresholds of the option -M.
+ */
+#define ILM_RENEW_STATS_DRIVE		0
+#define ILM_RENEW_STATS_LOCK		1
+
+#define ILM_RENEW_STATS_LOCK_NUM	64
+
+#define ILM_RENEW_LEVEL_OK		0
+#define ILM_RENEW_LEVEL_WARN		1
+#define ILM_RENEW_LEVEL_CRIT		2
+
+struct ilm_renew_stats {
+	uint32_t type;			/* ILM_RENEW_STATS_* */
+	uint32_t level;			/* ILM_RENEW_LEVEL_* of the margin */
+	struct idm_lock_id id;		/* Only for a lock */
+	uint64_t wwn;			/* Only for a drive */
+	char path[ILM_STATS_PATH_LEN];	/* Only for a drive */
+	uint64_t period_ms;		/* Quiescent period */
+	int64_t margin_ms;		/* Current, negative once timed out */
+	int64_t min_margin_ms;
+	uint64_t warnings;		/* Drops below a threshold */
+	uint64_t count;			/* Gaps accounted */
+	uint64_t max_gap_ms;
+	uint64_t hist[ILM_STATS_BUCKET_NUM];	/* Gap in milliseconds */
+};
+
+/* Completion of an asynchronous request, see ilm_reap() */
+struct ilm_completion {
+	uint32_t ticket;
+	int result;
+};
+
 extern uuid_t ilm_uuid;
 int ilm_connect(int *sock);
 int ilm_disconnect(int sock);
 int ilm_version(int sock, char *drive, uint8_t *version_major, uint8_t *version_minor);
 int ilm_lock(int sock, struct idm_lock_id *id, struct idm_lock_op *op);
+int ilm_lock_deadline(int sock, struct idm_lock_id *id,
+		      struct idm_lock_op *op, int deadline);
+int ilm_lock_cancel(int sock, struct idm_lock_id *id);
 int ilm_unlock(int sock, struct idm_lock_id *id);
 int ilm_convert(int sock, struct idm_lock_id *id, uint32_t mode);
+int ilm_lock_many(int sock, struct idm_lock_id *ids, uint32_t *modes, int num,
+		  struct idm_lock_op *op, int *results);
+int ilm_unlock_many(int sock, struct idm_lock_id *ids, int num, int *results);
+int ilm_convert_many(int sock, struct idm_lock_id *ids, uint32_t *modes,
+		     int num, int *results);
+int ilm_lock_submit(int sock, struct idm_lock_id *id, struct idm_lock_op *op,
+		    uint32_t *ticket);
+int ilm_unlock_submit(int sock, struct idm_lock_id *id, uint32_t *ticket);
+int ilm_convert_submit(int sock, struct idm_lock_id *id, uint32_t mode,
+		       uint32_t *ticket);
+int ilm_async_fd(int sock);
+int ilm_reap(int sock, struct ilm_completion *comp, int max);
 int ilm_write_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len);
 int ilm_read_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len);
 int ilm_set_signal(int sock, int signo);
@@ -54,5 +190,9 @@ int ilm_set_host_id(int sock, char *id, int id_len);
 int ilm_stop_renew(int sock);
 int ilm_start_renew(int sock);
 int ilm_inject_fault(int sock, int percentage);
+int ilm_get_stats(int sock, struct ilm_drive_stats *stats, int num);
+int ilm_get_stage_stats(int sock, struct ilm_stage_stats *stats);
+int ilm_get_lock_stats(int sock, struct ilm_lock_stats *stats, int num);
+int ilm_get_renew_stats(int sock, struct ilm_renew_stats *stats, int num);
 
 #endif /* __ILM_H__ */
@@ -9,6 +9,9 @@
 #define ILM_DEFAULT_RUN_DIR	"/run/seagate_ilm"
 #define ILM_SOCKET_NAME		"main.sock"
 #define ILM_LOCKFILE_NAME	"main.pid"
+#define ILM_METRICS_NAME	"metrics.sock"
+#define ILM_DRIVE_CACHE_NAME	"drive.cache"
+#define ILM_JOURNAL_NAME	"lock.journal"
 
 #define ILM_DEFAULT_LOG_DIR	"/var/log"
 
@@ -17,6 +20,17 @@
 struct ilm_env {
 	int debug;
 	int mlock;
+	int min_workers;
+	int max_workers;
+	int lock_deadline;	/* milliseconds */
+	int lock_cache;		/* milliseconds, 0 means disabled */
+	int slow_request;	/* milliseconds, 0 means disabled */
+	int margin_warn;	/* percent of quiescent period */
+	int margin_crit;	/* percent of quiescent period */
+	int metrics;		/* Serve metrics on ILM_METRICS_NAME */
+	int gc_high;		/* mutexes per drive, 0 means disabled */
+	int gc_low;		/* mutexes per drive */
+	int journal;		/* Adopt the locks of the last run */
 	const char *run_dir;
 	const char *log_dir;
 };
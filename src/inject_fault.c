@@ -22,10 +22,10 @@ int ilm_inject_fault_set_percentage(struct ilm_cmd *cmd)
 {
 	int percentage, ret;
 
-	ret = recv(cmd->cl->fd, &percentage, sizeof(int), MSG_WAITALL);
+	ret = ilm_cmd_read(cmd, &percentage, sizeof(int));
 	if (ret != sizeof(int)) {
-		ilm_log_err("Fail to receive percentage %d errno %d\n",
-			    cmd->cl->fd, errno);
+		ilm_log_err("Fail to receive percentage %d ret %d\n",
+			    cmd->cl->fd, ret);
 		ret = -EIO;
 		goto out;
 	}
@@ -41,7 +41,7 @@ int ilm_inject_fault_set_percentage(struct ilm_cmd *cmd)
 	__sync_synchronize();
 
 out:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
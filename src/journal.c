@@ -0,0 +1,561 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ilm_internal.h"
+#include "journal.h"
+#include "list.h"
+#include "lock.h"
+#include "log.h"
+
+#define ILM_JOURNAL_HASH_SIZE		1024
+#define ILM_JOURNAL_COMPACT_MIN		64	/* Dead records */
+
+struct ilm_journal_entry {
+	struct list_head list;		/* In the queue or hash table */
+	struct ilm_journal_rec *rec;	/* Allocated with the entry */
+};
+
+/*
+ * Lock journal: the acquired locks are appended to ILM_JOURNAL_NAME under
+ * the run directory as ADD records, and the released ones as DEL records.
+ * If the daemon is restarted without releasing its locks, the locks still
+ * in the journal are renewed and adopted rather than acquired again, see
+ * ilm_lock_journal_replay().
+ *
+ * The lock commands only queue the records; one thread appends them to the
+ * file and keeps the live records in a hash table, which is written into a
+ * new file once the dead records outnumber the live ones.  The run
+ * directory is in memory, so the file isn't synced: it only has to survive
+ * the daemon, not the host.
+ *
+ * A record torn by a crash fails the checksum and ends the replay, a lost
+ * ADD only means the lock is acquired again by the client and a lost DEL
+ * fails the renewal of the released lock.
+ */
+static struct list_head journal_queue = LIST_HEAD_INIT(journal_queue);
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t journal_thd;
+static int journal_running;
+static int journal_exit;
+
+/* Only accessed by the journal thread once it's started */
+static struct list_head journal_hash[ILM_JOURNAL_HASH_SIZE];
+static int journal_fd = -1;
+static int journal_live;	/* Records in the hash table */
+static int journal_recs;	/* Records in the file */
+static int journal_broken;	/* The file needs to be written again */
+
+/* Records loaded by ilm_journal_init(), taken by ilm_journal_recover() */
+static struct ilm_journal_rec **journal_replay;
+static int journal_replay_num;
+
+static int ilm_journal_path(char *path, size_t len, const char *suffix)
+{
+	int ret;
+
+	ret = snprintf(path, len, "%s/%s%s", env.run_dir, ILM_JOURNAL_NAME,
+		       suffix);
+	if (ret < 0 || (size_t)ret >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static uint32_t ilm_journal_csum(struct ilm_journal_rec *rec)
+{
+	uint32_t hash = 2166136261U;	/* FNV-1a */
+	uint32_t csum = rec->csum;
+	unsigned char *c = (unsigned char *)rec;
+	uint32_t i;
+
+	rec->csum = 0;
+	for (i = 0; i < rec->len; i++)
+		hash = (hash ^ c[i]) * 16777619U;
+	rec->csum = csum;
+
+	return hash;
+}
+
+static struct list_head *ilm_journal_bucket(struct ilm_journal_rec *rec)
+{
+	uint32_t hash = 2166136261U;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < IDM_LOCK_ID_LEN; i++)
+		hash = (hash ^ (unsigned char)rec->lock_id[i]) * 16777619U;
+
+	return &journal_hash[hash % ILM_JOURNAL_HASH_SIZE];
+}
+
+static struct ilm_journal_entry *ilm_journal_alloc(int drive_num)
+{
+	struct ilm_journal_entry *entry;
+	size_t len;
+
+	len = sizeof(struct ilm_journal_rec) + drive_num * sizeof(uint64_t);
+
+	entry = malloc(sizeof(struct ilm_journal_entry) + len);
+	if (!entry)
+		return NULL;
+
+	entry->rec = (struct ilm_journal_rec *)(entry + 1);
+	memset(entry->rec, 0, len);
+	entry->rec->magic = ILM_JOURNAL_MAGIC;
+	entry->rec->len = len;
+	entry->rec->drive_num = drive_num;
+	return entry;
+}
+
+/* Apply the record to the hash table, returns 1 if @entry is kept */
+static int ilm_journal_apply(struct ilm_journal_entry *entry)
+{
+	struct ilm_journal_rec *rec = entry->rec;
+	struct ilm_journal_entry *pos, *tmp;
+	struct list_head *bucket = ilm_journal_bucket(rec);
+
+	list_for_each_entry_safe(pos, tmp, bucket, list) {
+		if (memcmp(pos->rec->lock_id, rec->lock_id, IDM_LOCK_ID_LEN) ||
+		    memcmp(pos->rec->host_id, rec->host_id, IDM_HOST_ID_LEN))
+			continue;
+
+		list_del(&pos->list);
+		free(pos);
+		journal_live--;
+		break;
+	}
+
+	if (rec->op != ILM_JOURNAL_OP_ADD)
+		return 0;
+
+	list_add_tail(&entry->list, bucket);
+	journal_live++;
+	return 1;
+}
+
+static int ilm_journal_write_all(int fd, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Write the live records into a new file and switch to it */
+static int ilm_journal_compact(void)
+{
+	struct ilm_journal_entry *entry;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd, ret = 0, i;
+
+	if (ilm_journal_path(path, sizeof(path), "") ||
+	    ilm_journal_path(tmp, sizeof(tmp), ".tmp"))
+		return -ENAMETOOLONG;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		  0644);
+	if (fd < 0) {
+		ret = -errno;
+		ilm_log_warn("%s: fail to open %s %d", __func__, tmp, ret);
+		return ret;
+	}
+
+	for (i = 0; i < ILM_JOURNAL_HASH_SIZE && !ret; i++) {
+		list_for_each_entry(entry, &journal_hash[i], list) {
+			ret = ilm_journal_write_all(fd, (char *)entry->rec,
+						    entry->rec->len);
+			if (ret < 0)
+				break;
+		}
+	}
+
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+
+	if (ret < 0) {
+		ilm_log_warn("%s: fail to write %s %d", __func__, tmp, ret);
+		close(fd);
+		unlink(tmp);
+		return ret;
+	}
+
+	if (journal_fd >= 0)
+		close(journal_fd);
+	journal_fd = fd;
+	journal_recs = journal_live;
+	journal_broken = 0;
+	return 0;
+}
+
+/* Append the queued records to the file, called by the journal thread */
+static void ilm_journal_write(struct list_head *batch)
+{
+	struct ilm_journal_entry *entry, *tmp;
+	size_t len = 0, off = 0;
+	char *buf;
+	int num = 0, ret = -ENOMEM;
+
+	list_for_each_entry(entry, batch, list)
+		len += entry->rec->len;
+
+	/* Written in one go, so a crash tears at most the last record */
+	buf = malloc(len);
+	if (buf) {
+		list_for_each_entry(entry, batch, list) {
+			memcpy(buf + off, entry->rec, entry->rec->len);
+			off += entry->rec->len;
+		}
+	}
+
+	list_for_each_entry_safe(entry, tmp, batch, list) {
+		list_del(&entry->list);
+		if (!ilm_journal_apply(entry))
+			free(entry);
+		num++;
+	}
+
+	if (buf && !journal_broken && journal_fd >= 0)
+		ret = ilm_journal_write_all(journal_fd, buf, len);
+	free(buf);
+
+	if (ret < 0) {
+		/* Don't append after a partial record */
+		if (!journal_broken)
+			ilm_log_warn("%s: fail to append journal %d",
+				     __func__, ret);
+		journal_broken = 1;
+	} else {
+		journal_recs += num;
+	}
+
+	if (journal_broken ||
+	    journal_recs > 2 * journal_live + ILM_JOURNAL_COMPACT_MIN)
+		ilm_journal_compact();
+}
+
+static void *ilm_journal_thread(void *data __maybe_unused)
+{
+	struct list_head batch;
+
+	INIT_LIST_HEAD(&batch);
+
+	pthread_mutex_lock(&journal_mutex);
+
+	while (1) {
+		while (list_empty(&journal_queue) && !journal_exit)
+			pthread_cond_wait(&journal_cond, &journal_mutex);
+
+		/* Flush the queue before exiting */
+		if (list_empty(&journal_queue))
+			break;
+
+		list_splice_init(&journal_queue, &batch);
+		pthread_mutex_unlock(&journal_mutex);
+
+		ilm_journal_write(&batch);
+
+		pthread_mutex_lock(&journal_mutex);
+	}
+
+	pthread_mutex_unlock(&journal_mutex);
+	return NULL;
+}
+
+static int ilm_journal_rec_is_valid(struct ilm_journal_rec *rec, size_t left)
+{
+	if (left < sizeof(struct ilm_journal_rec) ||
+	    rec->magic != ILM_JOURNAL_MAGIC ||
+	    rec->drive_num > ILM_DRIVE_MAX_NUM ||
+	    rec->drive_num > rec->total_drive_num ||
+	    rec->len != sizeof(struct ilm_journal_rec) +
+			rec->drive_num * sizeof(uint64_t) ||
+	    rec->len > left)
+		return 0;
+
+	if (rec->op != ILM_JOURNAL_OP_ADD && rec->op != ILM_JOURNAL_OP_DEL)
+		return 0;
+
+	return ilm_journal_csum(rec) == rec->csum;
+}
+
+/* Read the records of the last run into the hash table */
+static int ilm_journal_load(void)
+{
+	struct ilm_journal_entry *entry;
+	struct ilm_journal_rec *rec;
+	char path[PATH_MAX];
+	struct stat st;
+	char *buf = NULL;
+	size_t off = 0;
+	ssize_t ret;
+	int fd;
+
+	if (ilm_journal_path(path, sizeof(path), ""))
+		return -ENAMETOOLONG;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+
+	if (fstat(fd, &st) || !st.st_size)
+		goto out;
+
+	buf = malloc(st.st_size);
+	if (!buf)
+		goto out;
+
+	while (off < (size_t)st.st_size) {
+		ret = read(fd, buf + off, st.st_size - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		off += ret;
+	}
+
+	st.st_size = off;
+	for (off = 0; off < (size_t)st.st_size; off += rec->len) {
+		/* The records are 8 bytes aligned in the file */
+		rec = (struct ilm_journal_rec *)(buf + off);
+		if (!ilm_journal_rec_is_valid(rec, st.st_size - off)) {
+			ilm_log_warn("%s: drop the journal from offset %zu",
+				     __func__, off);
+			break;
+		}
+
+		entry = ilm_journal_alloc(rec->drive_num);
+		if (!entry)
+			break;
+
+		memcpy(entry->rec, rec, rec->len);
+		journal_recs++;
+		if (!ilm_journal_apply(entry))
+			free(entry);
+	}
+
+out:
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+/* Copy the live records for ilm_journal_recover() */
+static void ilm_journal_replay_copy(void)
+{
+	struct ilm_journal_entry *entry;
+	int i;
+
+	if (!journal_live)
+		return;
+
+	journal_replay = calloc(journal_live, sizeof(*journal_replay));
+	if (!journal_replay)
+		return;
+
+	for (i = 0; i < ILM_JOURNAL_HASH_SIZE; i++) {
+		list_for_each_entry(entry, &journal_hash[i], list) {
+			journal_replay[journal_replay_num] =
+				malloc(entry->rec->len);
+			if (!journal_replay[journal_replay_num])
+				return;
+
+			memcpy(journal_replay[journal_replay_num], entry->rec,
+			       entry->rec->len);
+			journal_replay_num++;
+		}
+	}
+}
+
+static void ilm_journal_free_unsafe(void)
+{
+	struct ilm_journal_entry *entry, *tmp;
+	int i;
+
+	for (i = 0; i < ILM_JOURNAL_HASH_SIZE; i++) {
+		list_for_each_entry_safe(entry, tmp, &journal_hash[i], list) {
+			list_del(&entry->list);
+			free(entry);
+		}
+	}
+
+	list_for_each_entry_safe(entry, tmp, &journal_queue, list) {
+		list_del(&entry->list);
+		free(entry);
+	}
+
+	journal_live = 0;
+	journal_recs = 0;
+}
+
+int ilm_journal_init(void)
+{
+	int ret, i;
+
+	for (i = 0; i < ILM_JOURNAL_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&journal_hash[i]);
+
+	ret = ilm_journal_load();
+	if (ret < 0)
+		ilm_log_warn("%s: fail to read journal %d", __func__, ret);
+
+	ilm_journal_replay_copy();
+
+	/* Start from a file without the dead and torn records */
+	ret = ilm_journal_compact();
+	if (ret < 0)
+		goto fail;
+
+	ret = pthread_create(&journal_thd, NULL, ilm_journal_thread, NULL);
+	if (ret) {
+		ilm_log_err("Fail to create journal thread");
+		ret = -ret;
+		goto fail;
+	}
+
+	__atomic_store_n(&journal_running, 1, __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	ilm_journal_free_unsafe();
+	if (journal_fd >= 0) {
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	return ret;
+}
+
+void ilm_journal_exit(void)
+{
+	int i;
+
+	if (__atomic_load_n(&journal_running, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&journal_mutex);
+		journal_exit = 1;
+		pthread_cond_signal(&journal_cond);
+		pthread_mutex_unlock(&journal_mutex);
+
+		pthread_join(journal_thd, NULL);
+		__atomic_store_n(&journal_running, 0, __ATOMIC_RELEASE);
+
+		ilm_journal_free_unsafe();
+		close(journal_fd);
+		journal_fd = -1;
+	}
+
+	for (i = 0; i < journal_replay_num; i++)
+		free(journal_replay[i]);
+	free(journal_replay);
+	journal_replay = NULL;
+	journal_replay_num = 0;
+}
+
+/**
+ * ilm_journal_recover - Take the locks of the last run
+ * @recs:	Returned array of the ADD records.
+ *
+ * The records and the array are owned by the caller afterwards.
+ *
+ * Returns the number of records.
+ */
+int ilm_journal_recover(struct ilm_journal_rec ***recs)
+{
+	int num = journal_replay_num;
+
+	*recs = journal_replay;
+	journal_replay = NULL;
+	journal_replay_num = 0;
+	return num;
+}
+
+static void ilm_journal_queue(struct ilm_journal_entry *entry)
+{
+	entry->rec->csum = ilm_journal_csum(entry->rec);
+
+	pthread_mutex_lock(&journal_mutex);
+	list_add_tail(&entry->list, &journal_queue);
+	pthread_cond_signal(&journal_cond);
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+/* Record the lock with its current mode, replaces the previous record */
+void ilm_journal_add(struct ilm_lock *lock, char *host_id)
+{
+	struct ilm_journal_entry *entry;
+	int i;
+
+	if (!__atomic_load_n(&journal_running, __ATOMIC_ACQUIRE))
+		return;
+
+	entry = ilm_journal_alloc(lock->good_drive_num);
+	if (!entry) {
+		/* Only costs a full acquire after restart */
+		ilm_log_warn("%s: no memory for journal record", __func__);
+		return;
+	}
+
+	entry->rec->op = ILM_JOURNAL_OP_ADD;
+	entry->rec->mode = lock->mode;
+	entry->rec->timeout = lock->timeout;
+	entry->rec->total_drive_num = lock->total_drive_num;
+	entry->rec->path_sig = lock->path_sig;
+	memcpy(entry->rec->lock_id, lock->id, IDM_LOCK_ID_LEN);
+	memcpy(entry->rec->host_id, host_id, IDM_HOST_ID_LEN);
+	for (i = 0; i < lock->good_drive_num; i++)
+		entry->rec->wwn[i] = lock->drive[i].wwn;
+
+	ilm_journal_queue(entry);
+	lock->journaled = 1;
+}
+
+void ilm_journal_forget(char *lock_id, char *host_id)
+{
+	struct ilm_journal_entry *entry;
+
+	if (!__atomic_load_n(&journal_running, __ATOMIC_ACQUIRE))
+		return;
+
+	entry = ilm_journal_alloc(0);
+	if (!entry) {
+		/* The renewal of the released lock fails after restart */
+		ilm_log_warn("%s: no memory for journal record", __func__);
+		return;
+	}
+
+	entry->rec->op = ILM_JOURNAL_OP_DEL;
+	memcpy(entry->rec->lock_id, lock_id, IDM_LOCK_ID_LEN);
+	memcpy(entry->rec->host_id, host_id, IDM_HOST_ID_LEN);
+	ilm_journal_queue(entry);
+}
+
+/* Drop the record of a lock which is released */
+void ilm_journal_del(struct ilm_lock *lock, char *host_id)
+{
+	if (!lock->journaled)
+		return;
+
+	ilm_journal_forget(lock->id, host_id);
+	lock->journaled = 0;
+}
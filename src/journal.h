@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+
+#include "lock.h"
+
+#define ILM_JOURNAL_MAGIC		0x4A524E4C	/* "JRNL" */
+
+#define ILM_JOURNAL_OP_ADD		1
+#define ILM_JOURNAL_OP_DEL		2
+
+/*
+ * Record of the lock journal, the header is followed by 'drive_num' WWNs
+ * of the drives with known paths.  A DEL record has no WWN.
+ */
+struct ilm_journal_rec {
+	uint32_t magic;
+	uint32_t len;		/* Whole record including the WWNs */
+	uint32_t csum;		/* FNV-1a of the record with zero csum */
+	uint16_t op;
+	uint16_t mode;
+	int32_t timeout;
+	uint32_t total_drive_num;
+	uint32_t drive_num;
+	uint32_t pad;
+	uint64_t path_sig;
+	char lock_id[IDM_LOCK_ID_LEN];
+	char host_id[IDM_HOST_ID_LEN];
+	uint64_t wwn[];
+};
+
+int ilm_journal_init(void);
+void ilm_journal_exit(void);
+int ilm_journal_recover(struct ilm_journal_rec ***recs);
+void ilm_journal_add(struct ilm_lock *lock, char *host_id);
+void ilm_journal_del(struct ilm_lock *lock, char *host_id);
+void ilm_journal_forget(char *lock_id, char *host_id);
+
+#endif /* __JOURNAL_H__ */
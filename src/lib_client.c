@@ -20,17 +20,188 @@
 #include <syslog.h>
 #include <pthread.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include "client.h"
 #include "cmd.h"
 #include "ilm_internal.h"
 #include "lock.h"
+#include "status.h"
+
+/* A request carries a payload and at most a few more buffers */
+#define ILM_REQUEST_IOV_MAX	4
+
+/*
+ * A request waiting for its reply; the reply data is received into the
+ * caller's buffer directly.  An asynchronous request is moved to the
+ * socket's done list when its reply arrives, until it's reaped.
+ */
+struct ilm_waiter {
+	struct list_head list;
+	uint32_t req_id;
+	int done;
+	int result;
+	int async;
+	void *data;
+	int data_len;
+};
+
+/*
+ * State of a socket connected with ilm_connect().  With ILM_PROTO_V3 the
+ * replies carry the request ID, so multiple threads can have requests in
+ * flight on the same socket: whichever waiting thread is free reads the
+ * next reply and hands it to its owner.  Before ILM_PROTO_V3 there is only
+ * one request in flight at a time.
+ */
+struct ilm_sock {
+	int in_use;
+	int proto;		/* Negotiated wire protocol version */
+	int error;		/* Connection is broken */
+	uint32_t req_id;
+	int reader;		/* A thread is reading replies */
+	struct list_head wait_list;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_mutex_t send_mutex;
+	pthread_mutex_t serial_mutex;
+
+	/* Asynchronous requests, see ilm_async_fd() */
+	struct list_head done_list;
+	int efd;		/* Signaled when done_list isn't empty */
+	int epfd;		/* Polls both socket and efd */
+
+	/* Status region published by the daemon, see status.h */
+	int status_state;	/* Zero if not probed, negative if disabled */
+	uint64_t status_token;
+	void *status;
+	size_t status_len;
+};
+
+/* Indexed by socket fd, the entries are reused but never freed */
+static struct ilm_sock **sock_table;
+static int sock_table_num;
+static pthread_mutex_t sock_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ilm_sock *sock_register(int sock)
+{
+	struct ilm_sock **tmp, *s;
+	int num;
+
+	pthread_mutex_lock(&sock_table_mutex);
+
+	if (sock >= sock_table_num) {
+		num = sock_table_num ? sock_table_num : 64;
+		while (num <= sock)
+			num *= 2;
+
+		tmp = realloc(sock_table, sizeof(struct ilm_sock *) * num);
+		if (!tmp) {
+			pthread_mutex_unlock(&sock_table_mutex);
+			return NULL;
+		}
+
+		memset(tmp + sock_table_num, 0,
+		       sizeof(struct ilm_sock *) * (num - sock_table_num));
+		sock_table = tmp;
+		sock_table_num = num;
+	}
+
+	s = sock_table[sock];
+	if (!s) {
+		s = malloc(sizeof(struct ilm_sock));
+		if (!s) {
+			pthread_mutex_unlock(&sock_table_mutex);
+			return NULL;
+		}
+
+		pthread_mutex_init(&s->mutex, NULL);
+		pthread_cond_init(&s->cond, NULL);
+		pthread_mutex_init(&s->send_mutex, NULL);
+		pthread_mutex_init(&s->serial_mutex, NULL);
+		sock_table[sock] = s;
+	}
+
+	s->proto = ILM_PROTO_V1;
+	s->error = 0;
+	s->req_id = 0;
+	s->reader = 0;
+	INIT_LIST_HEAD(&s->wait_list);
+	INIT_LIST_HEAD(&s->done_list);
+	s->efd = -1;
+	s->epfd = -1;
+	s->status_state = 0;
+	s->status_token = 0;
+	s->status = NULL;
+	s->status_len = 0;
+	s->in_use = 1;
+
+	pthread_mutex_unlock(&sock_table_mutex);
+	return s;
+}
+
+static void sock_unregister(int sock)
+{
+	struct ilm_waiter *w, *tmp;
+	struct ilm_sock *s = NULL;
+
+	pthread_mutex_lock(&sock_table_mutex);
+	if (sock >= 0 && sock < sock_table_num && sock_table[sock]) {
+		s = sock_table[sock];
+		s->in_use = 0;
+	}
+	pthread_mutex_unlock(&sock_table_mutex);
+
+	if (!s)
+		return;
+
+	/* Nobody can reap the asynchronous requests anymore */
+	pthread_mutex_lock(&s->mutex);
+	list_for_each_entry_safe(w, tmp, &s->wait_list, list) {
+		if (!w->async)
+			continue;
+		list_del(&w->list);
+		free(w);
+	}
+	list_for_each_entry_safe(w, tmp, &s->done_list, list) {
+		list_del(&w->list);
+		free(w);
+	}
+
+	if (s->epfd >= 0)
+		close(s->epfd);
+	if (s->efd >= 0)
+		close(s->efd);
+	s->epfd = -1;
+	s->efd = -1;
+
+	if (s->status)
+		munmap(s->status, s->status_len);
+	s->status = NULL;
+	s->status_state = 0;
+	pthread_mutex_unlock(&s->mutex);
+}
+
+static struct ilm_sock *sock_get(int sock)
+{
+	struct ilm_sock *s = NULL;
+
+	pthread_mutex_lock(&sock_table_mutex);
+	if (sock >= 0 && sock < sock_table_num &&
+	    sock_table[sock] && sock_table[sock]->in_use)
+		s = sock_table[sock];
+	pthread_mutex_unlock(&sock_table_mutex);
+
+	return s;
+}
 
 static int connect_socket(int *sock_fd)
 {
@@ -63,293 +234,1280 @@ static int connect_socket(int *sock_fd)
 	return 0;
 }
 
-static int send_header(int sock, int cmd, int data_len)
+static int send_msg(int sock, struct iovec *iov, int iov_num)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov_num;
+
+	while (msg.msg_iovlen) {
+		ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+
+		/* Skip the sent part for a partial write */
+		while (msg.msg_iovlen &&
+		       (size_t)ret >= msg.msg_iov->iov_len) {
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (msg.msg_iovlen) {
+			msg.msg_iov->iov_base =
+				(char *)msg.msg_iov->iov_base + ret;
+			msg.msg_iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int recv_data(int sock, void *buf, size_t len)
 {
-	struct ilm_msg_header header;
 	int ret;
 
-	memset(&header, 0, sizeof(header));
-	header.magic = ILM_MSG_MAGIC;
-	header.cmd = cmd;
-	header.length = sizeof(header) + data_len;
+	if (!len)
+		return 0;
 
 retry:
-	ret = send(sock, (void *)&header, sizeof(header), 0);
+	ret = recv(sock, buf, len, MSG_WAITALL);
 	if (ret == -1 && errno == EINTR)
 		goto retry;
-
 	if (ret < 0)
 		return -errno;
+	if ((size_t)ret != len)
+		return -EPIPE;
+
+	return 0;
+}
+
+static int recv_drain(int sock, int len)
+{
+	char trash[64];
+	int n, ret;
+
+	while (len > 0) {
+		n = len < (int)sizeof(trash) ? len : (int)sizeof(trash);
+		ret = recv_data(sock, trash, n);
+		if (ret < 0)
+			return ret;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Send a request, the waiter is queued before the request is sent so the
+ * reply can be matched no matter which thread reads it.  The request ID is
+ * returned in @req_id if it isn't NULL, since an asynchronous waiter can
+ * be reaped even before this returns.
+ */
+static int sock_send(struct ilm_sock *s, int sock, int cmd, uint32_t version,
+		     struct iovec *iov, int iov_num, struct ilm_waiter *w,
+		     uint32_t *req_id)
+{
+	struct ilm_msg_header hdr;
+	struct iovec vec[ILM_REQUEST_IOV_MAX + 1];
+	int i, len = 0, ret;
+
+	if (iov_num > ILM_REQUEST_IOV_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < iov_num; i++) {
+		vec[i + 1] = iov[i];
+		len += iov[i].iov_len;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = ILM_MSG_MAGIC;
+	hdr.cmd = cmd;
+	hdr.length = ilm_msg_header_len(s->proto) + len;
+	hdr.version = version;
+
+	vec[0].iov_base = &hdr;
+	vec[0].iov_len = ilm_msg_header_len(s->proto);
+
+	pthread_mutex_lock(&s->mutex);
+	if (s->error) {
+		ret = s->error;
+		pthread_mutex_unlock(&s->mutex);
+		return ret;
+	}
+	w->req_id = hdr.req_id = ++s->req_id;
+	if (req_id)
+		*req_id = w->req_id;
+	list_add_tail(&w->list, &s->wait_list);
+	pthread_mutex_unlock(&s->mutex);
+
+	pthread_mutex_lock(&s->send_mutex);
+	ret = send_msg(sock, vec, iov_num + 1);
+	pthread_mutex_unlock(&s->send_mutex);
+
+	if (ret < 0) {
+		pthread_mutex_lock(&s->mutex);
+		list_del(&w->list);
+		pthread_mutex_unlock(&s->mutex);
+	}
+
+	return ret;
+}
+
+static struct ilm_waiter *sock_find_waiter_unsafe(struct ilm_sock *s,
+						  uint32_t req_id)
+{
+	struct ilm_waiter *w;
+
+	/* Replies come back in order before ILM_PROTO_V3 */
+	if (s->proto < ILM_PROTO_V3) {
+		if (list_empty(&s->wait_list))
+			return NULL;
+		return list_first_entry(&s->wait_list,
+					struct ilm_waiter, list);
+	}
+
+	list_for_each_entry(w, &s->wait_list, list) {
+		if (w->req_id == req_id)
+			return w;
+	}
+
+	return NULL;
+}
+
+static void sock_complete_unsafe(struct ilm_sock *s, struct ilm_waiter *w,
+				 int result)
+{
+	list_del(&w->list);
+	w->result = result;
+	w->done = 1;
+
+	if (!w->async)
+		return;
+
+	list_add_tail(&w->list, &s->done_list);
+	if (s->efd >= 0)
+		eventfd_write(s->efd, 1);
+}
+
+static int sock_read_reply(struct ilm_sock *s, int sock)
+{
+	struct ilm_msg_header hdr;
+	struct ilm_waiter *w;
+	int hdr_len = ilm_msg_header_len(s->proto);
+	int len, n, ret;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	ret = recv_data(sock, &hdr, hdr_len);
+	if (ret < 0)
+		return ret;
+
+	if (hdr.magic != ILM_MSG_MAGIC || hdr.length < (uint32_t)hdr_len)
+		return -EPROTO;
+
+	len = hdr.length - hdr_len;
+
+	pthread_mutex_lock(&s->mutex);
+	w = sock_find_waiter_unsafe(s, hdr.req_id);
+	pthread_mutex_unlock(&s->mutex);
+
+	/* The waiter cannot go away before it's done, fill it unlocked */
+	if (w) {
+		n = len < w->data_len ? len : w->data_len;
+		ret = recv_data(sock, w->data, n);
+		if (ret < 0)
+			return ret;
+		len -= n;
+	}
+
+	ret = recv_drain(sock, len);
+	if (ret < 0)
+		return ret;
 
+	/* Stale reply, e.g. for a request which failed to send */
+	if (!w)
+		return 0;
+
+	pthread_mutex_lock(&s->mutex);
+	sock_complete_unsafe(s, w, (int)hdr.result);
+	pthread_mutex_unlock(&s->mutex);
 	return 0;
 }
 
-static int send_data(int sock, const void *buf, size_t len, int flags)
+static void sock_fail_unsafe(struct ilm_sock *s, int error)
+{
+	struct ilm_waiter *w, *tmp;
+
+	s->error = error;
+
+	list_for_each_entry_safe(w, tmp, &s->wait_list, list)
+		sock_complete_unsafe(s, w, error);
+}
+
+static int sock_wait(struct ilm_sock *s, int sock, struct ilm_waiter *w)
 {
 	int ret;
 
-retry:
-	ret = send(sock, buf, len, flags);
-	if (ret == -1 && errno == EINTR)
-		goto retry;
+	pthread_mutex_lock(&s->mutex);
+
+	while (!w->done) {
+		if (s->reader) {
+			pthread_cond_wait(&s->cond, &s->mutex);
+			continue;
+		}
 
+		s->reader = 1;
+		pthread_mutex_unlock(&s->mutex);
+
+		ret = sock_read_reply(s, sock);
+
+		pthread_mutex_lock(&s->mutex);
+		s->reader = 0;
+		if (ret < 0)
+			sock_fail_unsafe(s, ret);
+		pthread_cond_broadcast(&s->cond);
+	}
+
+	ret = w->result;
+	pthread_mutex_unlock(&s->mutex);
 	return ret;
 }
 
-static int recv_data(int sock, void *buf, size_t len, int flags)
+/**
+ * ilm_request - Send a request and wait for its reply
+ * @sock:	Socket connected with ilm_connect().
+ * @cmd:	Command of the request.
+ * @iov:	Request data.
+ * @iov_num:	Number of entries in @iov.
+ * @data:	Buffer for the reply data, or NULL.
+ * @data_len:	Length of @data.
+ *
+ * Returns the result of the request, a negative errno on failure.
+ */
+static int ilm_request(int sock, int cmd, struct iovec *iov, int iov_num,
+		       void *data, int data_len)
 {
+	struct ilm_sock *s;
+	struct ilm_waiter w;
 	int ret;
 
-retry:
-	ret = recv(sock, buf, len, flags);
-	if (ret == -1 && errno == EINTR)
-		goto retry;
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
+
+	memset(&w, 0, sizeof(w));
+	w.data = data;
+	w.data_len = data ? data_len : 0;
+
+	if (s->proto < ILM_PROTO_V3)
+		pthread_mutex_lock(&s->serial_mutex);
+
+	ret = sock_send(s, sock, cmd, 0, iov, iov_num, &w, NULL);
+	if (!ret)
+		ret = sock_wait(s, sock, &w);
+
+	if (s->proto < ILM_PROTO_V3)
+		pthread_mutex_unlock(&s->serial_mutex);
+
+	return ret;
+}
+
+/* Create the eventfd and epoll fd for the asynchronous requests */
+static int sock_async_init(struct ilm_sock *s, int sock)
+{
+	struct epoll_event ev;
+	int ret = 0;
+
+	pthread_mutex_lock(&s->mutex);
+	if (s->epfd >= 0)
+		goto out;
+
+	s->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->efd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epfd < 0) {
+		ret = -errno;
+		goto fail;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = sock;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		ret = -errno;
+		goto fail;
+	}
+
+	ev.data.fd = s->efd;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->efd, &ev) < 0) {
+		ret = -errno;
+		goto fail;
+	}
+
+	/* Requests might have been completed before */
+	if (!list_empty(&s->done_list))
+		eventfd_write(s->efd, 1);
+out:
+	pthread_mutex_unlock(&s->mutex);
+	return ret;
+
+fail:
+	if (s->epfd >= 0)
+		close(s->epfd);
+	close(s->efd);
+	s->epfd = -1;
+	s->efd = -1;
+	pthread_mutex_unlock(&s->mutex);
+	return ret;
+}
+
+/*
+ * Read the replies which have arrived without blocking, unless another
+ * thread is reading replies at the same time.
+ */
+static int sock_read_ready(struct ilm_sock *s, int sock)
+{
+	struct pollfd pfd;
+	int ret = 0;
+
+	pthread_mutex_lock(&s->mutex);
+	if (s->reader || s->error) {
+		pthread_mutex_unlock(&s->mutex);
+		return 0;
+	}
+	s->reader = 1;
+	pthread_mutex_unlock(&s->mutex);
 
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) > 0) {
+		ret = sock_read_reply(s, sock);
+		if (ret < 0)
+			break;
+	}
+
+	pthread_mutex_lock(&s->mutex);
+	s->reader = 0;
+	if (ret < 0)
+		sock_fail_unsafe(s, ret);
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
 	return ret;
 }
 
-static int send_command(int cmd, int data_len)
+/* Send a request without waiting, the reply is collected by ilm_reap() */
+static int ilm_submit(int sock, int cmd, struct iovec *iov, int iov_num,
+		      uint32_t *ticket)
 {
-	int ret, sock;
+	struct ilm_sock *s;
+	struct ilm_waiter *w;
+	int ret;
+
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
 
-	ret = connect_socket(&sock);
+	/* Replies can only be matched out of order since ILM_PROTO_V3 */
+	if (s->proto < ILM_PROTO_V3)
+		return -EOPNOTSUPP;
+
+	ret = sock_async_init(s, sock);
 	if (ret < 0)
 		return ret;
 
-	ret = send_header(sock, cmd, data_len);
-	if (ret < 0) {
-		close(sock);
+	w = calloc(1, sizeof(struct ilm_waiter));
+	if (!w)
+		return -ENOMEM;
+	w->async = 1;
+
+	ret = sock_send(s, sock, cmd, 0, iov, iov_num, w, ticket);
+	if (ret < 0)
+		free(w);
+
+	return ret;
+}
+
+/*
+ * Pack the drive paths into one buffer: every path takes PATH_MAX bytes
+ * in ILM_PROTO_V1, later versions put the length-prefixed paths back to
+ * back.  The caller frees the buffer.
+ */
+static char *pack_drive_paths(int sock, char **drives, int drive_num,
+			      int *len)
+{
+	struct ilm_sock *s = sock_get(sock);
+	uint16_t path_len;
+	char *buf;
+	int i, pos;
+
+	if (!s || s->proto < ILM_PROTO_V2) {
+		*len = drive_num * PATH_MAX;
+		buf = calloc(drive_num, PATH_MAX);
+		if (!buf)
+			return NULL;
+
+		for (i = 0; i < drive_num; i++)
+			strncpy(buf + i * PATH_MAX, drives[i], PATH_MAX);
+		return buf;
+	}
+
+	*len = 0;
+	for (i = 0; i < drive_num; i++)
+		*len += sizeof(uint16_t) + strlen(drives[i]) + 1;
+
+	buf = malloc(*len);
+	if (!buf)
+		return NULL;
+
+	for (i = 0, pos = 0; i < drive_num; i++) {
+		path_len = strlen(drives[i]) + 1;
+		memcpy(buf + pos, &path_len, sizeof(path_len));
+		pos += sizeof(path_len);
+		memcpy(buf + pos, drives[i], path_len);
+		pos += path_len;
+	}
+
+	return buf;
+}
+
+static int check_drive_paths(char **drives, int drive_num)
+{
+	int i;
+
+	if (drive_num < 0 || drive_num > ILM_DRIVE_MAX_NUM)
+		return -EINVAL;
+
+	for (i = 0; i < drive_num; i++) {
+		if (!drives[i] || strlen(drives[i]) >= PATH_MAX)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void init_payload(struct ilm_lock_payload *payload,
+			 struct idm_lock_id *id, uint32_t mode, int drive_num)
+{
+	memset(payload, 0, sizeof(struct ilm_lock_payload));
+	payload->magic = ILM_LOCK_MAGIC;
+	payload->mode = mode;
+	payload->drive_num = drive_num;
+	if (id)
+		memcpy(payload->lock_id, id, sizeof(*id));
+}
+
+/* Send a lock payload followed by the drive paths */
+static int ilm_request_paths(int sock, int cmd,
+			     struct ilm_lock_payload *payload, char **drives,
+			     void *data, int data_len)
+{
+	struct iovec iov[2];
+	char *paths;
+	int len, ret;
+
+	ret = check_drive_paths(drives, payload->drive_num);
+	if (ret < 0)
 		return ret;
+
+	paths = pack_drive_paths(sock, drives, payload->drive_num, &len);
+	if (!paths)
+		return -ENOMEM;
+
+	iov[0].iov_base = payload;
+	iov[0].iov_len = sizeof(struct ilm_lock_payload);
+	iov[1].iov_base = paths;
+	iov[1].iov_len = len;
+
+	ret = ilm_request(sock, cmd, iov, 2, data, data_len);
+	free(paths);
+	return ret;
+}
+
+static int ilm_submit_paths(int sock, int cmd,
+			    struct ilm_lock_payload *payload, char **drives,
+			    uint32_t *ticket)
+{
+	struct iovec iov[2];
+	char *paths;
+	int len, ret;
+
+	ret = check_drive_paths(drives, payload->drive_num);
+	if (ret < 0)
+		return ret;
+
+	paths = pack_drive_paths(sock, drives, payload->drive_num, &len);
+	if (!paths)
+		return -ENOMEM;
+
+	iov[0].iov_base = payload;
+	iov[0].iov_len = sizeof(struct ilm_lock_payload);
+	iov[1].iov_base = paths;
+	iov[1].iov_len = len;
+
+	ret = ilm_submit(sock, cmd, iov, 2, ticket);
+	free(paths);
+	return ret;
+}
+
+static int ilm_submit_payload(int sock, int cmd,
+			      struct ilm_lock_payload *payload,
+			      uint32_t *ticket)
+{
+	struct iovec iov;
+
+	iov.iov_base = payload;
+	iov.iov_len = sizeof(struct ilm_lock_payload);
+
+	return ilm_submit(sock, cmd, &iov, 1, ticket);
+}
+
+static int ilm_request_payload(int sock, int cmd,
+			       struct ilm_lock_payload *payload,
+			       void *data, int data_len)
+{
+	struct iovec iov;
+
+	iov.iov_base = payload;
+	iov.iov_len = sizeof(struct ilm_lock_payload);
+
+	return ilm_request(sock, cmd, &iov, 1, data, data_len);
+}
+
+/* Map the daemon's status region, returns NULL if it's not available */
+static void *sock_status_map(size_t *len)
+{
+	struct ilm_status_header *hdr;
+	char path[PATH_MAX];
+	char *run_dir;
+	struct stat st;
+	void *addr;
+	int fd;
+
+	run_dir = getenv("ILM_RUN_DIR");
+	if (!run_dir)
+		run_dir = ILM_DEFAULT_RUN_DIR;
+
+	snprintf(path, sizeof(path), "%s/%s", run_dir, ILM_STATUS_NAME);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != ilm_status_size()) {
+		close(fd);
+		return NULL;
 	}
 
-	return sock;
+	addr = mmap(NULL, ilm_status_size(), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	hdr = addr;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) !=
+						ILM_STATUS_MAGIC ||
+	    hdr->version != ILM_STATUS_VERSION ||
+	    hdr->bucket_num != ILM_STATUS_BUCKET_NUM ||
+	    hdr->bucket_slots != ILM_STATUS_BUCKET_SLOTS ||
+	    hdr->slot_size != sizeof(struct ilm_status_slot)) {
+		munmap(addr, ilm_status_size());
+		return NULL;
+	}
+
+	*len = ilm_status_size();
+	return addr;
 }
 
-static int recv_result(int sock)
+/*
+ * Probe the status region once per socket: the token of the lockspace is
+ * fetched from the daemon, then the region is mapped.  Any failure falls
+ * back to send all queries to the daemon.
+ */
+static struct ilm_sock *sock_status_get(int sock)
 {
-	struct ilm_msg_header hdr;
+	struct ilm_sock *s;
+	uint64_t token;
+	void *addr = NULL;
+	size_t len = 0;
 	int ret;
 
-	memset(&hdr, 0, sizeof(hdr));
+	s = sock_get(sock);
+	if (!s || s->proto < ILM_PROTO_V3)
+		return NULL;
+
+	pthread_mutex_lock(&s->mutex);
+	ret = s->status_state;
+	pthread_mutex_unlock(&s->mutex);
+
+	if (ret > 0)
+		return s;
+	if (ret < 0)
+		return NULL;
+
+	ret = ilm_request(sock, ILM_CMD_GET_STATUS, NULL, 0,
+			  &token, sizeof(token));
+	if (!ret)
+		addr = sock_status_map(&len);
+
+	pthread_mutex_lock(&s->mutex);
+	if (s->status_state) {
+		/* Another thread has probed it */
+		pthread_mutex_unlock(&s->mutex);
+		if (addr)
+			munmap(addr, len);
+		return s->status_state > 0 ? s : NULL;
+	}
+
+	if (addr) {
+		s->status = addr;
+		s->status_len = len;
+		s->status_token = token;
+		s->status_state = 1;
+	} else {
+		s->status_state = -1;
+	}
+	pthread_mutex_unlock(&s->mutex);
+
+	return addr ? s : NULL;
+}
+
+/**
+ * sock_status_read - Read a held lock's state from the status region
+ * @sock:	Socket connected with ilm_connect().
+ * @id:		Lock ID.
+ * @slot:	Copy of the slot for the lock.
+ *
+ * The slot is copied under its sequence count and it's only used when the
+ * lock was renewed recently, so the state is the same as the daemon would
+ * reply.
+ *
+ * Returns zero if the lock is found, otherwise the query must be sent to
+ * the daemon.
+ */
+static int sock_status_read(int sock, struct idm_lock_id *id,
+			    struct ilm_status_slot *slot)
+{
+	struct ilm_status_slot *base, *src;
+	struct ilm_sock *s;
+	struct timespec ts;
+	uint32_t bucket, seq;
+	int i, retry;
+
+	s = sock_status_get(sock);
+	if (!s)
+		return -ENOENT;
+
+	bucket = ilm_status_bucket(s->status_token, (char *)id);
+	base = (struct ilm_status_slot *)((char *)s->status +
+					  sizeof(struct ilm_status_header));
+	base += bucket * ILM_STATUS_BUCKET_SLOTS;
+
+	for (i = 0; i < ILM_STATUS_BUCKET_SLOTS; i++) {
+		src = &base[i];
+
+		for (retry = 0; retry < 4; retry++) {
+			seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1)
+				continue;
+
+			memcpy(slot, src, sizeof(*slot));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq)
+				break;
+		}
+
+		/* The slot is busy, let the daemon reply */
+		if (retry == 4)
+			return -EBUSY;
+
+		if (slot->token != s->status_token ||
+		    memcmp(slot->lock_id, id, IDM_LOCK_ID_LEN))
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 >=
+		    slot->expire)
+			return -ESTALE;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static int ilm_request_buf(int sock, int cmd, void *buf, int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	return ilm_request(sock, cmd, &iov, len ? 1 : 0, NULL, 0);
+}
+
+/*
+ * Send a batch request, the reply data is the result for every lock.
+ * The entries are followed by the drive paths when drive_num isn't zero.
+ *
+ * The daemon only replies the per-lock results once it has parsed the
+ * whole request, so mark the results as pending beforehand and fill the
+ * untouched ones with the overall result.
+ */
+static int ilm_request_batch(int sock, int cmd, struct ilm_lock_batch *batch,
+			     struct ilm_lock_batch_entry *entry,
+			     char **drives, int *results)
+{
+	struct iovec iov[3];
+	char *paths = NULL;
+	int len = 0, ret, i;
+
+	if (batch->drive_num) {
+		ret = check_drive_paths(drives, batch->drive_num);
+		if (ret < 0)
+			return ret;
+
+		paths = pack_drive_paths(sock, drives, batch->drive_num, &len);
+		if (!paths)
+			return -ENOMEM;
+	}
+
+	iov[0].iov_base = batch;
+	iov[0].iov_len = sizeof(struct ilm_lock_batch);
+	iov[1].iov_base = entry;
+	iov[1].iov_len = sizeof(struct ilm_lock_batch_entry) * batch->num;
+	iov[2].iov_base = paths;
+	iov[2].iov_len = len;
+
+	for (i = 0; i < batch->num; i++)
+		results[i] = 1;
+
+	ret = ilm_request(sock, cmd, iov, paths ? 3 : 2, results,
+			  sizeof(int) * batch->num);
+
+	for (i = 0; i < batch->num; i++) {
+		if (results[i] == 1)
+			results[i] = ret < 0 ? ret : -EPROTO;
+	}
+
+	free(paths);
+	return ret;
+}
+
+/*
+ * Batch commands are only known by the daemon with ILM_PROTO_V3, fall
+ * back to one request per lock for an older daemon.
+ */
+static int ilm_batch_supported(int sock)
+{
+	struct ilm_sock *s = sock_get(sock);
+
+	return s && s->proto >= ILM_PROTO_V3;
+}
+
+static int ilm_many(int sock, int cmd, struct idm_lock_id *ids,
+		    uint32_t *modes, int num, struct idm_lock_op *op,
+		    int *results)
+{
+	struct ilm_lock_batch batch;
+	struct ilm_lock_batch_entry *entry;
+	struct idm_lock_op single;
+	int *res = results;
+	int ret = 0, i;
+
+	if (!ids || num <= 0 || num > ILM_LOCK_BATCH_MAX_NUM)
+		return -EINVAL;
+
+	if (cmd == ILM_CMD_CONVERT_MANY && !modes)
+		return -EINVAL;
+
+	if (!res) {
+		res = malloc(sizeof(int) * num);
+		if (!res)
+			return -ENOMEM;
+	}
+
+	if (!ilm_batch_supported(sock)) {
+		for (i = 0; i < num; i++) {
+			if (cmd == ILM_CMD_ACQUIRE_MANY) {
+				single = *op;
+				if (modes)
+					single.mode = modes[i];
+				res[i] = ilm_lock(sock, &ids[i], &single);
+			} else if (cmd == ILM_CMD_RELEASE_MANY) {
+				res[i] = ilm_unlock(sock, &ids[i]);
+			} else {
+				res[i] = ilm_convert(sock, &ids[i], modes[i]);
+			}
+
+			if (res[i] && !ret)
+				ret = res[i];
+		}
+		goto out;
+	}
+
+	entry = calloc(num, sizeof(struct ilm_lock_batch_entry));
+	if (!entry) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < num; i++) {
+		memcpy(entry[i].lock_id, &ids[i], sizeof(ids[i]));
+		if (modes)
+			entry[i].mode = modes[i];
+		else if (op)
+			entry[i].mode = op->mode;
+	}
+
+	memset(&batch, 0, sizeof(batch));
+	batch.magic = ILM_LOCK_BATCH_MAGIC;
+	batch.num = num;
+	if (op) {
+		batch.drive_num = op->drive_num;
+		batch.timeout = op->timeout;
+	}
+
+	ret = ilm_request_batch(sock, cmd, &batch, entry,
+				op ? op->drives : NULL, res);
+	free(entry);
+
+out:
+	if (res != results)
+		free(res);
+	return ret;
+}
+
+int ilm_connect(int *sock)
+{
+	struct ilm_sock *s;
+	struct ilm_waiter w;
+	uint32_t proto = ILM_PROTO_V1;
+	int fd, ret;
+
+	ret = connect_socket(&fd);
+	if (ret < 0)
+		return ret;
+
+	s = sock_register(fd);
+	if (!s) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * Advertise the highest supported version of wire protocol, legacy
+	 * daemon doesn't reply the version and stays with ILM_PROTO_V1.
+	 */
+	memset(&w, 0, sizeof(w));
+	w.data = &proto;
+	w.data_len = sizeof(proto);
+
+	ret = sock_send(s, fd, ILM_CMD_ADD_LOCKSPACE, ILM_PROTO_VERSION,
+			NULL, 0, &w, NULL);
+	if (!ret)
+		ret = sock_wait(s, fd, &w);
+	if (ret < 0)
+		goto out;
+
+	if (proto < ILM_PROTO_V1 || proto > ILM_PROTO_VERSION) {
+		ret = -EPROTO;
+		goto out;
+	}
+
+	s->proto = proto;
+	*sock = fd;
+	return 0;
+
+out:
+	sock_unregister(fd);
+	close(fd);
+	return ret;
+}
+
+int ilm_disconnect(int sock)
+{
+	int ret;
+
+	ret = ilm_request(sock, ILM_CMD_DEL_LOCKSPACE, NULL, 0, NULL, 0);
+	if (ret < 0)
+		return ret;
+
+	sock_unregister(sock);
+	close(sock);
+	return 0;
+}
+
+int ilm_version(int sock, char *drive, uint8_t *version_major, uint8_t *version_minor)
+{
+	struct ilm_lock_payload payload;
+	int ret;
+	struct _version {
+		uint8_t major;
+		uint8_t minor;
+	} version;
+
+	init_payload(&payload, NULL, 0, 1);
+
+	ret = ilm_request_paths(sock, ILM_CMD_VERSION, &payload, &drive,
+				&version, sizeof(version));
+	if (ret < 0)
+		return ret;
+
+	*version_major = version.major;
+	*version_minor = version.minor;
+
+	return 0;
+}
+
+int ilm_lock(int sock, struct idm_lock_id *id, struct idm_lock_op *op)
+{
+	struct ilm_lock_payload payload;
+	int ret;
+
+	/* Return error when drive number is zero */
+	if (!op || !op->drive_num)
+		return -EINVAL;
+
+	init_payload(&payload, id, op->mode, op->drive_num);
+	payload.timeout = op->timeout;
+
+	ret = ilm_request_paths(sock, ILM_CMD_ACQUIRE, &payload, op->drives,
+				NULL, 0);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+/**
+ * ilm_lock_deadline - Acquire a lock within a deadline
+ * @sock:	Connected socket.
+ * @id:		Lock ID.
+ * @op:		Lock operation, same as ilm_lock().
+ * @deadline:	Milliseconds to keep retrying if the lock is held by
+ *		others, zero to try only once without waiting.
+ *
+ * ilm_lock() waits for the daemon's default deadline for a contended
+ * lock.  The acquisition can be stopped earlier by ilm_lock_cancel() from
+ * another thread.
+ *
+ * Returns 0 on success, -ECANCELED if it has been cancelled,
+ * -EOPNOTSUPP if the daemon doesn't support the deadline, otherwise a
+ * negative errno on failure.
+ */
+int ilm_lock_deadline(int sock, struct idm_lock_id *id,
+		      struct idm_lock_op *op, int deadline)
+{
+	struct ilm_lock_payload payload;
+	struct ilm_sock *s;
+	struct iovec iov[3];
+	char *paths;
+	int len, ret;
+
+	/* Return error when drive number is zero */
+	if (!op || !op->drive_num || deadline < 0)
+		return -EINVAL;
+
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
+
+	if (s->proto < ILM_PROTO_V3)
+		return -EOPNOTSUPP;
+
+	ret = check_drive_paths(op->drives, op->drive_num);
+	if (ret < 0)
+		return ret;
+
+	init_payload(&payload, id, op->mode, op->drive_num);
+	payload.timeout = op->timeout;
+
+	paths = pack_drive_paths(sock, op->drives, op->drive_num, &len);
+	if (!paths)
+		return -ENOMEM;
 
-retry:
-	ret = recv(sock, &hdr, sizeof(hdr), MSG_WAITALL);
-	if (ret == -1 && errno == EINTR)
-		goto retry;
-	if (ret < 0)
-		return -errno;
-	if (ret != sizeof(hdr))
-		return -1;
+	iov[0].iov_base = &payload;
+	iov[0].iov_len = sizeof(payload);
+	iov[1].iov_base = &deadline;
+	iov[1].iov_len = sizeof(deadline);
+	iov[2].iov_base = paths;
+	iov[2].iov_len = len;
 
-	return (int)hdr.result;
+	ret = ilm_request(sock, ILM_CMD_ACQUIRE_DEADLINE, iov, 3, NULL, 0);
+	free(paths);
+	return ret;
 }
 
-int ilm_connect(int *sock)
+/**
+ * ilm_lock_cancel - Cancel an in-flight lock acquisition
+ * @sock:	Connected socket.
+ * @id:		Lock ID.
+ *
+ * The pending ilm_lock(), ilm_lock_deadline() or ilm_lock_submit() for
+ * the lock fails with -ECANCELED, the daemon releases the drives which
+ * have been acquired for it.  The acquisitions of shareable locks which
+ * are coalesced between lockspaces cannot be cancelled.
+ *
+ * Returns 0 on success, -ENOENT if the lock is unknown, -EALREADY if the
+ * lock isn't being acquired, or a negative errno on failure.
+ */
+int ilm_lock_cancel(int sock, struct idm_lock_id *id)
 {
-	int s, ret;
+	struct ilm_lock_payload payload;
+	struct ilm_sock *s;
 
-	ret = send_command(ILM_CMD_ADD_LOCKSPACE, 0);
-	if (ret < 0)
-		return ret;
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
 
-	s = ret;
-	ret = recv_result(s);
-	if (ret < 0)
-		goto out;
+	/* Needs to be sent while the acquisition is still pending */
+	if (s->proto < ILM_PROTO_V3)
+		return -EOPNOTSUPP;
 
-	*sock = s;
-	return 0;
+	init_payload(&payload, id, 0, 0);
 
-out:
-	close(s);
-	return ret;
+	return ilm_request_payload(sock, ILM_CMD_CANCEL, &payload, NULL, 0);
 }
 
-int ilm_disconnect(int sock)
+int ilm_unlock(int sock, struct idm_lock_id *id)
 {
+	struct ilm_lock_payload payload;
 	int ret;
 
-	ret = send_header(sock, ILM_CMD_DEL_LOCKSPACE, 0);
-	if (ret < 0)
-		return ret;
+	init_payload(&payload, id, 0, 0);
 
-	ret = recv_result(sock);
+	ret = ilm_request_payload(sock, ILM_CMD_RELEASE, &payload, NULL, 0);
 	if (ret < 0)
 		return ret;
 
-	close(sock);
 	return 0;
 }
 
-int ilm_version(int sock, char *drive, uint8_t *version_major, uint8_t *version_minor)
+int ilm_convert(int sock, struct idm_lock_id *id, uint32_t mode)
 {
 	struct ilm_lock_payload payload;
-	char path[PATH_MAX];
-	int len, ret;
-	struct _version {
-		uint8_t major;
-		uint8_t minor;
-	} version;
-
-	len = sizeof(struct ilm_lock_payload) + PATH_MAX;
-
-	ret = send_header(sock, ILM_CMD_VERSION, len);
-	if (ret < 0)
-		return ret;
+	int ret;
 
-	memset(&payload, 0, sizeof(struct ilm_lock_payload));
-	payload.magic = ILM_LOCK_MAGIC;
-	payload.drive_num = 1;
+	init_payload(&payload, id, mode, 0);
 
-	ret = send_data(sock, &payload, sizeof(struct ilm_lock_payload), 0);
+	ret = ilm_request_payload(sock, ILM_CMD_CONVERT, &payload, NULL, 0);
 	if (ret < 0)
 		return ret;
 
-	strncpy(path, drive, PATH_MAX);
-	ret = send_data(sock, path, PATH_MAX, 0);
-	if (ret < 0)
-		return ret;
+	return 0;
+}
 
-	ret = recv_result(sock);
-	if (ret < 0)
-		return ret;
+/**
+ * ilm_lock_many - Acquire multiple locks on the same drives
+ * @sock:	Connected socket.
+ * @ids:	Lock IDs.
+ * @modes:	Mode for every lock, or NULL to use op->mode for all locks.
+ * @num:	Number of locks, at most ILM_LOCK_BATCH_MAX_NUM.
+ * @op:	Drives and timeout shared by all locks.
+ * @results:	Result for every lock, or NULL.
+ *
+ * The daemon resolves the drives once and sends the mutex commands for
+ * all locks in one pipelined wave per drive.
+ *
+ * Returns 0 if all locks are acquired, otherwise the first failure.
+ */
+int ilm_lock_many(int sock, struct idm_lock_id *ids, uint32_t *modes, int num,
+		  struct idm_lock_op *op, int *results)
+{
+	/* Return error when drive number is zero */
+	if (!op || !op->drive_num)
+		return -EINVAL;
 
-	ret = recv_data(sock, (char *)&version, sizeof(version), 0);
-	if (ret < 0)
-		return ret;
+	return ilm_many(sock, ILM_CMD_ACQUIRE_MANY, ids, modes, num, op,
+			results);
+}
 
-	*version_major = version.major;
-	*version_minor = version.minor;
+/**
+ * ilm_unlock_many - Release multiple locks
+ * @sock:	Connected socket.
+ * @ids:	Lock IDs.
+ * @num:	Number of locks, at most ILM_LOCK_BATCH_MAX_NUM.
+ * @results:	Result for every lock, or NULL.
+ *
+ * Returns 0 if all locks are released, otherwise the first failure.
+ */
+int ilm_unlock_many(int sock, struct idm_lock_id *ids, int num, int *results)
+{
+	return ilm_many(sock, ILM_CMD_RELEASE_MANY, ids, NULL, num, NULL,
+			results);
+}
 
-	return 0;
+/**
+ * ilm_convert_many - Convert mode for multiple locks
+ * @sock:	Connected socket.
+ * @ids:	Lock IDs.
+ * @modes:	New mode for every lock.
+ * @num:	Number of locks, at most ILM_LOCK_BATCH_MAX_NUM.
+ * @results:	Result for every lock, or NULL.
+ *
+ * Returns 0 if all locks are converted, otherwise the first failure.
+ */
+int ilm_convert_many(int sock, struct idm_lock_id *ids, uint32_t *modes,
+		     int num, int *results)
+{
+	return ilm_many(sock, ILM_CMD_CONVERT_MANY, ids, modes, num, NULL,
+			results);
 }
 
-int ilm_lock(int sock, struct idm_lock_id *id, struct idm_lock_op *op)
+/**
+ * ilm_lock_submit - Submit a lock request without waiting
+ * @sock:	Connected socket.
+ * @id:		Lock ID.
+ * @op:		Lock operation, same as ilm_lock().
+ * @ticket:	Ticket to identify the request's completion.
+ *
+ * The result is collected by ilm_reap().  Requests for different locks
+ * run concurrently in the daemon, requests for the same lock complete in
+ * the order they were submitted.
+ *
+ * Returns 0 if the request has been sent, -EOPNOTSUPP if the daemon
+ * doesn't support asynchronous requests.
+ */
+int ilm_lock_submit(int sock, struct idm_lock_id *id, struct idm_lock_op *op,
+		    uint32_t *ticket)
 {
 	struct ilm_lock_payload payload;
-	int i, len, ret;
-	char path[PATH_MAX];
 
 	/* Return error when drive number is zero */
 	if (!op || !op->drive_num)
 		return -EINVAL;
 
-	/* Return error when detect drive path is NULL */
-	for (i = 0; i < op->drive_num; i++) {
-		if (!op->drives[i])
-			return -EINVAL;
-	}
-
-	len = sizeof(struct ilm_lock_payload) + op->drive_num * PATH_MAX;
-
-	ret = send_header(sock, ILM_CMD_ACQUIRE, len);
-	if (ret < 0)
-		return ret;
-
-	memset(&payload, 0, sizeof(struct ilm_lock_payload));
-	payload.magic = ILM_LOCK_MAGIC;
-	payload.mode = op->mode;
-	payload.drive_num = op->drive_num;
+	init_payload(&payload, id, op->mode, op->drive_num);
 	payload.timeout = op->timeout;
 
-	memcpy(payload.lock_id, id, sizeof(*id));
-
-	ret = send_data(sock, &payload, sizeof(struct ilm_lock_payload), 0);
-	if (ret < 0)
-		return ret;
+	return ilm_submit_paths(sock, ILM_CMD_ACQUIRE, &payload, op->drives,
+				ticket);
+}
 
-	for (i = 0; i < op->drive_num; i++) {
-		strncpy(path, op->drives[i], PATH_MAX);
-		ret = send_data(sock, path, PATH_MAX, 0);
-		if (ret < 0)
-			return ret;
-	}
+int ilm_unlock_submit(int sock, struct idm_lock_id *id, uint32_t *ticket)
+{
+	struct ilm_lock_payload payload;
 
-	ret = recv_result(sock);
-	if (ret < 0)
-		return ret;
+	init_payload(&payload, id, 0, 0);
 
-	return 0;
+	return ilm_submit_payload(sock, ILM_CMD_RELEASE, &payload, ticket);
 }
 
-int ilm_unlock(int sock, struct idm_lock_id *id)
+int ilm_convert_submit(int sock, struct idm_lock_id *id, uint32_t mode,
+		       uint32_t *ticket)
 {
 	struct ilm_lock_payload payload;
-	int len, ret;
 
-	len = sizeof(struct ilm_lock_payload);
+	init_payload(&payload, id, mode, 0);
 
-	ret = send_header(sock, ILM_CMD_RELEASE, len);
-	if (ret < 0)
-		return ret;
+	return ilm_submit_payload(sock, ILM_CMD_CONVERT, &payload, ticket);
+}
+
+/**
+ * ilm_async_fd - Get the pollable fd for asynchronous requests
+ * @sock:	Connected socket.
+ *
+ * The fd becomes readable when ilm_reap() may return completions, it's
+ * owned by the library and closed by ilm_disconnect().
+ *
+ * Returns the fd, or a negative errno on failure.
+ */
+int ilm_async_fd(int sock)
+{
+	struct ilm_sock *s;
+	int ret;
 
-	memset(&payload, 0, sizeof(struct ilm_lock_payload));
-	payload.magic = ILM_LOCK_MAGIC;
-	memcpy(payload.lock_id, id, sizeof(*id));
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
 
-	ret = send_data(sock, &payload, sizeof(struct ilm_lock_payload), 0);
-	if (ret < 0)
-		return ret;
+	if (s->proto < ILM_PROTO_V3)
+		return -EOPNOTSUPP;
 
-	ret = recv_result(sock);
+	ret = sock_async_init(s, sock);
 	if (ret < 0)
 		return ret;
 
-	return 0;
+	return s->epfd;
 }
 
-int ilm_convert(int sock, struct idm_lock_id *id, uint32_t mode)
+/**
+ * ilm_reap - Collect the completed asynchronous requests
+ * @sock:	Connected socket.
+ * @comp:	Array to return the completions.
+ * @max:	Size of @comp.
+ *
+ * This never blocks, callers wait for the fd from ilm_async_fd() to
+ * become readable.
+ *
+ * Returns the number of completions, or a negative errno if the
+ * connection is broken and there is nothing left to reap.
+ */
+int ilm_reap(int sock, struct ilm_completion *comp, int max)
 {
-	struct ilm_lock_payload payload;
-	int len, ret;
+	struct ilm_sock *s;
+	struct ilm_waiter *w;
+	eventfd_t val;
+	int num = 0, ret;
 
-	len = sizeof(struct ilm_lock_payload);
+	if (!comp || max <= 0)
+		return -EINVAL;
 
-	ret = send_header(sock, ILM_CMD_CONVERT, len);
-	if (ret < 0)
-		return ret;
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
 
-	memset(&payload, 0, sizeof(struct ilm_lock_payload));
-	payload.magic = ILM_LOCK_MAGIC;
-	payload.mode = mode;
-	memcpy(payload.lock_id, id, sizeof(*id));
+	sock_read_ready(s, sock);
 
-	ret = send_data(sock, &payload, sizeof(struct ilm_lock_payload), 0);
-	if (ret < 0)
-		return ret;
+	pthread_mutex_lock(&s->mutex);
 
-	ret = recv_result(sock);
-	if (ret < 0)
-		return ret;
+	if (s->efd >= 0)
+		eventfd_read(s->efd, &val);
 
-	return 0;
+	while (num < max && !list_empty(&s->done_list)) {
+		w = list_first_entry(&s->done_list, struct ilm_waiter, list);
+		list_del(&w->list);
+
+		comp[num].ticket = w->req_id;
+		comp[num].result = w->result;
+		num++;
+		free(w);
+	}
+
+	/* Keep the fd readable for the remaining completions */
+	if (!list_empty(&s->done_list) && s->efd >= 0)
+		eventfd_write(s->efd, 1);
+
+	ret = (!num && s->error) ? s->error : num;
+	pthread_mutex_unlock(&s->mutex);
+	return ret;
 }
 
 int ilm_write_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len)
 {
 	struct ilm_lock_payload payload;
-	int len, ret;
-
-	len = sizeof(struct ilm_lock_payload);
-	len += lvb_len;
-
-	ret = send_header(sock, ILM_CMD_WRITE_LVB, len);
-	if (ret < 0)
-		return ret;
-
-	memset(&payload, 0, sizeof(struct ilm_lock_payload));
-	payload.magic = ILM_LOCK_MAGIC;
-	memcpy(payload.lock_id, id, sizeof(*id));
+	struct iovec iov[2];
+	int ret;
 
-	ret = send_data(sock, &payload, sizeof(struct ilm_lock_payload), 0);
-	if (ret < 0)
-		return ret;
+	init_payload(&payload, id, 0, 0);
 
-	ret = send_data(sock, lvb, lvb_len, 0);
-	if (ret < 0)
-		return ret;
+	iov[0].iov_base = &payload;
+	iov[0].iov_len = sizeof(struct ilm_lock_payload);
+	iov[1].iov_base = lvb;
+	iov[1].iov_len = lvb_len;
 
-	ret = recv_result(sock);
+	ret = ilm_request(sock, ILM_CMD_WRITE_LVB, iov, 2, NULL, 0);
 	if (ret < 0)
 		return ret;
 
@@ -359,27 +1517,20 @@ int ilm_write_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len)
 int ilm_read_lvb(int sock, struct idm_lock_id *id, char *lvb, int lvb_len)
 {
 	struct ilm_lock_payload payload;
-	int len, ret;
-
-	len = sizeof(struct ilm_lock_payload);
-
-	ret = send_header(sock, ILM_CMD_READ_LVB, len);
-	if (ret < 0)
-		return ret;
-
-	memset(&payload, 0, sizeof(struct ilm_lock_payload));
-	payload.magic = ILM_LOCK_MAGIC;
-	memcpy(payload.lock_id, id, sizeof(*id));
+	struct ilm_status_slot slot;
+	int ret;
 
-	ret = send_data(sock, &payload, sizeof(struct ilm_lock_payload), 0);
-	if (ret < 0)
-		return ret;
+	if (!sock_status_read(sock, id, &slot) &&
+	    (slot.flags & ILM_STATUS_VB)) {
+		memcpy(lvb, slot.vb,
+		       lvb_len < IDM_VALUE_LEN ? lvb_len : IDM_VALUE_LEN);
+		return 0;
+	}
 
-	ret = recv_result(sock);
-	if (ret < 0)
-		return ret;
+	init_payload(&payload, id, 0, 0);
 
-	ret = recv_data(sock, lvb, lvb_len, 0);
+	ret = ilm_request_payload(sock, ILM_CMD_READ_LVB, &payload,
+				  lvb, lvb_len);
 	if (ret < 0)
 		return ret;
 
@@ -390,15 +1541,7 @@ int ilm_set_signal(int sock, int signo)
 {
 	int ret;
 
-	ret = send_header(sock, ILM_CMD_SET_SIGNAL, sizeof(int));
-	if (ret < 0)
-		return ret;
-
-	ret = send_data(sock, &signo, sizeof(int), 0);
-	if (ret < 0)
-		return ret;
-
-	ret = recv_result(sock);
+	ret = ilm_request_buf(sock, ILM_CMD_SET_SIGNAL, &signo, sizeof(int));
 	if (ret < 0)
 		return ret;
 
@@ -409,27 +1552,18 @@ int ilm_set_killpath(int sock, char *killpath, char *killargs)
 {
 	char path[IDM_FAILURE_PATH_LEN];
 	char args[IDM_FAILURE_ARGS_LEN];
-
-	int len, ret;
-
-	len = sizeof(struct ilm_lock_payload) +
-	      IDM_FAILURE_PATH_LEN + IDM_FAILURE_ARGS_LEN;
-
-	ret = send_header(sock, ILM_CMD_SET_KILLPATH, len);
-	if (ret < 0)
-		return ret;
+	struct iovec iov[2];
+	int ret;
 
 	strncpy(path, killpath, IDM_FAILURE_PATH_LEN);
-	ret = send_data(sock, path, IDM_FAILURE_PATH_LEN, 0);
-	if (ret < 0)
-		return ret;
-
 	strncpy(args, killargs, IDM_FAILURE_ARGS_LEN);
-	ret = send_data(sock, args, IDM_FAILURE_ARGS_LEN, 0);
-	if (ret < 0)
-		return ret;
 
-	ret = recv_result(sock);
+	iov[0].iov_base = path;
+	iov[0].iov_len = IDM_FAILURE_PATH_LEN;
+	iov[1].iov_base = args;
+	iov[1].iov_len = IDM_FAILURE_ARGS_LEN;
+
+	ret = ilm_request(sock, ILM_CMD_SET_KILLPATH, iov, 2, NULL, 0);
 	if (ret < 0)
 		return ret;
 
@@ -440,47 +1574,30 @@ int ilm_get_host_count(int sock, struct idm_lock_id *id,
 		       struct idm_lock_op *op, int *count, int *self)
 {
 	struct ilm_lock_payload payload;
-	int i, len, ret;
-	char path[PATH_MAX];
+	struct ilm_status_slot slot;
+	int ret;
 	struct _host_account {
 		int count;
 		int self;
 	} account;
 
-	len = sizeof(struct ilm_lock_payload) + op->drive_num * PATH_MAX;
-
-	ret = send_header(sock, ILM_CMD_LOCK_HOST_COUNT, len);
-	if (ret < 0)
-		return ret;
-
-	memset(&payload, 0, sizeof(struct ilm_lock_payload));
-	payload.magic = ILM_LOCK_MAGIC;
-	payload.drive_num = op->drive_num;
-
-	memcpy(payload.lock_id, id, sizeof(*id));
-
-	ret = send_data(sock, &payload, sizeof(struct ilm_lock_payload), 0);
-	if (ret < 0)
-		return ret;
-
-	for (i = 0; i < op->drive_num; i++) {
-		strncpy(path, op->drives[i], PATH_MAX);
-		ret = send_data(sock, path, PATH_MAX, 0);
-		if (ret < 0)
-			return ret;
+	if (!sock_status_read(sock, id, &slot) &&
+	    (slot.flags & ILM_STATUS_COUNT)) {
+		*count = slot.count;
+		*self = slot.self;
+		return 0;
 	}
 
-	ret = recv_result(sock);
+	init_payload(&payload, id, 0, op->drive_num);
+
+	ret = ilm_request_paths(sock, ILM_CMD_LOCK_HOST_COUNT, &payload,
+				op->drives, &account, sizeof(account));
 	if (ret == -ENOENT)
 		*count = 0;
 
 	if (ret < 0)
 		return ret;
 
-	ret = recv_data(sock, (char *)&account, sizeof(account), 0);
-	if (ret < 0)
-		return ret;
-
 	*count = account.count;
 	*self = account.self;
 	return 0;
@@ -490,43 +1607,24 @@ int ilm_get_mode(int sock, struct idm_lock_id *id,
 		 struct idm_lock_op *op, int *mode)
 {
 	struct ilm_lock_payload payload;
-	char path[PATH_MAX];
-	int i, len, ret;
-
-	len = sizeof(struct ilm_lock_payload) + op->drive_num * PATH_MAX;
-
-	ret = send_header(sock, ILM_CMD_LOCK_MODE, len);
-	if (ret < 0)
-		return ret;
-
-	memset(&payload, 0, sizeof(struct ilm_lock_payload));
-	payload.magic = ILM_LOCK_MAGIC;
-	payload.drive_num = op->drive_num;
-
-	memcpy(payload.lock_id, id, sizeof(*id));
-
-	ret = send_data(sock, &payload, sizeof(struct ilm_lock_payload), 0);
-	if (ret < 0)
-		return ret;
+	struct ilm_status_slot slot;
+	int ret;
 
-	for (i = 0; i < op->drive_num; i++) {
-		strncpy(path, op->drives[i], PATH_MAX);
-		ret = send_data(sock, path, PATH_MAX, 0);
-		if (ret < 0)
-			return ret;
+	if (!sock_status_read(sock, id, &slot)) {
+		*mode = slot.mode;
+		return 0;
 	}
 
-	ret = recv_result(sock);
+	init_payload(&payload, id, 0, op->drive_num);
+
+	ret = ilm_request_paths(sock, ILM_CMD_LOCK_MODE, &payload,
+				op->drives, mode, sizeof(int));
 	if (ret == -ENOENT)
 		*mode = 0;
 
 	if (ret < 0)
 		return ret;
 
-	ret = recv_data(sock, (char *)mode, sizeof(int), 0);
-	if (ret < 0)
-		return ret;
-
 	return 0;
 }
 
@@ -534,15 +1632,7 @@ int ilm_set_host_id(int sock, char *id, int id_len)
 {
 	int ret;
 
-	ret = send_header(sock, ILM_CMD_SET_HOST_ID, id_len);
-	if (ret < 0)
-		return ret;
-
-	ret = send_data(sock, id, id_len, 0);
-	if (ret < 0)
-		return ret;
-
-	ret = recv_result(sock);
+	ret = ilm_request_buf(sock, ILM_CMD_SET_HOST_ID, id, id_len);
 	if (ret < 0)
 		return ret;
 
@@ -553,11 +1643,7 @@ int ilm_stop_renew(int sock)
 {
 	int ret;
 
-	ret = send_header(sock, ILM_CMD_STOP_RENEW, 0);
-	if (ret < 0)
-		return ret;
-
-	ret = recv_result(sock);
+	ret = ilm_request(sock, ILM_CMD_STOP_RENEW, NULL, 0, NULL, 0);
 	if (ret < 0)
 		return ret;
 
@@ -568,11 +1654,7 @@ int ilm_start_renew(int sock)
 {
 	int ret;
 
-	ret = send_header(sock, ILM_CMD_START_RENEW, 0);
-	if (ret < 0)
-		return ret;
-
-	ret = recv_result(sock);
+	ret = ilm_request(sock, ILM_CMD_START_RENEW, NULL, 0, NULL, 0);
 	if (ret < 0)
 		return ret;
 
@@ -583,17 +1665,127 @@ int ilm_inject_fault(int sock, int percentage)
 {
 	int ret;
 
-	ret = send_header(sock, ILM_CMD_INJECT_FAULT, sizeof(int));
+	ret = ilm_request_buf(sock, ILM_CMD_INJECT_FAULT, &percentage,
+			      sizeof(int));
 	if (ret < 0)
 		return ret;
 
-	ret = send_data(sock, &percentage, sizeof(int), 0);
-	if (ret < 0)
-		return ret;
+	return 0;
+}
 
-	ret = recv_result(sock);
-	if (ret < 0)
-		return ret;
+/**
+ * ilm_get_stats - Read out the drive command statistics
+ * @sock:	Connected socket.
+ * @stats:	Array of statistics, one entry per drive.
+ * @num:	Number of entries in @stats.
+ *
+ * The statistics are accumulated since the daemon is launched, for every
+ * drive accessed by the daemon.  Only the first @num drives are filled if
+ * the daemon has accessed more drives.
+ *
+ * Returns the number of drives, or a negative errno on failure.
+ */
+int ilm_get_stats(int sock, struct ilm_drive_stats *stats, int num)
+{
+	struct ilm_sock *s;
 
-	return 0;
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
+
+	if (s->proto < ILM_PROTO_V3)
+		return -EOPNOTSUPP;
+
+	if (num < 0)
+		return -EINVAL;
+
+	return ilm_request(sock, ILM_CMD_STATS, NULL, 0, stats,
+			   sizeof(struct ilm_drive_stats) * num);
+}
+
+/**
+ * ilm_get_stage_stats - Read out the latency statistics of request stages
+ * @sock:	Connected socket.
+ * @stats:	Statistics of stages, indexed by ILM_STAGE_*.
+ *
+ * The statistics are accumulated since the daemon is launched, for the
+ * requests of all clients.  The drive request and issue stages are counted
+ * for every request sent to a drive and every round on drives.
+ *
+ * Returns zero or a negative errno on failure.
+ */
+int ilm_get_stage_stats(int sock, struct ilm_stage_stats *stats)
+{
+	struct ilm_sock *s;
+
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
+
+	if (s->proto < ILM_PROTO_V3)
+		return -EOPNOTSUPP;
+
+	return ilm_request(sock, ILM_CMD_STAGE_STATS, NULL, 0, stats,
+			   sizeof(struct ilm_stage_stats));
+}
+
+/**
+ * ilm_get_lock_stats - Read out the contention statistics of lock IDs
+ * @sock:	Connected socket.
+ * @stats:	Array of statistics, one entry per lock ID.
+ * @num:	Number of entries in @stats.
+ *
+ * The statistics are accumulated since the daemon is launched for at most
+ * ILM_LOCK_STATS_NUM lock IDs, the most contended first.  Only the first
+ * @num lock IDs are filled if the daemon tracks more.
+ *
+ * Returns the number of lock IDs, or a negative errno on failure.
+ */
+int ilm_get_lock_stats(int sock, struct ilm_lock_stats *stats, int num)
+{
+	struct ilm_sock *s;
+
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
+
+	if (s->proto < ILM_PROTO_V3)
+		return -EOPNOTSUPP;
+
+	if (num < 0)
+		return -EINVAL;
+
+	return ilm_request(sock, ILM_CMD_LOCK_STATS, NULL, 0, stats,
+			   sizeof(struct ilm_lock_stats) * num);
+}
+
+/**
+ * ilm_get_renew_stats - Read out the renewal margin of drives and locks
+ * @sock:	Connected socket.
+ * @stats:	Array of statistics, one entry per drive or lock.
+ * @num:	Number of entries in @stats.
+ *
+ * The drives come first and are accounted since the daemon is launched,
+ * followed by at most ILM_RENEW_STATS_LOCK_NUM held locks of all
+ * lockspaces, the lowest margin first.  Only the first @num entries are
+ * filled if the daemon has more.
+ *
+ * Returns the number of entries, or a negative errno on failure.
+ */
+int ilm_get_renew_stats(int sock, struct ilm_renew_stats *stats, int num)
+{
+	struct ilm_sock *s;
+
+	s = sock_get(sock);
+	if (!s)
+		return -EBADF;
+
+	if (s->proto < ILM_PROTO_V3)
+		return -EOPNOTSUPP;
+
+	if (num < 0)
+		return -EINVAL;
+
+	return ilm_request(sock, ILM_CMD_RENEW_STATS, NULL, 0, stats,
+			   sizeof(struct ilm_renew_stats) * num);
 }
@@ -5,10 +5,12 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <uuid/uuid.h>
 #include <unistd.h>
 
@@ -16,11 +18,15 @@
 #include "cmd.h"
 #include "drive.h"
 #include "idm_api.h"
+#include "ilm_internal.h"
+#include "journal.h"
 #include "list.h"
 #include "lockspace.h"
 #include "lock.h"
 #include "log.h"
 #include "raid_lock.h"
+#include "req_trace.h"
+#include "status.h"
 #include "util.h"
 #include "uuid.h"
 
@@ -34,11 +40,10 @@ static int ilm_lock_payload_read(struct ilm_cmd *cmd,
 {
 	int ret;
 
-	ret = recv(cmd->cl->fd, payload,
-		   sizeof(struct ilm_lock_payload), MSG_WAITALL);
-	if (!ret || (ret != sizeof(struct ilm_lock_payload))) {
-		ilm_log_err("Client fd %d recv lock payload errno %d\n",
-			    cmd->cl->fd, errno);
+	ret = ilm_cmd_read(cmd, payload, sizeof(struct ilm_lock_payload));
+	if (ret != sizeof(struct ilm_lock_payload)) {
+		ilm_log_err("Client fd %d short lock payload %d\n",
+			    cmd->cl->fd, ret);
 		return -EIO;
 	}
 
@@ -51,6 +56,111 @@ static int ilm_lock_payload_read(struct ilm_cmd *cmd,
 	return ret;
 }
 
+/*
+ * Parse the drive paths following the lock payload, the returned pointers
+ * refer to the command's request data.
+ */
+static int ilm_lock_paths_read(struct ilm_cmd *cmd, int drive_num,
+			       char **path)
+{
+	uint16_t len;
+	char *buf;
+	int total, off, i, ret;
+
+	if (!drive_num)
+		return 0;
+
+	if (cmd->cl->proto < ILM_PROTO_V2) {
+		total = drive_num * PATH_MAX;
+		ret = ilm_cmd_data(cmd, total, &buf);
+		if (ret < 0) {
+			ilm_log_err("Drive paths are truncated: %d\n",
+				    ilm_cmd_data_left(cmd));
+			return ret;
+		}
+
+		for (i = 0; i < drive_num; i++) {
+			path[i] = buf + i * PATH_MAX;
+			path[i][PATH_MAX - 1] = '\0';
+		}
+		return 0;
+	}
+
+	total = ilm_cmd_data_left(cmd);
+	if (total <= 0 || total > drive_num * (sizeof(len) + PATH_MAX)) {
+		ilm_log_err("Drive paths length is out of scope: %d\n", total);
+		return -EINVAL;
+	}
+
+	ret = ilm_cmd_data(cmd, total, &buf);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0, off = 0; i < drive_num; i++) {
+		if (off + sizeof(len) > total)
+			goto malformed;
+
+		memcpy(&len, buf + off, sizeof(len));
+		off += sizeof(len);
+
+		if (!len || len > PATH_MAX || off + len > total ||
+		    buf[off + len - 1] != '\0')
+			goto malformed;
+
+		path[i] = buf + off;
+		off += len;
+	}
+
+	return 0;
+
+malformed:
+	ilm_log_err("Malformed drive path %d in request\n", i);
+	return -EINVAL;
+}
+
+/*
+ * Parse the batch header and return the entry array which refers to the
+ * command's request data.
+ */
+static int ilm_lock_batch_read(struct ilm_cmd *cmd,
+			       struct ilm_lock_batch *batch,
+			       struct ilm_lock_batch_entry **entry)
+{
+	char *buf;
+	int ret;
+
+	ret = ilm_cmd_read(cmd, batch, sizeof(struct ilm_lock_batch));
+	if (ret != sizeof(struct ilm_lock_batch)) {
+		ilm_log_err("Client fd %d short batch header %d\n",
+			    cmd->cl->fd, ret);
+		return -EIO;
+	}
+
+	if (batch->magic != ILM_LOCK_BATCH_MAGIC) {
+		ilm_log_err("Client fd %d batch magic %x vs %x\n",
+			    cmd->cl->fd, batch->magic, ILM_LOCK_BATCH_MAGIC);
+		return -EINVAL;
+	}
+
+	if (!batch->num || batch->num > ILM_LOCK_BATCH_MAX_NUM ||
+	    batch->drive_num > ILM_DRIVE_MAX_NUM) {
+		ilm_log_err("Batch is out of scope: num %u drive_num %u\n",
+			    batch->num, batch->drive_num);
+		return -EINVAL;
+	}
+
+	ret = ilm_cmd_data(cmd, batch->num * sizeof(struct ilm_lock_batch_entry),
+			   &buf);
+	if (ret < 0) {
+		ilm_log_err("Batch entries are truncated: %d\n",
+			    ilm_cmd_data_left(cmd));
+		return ret;
+	}
+
+	*entry = (struct ilm_lock_batch_entry *)buf;
+	return 0;
+}
+
 static int ilm_sort_drive_uuid(unsigned long *wwn_arr, int drive_num)
 {
 	int i, j;
@@ -79,9 +189,49 @@ static int ilm_sort_drive_uuid(unsigned long *wwn_arr, int drive_num)
 	return 0;
 }
 
+/*
+ * Fill in SG paths for drives from a single drive list snapshot, so the paths
+ * are consistent with the version recorded in the lock.  Drives without any
+ * known path get a second chance after a drive list refresh; the version
+ * from the first snapshot is kept so any path loaded from it will be checked
+ * again on next access.
+ */
+static void ilm_load_drive_multi_paths(struct ilm_lock *lock,
+				       struct ilm_drive *drive, int num)
+{
+	struct ilm_drive_snapshot *snap;
+	int i, idx, missing = 0;
+
+	snap = ilm_drive_snapshot_get(&idx);
+	lock->drive_version = ilm_drive_snapshot_version(snap);
+	for (i = 0; i < num; i++) {
+		drive[i].path_num = ilm_drive_snapshot_get_sgs(snap,
+				drive[i].wwn, drive[i].path, IDM_DRIVE_PATH_NUM);
+		if (!drive[i].path_num)
+			missing++;
+	}
+	ilm_drive_snapshot_put(idx);
+
+	if (!missing)
+		return;
+
+	/* Failed to retrieve any SG path for drive, refresh block list and retry */
+	ilm_drive_list_refresh();
+
+	snap = ilm_drive_snapshot_get(&idx);
+	for (i = 0; i < num; i++) {
+		if (drive[i].path_num)
+			continue;
+
+		drive[i].path_num = ilm_drive_snapshot_get_sgs(snap,
+				drive[i].wwn, drive[i].path, IDM_DRIVE_PATH_NUM);
+	}
+	ilm_drive_snapshot_put(idx);
+}
+
 int ilm_update_drive_multi_paths(struct ilm_lock *lock)
 {
-	int i, j, retry = 0;
+	int i, j;
 	struct ilm_drive *drive;
 
 	/*
@@ -91,57 +241,34 @@ int ilm_update_drive_multi_paths(struct ilm_lock *lock)
 	if (lock->drive_version == ilm_drive_list_version())
 		return 0;
 
-	do {
-		if (retry >= 10) {
-			ilm_log_err("%s: retries > 10 times for but fails",
-				    __func__);
-			return -1;
-		}
-
-		/* Update to the latest drive version */
-		lock->drive_version = ilm_drive_list_version();
-
-		for (i = 0; i < lock->good_drive_num; i++) {
-			drive = &lock->drive[i];
-
-			/* Cleanup for old pathes */
-			for (j = 0; j < drive->path_num; j++) {
-				free(drive->path[j]);
-				drive->path[j] = NULL;
-			}
-
-			drive->path_num = ilm_drive_get_all_sgs(drive->wwn,
-				drive->path, IDM_DRIVE_PATH_NUM);
+	for (i = 0; i < lock->good_drive_num; i++) {
+		drive = &lock->drive[i];
 
-			/* Failed to retrieve any SG path for drive, refresh block list and retry */
-			if (!drive->path_num) {
-				ilm_drive_list_refresh();
-				drive->path_num = ilm_drive_get_all_sgs(drive->wwn,
-					drive->path, IDM_DRIVE_PATH_NUM);
-			}
+		/* Cleanup for old pathes */
+		for (j = 0; j < drive->path_num; j++) {
+			free(drive->path[j]);
+			drive->path[j] = NULL;
 		}
+		drive->path_num = 0;
+	}
 
-		ilm_log_warn("Detects drive path is altered, update!");
+	ilm_load_drive_multi_paths(lock, lock->drive, lock->good_drive_num);
 
-		for (i = 0; i < lock->good_drive_num; i++) {
-			drive = &lock->drive[i];
+	ilm_log_warn("Detects drive path is altered, update!");
 
-			ilm_log_warn(" Drive %d WWN: 0x%lx", i, drive->wwn);
+	for (i = 0; i < lock->good_drive_num; i++) {
+		drive = &lock->drive[i];
 
-			if (!drive->path_num) {
-				ilm_log_warn("  Cannot find any known path");
-				continue;
-			}
+		ilm_log_warn(" Drive %d WWN: 0x%lx", i, drive->wwn);
 
-			for (j = 0; j < drive->path_num; j++)
-				ilm_log_warn("  Path [%d] is %s", j, drive->path[j]);
+		if (!drive->path_num) {
+			ilm_log_warn("  Cannot find any known path");
+			continue;
 		}
 
-	/*
-	 * It's possible that the drive list is altered during updating,
-	 * check the version number and if doesn't match, try it again.
-	 */
-	} while (lock->drive_version != ilm_drive_list_version());
+		for (j = 0; j < drive->path_num; j++)
+			ilm_log_warn("  Path [%d] is %s", j, drive->path[j]);
+	}
 
 	return 0;
 }
@@ -150,51 +277,42 @@ static int ilm_insert_drive_multi_paths(struct ilm_lock *lock,
 					unsigned long *wwn,
 					int wwn_num)
 {
-	int i, j;
 	struct ilm_drive *drive;
-	int found;
-
-	lock->drive_version = ilm_drive_list_version();
+	int i, j, num = 0;
 
 	for (i = 0; i < wwn_num; i++) {
-
-		/* Check if the drive paths have been initialized yet */
-		found = 0;
-		for (j = 0; j < lock->good_drive_num; j++) {
-			/* Find a matched drive */
-			if (lock->drive[j].wwn == wwn[i]) {
-				found = 1;
-				break;
-			}
-		}
-
 		/*
 		 * The drive has been initialized in previous loop,
 		 * continue to serve next WWN.
 		 */
-		if (found)
+		for (j = 0; j < num; j++) {
+			if (lock->drive[j].wwn == wwn[i])
+				break;
+		}
+		if (j < num)
 			continue;
 
-		drive = &lock->drive[lock->good_drive_num];
-		drive->wwn = wwn[i];
-		drive->path_num = ilm_drive_get_all_sgs(drive->wwn, drive->path,
-						       IDM_DRIVE_PATH_NUM);
+		lock->drive[num].wwn = wwn[i];
+		lock->drive[num].path_num = 0;
+		num++;
+	}
 
-		/* Failed to retrieve any SG path for drive, refresh block list and retry */
-		if (!drive->path_num) {
-			ilm_drive_list_refresh();
-			drive->path_num = ilm_drive_get_all_sgs(drive->wwn,
-				drive->path, IDM_DRIVE_PATH_NUM);
-		}
+	ilm_load_drive_multi_paths(lock, lock->drive, num);
 
-		if (drive->path_num) {
-			drive->index = lock->good_drive_num;
-			lock->good_drive_num++;
-		} else {
+	/* Compact the drives with known paths to the head of array */
+	for (i = 0; i < num; i++) {
+		if (!lock->drive[i].path_num) {
 			ilm_log_warn("Drive with WWN 0x%lx failed to parse sgs",
-				     drive->wwn);
+				     lock->drive[i].wwn);
 			lock->fail_drive_num++;
+			continue;
 		}
+
+		drive = &lock->drive[lock->good_drive_num];
+		if (drive != &lock->drive[i])
+			*drive = lock->drive[i];
+		drive->index = lock->good_drive_num;
+		lock->good_drive_num++;
 	}
 
 	ilm_log_dbg("Final info for drives:");
@@ -248,11 +366,39 @@ try_cached_dev_map:
 	return ilm_find_cached_device_mapping(path, wwn);
 }
 
-static struct ilm_lock *ilm_alloc(struct ilm_cmd *cmd,
-				  struct ilm_lockspace *ls,
-				  int drive_num, int *pos)
+/*
+ * Fill in the drives of a new lock from their WWNs, the drives which have
+ * been failed to resolve must be counted in fail_drive_num by the caller.
+ */
+static int ilm_init_drives(struct ilm_lock *lock, unsigned long *wwn_arr,
+			   int wwn_num)
+{
+	int ret;
+
+	ret = ilm_sort_drive_uuid(wwn_arr, wwn_num);
+	if (ret < 0)
+		return ret;
+
+	ret = ilm_insert_drive_multi_paths(lock, wwn_arr, wwn_num);
+	if (ret < 0)
+		return ret;
+
+	lock->total_drive_num = lock->good_drive_num + lock->fail_drive_num;
+
+	/*
+	 * If good drives is less than or equal the half of drives,
+	 * it's no chance to achieve majority.  Directly return failure
+	 * for this case.
+	 */
+	if (lock->good_drive_num <= (lock->total_drive_num >> 1))
+		return -EIO;
+
+	return 0;
+}
+
+static struct ilm_lock *ilm_alloc(struct ilm_lockspace *ls, char *lock_id,
+				  char **path, int drive_num)
 {
-	char path[PATH_MAX];
 	struct ilm_lock *lock;
 	struct ilm_drive *drive;
 	int ret, i, j, copied = 0, failed = 0;
@@ -277,17 +423,10 @@ static struct ilm_lock *ilm_alloc(struct ilm_cmd *cmd,
 
 	INIT_LIST_HEAD(&lock->list);
 	pthread_mutex_init(&lock->mutex, NULL);
+	memcpy(lock->id, lock_id, IDM_LOCK_ID_LEN);
 
 	for (i = 0; i < drive_num; i++) {
-		ret = recv(cmd->cl->fd, &path, sizeof(path), MSG_WAITALL);
-		if (ret <= 0) {
-			ilm_log_err("Fail to read out drive path\n");
-			goto drive_fail;
-		}
-
-		*pos += ret;
-
-		sg_path = ilm_find_sg_path(path, &wwn);
+		sg_path = ilm_find_sg_path(path[i], &wwn);
 		if (!sg_path) {
 			failed++;
 			continue;
@@ -296,34 +435,28 @@ static struct ilm_lock *ilm_alloc(struct ilm_cmd *cmd,
 		wwn_arr[copied] = wwn;
 		copied++;
 
-		ilm_add_cached_device_mapping(path, sg_path, wwn);
+		ilm_add_cached_device_mapping(path[i], sg_path, wwn);
+		free(sg_path);
 	}
 
 	lock->fail_drive_num = failed;
 
-	ret = ilm_sort_drive_uuid(wwn_arr, copied);
-	if (ret < 0)
-		goto drive_fail;
-
-	ret = ilm_insert_drive_multi_paths(lock, wwn_arr, copied);
+	ret = ilm_init_drives(lock, wwn_arr, copied);
 	if (ret < 0)
 		goto drive_fail;
 
-	lock->total_drive_num = lock->good_drive_num + lock->fail_drive_num;
+	/* The lock is owned by the caller if it's not in any lockspace */
+	if (ls) {
+		/* Can be cancelled once it's visible in the lockspace */
+		lock->acquiring = 1;
 
-	/*
-	 * If good drives is less than or equal the half of drives,
-	 * it's no chance to achieve majority.  Directly return failure
-	 * for this case.
-	 */
-	if (lock->good_drive_num <= (lock->total_drive_num >> 1))
-		goto drive_fail;
+		ret = ilm_lockspace_add_lock(ls, lock);
+		if (ret < 0)
+			goto drive_fail;
 
-	ret = ilm_lockspace_add_lock(ls, lock);
-	if (ret < 0)
-		goto drive_fail;
+		lock->raid_th = ls->raid_thd;
+	}
 
-	lock->raid_th = ls->raid_thd;
 	free(wwn_arr);
 	return lock;
 
@@ -339,15 +472,75 @@ drive_fail:
 	return NULL;
 }
 
-static int ilm_free(struct ilm_lockspace *ls, struct ilm_lock *lock)
+/*
+ * Allocate a lock which uses the same drives as @src, the drives have
+ * been resolved for @src so this skips all the device lookups.
+ */
+static struct ilm_lock *ilm_clone(struct ilm_lockspace *ls,
+				  struct ilm_lock *src, char *lock_id)
 {
+	struct ilm_lock *lock;
 	struct ilm_drive *drive;
-	int i, j;
-	int ret;
+	int ret, i, j;
 
-	ret = ilm_lockspace_del_lock(ls, lock);
-	if (ret < 0)
-		return ret;
+	lock = malloc(sizeof(struct ilm_lock));
+	if (!lock) {
+	        ilm_log_err("No spare memory to allocate lock\n");
+		return NULL;
+	}
+	memset(lock, 0, sizeof(struct ilm_lock));
+
+	INIT_LIST_HEAD(&lock->list);
+	pthread_mutex_init(&lock->mutex, NULL);
+	memcpy(lock->id, lock_id, IDM_LOCK_ID_LEN);
+
+	lock->fail_drive_num = src->fail_drive_num;
+	lock->total_drive_num = src->total_drive_num;
+	lock->drive_version = src->drive_version;
+
+	for (i = 0; i < src->good_drive_num; i++) {
+		drive = &lock->drive[i];
+		drive->index = i;
+		drive->wwn = src->drive[i].wwn;
+
+		for (j = 0; j < src->drive[i].path_num; j++) {
+			drive->path[j] = strdup(src->drive[i].path[j]);
+			if (!drive->path[j])
+				goto drive_fail;
+			drive->path_num++;
+		}
+
+		lock->good_drive_num++;
+	}
+
+	/* The lock is owned by the caller if it's not in any lockspace */
+	if (ls) {
+		lock->acquiring = 1;
+
+		ret = ilm_lockspace_add_lock(ls, lock);
+		if (ret < 0)
+			goto drive_fail;
+
+		lock->raid_th = ls->raid_thd;
+	}
+
+	return lock;
+
+drive_fail:
+	for (i = 0; i <= lock->good_drive_num && i < src->good_drive_num; i++) {
+		drive = &lock->drive[i];
+		for (j = 0; j < drive->path_num; j++)
+			free(drive->path[j]);
+	}
+
+	free(lock);
+	return NULL;
+}
+
+static void ilm_destroy(struct ilm_lock *lock)
+{
+	struct ilm_drive *drive;
+	int i, j;
 
 	for (i = 0; i < lock->good_drive_num; i++) {
 		drive = &lock->drive[i];
@@ -356,9 +549,61 @@ static int ilm_free(struct ilm_lockspace *ls, struct ilm_lock *lock)
 	}
 
 	free(lock);
+}
+
+static int ilm_free(struct ilm_lockspace *ls, struct ilm_lock *lock)
+{
+	int ret;
+
+	ret = ilm_lockspace_del_lock(ls, lock);
+	if (ret < 0)
+		return ret;
+
+	ilm_destroy(lock);
 	return 0;
 }
 
+/*
+ * Allocate a lock which isn't in any lockspace from the WWNs recorded in
+ * the lock journal, the drives which aren't found count as failed drives.
+ */
+static struct ilm_lock *ilm_alloc_wwn(char *lock_id, uint64_t *wwn,
+				      int wwn_num, int total_drive_num)
+{
+	struct ilm_lock *lock;
+	unsigned long *wwn_arr;
+	int i;
+
+	lock = malloc(sizeof(struct ilm_lock));
+	if (!lock) {
+		ilm_log_err("No spare memory to allocate lock\n");
+		return NULL;
+	}
+	memset(lock, 0, sizeof(struct ilm_lock));
+
+	wwn_arr = malloc(sizeof(unsigned long) * (wwn_num ? wwn_num : 1));
+	if (!wwn_arr) {
+		free(lock);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&lock->list);
+	pthread_mutex_init(&lock->mutex, NULL);
+	memcpy(lock->id, lock_id, IDM_LOCK_ID_LEN);
+
+	for (i = 0; i < wwn_num; i++)
+		wwn_arr[i] = wwn[i];
+	lock->fail_drive_num = total_drive_num - wwn_num;
+
+	if (ilm_init_drives(lock, wwn_arr, wwn_num) < 0) {
+		ilm_destroy(lock);
+		lock = NULL;
+	}
+
+	free(wwn_arr);
+	return lock;
+}
+
 static void ilm_lock_dump(const char *str, struct ilm_lock *lock)
 {
 	int i, j;
@@ -379,33 +624,1146 @@ static void ilm_lock_dump(const char *str, struct ilm_lock *lock)
 
 	ilm_log_warn("Lock mode=%d", lock->mode);
 
-	ilm_log_array_warn("Lock ID", lock->id, 64);
+	ilm_log_array_warn("Lock ID", lock->id, 64);
+
+	ilm_id_write_format(lock->id, uuid_str, sizeof(uuid_str));
+	if (strlen(uuid_str))
+		ilm_log_warn("lock ID (VG): %s", uuid_str);
+	else
+		ilm_log_warn("lock ID (VG): Empty string");
+
+	ilm_id_write_format(lock->id + 32, uuid_str, sizeof(uuid_str));
+	if (strlen(uuid_str))
+		ilm_log_warn("lock ID (LV): %s", uuid_str);
+	else
+		ilm_log_warn("lock ID (LV): Empty string");
+
+	ilm_log_warn(">>>>> Lock dump: %s >>>>>", str);
+}
+
+/*
+ * Local shared lock coalescing
+ *
+ * Lockspaces on this host which don't assign their own host ID all hold
+ * shareable locks on behalf of the same node, so there is no reason to
+ * touch the drives for every one of them.  The first holder acquires the
+ * IDM with a host ID shared by the daemon, later holders only take a
+ * reference, and the last holder releases the IDM.  Every lockspace gets
+ * a proxy lock without drives which points to the table entry; the
+ * renewal is issued once per entry however many proxies refer to it.
+ */
+#define ILM_SHARED_LOCK_HASH_SIZE	256
+#define ILM_SHARED_LOCK_RENEW_INTERVAL	1000	/* milliseconds */
+
+#define ILM_SHARED_LOCK_ACQUIRING	0
+#define ILM_SHARED_LOCK_HELD		1
+#define ILM_SHARED_LOCK_BUSY		2	/* Converting or releasing */
+
+struct ilm_shared_lock {
+	struct list_head list;
+	char id[IDM_LOCK_ID_LEN];
+	int state;
+	int refcount;
+	uint64_t last_renewal;		/* Last renewal attempt */
+	struct ilm_lock *lock;		/* Owns the drives */
+	struct ilm_lock *owner;		/* Proxy acquiring the IDM */
+	uint64_t path_sig;		/* Drives of the IDM */
+	uint64_t timeout;		/* Lease timeout of the IDM */
+};
+
+static struct list_head shared_hash[ILM_SHARED_LOCK_HASH_SIZE];
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shared_cond = PTHREAD_COND_INITIALIZER;
+static struct _raid_thread *shared_raid_thd;
+static char shared_host_id[IDM_HOST_ID_LEN];
+
+static struct list_head *ilm_shared_lock_bucket(char *lock_id)
+{
+	unsigned int hash = 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < IDM_LOCK_ID_LEN; i++)
+		hash = (hash ^ (unsigned char)lock_id[i]) * 16777619u;
+
+	return &shared_hash[hash % ILM_SHARED_LOCK_HASH_SIZE];
+}
+
+static int ilm_shared_lock_init_unsafe(void)
+{
+	pthread_condattr_t attr;
+	int i, ret;
+
+	if (shared_raid_thd)
+		return 0;
+
+	ret = idm_raid_thread_create(&shared_raid_thd);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < ILM_SHARED_LOCK_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&shared_hash[i]);
+
+	/* Nobody waits yet, so switch the waits to the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&shared_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* PID part is zero so it never clashes with any lockspace */
+	memset(shared_host_id, 0, IDM_HOST_ID_LEN);
+	memcpy(shared_host_id + 16, &ilm_uuid, sizeof(uuid_t));
+	return 0;
+}
+
+static struct ilm_shared_lock *ilm_shared_lock_find_unsafe(char *lock_id)
+{
+	struct ilm_shared_lock *shared;
+
+	list_for_each_entry(shared, ilm_shared_lock_bucket(lock_id), list) {
+		if (!memcmp(shared->id, lock_id, IDM_LOCK_ID_LEN))
+			return shared;
+	}
+
+	return NULL;
+}
+
+/*
+ * Wait for the local holder to settle the lock.  Like the requesters
+ * queued for the drives, give up with -ETIMEDOUT when the deadline
+ * expires, or -ECANCELED once the acquisition is cancelled.
+ */
+static int ilm_shared_lock_wait(struct ilm_lock *proxy, uint64_t timeout)
+{
+	uint64_t now, usec;
+	struct timespec ts;
+
+	if (__atomic_load_n(&proxy->cancelled, __ATOMIC_ACQUIRE))
+		return -ECANCELED;
+
+	now = ilm_curr_time();
+	if (now >= timeout)
+		return -ETIMEDOUT;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	usec = (timeout - now) * 1000 + ts.tv_nsec / 1000;
+	ts.tv_sec += usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+
+	pthread_cond_timedwait(&shared_cond, &shared_mutex, &ts);
+	return 0;
+}
+
+/*
+ * Take a reference on the shareable lock for @proxy, the IDM is only
+ * acquired when there is no local holder yet.  Return -EBUSY if a local
+ * holder has converted the lock to exclusive mode, or -EINVAL if it
+ * holds the lock on other drives or with another timeout.
+ */
+static int ilm_shared_lock_get(struct ilm_lock *proxy,
+			       struct ilm_lock_payload *payload, char **path,
+			       uint64_t path_sig, int deadline,
+			       struct ilm_shared_lock **shared_out)
+{
+	uint64_t timeout = ilm_curr_time() + idm_raid_lock_deadline(deadline);
+	struct ilm_shared_lock *shared;
+	struct ilm_lock *lock;
+	int ret;
+
+	pthread_mutex_lock(&shared_mutex);
+
+	ret = ilm_shared_lock_init_unsafe();
+	if (ret < 0)
+		goto out;
+
+retry:
+	shared = ilm_shared_lock_find_unsafe(payload->lock_id);
+	if (shared) {
+		if (shared->path_sig != path_sig ||
+		    shared->timeout != payload->timeout) {
+			ilm_log_err("%s: drives or timeout mismatch shared lock",
+				    __func__);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		if (shared->state != ILM_SHARED_LOCK_HELD) {
+			ret = ilm_shared_lock_wait(proxy, timeout);
+			if (ret < 0)
+				goto out;
+			goto retry;
+		}
+
+		if (shared->lock->mode != IDM_MODE_SHAREABLE) {
+			ret = -EBUSY;
+			goto out;
+		}
+
+		shared->refcount++;
+		*shared_out = shared;
+		goto out;
+	}
+
+	shared = malloc(sizeof(struct ilm_shared_lock));
+	if (!shared) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(shared, 0, sizeof(struct ilm_shared_lock));
+
+	memcpy(shared->id, payload->lock_id, IDM_LOCK_ID_LEN);
+	shared->state = ILM_SHARED_LOCK_ACQUIRING;
+	shared->refcount = 1;
+	shared->owner = proxy;
+	shared->path_sig = path_sig;
+	shared->timeout = payload->timeout;
+	list_add(&shared->list, ilm_shared_lock_bucket(payload->lock_id));
+	pthread_mutex_unlock(&shared_mutex);
+
+	lock = ilm_alloc(NULL, payload->lock_id, path, payload->drive_num);
+	if (!lock) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	lock->raid_th = shared_raid_thd;
+	lock->mode = IDM_MODE_SHAREABLE;
+	lock->timeout = payload->timeout;
+
+	/* Cancelled with the proxy, see ilm_shared_lock_cancel() */
+	lock->acquiring = 1;
+
+	pthread_mutex_lock(&shared_mutex);
+	shared->lock = lock;
+	if (__atomic_load_n(&proxy->cancelled, __ATOMIC_ACQUIRE))
+		lock->cancelled = 1;
+	pthread_mutex_unlock(&shared_mutex);
+
+	ilm_lock_dump("shared_lock_acquire", lock);
+
+	ilm_req_trace_mutex_lock(&lock->mutex);
+	ret = idm_raid_lock(lock, shared_host_id, deadline);
+	if (!ret)
+		lock->last_renewal_success = ilm_curr_time();
+	pthread_mutex_unlock(&lock->mutex);
+
+	if (ret) {
+	        ilm_log_err("Fail to acquire shared raid lock %d\n", ret);
+		goto fail;
+	}
+
+	pthread_mutex_lock(&shared_mutex);
+	shared->last_renewal = lock->last_renewal_success;
+	shared->state = ILM_SHARED_LOCK_HELD;
+	shared->owner = NULL;
+	pthread_cond_broadcast(&shared_cond);
+	*shared_out = shared;
+out:
+	pthread_mutex_unlock(&shared_mutex);
+	return ret;
+
+fail:
+	/* Waiters will retry to acquire the lock by themselves */
+	pthread_mutex_lock(&shared_mutex);
+	list_del(&shared->list);
+	pthread_cond_broadcast(&shared_cond);
+	pthread_mutex_unlock(&shared_mutex);
+
+	if (shared->lock)
+		ilm_destroy(shared->lock);
+	free(shared);
+	return ret;
+}
+
+/**
+ * ilm_shared_lock_cancel - Cancel a coalesced shareable acquisition
+ * @proxy:	Lock of the lockspace which has been cancelled.
+ *
+ * The proxy either waits for the local holder, which is woken up to see
+ * the cancellation, or is the one acquiring the IDM for all local holders,
+ * whose acquisition on drives is cancelled then.  The other waiters retry
+ * by themselves.
+ */
+void ilm_shared_lock_cancel(struct ilm_lock *proxy)
+{
+	struct ilm_shared_lock *shared;
+
+	pthread_mutex_lock(&shared_mutex);
+
+	if (shared_raid_thd) {
+		shared = ilm_shared_lock_find_unsafe(proxy->id);
+		if (shared && shared->owner == proxy && shared->lock)
+			idm_raid_lock_cancel(shared->lock);
+	}
+
+	pthread_cond_broadcast(&shared_cond);
+	pthread_mutex_unlock(&shared_mutex);
+}
+
+/* Drop the reference, the last holder releases the IDM */
+static int ilm_shared_lock_put(struct ilm_shared_lock *shared)
+{
+	struct ilm_lock *lock = shared->lock;
+	int ret;
+
+	pthread_mutex_lock(&shared_mutex);
+	if (--shared->refcount) {
+		pthread_mutex_unlock(&shared_mutex);
+		return 0;
+	}
+
+	/* Block new holders until the IDM has been released */
+	shared->state = ILM_SHARED_LOCK_BUSY;
+	pthread_mutex_unlock(&shared_mutex);
+
+	ilm_lock_dump("shared_lock_release", lock);
+
+	ilm_req_trace_mutex_lock(&lock->mutex);
+	ret = idm_raid_unlock(lock, shared_host_id);
+	/* Blind destroy, see ilm_lock_release() */
+	idm_raid_destroy_lock(lock, shared_host_id);
+	pthread_mutex_unlock(&lock->mutex);
+
+	pthread_mutex_lock(&shared_mutex);
+	list_del(&shared->list);
+	pthread_cond_broadcast(&shared_cond);
+	pthread_mutex_unlock(&shared_mutex);
+
+	ilm_destroy(lock);
+	free(shared);
+	return ret;
+}
+
+/*
+ * Only the sole holder is allowed to convert the lock mode, otherwise
+ * it would change the mode for other lockspaces as well.
+ */
+static int ilm_shared_lock_convert(struct ilm_lock *proxy, int mode)
+{
+	struct ilm_shared_lock *shared = proxy->shared;
+	struct ilm_lock *lock = shared->lock;
+	int ret;
+
+	pthread_mutex_lock(&shared_mutex);
+	if (shared->refcount > 1) {
+		ilm_log_err("Fail to convert lock with %d local holders\n",
+			    shared->refcount);
+		pthread_mutex_unlock(&shared_mutex);
+		return -EBUSY;
+	}
+	shared->state = ILM_SHARED_LOCK_BUSY;
+	pthread_mutex_unlock(&shared_mutex);
+
+	ilm_req_trace_mutex_lock(&lock->mutex);
+	ret = idm_raid_convert_lock(lock, shared_host_id, mode);
+	if (ret) {
+	        ilm_log_err("Fail to convert raid lock %d mode %d vs %d\n",
+			    ret, lock->mode, mode);
+	} else {
+		lock->mode = mode;
+		proxy->mode = mode;
+	}
+	pthread_mutex_unlock(&lock->mutex);
+
+	pthread_mutex_lock(&shared_mutex);
+	shared->state = ILM_SHARED_LOCK_HELD;
+	pthread_cond_broadcast(&shared_cond);
+	pthread_mutex_unlock(&shared_mutex);
+	return ret;
+}
+
+/*
+ * Every lockspace thread calls this for its proxy, the IDM is renewed at
+ * most once per interval.  Return the time of the last renewal success.
+ */
+static uint64_t ilm_shared_lock_renew(struct ilm_shared_lock *shared)
+{
+	struct ilm_lock *lock = shared->lock;
+	uint64_t now, time;
+
+	pthread_mutex_lock(&lock->mutex);
+
+	now = ilm_curr_time();
+	if (now >= shared->last_renewal + ILM_SHARED_LOCK_RENEW_INTERVAL) {
+		shared->last_renewal = now;
+		if (!idm_raid_renew_lock(lock, shared_host_id))
+			lock->last_renewal_success = ilm_curr_time();
+	}
+
+	time = lock->last_renewal_success;
+	pthread_mutex_unlock(&lock->mutex);
+	return time;
+}
+
+static int ilm_shared_lock_acquire(struct ilm_lockspace *ls,
+				   struct ilm_lock_payload *payload,
+				   char **path, uint64_t path_sig,
+				   int deadline)
+{
+	struct ilm_shared_lock *shared;
+	struct ilm_lock *lock;
+	int ret;
+
+	lock = malloc(sizeof(struct ilm_lock));
+	if (!lock) {
+	        ilm_log_err("No spare memory to allocate lock\n");
+		return -ENOMEM;
+	}
+	memset(lock, 0, sizeof(struct ilm_lock));
+
+	INIT_LIST_HEAD(&lock->list);
+	pthread_mutex_init(&lock->mutex, NULL);
+	memcpy(lock->id, payload->lock_id, IDM_LOCK_ID_LEN);
+	lock->mode = IDM_MODE_SHAREABLE;
+	lock->timeout = payload->timeout;
+
+	/* Can be cancelled while it waits for the shared lock */
+	lock->acquiring = 1;
+
+	ret = ilm_lockspace_add_lock(ls, lock);
+	if (ret < 0) {
+		pthread_mutex_destroy(&lock->mutex);
+		free(lock);
+		return ret;
+	}
+
+	ret = ilm_shared_lock_get(lock, payload, path, path_sig, deadline,
+				  &shared);
+	if (ret) {
+		ilm_lockspace_del_lock(ls, lock);
+		pthread_mutex_destroy(&lock->mutex);
+		free(lock);
+		return ret;
+	}
+
+	lock->shared = shared;
+	ilm_lockspace_start_lock(ls, lock, ilm_curr_time());
+	return 0;
+}
+
+/*
+ * Cache for the released locks.  When the grace period is set with the
+ * option "-C", releasing a lock which isn't coalesced with other local
+ * holders doesn't release the IDM on drives; the lock is parked in the
+ * cache and renewed by the cache thread, so if the same host acquires it
+ * again with the same mode and drives, it is handed back without any
+ * drive I/O.  The IDM is released when the grace period expires, or as
+ * soon as another host requests it with the companion mutex.
+ *
+ * Locks stay in the cache for a short time only, so a list in the order
+ * of expiry is sufficient.
+ */
+#define ILM_LOCK_CACHE_POLL_INTERVAL	200	/* milliseconds */
+#define ILM_LOCK_CACHE_RENEW_INTERVAL	1000	/* milliseconds */
+
+struct ilm_cached_lock {
+	struct list_head list;
+	char host_id[IDM_HOST_ID_LEN];
+	uint64_t expire;
+	uint64_t last_check;		/* Last check for release request */
+	uint64_t last_renewal;		/* Last renewal attempt */
+	int busy;			/* Accessed by the cache thread */
+	struct ilm_lock *lock;
+};
+
+static struct list_head cache_list = LIST_HEAD_INIT(cache_list);
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond;
+static pthread_t cache_thd;
+static int cache_thd_done;
+static struct _raid_thread *cache_raid_thd;
+static int cache_replayed;		/* Holds the locks from the journal */
+
+static uint64_t ilm_lock_path_sig(char **path, int drive_num)
+{
+	uint64_t hash = 14695981039346656037ULL;	/* FNV-1a */
+	unsigned char *c;
+	int i;
+
+	for (i = 0; i < drive_num; i++) {
+		/* Include the terminator to separate paths */
+		c = (unsigned char *)path[i];
+		do {
+			hash = (hash ^ *c) * 1099511628211ULL;
+		} while (*c++);
+	}
+
+	return hash;
+}
+
+static struct ilm_cached_lock *ilm_lock_cache_find_unsafe(char *lock_id)
+{
+	struct ilm_cached_lock *cached;
+
+	list_for_each_entry(cached, &cache_list, list) {
+		if (!memcmp(cached->lock->id, lock_id, IDM_LOCK_ID_LEN))
+			return cached;
+	}
+
+	return NULL;
+}
+
+/* Release the IDM on drives, the caller frees the cached lock */
+static void ilm_lock_cache_unlock(struct ilm_cached_lock *cached)
+{
+	struct ilm_lock *lock = cached->lock;
+
+	ilm_lock_dump("lock_cache_release", lock);
+
+	pthread_mutex_lock(&lock->mutex);
+	idm_raid_unlock(lock, cached->host_id);
+	/* Blind destroy, see ilm_lock_release() */
+	idm_raid_destroy_lock(lock, cached->host_id);
+	pthread_mutex_unlock(&lock->mutex);
+
+	ilm_journal_del(lock, cached->host_id);
+}
+
+static void ilm_lock_cache_free(struct ilm_cached_lock *cached)
+{
+	ilm_destroy(cached->lock);
+	free(cached);
+}
+
+/* Return 1 if the cached lock should be released */
+static int ilm_lock_cache_check(struct ilm_cached_lock *cached, uint64_t now)
+{
+	struct ilm_lock *lock = cached->lock;
+	int release = 0;
+
+	if (now >= cached->expire)
+		return 1;
+
+	pthread_mutex_lock(&lock->mutex);
+
+	if (idm_raid_release_requested(lock, cached->host_id)) {
+		ilm_log_dbg("%s: requested by other hosts", __func__);
+		release = 1;
+	} else if (now >= cached->last_renewal + ILM_LOCK_CACHE_RENEW_INTERVAL) {
+		cached->last_renewal = now;
+		if (idm_raid_renew_lock(lock, cached->host_id)) {
+			ilm_log_warn("%s: fail to renew cached lock", __func__);
+			release = 1;
+		} else {
+			lock->last_renewal_success = ilm_curr_time();
+		}
+	}
+
+	pthread_mutex_unlock(&lock->mutex);
+	return release;
+}
+
+/*
+ * Find a cached lock which is due for checking; otherwise return NULL and
+ * the time of the next due in @next, @next is zero if the cache is empty.
+ */
+static struct ilm_cached_lock *ilm_lock_cache_due_unsafe(uint64_t now,
+							 uint64_t *next)
+{
+	struct ilm_cached_lock *cached;
+	uint64_t due;
+
+	*next = 0;
+	list_for_each_entry(cached, &cache_list, list) {
+		if (cached->busy)
+			continue;
+
+		due = cached->last_check + ILM_LOCK_CACHE_POLL_INTERVAL;
+		if (cached->expire < due)
+			due = cached->expire;
+
+		if (now >= due)
+			return cached;
+
+		if (!*next || due < *next)
+			*next = due;
+	}
+
+	return NULL;
+}
+
+static void ilm_lock_cache_wait_unsafe(uint64_t now, uint64_t next)
+{
+	struct timespec ts;
+	uint64_t nsec;
+
+	if (!next) {
+		pthread_cond_wait(&cache_cond, &cache_mutex);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	nsec = ts.tv_nsec + (next - now) * 1000000;
+	ts.tv_sec += nsec / 1000000000;
+	ts.tv_nsec = nsec % 1000000000;
+	pthread_cond_timedwait(&cache_cond, &cache_mutex, &ts);
+}
+
+static void *ilm_lock_cache_thread(void *data __maybe_unused)
+{
+	struct ilm_cached_lock *cached;
+	uint64_t now, next;
+	int release;
+
+	pthread_mutex_lock(&cache_mutex);
+
+	while (!cache_thd_done) {
+		now = ilm_curr_time();
+
+		cached = ilm_lock_cache_due_unsafe(now, &next);
+		if (!cached) {
+			ilm_lock_cache_wait_unsafe(now, next);
+			continue;
+		}
+
+		/* Acquirers wait for the busy lock rather than racing with it */
+		cached->busy = 1;
+		pthread_mutex_unlock(&cache_mutex);
+
+		release = ilm_lock_cache_check(cached, now);
+		if (release)
+			ilm_lock_cache_unlock(cached);
+
+		pthread_mutex_lock(&cache_mutex);
+		cached->busy = 0;
+		cached->last_check = ilm_curr_time();
+		if (release)
+			list_del(&cached->list);
+		pthread_cond_broadcast(&cache_cond);
+
+		if (release) {
+			pthread_mutex_unlock(&cache_mutex);
+			ilm_lock_cache_free(cached);
+			pthread_mutex_lock(&cache_mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&cache_mutex);
+	return NULL;
+}
+
+static int ilm_lock_cache_init_unsafe(void)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	if (cache_raid_thd)
+		return 0;
+
+	ret = idm_raid_thread_create(&cache_raid_thd);
+	if (ret < 0)
+		return ret;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cache_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&cache_thd, NULL, ilm_lock_cache_thread, NULL);
+	if (ret) {
+		ilm_log_err("Fail to create lock cache thread");
+		pthread_cond_destroy(&cache_cond);
+		idm_raid_thread_free(cache_raid_thd);
+		cache_raid_thd = NULL;
+		return -ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Move the released lock from the lockspace into the cache, the lock
+ * renewal must have been stopped by the caller.
+ */
+static int ilm_lock_cache_add(struct ilm_lockspace *ls,
+			      struct ilm_lock *lock, uint64_t time)
+{
+	struct ilm_cached_lock *cached;
+	int ret;
+
+	cached = malloc(sizeof(struct ilm_cached_lock));
+	if (!cached)
+		return -ENOMEM;
+	memset(cached, 0, sizeof(struct ilm_cached_lock));
+
+	pthread_mutex_lock(&cache_mutex);
+
+	ret = ilm_lock_cache_init_unsafe();
+	if (ret < 0)
+		goto fail;
+
+	ret = ilm_lockspace_del_lock(ls, lock);
+	if (ret < 0)
+		goto fail;
+
+	ilm_lock_dump("lock_cache_add", lock);
+
+	memcpy(cached->host_id, ls->host_id, IDM_HOST_ID_LEN);
+	cached->lock = lock;
+	cached->expire = ilm_curr_time() + env.lock_cache;
+	cached->last_check = ilm_curr_time();
+	cached->last_renewal = time;
+
+	lock->raid_th = cache_raid_thd;
+	lock->last_renewal_success = time;
+
+	list_add_tail(&cached->list, &cache_list);
+	pthread_cond_broadcast(&cache_cond);
+	pthread_mutex_unlock(&cache_mutex);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&cache_mutex);
+	free(cached);
+	return ret;
+}
+
+/*
+ * Take the lock from the cache and add it into the lockspace.  Return 0
+ * if the lock has been adopted, -ENOENT if it isn't cached.  A cached
+ * lock which doesn't match the request is released first, so the request
+ * won't race with the IDM held by the cache.
+ */
+static int ilm_lock_cache_adopt(struct ilm_lockspace *ls,
+				struct ilm_lock_payload *payload,
+				uint64_t path_sig)
+{
+	struct ilm_cached_lock *cached;
+	struct ilm_lock *lock;
+	int ret;
+
+	pthread_mutex_lock(&cache_mutex);
+
+retry:
+	cached = ilm_lock_cache_find_unsafe(payload->lock_id);
+	if (!cached) {
+		pthread_mutex_unlock(&cache_mutex);
+		return -ENOENT;
+	}
+
+	if (cached->busy) {
+		pthread_cond_wait(&cache_cond, &cache_mutex);
+		goto retry;
+	}
+
+	list_del(&cached->list);
+	pthread_mutex_unlock(&cache_mutex);
+
+	lock = cached->lock;
+
+	if (memcmp(cached->host_id, ls->host_id, IDM_HOST_ID_LEN) ||
+	    lock->mode != payload->mode ||
+	    lock->timeout != payload->timeout ||
+	    lock->path_sig != path_sig) {
+		ilm_lock_cache_unlock(cached);
+		ilm_lock_cache_free(cached);
+		return -ENOENT;
+	}
+
+	free(cached);
+
+	ret = ilm_lockspace_add_lock(ls, lock);
+	if (ret < 0) {
+		ilm_req_trace_mutex_lock(&lock->mutex);
+		idm_raid_unlock(lock, ls->host_id);
+		idm_raid_destroy_lock(lock, ls->host_id);
+		pthread_mutex_unlock(&lock->mutex);
+		ilm_journal_del(lock, ls->host_id);
+		ilm_destroy(lock);
+		return ret;
+	}
+
+	ilm_lock_dump("lock_cache_adopt", lock);
+
+	lock->raid_th = ls->raid_thd;
+	ilm_lockspace_start_lock(ls, lock, lock->last_renewal_success);
+	return 0;
+}
+
+/* Stop the cache thread and release all cached locks */
+void ilm_lock_cache_exit(void)
+{
+	struct ilm_cached_lock *cached, *tmp;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (!cache_raid_thd) {
+		pthread_mutex_unlock(&cache_mutex);
+		return;
+	}
+	cache_thd_done = 1;
+	pthread_cond_broadcast(&cache_cond);
+	pthread_mutex_unlock(&cache_mutex);
+
+	pthread_join(cache_thd, NULL);
+
+	list_for_each_entry_safe(cached, tmp, &cache_list, list) {
+		list_del(&cached->list);
+		ilm_lock_cache_unlock(cached);
+		ilm_lock_cache_free(cached);
+	}
+
+	idm_raid_thread_free(cache_raid_thd);
+	cache_raid_thd = NULL;
+}
+
+/*
+ * The locks adopted from the lock journal wait in the cache for their
+ * clients to acquire them again, which covers the restart of the clients.
+ * Other hosts only ask for the cached locks to be released when they run
+ * with the cache as well, so without "-C" the journaled locks are handed
+ * back right away rather than blocking the other hosts for the grace.
+ */
+#define ILM_LOCK_JOURNAL_GRACE		60000	/* milliseconds */
+
+static int ilm_lock_journal_cmp(const void *a, const void *b)
+{
+	const struct ilm_journal_rec *x = *(struct ilm_journal_rec **)a;
+	const struct ilm_journal_rec *y = *(struct ilm_journal_rec **)b;
+
+	return memcmp(x->host_id, y->host_id, IDM_HOST_ID_LEN);
+}
+
+/*
+ * Renew the journaled locks of one host ID with a single round, the
+ * renewed locks are moved into the cache and the others are released.
+ * Without the cache all of them are released.  Returns the number of the
+ * adopted locks.
+ */
+static int ilm_lock_journal_adopt(struct ilm_journal_rec **recs, int num,
+				  struct ilm_lock **locks, int *results)
+{
+	char *host_id = recs[0]->host_id;
+	struct ilm_cached_lock *cached;
+	struct ilm_lock *lock;
+	int i, n = 0, failed = 0, adopted = 0;
+	uint64_t now;
+
+	for (i = 0; i < num; i++) {
+		lock = ilm_alloc_wwn(recs[i]->lock_id, recs[i]->wwn,
+				     recs[i]->drive_num,
+				     recs[i]->total_drive_num);
+		if (!lock) {
+			ilm_log_array_warn("Drop journaled lock ID:",
+					   recs[i]->lock_id, IDM_LOCK_ID_LEN);
+			ilm_journal_forget(recs[i]->lock_id, host_id);
+			continue;
+		}
+
+		lock->mode = recs[i]->mode;
+		lock->timeout = recs[i]->timeout;
+		lock->path_sig = recs[i]->path_sig;
+		lock->journaled = 1;
+		lock->raid_th = cache_raid_thd;
+		locks[n++] = lock;
+	}
+
+	if (!n)
+		return 0;
+
+	if (!env.lock_cache) {
+		failed = n;
+		goto release;
+	}
+
+	idm_raid_renew_many(locks, n, host_id, results);
+
+	now = ilm_curr_time();
+	for (i = 0; i < n; i++) {
+		lock = locks[i];
+
+		cached = results[i] ? NULL : malloc(sizeof(*cached));
+		if (!cached) {
+			/* Released below together with the other failures */
+			locks[failed++] = lock;
+			continue;
+		}
+		memset(cached, 0, sizeof(*cached));
+
+		ilm_lock_dump("lock_journal_adopt", lock);
+
+		memcpy(cached->host_id, host_id, IDM_HOST_ID_LEN);
+		cached->lock = lock;
+		cached->expire = now + ILM_LOCK_JOURNAL_GRACE;
+		cached->last_check = now;
+		cached->last_renewal = now;
+		lock->last_renewal_success = now;
+
+		pthread_mutex_lock(&cache_mutex);
+		list_add_tail(&cached->list, &cache_list);
+		pthread_cond_broadcast(&cache_cond);
+		pthread_mutex_unlock(&cache_mutex);
+		adopted++;
+	}
+
+release:
+	/* Give up the drives which are still locked by the failed ones */
+	if (failed)
+		idm_raid_unlock_many(locks, failed, host_id, results);
+
+	for (i = 0; i < failed; i++) {
+		ilm_log_array_warn(env.lock_cache ?
+				   "Fail to adopt journaled lock ID:" :
+				   "Release journaled lock ID:",
+				   locks[i]->id, IDM_LOCK_ID_LEN);
+		ilm_journal_del(locks[i], host_id);
+		ilm_destroy(locks[i]);
+	}
+
+	return adopted;
+}
+
+/**
+ * ilm_lock_journal_replay - Adopt the locks held before the restart
+ *
+ * The locks recorded in the lock journal by the last run are renewed with
+ * one round per host ID rather than acquired again, and the renewed ones
+ * are put into the lock cache, so a client which acquires them again gets
+ * them back without any further drive I/O.  Without the lock cache ("-C")
+ * they are released instead, so they don't wait for their lease to expire.
+ *
+ * Returns the number of the adopted locks.
+ */
+int ilm_lock_journal_replay(void)
+{
+	struct ilm_journal_rec **recs;
+	struct ilm_lock **locks = NULL;
+	uint64_t start = ilm_curr_time();
+	int *results = NULL;
+	int num, ret, i, j, adopted = 0;
+
+	num = ilm_journal_recover(&recs);
+	if (!num)
+		return 0;
+
+	locks = malloc(sizeof(struct ilm_lock *) * num);
+	results = malloc(sizeof(int) * num);
+	if (!locks || !results) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	pthread_mutex_lock(&cache_mutex);
+	ret = ilm_lock_cache_init_unsafe();
+	pthread_mutex_unlock(&cache_mutex);
+	if (ret < 0)
+		goto out;
+
+	qsort(recs, num, sizeof(*recs), ilm_lock_journal_cmp);
+
+	for (i = 0; i < num; i = j) {
+		for (j = i + 1; j < num; j++) {
+			if (ilm_lock_journal_cmp(&recs[i], &recs[j]))
+				break;
+		}
+
+		adopted += ilm_lock_journal_adopt(&recs[i], j - i,
+						  locks, results);
+	}
+
+	if (adopted)
+		__atomic_store_n(&cache_replayed, 1, __ATOMIC_RELEASE);
+
+	ilm_log_warn("Adopted %d of %d journaled locks in %lu ms",
+		     adopted, num, ilm_curr_time() - start);
+	ret = adopted;
+
+out:
+	if (ret < 0) {
+		ilm_log_err("Fail to replay lock journal %d", ret);
+		for (i = 0; i < num; i++)
+			ilm_journal_forget(recs[i]->lock_id, recs[i]->host_id);
+	}
+
+	for (i = 0; i < num; i++)
+		free(recs[i]);
+	free(recs);
+	free(locks);
+	free(results);
+	return ret;
+}
+
+/*
+ * Querying a lock which isn't held by the lockspace needs a lock with the
+ * resolved drives.  Keep the resolved drive sets for a while, so repeated
+ * queries only clone the lock and skip all device lookups.  The entries
+ * are not refreshed when used, so the drives are resolved again after
+ * ILM_LOCK_SHELL_TTL in case the device paths have changed.
+ */
+#define ILM_LOCK_SHELL_TTL		10000	/* ms */
+#define ILM_LOCK_SHELL_MAX		32
+
+struct ilm_lock_shell {
+	struct list_head list;
+	uint64_t path_sig;
+	uint64_t expire;
+	struct ilm_lock *base;
+};
+
+static struct list_head shell_list = LIST_HEAD_INIT(shell_list);
+static pthread_mutex_t shell_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int shell_num;
+
+static void ilm_lock_shell_free(struct ilm_lock_shell *shell)
+{
+	ilm_destroy(shell->base);
+	free(shell);
+}
+
+/* Drop the expired entries, the newest entries are at the head */
+static struct ilm_lock_shell *ilm_lock_shell_find_unsafe(uint64_t path_sig,
+							 uint64_t now)
+{
+	struct ilm_lock_shell *shell, *tmp, *found = NULL;
+
+	list_for_each_entry_safe(shell, tmp, &shell_list, list) {
+		if (now >= shell->expire) {
+			list_del(&shell->list);
+			shell_num--;
+			ilm_lock_shell_free(shell);
+			continue;
+		}
+
+		if (!found && shell->path_sig == path_sig)
+			found = shell;
+	}
+
+	return found;
+}
+
+static void ilm_lock_shell_add(struct ilm_lock *base, uint64_t path_sig)
+{
+	struct ilm_lock_shell *shell, *last;
+
+	shell = malloc(sizeof(struct ilm_lock_shell));
+	if (!shell) {
+		ilm_destroy(base);
+		return;
+	}
+
+	shell->path_sig = path_sig;
+	shell->expire = ilm_curr_time() + ILM_LOCK_SHELL_TTL;
+	shell->base = base;
+
+	pthread_mutex_lock(&shell_mutex);
+
+	/* Another query has resolved the same drives at the meantime */
+	if (ilm_lock_shell_find_unsafe(path_sig, ilm_curr_time())) {
+		pthread_mutex_unlock(&shell_mutex);
+		ilm_lock_shell_free(shell);
+		return;
+	}
+
+	list_add(&shell->list, &shell_list);
+	shell_num++;
+
+	if (shell_num > ILM_LOCK_SHELL_MAX) {
+		last = list_last_entry(&shell_list, struct ilm_lock_shell, list);
+		list_del(&last->list);
+		shell_num--;
+		ilm_lock_shell_free(last);
+	}
+
+	pthread_mutex_unlock(&shell_mutex);
+}
+
+/*
+ * Get a lock to query @lock_id on the drives, it's not added into the
+ * lockspace and must be released with ilm_destroy().
+ */
+static struct ilm_lock *ilm_lock_shell_get(struct ilm_lockspace *ls,
+					   char *lock_id, char **path,
+					   int drive_num)
+{
+	struct ilm_lock_shell *shell;
+	struct ilm_lock *lock, *base;
+	uint64_t path_sig;
+
+	path_sig = ilm_lock_path_sig(path, drive_num);
+
+	pthread_mutex_lock(&shell_mutex);
+	shell = ilm_lock_shell_find_unsafe(path_sig, ilm_curr_time());
+	lock = shell ? ilm_clone(NULL, shell->base, lock_id) : NULL;
+	pthread_mutex_unlock(&shell_mutex);
+
+	if (!lock) {
+		lock = ilm_alloc(NULL, lock_id, path, drive_num);
+		if (!lock)
+			return NULL;
+
+		base = ilm_clone(NULL, lock, lock_id);
+		if (base)
+			ilm_lock_shell_add(base, path_sig);
+	}
+
+	lock->raid_th = ls->raid_thd;
+	return lock;
+}
+
+void ilm_lock_shell_exit(void)
+{
+	struct ilm_lock_shell *shell, *tmp;
+
+	pthread_mutex_lock(&shell_mutex);
+	list_for_each_entry_safe(shell, tmp, &shell_list, list) {
+		list_del(&shell->list);
+		ilm_lock_shell_free(shell);
+	}
+	shell_num = 0;
+	pthread_mutex_unlock(&shell_mutex);
+}
 
-	ilm_id_write_format(lock->id, uuid_str, sizeof(uuid_str));
-	if (strlen(uuid_str))
-		ilm_log_warn("lock ID (VG): %s", uuid_str);
-	else
-		ilm_log_warn("lock ID (VG): Empty string");
+/* The lock which is used to access drives and the host ID for it */
+/*
+ * Only a host ID which is set by the client stays the same after the
+ * daemon is restarted, so the locks of other lockspaces can't be adopted.
+ */
+static void ilm_lock_journal_add(struct ilm_lockspace *ls,
+				 struct ilm_lock *lock)
+{
+	if (ls->host_id_set && !lock->shared)
+		ilm_journal_add(lock, ls->host_id);
+}
 
-	ilm_id_write_format(lock->id + 32, uuid_str, sizeof(uuid_str));
-	if (strlen(uuid_str))
-		ilm_log_warn("lock ID (LV): %s", uuid_str);
-	else
-		ilm_log_warn("lock ID (LV): Empty string");
+static struct ilm_lock *ilm_lock_target(struct ilm_lockspace *ls,
+					struct ilm_lock *lock, char **host_id)
+{
+	if (lock->shared) {
+		*host_id = shared_host_id;
+		return lock->shared->lock;
+	}
 
-	ilm_log_warn(">>>>> Lock dump: %s >>>>>", str);
+	*host_id = ls->host_id;
+	return lock;
 }
 
 int ilm_lock_acquire(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 {
 	struct ilm_lock_payload payload;
+	char *path[ILM_DRIVE_MAX_NUM];
 	struct ilm_lock *lock;
-	int ret, pos = 0;
+	uint64_t path_sig;
+	int deadline = -1;
+	int ret;
 
 	ret = ilm_lock_payload_read(cmd, &payload);
 	if (ret < 0)
 		goto out;
-	pos += ret;
+
+	if (cmd->cmd == ILM_CMD_ACQUIRE_DEADLINE) {
+		ret = ilm_cmd_read(cmd, &deadline, sizeof(deadline));
+		if (ret != sizeof(deadline)) {
+			ilm_log_err("Client fd %d short deadline %d\n",
+				    cmd->cl->fd, ret);
+			ret = -EIO;
+			goto out;
+		}
+
+		if (deadline < 0) {
+			ilm_log_err("Acquire deadline is invalid: %d\n",
+				    deadline);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
 
 	if (!payload.drive_num || payload.drive_num > ILM_DRIVE_MAX_NUM) {
 	        ilm_log_err("Drive list is out of scope: drive_num %d\n",
@@ -429,20 +1787,39 @@ int ilm_lock_acquire(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto out;
 	}
 
-	lock = ilm_alloc(cmd, ls, payload.drive_num, &pos);
+	ret = ilm_lock_paths_read(cmd, payload.drive_num, path);
+	if (ret < 0)
+		goto out;
+
+	path_sig = ilm_lock_path_sig(path, payload.drive_num);
+
+	if (payload.mode == IDM_MODE_SHAREABLE && !ls->host_id_set) {
+		ret = ilm_shared_lock_acquire(ls, &payload, path, path_sig,
+					      deadline);
+		goto out;
+	}
+
+	if (env.lock_cache ||
+	    __atomic_load_n(&cache_replayed, __ATOMIC_ACQUIRE)) {
+		ret = ilm_lock_cache_adopt(ls, &payload, path_sig);
+		if (ret != -ENOENT)
+			goto out;
+	}
+
+	lock = ilm_alloc(ls, payload.lock_id, path, payload.drive_num);
 	if (!lock) {
 		ret = -ENOMEM;
 		goto out;
 	}
 
 	pthread_mutex_lock(&lock->mutex);
-	memcpy(lock->id, payload.lock_id, IDM_LOCK_ID_LEN);
 	lock->mode = payload.mode;
 	lock->timeout = payload.timeout;
+	lock->path_sig = path_sig;
 
 	ilm_lock_dump("lock_acquire", lock);
 
-	ret = idm_raid_lock(lock, ls->host_id);
+	ret = idm_raid_lock(lock, ls->host_id, deadline);
 	if (ret) {
 		pthread_mutex_unlock(&lock->mutex);
 	        ilm_log_err("Fail to acquire raid lock %d\n", ret);
@@ -450,12 +1827,33 @@ int ilm_lock_acquire(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto out;
 	}
 
+	ilm_lock_journal_add(ls, lock);
 	pthread_mutex_unlock(&lock->mutex);
 
 	ilm_lockspace_start_lock(ls, lock, ilm_curr_time());
 out:
-	ilm_client_recv_all(cmd->cl, cmd->sock_msg_len, pos);
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
+	return ret;
+}
+
+int ilm_lock_cancel_acquire(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
+{
+	struct ilm_lock_payload payload;
+	int ret;
+
+	ret = ilm_lock_payload_read(cmd, &payload);
+	if (ret < 0)
+		goto out;
+
+	ret = ilm_lockspace_cancel_lock(ls, payload.lock_id);
+	if (ret < 0) {
+		ilm_log_warn("%s: Fail to cancel lock %d\n", __func__, ret);
+		ilm_log_array_warn("Lock ID:", payload.lock_id,
+				   IDM_LOCK_ID_LEN);
+	}
+
+out:
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
@@ -463,6 +1861,7 @@ int ilm_lock_release(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 {
 	struct ilm_lock_payload payload;
 	struct ilm_lock *lock;
+	uint64_t time;
 	int ret;
 
 	ret = ilm_lock_payload_read(cmd, &payload);
@@ -476,11 +1875,21 @@ int ilm_lock_release(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto out;
 	}
 
-	ilm_lock_dump("lock_release", lock);
+	ilm_lockspace_stop_lock(ls, lock, &time);
+
+	if (lock->shared) {
+		ret = ilm_shared_lock_put(lock->shared);
+		ilm_free(ls, lock);
+		goto out;
+	}
 
-	ilm_lockspace_stop_lock(ls, lock, NULL);
+	/* Keep holding the IDM for a fast reacquire */
+	if (env.lock_cache && !ilm_lock_cache_add(ls, lock, time))
+		goto out;
 
-	pthread_mutex_lock(&lock->mutex);
+	ilm_lock_dump("lock_release", lock);
+
+	ilm_req_trace_mutex_lock(&lock->mutex);
 	ret = idm_raid_unlock(lock, ls->host_id);
 	/* Blind destroy of every mutex acting as a rudimentary real-time
 	mutex cleanup mechanism.
@@ -489,9 +1898,10 @@ int ilm_lock_release(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	idm_raid_destroy_lock(lock, ls->host_id);
 	pthread_mutex_unlock(&lock->mutex);
 
+	ilm_journal_del(lock, ls->host_id);
 	ilm_free(ls, lock);
 out:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
@@ -525,7 +1935,12 @@ int ilm_lock_convert_mode(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	 */
 	ilm_lockspace_stop_lock(ls, lock, &time);
 
-	pthread_mutex_lock(&lock->mutex);
+	if (lock->shared) {
+		ret = ilm_shared_lock_convert(lock, payload.mode);
+		goto restart;
+	}
+
+	ilm_req_trace_mutex_lock(&lock->mutex);
 
 	ret = idm_raid_convert_lock(lock, ls->host_id, payload.mode);
 	if (ret)
@@ -534,14 +1949,380 @@ int ilm_lock_convert_mode(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	else {
 		/* Update after convert mode successfully */
 		lock->mode = payload.mode;
+		ilm_lock_journal_add(ls, lock);
 	}
 
 	pthread_mutex_unlock(&lock->mutex);
 
+restart:
 	/* Restart the lock renewal */
 	ilm_lockspace_start_lock(ls, lock, time);
 out:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
+	return ret;
+}
+
+/* Reply the overall result followed by the result for every lock */
+static void ilm_lock_batch_reply(struct ilm_cmd *cmd, int ret,
+				 int *results, int num)
+{
+	if (!results) {
+		ilm_send_result(cmd, ret, NULL, 0);
+		return;
+	}
+
+	ilm_send_result(cmd, ret, (char *)results, sizeof(int) * num);
+}
+
+static int ilm_lock_batch_first_err(int *results, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (results[i])
+			return results[i];
+	}
+
+	return 0;
+}
+
+/* The same lock ID is only allowed once in a batch */
+static int ilm_lock_batch_is_dup(struct ilm_lock **locks, int num,
+				 struct ilm_lock *lock)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (locks[i] == lock)
+			return 1;
+	}
+
+	return 0;
+}
+
+int ilm_lock_acquire_many(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
+{
+	struct ilm_lock_batch batch;
+	struct ilm_lock_batch_entry *entry;
+	struct ilm_lock_payload payload;
+	char *path[ILM_DRIVE_MAX_NUM];
+	struct ilm_lock **locks = NULL;
+	struct ilm_lock *lock, *base = NULL;
+	int *results = NULL, *index = NULL, *raid_results = NULL;
+	int *reply = NULL;
+	uint64_t path_sig;
+	int ret, i, j, num = 0, alloc_failed = 0;
+
+	ret = ilm_lock_batch_read(cmd, &batch, &entry);
+	if (ret < 0)
+		goto out;
+
+	if (!batch.drive_num) {
+		ilm_log_err("Drive list is out of scope: drive_num %d\n",
+			    batch.drive_num);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = ilm_lock_paths_read(cmd, batch.drive_num, path);
+	if (ret < 0)
+		goto out;
+
+	path_sig = ilm_lock_path_sig(path, batch.drive_num);
+
+	locks = malloc(sizeof(struct ilm_lock *) * batch.num);
+	results = malloc(sizeof(int) * batch.num);
+	index = malloc(sizeof(int) * batch.num);
+	raid_results = malloc(sizeof(int) * batch.num);
+	if (!locks || !results || !index || !raid_results) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < batch.num; i++) {
+		if (entry[i].mode != IDM_MODE_EXCLUSIVE &&
+		    entry[i].mode != IDM_MODE_SHAREABLE) {
+			ilm_log_err("Lock mode is not supported: %d\n",
+				    entry[i].mode);
+			results[i] = -EINVAL;
+			continue;
+		}
+
+		if (!ilm_lockspace_find_lock(ls, entry[i].lock_id, NULL)) {
+			ilm_log_err("Has acquired the lock yet!\n");
+			ilm_log_array_err("Lock ID:", entry[i].lock_id,
+					  IDM_LOCK_ID_LEN);
+			results[i] = -EBUSY;
+			continue;
+		}
+
+		if (env.lock_cache ||
+		    __atomic_load_n(&cache_replayed, __ATOMIC_ACQUIRE)) {
+			memcpy(payload.lock_id, entry[i].lock_id,
+			       IDM_LOCK_ID_LEN);
+			payload.mode = entry[i].mode;
+			payload.timeout = batch.timeout;
+
+			results[i] = ilm_lock_cache_adopt(ls, &payload,
+							  path_sig);
+			if (results[i] != -ENOENT)
+				continue;
+		}
+
+		/*
+		 * All locks in the batch use the same drives, so only
+		 * resolve the drive paths for the first lock.
+		 */
+		if (base)
+			lock = ilm_clone(ls, base, entry[i].lock_id);
+		else if (!alloc_failed)
+			lock = ilm_alloc(ls, entry[i].lock_id, path,
+					 batch.drive_num);
+		else
+			lock = NULL;
+
+		if (!lock) {
+			alloc_failed = 1;
+			results[i] = -ENOMEM;
+			continue;
+		}
+
+		if (!base) {
+			base = lock;
+			ilm_lock_dump("lock_acquire_many", base);
+		}
+
+		ilm_req_trace_mutex_lock(&lock->mutex);
+		lock->mode = entry[i].mode;
+		lock->timeout = batch.timeout;
+		lock->path_sig = path_sig;
+
+		locks[num] = lock;
+		index[num] = i;
+		num++;
+	}
+
+	ilm_log_dbg("%s: acquire %d locks of %u", __func__, num, batch.num);
+
+	if (num)
+		idm_raid_lock_many(locks, num, ls->host_id, raid_results);
+
+	for (j = 0; j < num; j++) {
+		lock = locks[j];
+		i = index[j];
+
+		results[i] = raid_results[j];
+		pthread_mutex_unlock(&lock->mutex);
+
+		if (results[i]) {
+			ilm_log_err("Fail to acquire raid lock %d\n",
+				    results[i]);
+			ilm_log_array_err("Lock ID:", lock->id,
+					  IDM_LOCK_ID_LEN);
+			ilm_free(ls, lock);
+			continue;
+		}
+
+		ilm_lock_journal_add(ls, lock);
+		ilm_lockspace_start_lock(ls, lock, ilm_curr_time());
+	}
+
+	ret = ilm_lock_batch_first_err(results, batch.num);
+	reply = results;
+out:
+	ilm_lock_batch_reply(cmd, ret, reply, batch.num);
+	free(locks);
+	free(results);
+	free(index);
+	free(raid_results);
+	return ret;
+}
+
+int ilm_lock_release_many(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
+{
+	struct ilm_lock_batch batch;
+	struct ilm_lock_batch_entry *entry;
+	struct ilm_lock **locks = NULL;
+	struct ilm_lock *lock;
+	int *results = NULL, *index = NULL, *raid_results = NULL;
+	int *reply = NULL;
+	int ret, i, j, num = 0;
+
+	ret = ilm_lock_batch_read(cmd, &batch, &entry);
+	if (ret < 0)
+		goto out;
+
+	locks = malloc(sizeof(struct ilm_lock *) * batch.num);
+	results = malloc(sizeof(int) * batch.num);
+	index = malloc(sizeof(int) * batch.num);
+	raid_results = malloc(sizeof(int) * batch.num);
+	if (!locks || !results || !index || !raid_results) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < batch.num; i++) {
+		results[i] = ilm_lockspace_find_lock(ls, entry[i].lock_id,
+						     &lock);
+		if (results[i] < 0) {
+			ilm_log_err("%s: Don't find data for the lock ID!\n",
+				    __func__);
+			ilm_log_array_err("Lock ID:", entry[i].lock_id,
+					  IDM_LOCK_ID_LEN);
+			continue;
+		}
+
+		if (ilm_lock_batch_is_dup(locks, num, lock)) {
+			results[i] = -EINVAL;
+			continue;
+		}
+
+		ilm_lockspace_stop_lock(ls, lock, NULL);
+
+		/* Coalesced locks are released on their own */
+		if (lock->shared) {
+			results[i] = ilm_shared_lock_put(lock->shared);
+			ilm_free(ls, lock);
+			continue;
+		}
+
+		ilm_req_trace_mutex_lock(&lock->mutex);
+
+		locks[num] = lock;
+		index[num] = i;
+		num++;
+	}
+
+	ilm_log_dbg("%s: release %d locks of %u", __func__, num, batch.num);
+
+	if (num) {
+		idm_raid_unlock_many(locks, num, ls->host_id, raid_results);
+		/* Blind destroy, see ilm_lock_release() */
+		idm_raid_destroy_lock_many(locks, num, ls->host_id);
+	}
+
+	for (j = 0; j < num; j++) {
+		results[index[j]] = raid_results[j];
+		pthread_mutex_unlock(&locks[j]->mutex);
+		ilm_journal_del(locks[j], ls->host_id);
+		ilm_free(ls, locks[j]);
+	}
+
+	ret = ilm_lock_batch_first_err(results, batch.num);
+	reply = results;
+out:
+	ilm_lock_batch_reply(cmd, ret, reply, batch.num);
+	free(locks);
+	free(results);
+	free(index);
+	free(raid_results);
+	return ret;
+}
+
+int ilm_lock_convert_many(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
+{
+	struct ilm_lock_batch batch;
+	struct ilm_lock_batch_entry *entry;
+	struct ilm_lock **locks = NULL;
+	struct ilm_lock *lock;
+	uint64_t *time = NULL;
+	int *results = NULL, *index = NULL, *modes = NULL;
+	int *raid_results = NULL, *reply = NULL;
+	int ret, i, j, num = 0;
+
+	ret = ilm_lock_batch_read(cmd, &batch, &entry);
+	if (ret < 0)
+		goto out;
+
+	locks = malloc(sizeof(struct ilm_lock *) * batch.num);
+	time = malloc(sizeof(uint64_t) * batch.num);
+	results = malloc(sizeof(int) * batch.num);
+	index = malloc(sizeof(int) * batch.num);
+	modes = malloc(sizeof(int) * batch.num);
+	raid_results = malloc(sizeof(int) * batch.num);
+	if (!locks || !time || !results || !index || !modes ||
+	    !raid_results) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < batch.num; i++) {
+		if (entry[i].mode != IDM_MODE_EXCLUSIVE &&
+		    entry[i].mode != IDM_MODE_SHAREABLE) {
+			ilm_log_err("Lock mode is not supported: %d\n",
+				    entry[i].mode);
+			results[i] = -EINVAL;
+			continue;
+		}
+
+		results[i] = ilm_lockspace_find_lock(ls, entry[i].lock_id,
+						     &lock);
+		if (results[i] < 0) {
+			ilm_log_err("%s: Don't find data for the lock ID!\n",
+				    __func__);
+			ilm_log_array_err("Lock ID:", entry[i].lock_id,
+					  IDM_LOCK_ID_LEN);
+			continue;
+		}
+
+		if (ilm_lock_batch_is_dup(locks, num, lock)) {
+			results[i] = -EINVAL;
+			continue;
+		}
+
+		/* Disable the lock renewal, see ilm_lock_convert_mode() */
+		ilm_lockspace_stop_lock(ls, lock, &time[num]);
+
+		if (lock->shared) {
+			results[i] = ilm_shared_lock_convert(lock,
+							     entry[i].mode);
+			ilm_lockspace_start_lock(ls, lock, time[num]);
+			continue;
+		}
+
+		ilm_req_trace_mutex_lock(&lock->mutex);
+
+		locks[num] = lock;
+		modes[num] = entry[i].mode;
+		index[num] = i;
+		num++;
+	}
+
+	ilm_log_dbg("%s: convert %d locks of %u", __func__, num, batch.num);
+
+	if (num)
+		idm_raid_convert_many(locks, num, ls->host_id, modes,
+				      raid_results);
+
+	for (j = 0; j < num; j++) {
+		lock = locks[j];
+		i = index[j];
+
+		results[i] = raid_results[j];
+		if (results[i])
+			ilm_log_err("Fail to convert raid lock %d mode %d vs %d\n",
+				    results[i], lock->mode, modes[j]);
+		else {
+			lock->mode = modes[j];
+			ilm_lock_journal_add(ls, lock);
+		}
+
+		pthread_mutex_unlock(&lock->mutex);
+
+		/* Restart the lock renewal */
+		ilm_lockspace_start_lock(ls, lock, time[j]);
+	}
+
+	ret = ilm_lock_batch_first_err(results, batch.num);
+	reply = results;
+out:
+	ilm_lock_batch_reply(cmd, ret, reply, batch.num);
+	free(locks);
+	free(time);
+	free(results);
+	free(index);
+	free(modes);
+	free(raid_results);
 	return ret;
 }
 
@@ -550,6 +2331,7 @@ int ilm_lock_vb_write(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	struct ilm_lock_payload payload;
 	struct ilm_lock *lock;
 	char buf[IDM_VALUE_LEN];
+	char *host_id;
 	int ret;
 
 	ret = ilm_lock_payload_read(cmd, &payload);
@@ -563,24 +2345,26 @@ int ilm_lock_vb_write(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto out;
 	}
 
-	ret = recv(cmd->cl->fd, buf, IDM_VALUE_LEN, MSG_WAITALL);
+	ret = ilm_cmd_read(cmd, buf, IDM_VALUE_LEN);
 	if (ret != ILM_LVB_SIZE) {
-		ilm_log_err("Fail to receive LVB fd %d errno %d\n",
-			    cmd->cl->fd, errno);
+		ilm_log_err("Fail to receive LVB fd %d ret %d\n",
+			    cmd->cl->fd, ret);
 		ret = -EIO;
 		goto out;
 	}
 
+	lock = ilm_lock_target(ls, lock, &host_id);
+
 	ilm_lock_dump("lock_vb_write", lock);
 	ilm_log_array_dbg("value buffer:", buf, IDM_VALUE_LEN);
 
 #if 0
-	ret = idm_raid_write_lvb(lock, ls->host_id, buf, IDM_VALUE_LEN);
+	ret = idm_raid_write_lvb(lock, host_id, buf, IDM_VALUE_LEN);
 	if (ret) {
 		ilm_log_err("Fail to write lvb %d\n", ret);
 	} else {
 		/* Update after convert mode successfully */
-		pthread_mutex_lock(&lock->mutex);
+		ilm_req_trace_mutex_lock(&lock->mutex);
 		memcpy(lock->vb, buf, IDM_VALUE_LEN);
 		pthread_mutex_unlock(&lock->mutex);
 	}
@@ -589,14 +2373,16 @@ int ilm_lock_vb_write(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	 * Update the cached LVB, which will be deferred to write
 	 * into IDM when unlock it.
 	 */
-	pthread_mutex_lock(&lock->mutex);
+	ilm_req_trace_mutex_lock(&lock->mutex);
 	memcpy(lock->vb, buf, IDM_VALUE_LEN);
+	lock->vb_pending = 1;
+	ilm_status_update(lock);
 	pthread_mutex_unlock(&lock->mutex);
 	ret = 0;
 #endif
 
 out:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
@@ -605,6 +2391,7 @@ int ilm_lock_vb_read(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	struct ilm_lock_payload payload;
 	struct ilm_lock *lock;
 	char buf[IDM_VALUE_LEN];
+	char *host_id;
 	int ret;
 
 	ret = ilm_lock_payload_read(cmd, &payload);
@@ -618,11 +2405,20 @@ int ilm_lock_vb_read(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto fail;
 	}
 
+	lock = ilm_lock_target(ls, lock, &host_id);
+
 	ilm_lock_dump("lock_vb_read", lock);
 
-	pthread_mutex_lock(&lock->mutex);
+	ilm_req_trace_mutex_lock(&lock->mutex);
+
+	if (lock->vb_pending) {
+		/* Not written into IDM yet, the cached LVB is the latest */
+		memcpy(buf, lock->vb, IDM_VALUE_LEN);
+		pthread_mutex_unlock(&lock->mutex);
+		goto done;
+	}
 
-	ret = idm_raid_read_lvb(lock, ls->host_id, buf, IDM_VALUE_LEN);
+	ret = idm_raid_read_lvb(lock, host_id, buf, IDM_VALUE_LEN);
 	if (ret) {
 		ilm_log_err("Fail to read lvb %d\n", ret);
 		pthread_mutex_unlock(&lock->mutex);
@@ -630,25 +2426,32 @@ int ilm_lock_vb_read(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	} else {
 		/* Update the cached LVB */
 		memcpy(lock->vb, buf, IDM_VALUE_LEN);
+		if (lock->mode == IDM_MODE_EXCLUSIVE) {
+			lock->vb_valid = 1;
+			ilm_status_update(lock);
+		}
 	}
 
 	pthread_mutex_unlock(&lock->mutex);
 
+done:
 	ilm_log_array_dbg("value buffer:", buf, IDM_VALUE_LEN);
 
-	ilm_send_result(cmd->cl->fd, 0, buf, IDM_VALUE_LEN);
+	ilm_send_result(cmd, 0, buf, IDM_VALUE_LEN);
 	return 0;
 
 fail:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
 int ilm_lock_host_count(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 {
 	struct ilm_lock_payload payload;
-	struct ilm_lock *lock = NULL;
-	int allocated = 0, pos = 0, ret;
+	char *path[ILM_DRIVE_MAX_NUM];
+	struct ilm_lock *lock = NULL, *target;
+	char *host_id;
+	int allocated = 0, ret;
 	struct _account {
 		int count;
 		int self;
@@ -657,7 +2460,6 @@ int ilm_lock_host_count(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	ret = ilm_lock_payload_read(cmd, &payload);
 	if (ret < 0)
 		goto out;
-	pos += ret;
 
 	if (payload.drive_num > ILM_DRIVE_MAX_NUM) {
 	        ilm_log_err("Drive list is out of scope: drive_num %d\n",
@@ -668,22 +2470,34 @@ int ilm_lock_host_count(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 
 	ret = ilm_lockspace_find_lock(ls, payload.lock_id, &lock);
 	if (ret < 0) {
-		ilm_log_warn("%s: Fail find lock!\n", __func__);
-		ilm_log_array_warn("Lock ID:", payload.lock_id, IDM_LOCK_ID_LEN);
-		lock = ilm_alloc(cmd, ls, payload.drive_num, &pos);
+		ilm_log_dbg("%s: lock is not held, query drives", __func__);
+		ret = ilm_lock_paths_read(cmd, payload.drive_num, path);
+		if (ret < 0)
+			goto out;
+
+		lock = ilm_lock_shell_get(ls, payload.lock_id, path,
+					  payload.drive_num);
 		if (!lock) {
 			ret = -ENOMEM;
 			goto out;
 		}
-		memcpy(lock->id, payload.lock_id, IDM_LOCK_ID_LEN);
 		allocated = 1;
 	}
 
-	ilm_lock_dump("lock_host_count", lock);
-
-	pthread_mutex_lock(&lock->mutex);
-	ret = idm_raid_count(lock, ls->host_id, &account.count, &account.self);
-	pthread_mutex_unlock(&lock->mutex);
+	target = ilm_lock_target(ls, lock, &host_id);
+	ilm_lock_dump("lock_host_count", target);
+
+	pthread_mutex_lock(&target->mutex);
+	ret = idm_raid_count(target, host_id, &account.count, &account.self);
+	if (!ret && !allocated && target == lock &&
+	    lock->mode == IDM_MODE_EXCLUSIVE) {
+		/* Publish it, the count doesn't change when hold EX mode */
+		lock->host_count = account.count;
+		lock->host_self = account.self;
+		lock->host_count_valid = 1;
+		ilm_status_update(lock);
+	}
+	pthread_mutex_unlock(&target->mutex);
 
 	if (ret) {
 		ilm_log_err("Fail to read count %d\n", ret);
@@ -694,27 +2508,27 @@ int ilm_lock_host_count(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 
 out:
 	if (allocated)
-		ilm_free(ls, lock);
+		ilm_destroy(lock);
 
-	ilm_client_recv_all(cmd->cl, cmd->sock_msg_len, pos);
 	if (!ret)
-		ilm_send_result(cmd->cl->fd, ret,
+		ilm_send_result(cmd, ret,
 				(char *)&account, sizeof(account));
 	else
-		ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+		ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
 int ilm_lock_mode(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 {
 	struct ilm_lock_payload payload;
-	struct ilm_lock *lock = NULL;
-	int mode, allocated = 0, pos = 0, ret;
+	char *path[ILM_DRIVE_MAX_NUM];
+	struct ilm_lock *lock = NULL, *target;
+	char *host_id;
+	int mode, allocated = 0, ret;
 
 	ret = ilm_lock_payload_read(cmd, &payload);
 	if (ret < 0)
 		goto out;
-	pos += ret;
 
 	if (payload.drive_num > ILM_DRIVE_MAX_NUM) {
 	        ilm_log_err("Drive list is out of scope: drive_num %d\n",
@@ -725,21 +2539,26 @@ int ilm_lock_mode(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 
 	ret = ilm_lockspace_find_lock(ls, payload.lock_id, &lock);
 	if (ret < 0) {
-		ilm_log_warn("%s: Fail find lock!\n", __func__);
-		ilm_log_array_warn("Lock ID:", payload.lock_id, IDM_LOCK_ID_LEN);
-		lock = ilm_alloc(cmd, ls, payload.drive_num, &pos);
+		ilm_log_dbg("%s: lock is not held, query drives", __func__);
+		ret = ilm_lock_paths_read(cmd, payload.drive_num, path);
+		if (ret < 0)
+			goto out;
+
+		lock = ilm_lock_shell_get(ls, payload.lock_id, path,
+					  payload.drive_num);
 		if (!lock) {
 			ret = -ENOMEM;
 			goto out;
 		}
-		memcpy(lock->id, payload.lock_id, IDM_LOCK_ID_LEN);
 		allocated = 1;
 	}
-	ilm_lock_dump("lock_host_mode", lock);
 
-	pthread_mutex_lock(&lock->mutex);
-	ret = idm_raid_mode(lock, &mode);
-	pthread_mutex_unlock(&lock->mutex);
+	target = ilm_lock_target(ls, lock, &host_id);
+	ilm_lock_dump("lock_host_mode", target);
+
+	pthread_mutex_lock(&target->mutex);
+	ret = idm_raid_mode(target, &mode);
+	pthread_mutex_unlock(&target->mutex);
 
 	if (ret) {
 		ilm_log_err("Fail to read mode %d\n", ret);
@@ -749,30 +2568,63 @@ int ilm_lock_mode(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 
 out:
 	if (allocated)
-		ilm_free(ls, lock);
+		ilm_destroy(lock);
 
-	ilm_client_recv_all(cmd->cl, cmd->sock_msg_len, pos);
 	if (!ret)
-		ilm_send_result(cmd->cl->fd, ret, (char *)&mode, sizeof(mode));
+		ilm_send_result(cmd, ret, (char *)&mode, sizeof(mode));
 	else
-		ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+		ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
 int ilm_lock_terminate(struct ilm_lockspace *ls, struct ilm_lock *lock)
 {
+	if (lock->shared) {
+		ilm_shared_lock_put(lock->shared);
+		pthread_mutex_destroy(&lock->mutex);
+		free(lock);
+		return 0;
+	}
+
+	ilm_status_remove(lock);
 	idm_raid_unlock(lock, ls->host_id);
 	idm_raid_destroy_lock(lock, ls->host_id);
-	free(lock);
+	ilm_journal_del(lock, ls->host_id);
+	ilm_destroy(lock);
 
 	return 0;
 }
 
+/* The lock which holds the drives, a coalesced lock shares its owner's */
+struct ilm_lock *ilm_lock_owner(struct ilm_lock *lock)
+{
+	return lock->shared ? lock->shared->lock : lock;
+}
+
+void ilm_lock_renew(struct ilm_lockspace *ls, struct ilm_lock *lock)
+{
+	int ret;
+
+	if (lock->shared) {
+		lock->last_renewal_success =
+			ilm_shared_lock_renew(lock->shared);
+		return;
+	}
+
+	pthread_mutex_lock(&lock->mutex);
+	ret = idm_raid_renew_lock(lock, ls->host_id);
+	pthread_mutex_unlock(&lock->mutex);
+	if (!ret) {
+		lock->last_renewal_success = ilm_curr_time();
+		ilm_status_update(lock);
+	}
+}
+
 int ilm_lock_version(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 {
 	struct ilm_lock_payload payload;
-	char path[PATH_MAX];
-	int pos = 0, ret;
+	char *path;
+	int ret;
 	struct _version {
 		uint8_t major;
 		uint8_t minor;
@@ -781,7 +2633,6 @@ int ilm_lock_version(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	ret = ilm_lock_payload_read(cmd, &payload);
 	if (ret < 0)
 		goto out;
-	pos += ret;
 
 	if (payload.drive_num != 1) {
 	        ilm_log_err("%s: only can read version from single drive %d\n",
@@ -790,23 +2641,21 @@ int ilm_lock_version(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto out;
 	}
 
-	ret = recv(cmd->cl->fd, &path, sizeof(path), MSG_WAITALL);
-	if (ret <= 0) {
+	ret = ilm_lock_paths_read(cmd, 1, &path);
+	if (ret < 0) {
 		ilm_log_err("Fail to read out drive path\n");
 		goto out;
 	}
-	pos += ret;
 
 	ret = idm_drive_version(path, &version.major, &version.minor);
 	if (ret < 0)
 		ilm_log_err("Fail to read out version\n");
 
 out:
-	ilm_client_recv_all(cmd->cl, cmd->sock_msg_len, pos);
 	if (!ret)
-		ilm_send_result(cmd->cl->fd, ret,
+		ilm_send_result(cmd, ret,
 				(char *)&version, sizeof(version));
 	else
-		ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+		ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
@@ -12,6 +12,7 @@
 #include "ilm.h"
 #include "list.h"
 #include "lockspace.h"
+#include "margin.h"
 
 #define IDM_DRIVE_PATH_NUM		4
 
@@ -31,6 +32,11 @@ struct ilm_drive {
 	int self;		/* cache the self count */
 	char vb[IDM_VALUE_LEN];
 	int is_brk;		/* indicate breaking lock */
+
+	/* Protected by the mutex in margin.c */
+	uint64_t last_renew;	/* Last renewal success on the drive */
+	uint64_t renew_gap;	/* Gap not yet seen by the check */
+	int margin_level;
 };
 
 #define ILM_DRIVE_NO_ACCESS		0
@@ -38,6 +44,7 @@ struct ilm_drive {
 #define ILM_DRIVE_FAILED		2
 
 struct _raid_thread;
+struct ilm_shared_lock;
 
 struct ilm_lock {
 	struct list_head list;
@@ -54,9 +61,32 @@ struct ilm_lock {
 	int drive_version;
 
 	char vb[IDM_VALUE_LEN];
+	int vb_pending;		/* LVB is written into IDM when unlock */
+
+	/* Signature of the drive paths passed by user */
+	uint64_t path_sig;
 
 	int convert_failed;
 	struct _raid_thread *raid_th;
+
+	/* Not NULL if the lock is coalesced with other local holders */
+	struct ilm_shared_lock *shared;
+
+	int journaled;		/* Recorded in the lock journal */
+
+	/* Published into the status region, see status.c */
+	int status_slot;	/* Slot index plus one, zero if not published */
+	uint64_t status_token;
+	int vb_valid;		/* LVB has been read from IDM */
+	int host_count_valid;	/* Host count has been read from IDM */
+	int host_count;
+	int host_self;
+
+	struct ilm_margin margin;
+
+	/* Protected by the lock queue mutex in raid_lock.c */
+	int acquiring;		/* acquisition is in progress */
+	int cancelled;		/* acquisition has been cancelled */
 };
 
 #define ILM_LOCK_MAGIC		0x4C4F434B
@@ -70,14 +100,43 @@ struct ilm_lock_payload {
 	int timeout;
 };
 
+#define ILM_LOCK_BATCH_MAGIC	0x4C4F4342
+
+/*
+ * Batch request: the header is followed by 'num' entries and then the
+ * drive paths in the same format as a single lock request.  The drive
+ * paths are only sent for ILM_CMD_ACQUIRE_MANY.
+ */
+struct ilm_lock_batch {
+	uint32_t magic;
+	uint32_t num;
+	uint32_t drive_num;
+	int timeout;
+};
+
+struct ilm_lock_batch_entry {
+	char lock_id[IDM_LOCK_ID_LEN];
+	uint32_t mode;
+};
+
 int ilm_lock_acquire(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
+int ilm_lock_cancel_acquire(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_lock_release(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_lock_convert_mode(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
+int ilm_lock_acquire_many(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
+int ilm_lock_release_many(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
+int ilm_lock_convert_many(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_lock_vb_write(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_lock_vb_read(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_lock_host_count(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_lock_mode(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_lock_terminate(struct ilm_lockspace *ls, struct ilm_lock *lock);
+struct ilm_lock *ilm_lock_owner(struct ilm_lock *lock);
+void ilm_lock_renew(struct ilm_lockspace *ls, struct ilm_lock *lock);
+void ilm_shared_lock_cancel(struct ilm_lock *proxy);
+void ilm_lock_cache_exit(void);
+void ilm_lock_shell_exit(void);
+int ilm_lock_journal_replay(void);
 int ilm_lock_version(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_update_drive_multi_paths(struct ilm_lock *lock);
 
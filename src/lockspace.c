@@ -16,17 +16,22 @@
 #include "client.h"
 #include "cmd.h"
 #include "failure.h"
+#include "journal.h"
 #include "list.h"
 #include "lock.h"
 #include "log.h"
+#include "margin.h"
 #include "raid_lock.h"
+#include "status.h"
 #include "util.h"
 
-#define IDM_QUIESCENT_PERIOD	50000	/* 50 seconds */
-
 static struct list_head ls_list = LIST_HEAD_INIT(ls_list);
 static pthread_mutex_t ls_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Read by the metrics exporter without taking any mutex */
+static int ls_num;
+static int ls_lock_num;
+
 static int _ls_is_valid(struct ilm_lockspace *ilm_ls)
 {
 	struct ilm_lockspace *pos;
@@ -50,8 +55,8 @@ static void *ilm_lockspace_thread(void *data)
 {
 	struct ilm_lockspace *ls = data;
 	struct ilm_lock *lock;
-	int exit, ret;
-	uint64_t now;
+	int exit;
+	uint64_t now, prev;
 
 	while (1) {
 		pthread_mutex_lock(&ls->mutex);
@@ -107,11 +112,9 @@ static void *ilm_lockspace_thread(void *data)
 				continue;
 			}
 
-			pthread_mutex_lock(&lock->mutex);
-			ret = idm_raid_renew_lock(lock, ls->host_id);
-			pthread_mutex_unlock(&lock->mutex);
-			if (!ret)
-				lock->last_renewal_success = ilm_curr_time();
+			prev = lock->last_renewal_success;
+			ilm_lock_renew(ls, lock);
+			ilm_margin_check(lock, prev);
 		}
 
 sleep_loop:
@@ -126,6 +129,7 @@ sleep_loop:
 int ilm_lockspace_create(struct ilm_cmd *cmd, struct ilm_lockspace **ls_out)
 {
 	struct ilm_lockspace *ilm_ls;
+	uint32_t proto;
 	int ret;
 
 	ilm_ls = malloc(sizeof(struct ilm_lockspace));
@@ -140,12 +144,14 @@ int ilm_lockspace_create(struct ilm_cmd *cmd, struct ilm_lockspace **ls_out)
 	memcpy(ilm_ls->host_id + 16, &ilm_uuid, sizeof(uuid_t));
 	memcpy(ilm_ls->host_id, &cmd->cl->pid, sizeof(int));
 	ilm_ls->kill_pid = cmd->cl->pid;
+	ilm_ls->status_token = ilm_status_token();
 
 	INIT_LIST_HEAD(&ilm_ls->lock_list);
 	pthread_mutex_init(&ilm_ls->mutex, NULL);
 
 	pthread_mutex_lock(&ls_mutex);
 	list_add(&ilm_ls->list, &ls_list);
+	__atomic_add_fetch(&ls_num, 1, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&ls_mutex);
 
 	ret = pthread_create(&ilm_ls->thd, NULL, ilm_lockspace_thread, ilm_ls);
@@ -161,7 +167,21 @@ int ilm_lockspace_create(struct ilm_cmd *cmd, struct ilm_lockspace **ls_out)
 	}
 
 	*ls_out = ilm_ls;
-	ilm_send_result(cmd->cl->fd, 0, NULL, 0);
+
+	/*
+	 * Legacy clients don't expect any data in the reply, only reply the
+	 * negotiated protocol version if client has advertised its version.
+	 */
+	if (cmd->version >= ILM_PROTO_V2) {
+		proto = cmd->version;
+		if (proto > ILM_PROTO_VERSION)
+			proto = ILM_PROTO_VERSION;
+		cmd->cl->proto = proto;
+		ilm_send_result(cmd, 0, (char *)&proto, sizeof(proto));
+	} else {
+		cmd->cl->proto = ILM_PROTO_V1;
+		ilm_send_result(cmd, 0, NULL, 0);
+	}
 	return 0;
 
 fail_raid_thd:
@@ -172,15 +192,17 @@ fail_raid_thd:
 fail:
 	pthread_mutex_lock(&ls_mutex);
 	list_del(&ilm_ls->list);
+	__atomic_sub_fetch(&ls_num, 1, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&ls_mutex);
 
 	free(ilm_ls);
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return -1;
 }
 
 int ilm_lockspace_delete(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls)
 {
+	struct ilm_lock *lock;
 	int ret;
 
 	if (!_ls_is_valid(ilm_ls)) {
@@ -194,8 +216,13 @@ int ilm_lockspace_delete(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls)
 
 	ret = pthread_join(ilm_ls->thd, NULL);
 
+	/* The locks left by the client are not renewed anymore */
+	list_for_each_entry(lock, &ilm_ls->lock_list, list)
+		ilm_journal_del(lock, ilm_ls->host_id);
+
 	pthread_mutex_lock(&ls_mutex);
 	list_del(&ilm_ls->list);
+	__atomic_sub_fetch(&ls_num, 1, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&ls_mutex);
 
 	idm_raid_thread_free(ilm_ls->raid_thd);
@@ -206,7 +233,7 @@ int ilm_lockspace_delete(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls)
 		free(ilm_ls->kill_args);
 	free(ilm_ls);
 
-	ilm_send_result(cmd->cl->fd, 0, NULL, 0);
+	ilm_send_result(cmd, 0, NULL, 0);
 	return ret;
 }
 
@@ -220,6 +247,7 @@ int ilm_lockspace_add_lock(struct ilm_lockspace *ls,
 
 	pthread_mutex_lock(&ls->mutex);
 	list_add(&lock->list, &ls->lock_list);
+	__atomic_add_fetch(&ls_lock_num, 1, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&ls->mutex);
 
 	return 0;
@@ -234,6 +262,8 @@ int ilm_lockspace_del_lock(struct ilm_lockspace *ls, struct ilm_lock *lock)
 
 	pthread_mutex_lock(&ls->mutex);
 	list_del(&lock->list);
+	__atomic_sub_fetch(&ls_lock_num, 1, __ATOMIC_RELAXED);
+	ilm_margin_del(lock);
 	pthread_mutex_unlock(&ls->mutex);
 
 	return 0;
@@ -250,6 +280,8 @@ int ilm_lockspace_start_lock(struct ilm_lockspace *ls,
 
 	pthread_mutex_lock(&ls->mutex);
 	lock->last_renewal_success = time;
+	ilm_status_publish(ls, lock);
+	ilm_margin_add(lock);
 	pthread_mutex_unlock(&ls->mutex);
 
 	return 0;
@@ -268,6 +300,8 @@ int ilm_lockspace_stop_lock(struct ilm_lockspace *ls,
 	if (time)
 		*time = lock->last_renewal_success;
 	lock->last_renewal_success = 0;
+	ilm_status_remove(lock);
+	ilm_margin_del(lock);
 	pthread_mutex_unlock(&ls->mutex);
 
 	return 0;
@@ -283,16 +317,17 @@ int ilm_lockspace_set_signal(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto out;
 	}
 
-	ret = recv(cmd->cl->fd, &signo, sizeof(int), MSG_WAITALL);
-	if (ret <= 0) {
+	ret = ilm_cmd_read(cmd, &signo, sizeof(int));
+	if (ret != sizeof(int)) {
 		ilm_log_err("Failed to read out singal number\n");
+		ret = -EIO;
 		goto out;
 	}
 
 	ls->kill_sig = signo;
 
 out:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
@@ -300,7 +335,7 @@ int ilm_lockspace_set_killpath(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 {
 	char path[IDM_FAILURE_PATH_LEN];
 	char args[IDM_FAILURE_ARGS_LEN];
-	int ret, pos = 0;
+	int ret;
 
 	if (!_ls_is_valid(ls)) {
 		ilm_log_err("%s: lockspace is invalid\n", __func__);
@@ -308,13 +343,12 @@ int ilm_lockspace_set_killpath(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto out;
 	}
 
-	ret = recv(cmd->cl->fd, path, IDM_FAILURE_PATH_LEN, MSG_WAITALL);
-	if (!ret || (ret != IDM_FAILURE_PATH_LEN)) {
-		ilm_log_err("Fail to receive kill path %d", errno);
+	ret = ilm_cmd_read(cmd, path, IDM_FAILURE_PATH_LEN);
+	if (ret != IDM_FAILURE_PATH_LEN) {
+		ilm_log_err("Fail to receive kill path %d", ret);
 		ret = -EIO;
 		goto out;
 	}
-	pos += ret;
 
 	ls->kill_path = strndup(path, IDM_FAILURE_PATH_LEN);
 	if (!ls->kill_path) {
@@ -323,13 +357,12 @@ int ilm_lockspace_set_killpath(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 		goto out;
 	}
 
-	ret = recv(cmd->cl->fd, args, IDM_FAILURE_ARGS_LEN, MSG_WAITALL);
-	if (!ret || (ret != IDM_FAILURE_ARGS_LEN)) {
-		ilm_log_err("Fail to receive kill args %d", errno);
+	ret = ilm_cmd_read(cmd, args, IDM_FAILURE_ARGS_LEN);
+	if (ret != IDM_FAILURE_ARGS_LEN) {
+		ilm_log_err("Fail to receive kill args %d", ret);
 		ret = -EIO;
 		goto out;
 	}
-	pos += ret;
 
 	ls->kill_args = strndup(args, IDM_FAILURE_ARGS_LEN);
 	if (!ls->kill_args) {
@@ -338,8 +371,7 @@ int ilm_lockspace_set_killpath(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
 	}
 
 out:
-	ilm_client_recv_all(cmd->cl, cmd->sock_msg_len, pos);
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
@@ -368,6 +400,42 @@ int ilm_lockspace_find_lock(struct ilm_lockspace *ls, char *lock_id,
 	return ret;
 }
 
+/*
+ * Cancel the in-flight acquisition of a lock, this is done with the
+ * lockspace mutex held so the lock cannot be freed by the acquiring
+ * worker at the meantime.  The local holders of a coalesced shareable
+ * lock don't wait on drives, so return -EALREADY for them, but a request
+ * still waiting for the coalesced lock is cancelled.
+ */
+int ilm_lockspace_cancel_lock(struct ilm_lockspace *ls, char *lock_id)
+{
+	struct ilm_lock *pos;
+	int ret = -ENOENT;
+
+	if (!_ls_is_valid(ls)) {
+		ilm_log_err("%s: lockspace is invalid\n", __func__);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ls->mutex);
+	list_for_each_entry(pos, &ls->lock_list, list) {
+		if (memcmp(pos->id, lock_id, IDM_LOCK_ID_LEN))
+			continue;
+
+		if (pos->shared) {
+			ret = -EALREADY;
+		} else {
+			ret = idm_raid_lock_cancel(pos);
+			if (!ret && pos->mode == IDM_MODE_SHAREABLE)
+				ilm_shared_lock_cancel(pos);
+		}
+		break;
+	}
+
+	pthread_mutex_unlock(&ls->mutex);
+	return ret;
+}
+
 int ilm_lockspace_set_host_id(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls)
 {
 	struct ilm_lockspace *pos;
@@ -380,9 +448,10 @@ int ilm_lockspace_set_host_id(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls)
 		goto out;
 	}
 
-	ret = recv(cmd->cl->fd, host_id, IDM_HOST_ID_LEN, MSG_WAITALL);
-	if (ret <= 0) {
+	ret = ilm_cmd_read(cmd, host_id, IDM_HOST_ID_LEN);
+	if (ret != IDM_HOST_ID_LEN) {
 		ilm_log_err("Failed to read out host ID\n");
+		ret = -EIO;
 		goto out;
 	}
 
@@ -399,13 +468,14 @@ int ilm_lockspace_set_host_id(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls)
 	pthread_mutex_unlock(&ls_mutex);
 
 	memcpy(ilm_ls->host_id, host_id, IDM_HOST_ID_LEN);
+	ilm_ls->host_id_set = 1;
 
 	ilm_log_array_dbg("Host ID:", host_id, IDM_HOST_ID_LEN);
-	ilm_send_result(cmd->cl->fd, 0, NULL, 0);
+	ilm_send_result(cmd, 0, NULL, 0);
 	return 0;
 
 out:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
@@ -424,7 +494,7 @@ int ilm_lockspace_stop_renew(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls)
 	pthread_mutex_unlock(&ilm_ls->mutex);
 
 out:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
@@ -443,7 +513,7 @@ int ilm_lockspace_start_renew(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls)
 	pthread_mutex_unlock(&ilm_ls->mutex);
 
 out:
-	ilm_send_result(cmd->cl->fd, ret, NULL, 0);
+	ilm_send_result(cmd, ret, NULL, 0);
 	return ret;
 }
 
@@ -464,6 +534,8 @@ int ilm_lockspace_terminate(struct ilm_lockspace *ls)
 
 	list_for_each_entry_safe(lock, next, &ls->lock_list, list) {
 		list_del(&lock->list);
+		__atomic_sub_fetch(&ls_lock_num, 1, __ATOMIC_RELAXED);
+		ilm_margin_del(lock);
 		ilm_lock_terminate(ls, lock);
 	}
 
@@ -475,6 +547,7 @@ int ilm_lockspace_terminate(struct ilm_lockspace *ls)
 
 	pthread_mutex_lock(&ls_mutex);
 	list_del(&ls->list);
+	__atomic_sub_fetch(&ls_num, 1, __ATOMIC_RELAXED);
 	pthread_mutex_unlock(&ls_mutex);
 
 	idm_raid_thread_free(ls->raid_thd);
@@ -486,3 +559,10 @@ int ilm_lockspace_terminate(struct ilm_lockspace *ls)
 	free(ls);
 	return 0;
 }
+
+/* Number of lockspaces and of the locks in them, for the metrics */
+int ilm_lockspace_count(int *lock_num)
+{
+	*lock_num = __atomic_load_n(&ls_lock_num, __ATOMIC_RELAXED);
+	return __atomic_load_n(&ls_num, __ATOMIC_RELAXED);
+}
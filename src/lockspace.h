@@ -14,9 +14,14 @@
 
 #define IDM_HOST_ID_LEN			32
 
+/* A lock not renewed for this long is timed out and the lockspace killed */
+#define IDM_QUIESCENT_PERIOD		50000	/* 50 seconds */
+
 struct ilm_lockspace {
 	struct list_head list;
 	char host_id[IDM_HOST_ID_LEN];
+	int host_id_set;	/* Host ID is assigned by client */
+	uint64_t status_token;	/* Identify the locks in status region */
 
 	struct list_head lock_list;
 
@@ -50,10 +55,12 @@ int ilm_lockspace_stop_lock(struct ilm_lockspace *ls, struct ilm_lock *lock,
 			    uint64_t *time);
 int ilm_lockspace_set_signal(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
 int ilm_lockspace_set_killpath(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
+int ilm_lockspace_cancel_lock(struct ilm_lockspace *ls, char *lock_id);
 int ilm_lockspace_find_lock(struct ilm_lockspace *ls, char *lock_uuid,
 			    struct ilm_lock **lock);
 int ilm_lockspace_stop_renew(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls);
 int ilm_lockspace_start_renew(struct ilm_cmd *cmd, struct ilm_lockspace *ilm_ls);
 int ilm_lockspace_terminate(struct ilm_lockspace *ls);
+int ilm_lockspace_count(int *lock_num);
 
 #endif /* __LOCKSPACE_H__ */
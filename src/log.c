@@ -37,11 +37,73 @@
 
 #define ILM_LOG_ENTRIES		50000
 
+/*
+ * Every thread appends binary records into its own ring, which has a
+ * single producer and the log thread as the single consumer, so logging
+ * takes no lock.  A record keeps the format string pointer and the raw
+ * arguments, the strings are copied into the record; the log thread
+ * formats the records in the order of their timestamps.
+ *
+ * The daemon runs with all its memory locked, so a ring is kept small
+ * (about 120KB), the log thread is woken up as soon as a record comes in
+ * and only a long burst from one thread overruns its ring.
+ */
+#define ILM_LOG_RING_SLOTS	512		/* Power of 2 */
+#define ILM_LOG_RING_MAX	256
+#define ILM_LOG_ARG_LEN		192
+#define ILM_LOG_ARRAY_CHUNK	(ILM_LOG_ARG_LEN - 64)
+
+/* Replaces the tail of a string which doesn't fit into the record */
+#define ILM_LOG_TRUNC		"..."
+#define ILM_LOG_TRUNC_LEN	(sizeof(ILM_LOG_TRUNC) - 1)
+
+#define LOG_REC_MSG		0
+#define LOG_REC_ARRAY		1
+
+struct log_rec {
+	uint64_t mono_ns;
+	time_t real_sec;
+	const char *fmt;
+	pid_t tid;
+	int level;
+	short type;
+	short argc;		/* Arguments captured, -1 for all */
+	int offset;		/* Offset of array chunk */
+	int len;
+	char arg[ILM_LOG_ARG_LEN];
+};
+
+struct log_ring {
+	unsigned int head;	/* Written by producer */
+	unsigned int tail;	/* Written by consumer */
+	unsigned int dropped;
+	int in_use;
+	pid_t tid;
+	struct log_rec rec[ILM_LOG_RING_SLOTS];
+};
+
 static pthread_t log_thd;
 
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
 
+static struct log_ring *log_rings[ILM_LOG_RING_MAX];
+static int log_ring_num;		/* Published with release ordering */
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *log_self;
+
+/* Used by the threads beyond ILM_LOG_RING_MAX, producers take the mutex */
+static struct log_ring *log_shared_ring;
+static pthread_mutex_t log_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int log_thread_running;
+static int log_thread_waiting;
+
+/* Entries reported as dropped so far, read by the metrics exporter */
+static uint64_t log_dropped;
+
+/* History of formatted entries for replaying, only used by log thread */
 struct log_entry {
 	int level;
 	char str[ILM_LOG_STR_LEN];
@@ -49,9 +111,6 @@ struct log_entry {
 
 static struct log_entry *log_records;
 static unsigned int log_head; /* add at head */
-static unsigned int log_tail; /* remove from tail */
-static unsigned int log_dropped;
-static unsigned int log_pending_ents;
 static unsigned int log_thread_done;
 
 static FILE *log_file_fp;
@@ -69,175 +128,522 @@ static void log_save_record(int level, char *str, int len)
 	if (!log_records)
 		return;
 
-	if (log_pending_ents == ILM_LOG_ENTRIES) {
-		log_dropped++;
-
-		/*
-		 * If tail pointer equals to head pointer, it means the
-		 * log buffer is empty.  So correct tail pointer to one
-		 * item ahead than head pointer so can distinguish the
-		 * the buffer is full.
-		 */
-		if (log_tail == log_head)
-			log_tail = (log_head + 1) % ILM_LOG_ENTRIES;
-		return;
-	}
-
 	e = &log_records[log_head++];
 	log_head = log_head % ILM_LOG_ENTRIES;
-	log_pending_ents++;
 
 	e->level = level;
 	memcpy(e->str, str, len);
 }
 
-/**
- * The main log function, the log level is descent ordered
- * so less value with higher priority.
- *
- * It copies log_str into the log_records circular array to be
- * written to logfile and/or syslog (so callers don't block
- * writing messages to files).
+/* Parse a conversion specification, returns its length or 0 if invalid */
+static int log_parse_spec(const char *p, int *star_num, char *len_mod,
+			  char *conv)
+{
+	const char *start = p;
+
+	*star_num = 0;
+	len_mod[0] = len_mod[1] = '\0';
+
+	p++;	/* Skip '%' */
+
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+
+	if (*p == '*') {
+		(*star_num)++;
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			(*star_num)++;
+			p++;
+		} else {
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+	}
+
+	if (*p && strchr("hljztLq", *p)) {
+		len_mod[0] = *p++;
+		if ((len_mod[0] == 'h' || len_mod[0] == 'l') &&
+		    *p == len_mod[0])
+			len_mod[1] = *p++;
+	}
+
+	if (!*p)
+		return 0;
+
+	*conv = *p++;
+	return p - start;
+}
+
+static int log_put(char *buf, int len, int *pos, const void *val, int size)
+{
+	if (*pos + size > len)
+		return -1;
+
+	memcpy(buf + *pos, val, size);
+	*pos += size;
+	return 0;
+}
+
+/*
+ * Copy the arguments into the record: the integers and pointers are saved
+ * as 64 bits, the floating values as double and the strings are copied
+ * inline.  Returns the number of captured conversions, or -1 if all of
+ * them are captured.
  */
-void ilm_log(int level, const char *fmt, ...)
+static int log_capture(char *buf, int len, const char *fmt, va_list ap)
 {
-	va_list ap;
-	int ret, pos = 0;
-	char log_str[ILM_LOG_STR_LEN];
-	int len = ILM_LOG_STR_LEN - 2; /* leave room for \n\0 */
-	struct timeval cur_time;
-	struct tm time_info;
-	pid_t tid;
-	struct timespec ts;
+	const char *p = fmt, *str;
+	char len_mod[2], conv;
+	int pos = 0, argc = 0, star_num, spec_len, n, i;
+	long long ival;
+	double dval;
+
+	while ((p = strchr(p, '%'))) {
+		spec_len = log_parse_spec(p, &star_num, len_mod, &conv);
+		if (!spec_len)
+			break;
+		p += spec_len;
 
-	pthread_mutex_lock(&log_mutex);
+		if (conv == '%')
+			continue;
 
-	gettimeofday(&cur_time, NULL);
+		for (i = 0; i < star_num; i++) {
+			ival = va_arg(ap, int);
+			if (log_put(buf, len, &pos, &ival, sizeof(ival)))
+				return argc;
+		}
 
-	if (log_file_use_utc)
-		gmtime_r(&cur_time.tv_sec, &time_info);
-	else
-		localtime_r(&cur_time.tv_sec, &time_info);
+		switch (conv) {
+		case 'd': case 'i': case 'u': case 'x': case 'X':
+		case 'o': case 'c':
+			if (len_mod[0] == 'l' && len_mod[1] == 'l')
+				ival = va_arg(ap, long long);
+			else if (len_mod[0] == 'q')
+				ival = va_arg(ap, long long);
+			else if (len_mod[0] == 'l')
+				ival = va_arg(ap, long);
+			else if (len_mod[0] == 'j')
+				ival = va_arg(ap, intmax_t);
+			else if (len_mod[0] == 'z')
+				ival = va_arg(ap, size_t);
+			else if (len_mod[0] == 't')
+				ival = va_arg(ap, ptrdiff_t);
+			else
+				ival = va_arg(ap, int);
+
+			if (log_put(buf, len, &pos, &ival, sizeof(ival)))
+				return argc;
+			break;
+		case 'p':
+			ival = (long long)(uintptr_t)va_arg(ap, void *);
+			if (log_put(buf, len, &pos, &ival, sizeof(ival)))
+				return argc;
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			if (len_mod[0] == 'L')
+				dval = va_arg(ap, long double);
+			else
+				dval = va_arg(ap, double);
+
+			if (log_put(buf, len, &pos, &dval, sizeof(dval)))
+				return argc;
+			break;
+		case 's':
+			str = va_arg(ap, const char *);
+			if (!str)
+				str = "(null)";
+
+			/* Truncate the string to fit into the record */
+			n = strnlen(str, len - pos);
+			if (pos + n >= len)
+				n = len - pos - 1;
+			if (n < 0)
+				return argc;
+
+			memcpy(buf + pos, str, n);
+			if (str[n] && n >= (int)ILM_LOG_TRUNC_LEN)
+				memcpy(buf + pos + n - ILM_LOG_TRUNC_LEN,
+				       ILM_LOG_TRUNC, ILM_LOG_TRUNC_LEN);
+			buf[pos + n] = '\0';
+			pos += n + 1;
+			break;
+		case 'n':
+			(void)va_arg(ap, void *);
+			break;
+		default:
+			return argc;
+		}
 
-	ret = strftime(log_str + pos, len - pos,
-		       "%Y-%m-%d %H:%M:%S ", &time_info);
-	pos += ret;
+		argc++;
+	}
 
-	tid = syscall(SYS_gettid);
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	ret = snprintf(log_str + pos, len - pos, "%lu [%u]: ",
-		       ts.tv_sec, tid);
-	pos += ret;
+	return -1;
+}
 
-	va_start(ap, fmt);
-	ret = vsnprintf(log_str + pos, len - pos, fmt, ap);
-	va_end(ap);
+static int log_get(char *buf, int len, int *pos, void *val, int size)
+{
+	if (*pos + size > len)
+		return -1;
 
-	if (ret >= len - pos)
-		pos = len - 1;
-	else
-		pos += ret;
+	memcpy(val, buf + *pos, size);
+	*pos += size;
+	return 0;
+}
 
-	log_str[pos++] = '\n';
-	log_str[pos++] = '\0';
+/* Format a record with its captured arguments, returns the length */
+static int log_format(char *out, int out_len, struct log_rec *r)
+{
+	const char *p = r->fmt, *next;
+	char spec[64], len_mod[2], conv, *s;
+	int pos = 0, arg_pos = 0, argc = 0, star_num, spec_len;
+	int ret, n, i;
+	long long ival = 0, star[2] = { 0, 0 };
+	double dval = 0;
+
+	while (*p && pos < out_len - 1) {
+		next = strchr(p, '%');
+		if (!next)
+			next = p + strlen(p);
+
+		n = next - p;
+		if (n > out_len - 1 - pos)
+			n = out_len - 1 - pos;
+		memcpy(out + pos, p, n);
+		pos += n;
+		p = next;
+
+		if (!*p)
+			break;
 
-	/*
-	 * Save messages in circular array "log_records" that a thread
-	 * writes to logfile/syslog
-	 */
-	log_save_record(level, log_str, pos);
+		spec_len = log_parse_spec(p, &star_num, len_mod, &conv);
+		if (!spec_len || spec_len >= (int)sizeof(spec) - 40)
+			break;
 
-	if (level <= log_stderr_priority)
-		fprintf(stderr, "%s", log_str);
+		if (conv == '%') {
+			out[pos++] = '%';
+			p += spec_len;
+			continue;
+		}
 
-	pthread_cond_signal(&log_cond);
-	pthread_mutex_unlock(&log_mutex);
+		if (r->argc >= 0 && argc >= r->argc) {
+			ret = snprintf(out + pos, out_len - pos, "...");
+			pos += ret < out_len - pos ? ret : out_len - 1 - pos;
+			break;
+		}
+
+		for (i = 0; i < star_num; i++)
+			log_get(r->arg, r->len, &arg_pos, &star[i],
+				sizeof(star[i]));
+
+		/* Rebuild the spec with the width and precision resolved */
+		for (i = 0, n = 0, s = spec; i < spec_len; i++) {
+			if (p[i] == '*') {
+				s += sprintf(s, "%d", (int)star[n++]);
+			} else if (p[i] == 'L') {
+				continue;
+			} else {
+				*s++ = p[i];
+			}
+		}
+		*s = '\0';
+		p += spec_len;
+
+		ret = 0;
+		switch (conv) {
+		case 'd': case 'i': case 'u': case 'x': case 'X':
+		case 'o': case 'c':
+			log_get(r->arg, r->len, &arg_pos, &ival, sizeof(ival));
+			if ((len_mod[0] == 'l' && len_mod[1] == 'l') ||
+			    len_mod[0] == 'q')
+				ret = snprintf(out + pos, out_len - pos, spec, ival);
+			else if (len_mod[0] == 'l')
+				ret = snprintf(out + pos, out_len - pos, spec,
+					       (long)ival);
+			else if (len_mod[0] == 'j')
+				ret = snprintf(out + pos, out_len - pos, spec,
+					       (intmax_t)ival);
+			else if (len_mod[0] == 'z')
+				ret = snprintf(out + pos, out_len - pos, spec,
+					       (size_t)ival);
+			else if (len_mod[0] == 't')
+				ret = snprintf(out + pos, out_len - pos, spec,
+					       (ptrdiff_t)ival);
+			else
+				ret = snprintf(out + pos, out_len - pos, spec,
+					       (int)ival);
+			break;
+		case 'p':
+			log_get(r->arg, r->len, &arg_pos, &ival, sizeof(ival));
+			ret = snprintf(out + pos, out_len - pos, spec,
+				       (void *)(uintptr_t)ival);
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			log_get(r->arg, r->len, &arg_pos, &dval, sizeof(dval));
+			ret = snprintf(out + pos, out_len - pos, spec, dval);
+			break;
+		case 's':
+			s = r->arg + arg_pos;
+			ret = snprintf(out + pos, out_len - pos, spec, s);
+			arg_pos += strlen(s) + 1;
+			break;
+		default:
+			break;
+		}
+
+		if (ret > 0)
+			pos += ret < out_len - pos ? ret : out_len - 1 - pos;
+		argc++;
+	}
+
+	out[pos] = '\0';
+	return pos;
 }
 
-void ilm_log_array(int level, const char *array_name, char *buf, int buf_len)
+static void log_ring_exit(void *data)
 {
-	char log_str[ILM_LOG_STR_LEN];
-	int len = ILM_LOG_STR_LEN - 2; /* leave room for \n\0 */
-	int ret, pos = 0;
-	struct timeval cur_time;
-	struct tm time_info;
-	pid_t tid;
-	struct timespec ts;
+	struct log_ring *ring = data;
+
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void log_ring_key_init(void)
+{
+	pthread_key_create(&log_ring_key, log_ring_exit);
+}
+
+/* Take a ring for the thread, reuse the ring of an exited thread */
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring = NULL;
 	int i;
 
+	if (log_self)
+		return log_self;
+
+	pthread_once(&log_ring_once, log_ring_key_init);
+
 	pthread_mutex_lock(&log_mutex);
 
-	gettimeofday(&cur_time, NULL);
+	for (i = 0; i < log_ring_num; i++) {
+		if (!__atomic_load_n(&log_rings[i]->in_use, __ATOMIC_ACQUIRE)) {
+			ring = log_rings[i];
+			break;
+		}
+	}
 
-	if (log_file_use_utc)
-		gmtime_r(&cur_time.tv_sec, &time_info);
-	else
-		localtime_r(&cur_time.tv_sec, &time_info);
+	if (!ring && log_ring_num < ILM_LOG_RING_MAX) {
+		ring = calloc(1, sizeof(*ring));
+		if (ring) {
+			log_rings[log_ring_num] = ring;
+			__atomic_store_n(&log_ring_num, log_ring_num + 1,
+					 __ATOMIC_RELEASE);
+		}
+	}
+
+	if (!ring) {
+		pthread_mutex_unlock(&log_mutex);
+		return NULL;
+	}
+
+	ring->in_use = 1;
+	ring->tid = syscall(SYS_gettid);
+	pthread_mutex_unlock(&log_mutex);
 
-	ret = strftime(log_str + pos, len - pos,
-		       "%Y-%m-%d %H:%M:%S ", &time_info);
-	pos += ret;
+	pthread_setspecific(log_ring_key, ring);
+	log_self = ring;
+	return ring;
+}
+
+static struct log_rec *log_ring_reserve(struct log_ring *ring)
+{
+	unsigned int head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+						ILM_LOG_RING_SLOTS) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return &ring->rec[head & (ILM_LOG_RING_SLOTS - 1)];
+}
+
+static void log_ring_commit(struct log_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+
+	/* Only wake up the log thread when it's going to sleep */
+	if (__atomic_load_n(&log_thread_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&log_mutex);
+		pthread_cond_signal(&log_cond);
+		pthread_mutex_unlock(&log_mutex);
+	}
+}
+
+static void log_rec_stamp(struct log_rec *r, int level, int type)
+{
+	struct timespec ts;
 
-	tid = syscall(SYS_gettid);
 	clock_gettime(CLOCK_MONOTONIC, &ts);
-	ret = snprintf(log_str + pos, len - pos, "%lu [%u]: ",
-		       ts.tv_sec, tid);
-	pos += ret;
+	r->mono_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->real_sec = ts.tv_sec;
+	r->tid = log_self ? log_self->tid : syscall(SYS_gettid);
+	r->level = level;
+	r->type = type;
+}
 
-	ret = snprintf(log_str + pos, len - pos, "ARRAY: %s\n", array_name);
-	pos += ret;
+static int log_prefix(char *str, int len, time_t real_sec, uint64_t mono_ns,
+		      pid_t tid)
+{
+	struct tm time_info;
+	int pos;
 
-	log_str[pos++] = '\0';
+	if (log_file_use_utc)
+		gmtime_r(&real_sec, &time_info);
+	else
+		localtime_r(&real_sec, &time_info);
 
-	/*
-	 * Save messages in circular array "log_records" that a thread
-	 * writes to logfile/syslog
-	 */
-	log_save_record(level, log_str, pos);
+	pos = strftime(str, len, "%Y-%m-%d %H:%M:%S ", &time_info);
+	pos += snprintf(str + pos, len - pos, "%lu [%u]: ",
+			(unsigned long)(mono_ns / 1000000000), tid);
+	return pos;
+}
 
-	if (level <= log_stderr_priority)
-		fprintf(stderr, "%s", log_str);
-
-	i = 0;
-	while (buf_len > 0) {
-		if (!(i % 16)) {
-			pos = 0;
-			ret = snprintf(log_str + pos, len - pos,
-				       "%04x: ", i);
-			pos += ret;
-		}
+/* Without log thread, the message is formatted and printed directly */
+static void log_direct(int level, const char *fmt, va_list ap)
+{
+	char log_str[ILM_LOG_STR_LEN];
+	int len = ILM_LOG_STR_LEN - 2; /* leave room for \n\0 */
+	struct timespec ts, mono;
+	int ret, pos;
+
+	if (level > log_stderr_priority)
+		return;
 
-		ret = snprintf(log_str + pos, len - pos,
-			       "%02x ", buf[i] & 0xff);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	pos = log_prefix(log_str, len, ts.tv_sec,
+			 (uint64_t)mono.tv_sec * 1000000000,
+			 syscall(SYS_gettid));
+
+	ret = vsnprintf(log_str + pos, len - pos, fmt, ap);
+	if (ret >= len - pos)
+		pos = len - 1;
+	else
 		pos += ret;
 
-		i += 1;
-		if (!(i % 16)) {
-			log_str[pos++] = '\n';
-			log_str[pos++] = '\0';
+	log_str[pos++] = '\n';
+	log_str[pos++] = '\0';
 
-			log_save_record(level, log_str, pos);
+	pthread_mutex_lock(&log_mutex);
+	fprintf(stderr, "%s", log_str);
+	pthread_mutex_unlock(&log_mutex);
+}
 
-			if (level <= log_stderr_priority)
-				fprintf(stderr, "%s", log_str);
-		}
+/**
+ * The main log function, the log level is descent ordered
+ * so less value with higher priority.
+ *
+ * It saves the format and arguments into the thread's ring, the log
+ * thread formats them and writes to logfile and/or syslog (so callers
+ * neither block writing messages to files nor contend on a lock).
+ */
+void ilm_log(int level, const char *fmt, ...)
+{
+	struct log_ring *ring;
+	struct log_rec *r;
+	va_list ap;
+
+	va_start(ap, fmt);
+
+	if (!__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE)) {
+		log_direct(level, fmt, ap);
+		va_end(ap);
+		return;
+	}
 
-		buf_len -= 1;
+	ring = log_ring_get();
+	if (!ring) {
+		ring = log_shared_ring;
+		pthread_mutex_lock(&log_shared_mutex);
 	}
 
-	if (i % 16) {
-		log_str[pos++] = '\n';
-		log_str[pos++] = '\0';
+	r = log_ring_reserve(ring);
+	if (r) {
+		log_rec_stamp(r, level, LOG_REC_MSG);
+		r->fmt = fmt;
+		r->offset = 0;
+		r->argc = log_capture(r->arg, ILM_LOG_ARG_LEN, fmt, ap);
+		r->len = ILM_LOG_ARG_LEN;
+		log_ring_commit(ring);
+	}
+
+	if (ring == log_shared_ring)
+		pthread_mutex_unlock(&log_shared_mutex);
+
+	va_end(ap);
+}
 
-		log_save_record(level, log_str, pos);
+void ilm_log_array(int level, const char *array_name, char *buf, int buf_len)
+{
+	struct log_ring *ring;
+	struct log_rec *r;
+	int offset = 0, n, name_len;
 
-		if (level <= log_stderr_priority)
-			fprintf(stderr, "%s", log_str);
+	if (!__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE)) {
+		ilm_log(level, "ARRAY: %s", array_name);
+		return;
 	}
 
-	pthread_cond_signal(&log_cond);
-	pthread_mutex_unlock(&log_mutex);
-	return;
+	ring = log_ring_get();
+	if (!ring) {
+		ring = log_shared_ring;
+		pthread_mutex_lock(&log_shared_mutex);
+	}
+
+	/* Split the array into chunks, the first one carries the name */
+	do {
+		r = log_ring_reserve(ring);
+		if (!r)
+			break;
+
+		log_rec_stamp(r, level, LOG_REC_ARRAY);
+		r->fmt = NULL;
+		r->offset = offset;
+
+		name_len = 0;
+		if (!offset) {
+			name_len = snprintf(r->arg, ILM_LOG_ARG_LEN - 1 -
+					    ILM_LOG_ARRAY_CHUNK, "%s",
+					    array_name);
+			if (name_len > ILM_LOG_ARG_LEN - 2 - ILM_LOG_ARRAY_CHUNK)
+				name_len = ILM_LOG_ARG_LEN - 2 -
+					   ILM_LOG_ARRAY_CHUNK;
+		}
+		r->argc = name_len;
+
+		n = buf_len - offset;
+		if (n > ILM_LOG_ARRAY_CHUNK)
+			n = ILM_LOG_ARRAY_CHUNK;
+		memcpy(r->arg + name_len + 1, buf + offset, n);
+		r->len = n;
+
+		offset += n;
+		log_ring_commit(ring);
+	} while (offset < buf_len);
+
+	if (ring == log_shared_ring)
+		pthread_mutex_unlock(&log_shared_mutex);
 }
 
 static void log_write_record(int level, char *str)
@@ -255,7 +661,7 @@ static void log_write_dropped(int level, int num)
 {
 	char str[ILM_LOG_STR_LEN];
 
-	sprintf(str, "dropped %d entries", num);
+	sprintf(str, "dropped %d entries\n", num);
 	log_write_record(level, str);
 }
 
@@ -274,10 +680,10 @@ static void log_replay_for_error_log(void)
 	 *   - It should avoid the overflow.
 	 */
 	do {
-		first_replay = log_tail - num;
+		first_replay = log_head - num;
 
 		if (first_replay < 0)
-			first_replay = log_tail + ILM_LOG_ENTRIES - num;
+			first_replay = log_head + ILM_LOG_ENTRIES - num;
 
 		e = &log_records[first_replay];
 
@@ -293,7 +699,7 @@ static void log_replay_for_error_log(void)
 			break;
 
 		num++;
-	} while (first_replay != log_tail);
+	} while (first_replay != (int)log_head);
 
 	/*
 	 * first_replay needs to move forward one step, so can print out the
@@ -302,13 +708,13 @@ static void log_replay_for_error_log(void)
 	first_replay++;
 	first_replay = first_replay % ILM_LOG_ENTRIES;
 
-	/* If the first_replay is same with log_tail, nothing to do */
-	if (first_replay == log_tail)
+	/* If the first_replay is same with log_head, nothing to do */
+	if (first_replay == (int)log_head)
 		return;
 
 	/* Force to output replaying logs with LOG_ERR level */
 	log_write_record(LOG_ERR, (char *)("===== Detect error, replay the logs =====\n"));
-	for (i = first_replay; i != log_tail;) {
+	for (i = first_replay; i != (int)log_head;) {
 		e = &log_records[i];
 		log_write_record(LOG_ERR, e->str);
 		i = (i + 1) % ILM_LOG_ENTRIES;
@@ -316,54 +722,146 @@ static void log_replay_for_error_log(void)
 	log_write_record(LOG_ERR, (char *)("=========================================\n"));
 }
 
-static void *log_thd_fn(void *arg __maybe_unused)
+/* Write out a formatted entry and keep it in history for replaying */
+static void log_emit(int level, char *str, int len)
+{
+	/*
+	 * Detect the error, replay the log history so can give more
+	 * detailed information for debugging.
+	 */
+	log_write_record(level, str);
+	if (level <= LOG_ERR)
+		log_replay_for_error_log();
+
+	if (level <= log_stderr_priority)
+		fprintf(stderr, "%s", str);
+
+	log_save_record(level, str, len);
+}
+
+static void log_emit_rec(struct log_rec *r)
 {
 	char str[ILM_LOG_STR_LEN];
-	struct log_entry *e;
-	int level, prev_dropped;
+	int len = ILM_LOG_STR_LEN - 2; /* leave room for \n\0 */
+	int pos = 0, i;
+	char *data;
+
+	if (r->type == LOG_REC_MSG) {
+		pos = log_prefix(str, len, r->real_sec, r->mono_ns, r->tid);
+		pos += log_format(str + pos, len - pos, r);
+		str[pos++] = '\n';
+		str[pos++] = '\0';
+		log_emit(r->level, str, pos);
+		return;
+	}
+
+	if (!r->offset) {
+		pos = log_prefix(str, len, r->real_sec, r->mono_ns, r->tid);
+		pos += snprintf(str + pos, len - pos, "ARRAY: %.*s\n",
+				r->argc, r->arg);
+		log_emit(r->level, str, pos + 1);
+	}
+
+	data = r->arg + r->argc + 1;
+	for (i = 0; i < r->len; i++) {
+		if (!(i % 16))
+			pos = snprintf(str, len, "%04x: ", r->offset + i);
+
+		pos += snprintf(str + pos, len - pos, "%02x ", data[i] & 0xff);
+
+		if (!((i + 1) % 16) || i == r->len - 1) {
+			str[pos++] = '\n';
+			str[pos++] = '\0';
+			log_emit(r->level, str, pos);
+		}
+	}
+}
+
+/* Find the ring with the earliest pending record */
+static struct log_ring *log_next_ring(void)
+{
+	struct log_ring *ring, *found = NULL;
+	struct log_rec *r;
+	uint64_t earliest = UINT64_MAX;
+	unsigned int tail;
+	int num, i;
+
+	num = __atomic_load_n(&log_ring_num, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i <= num; i++) {
+		ring = i < num ? log_rings[i] : log_shared_ring;
+		if (!ring)
+			continue;
+
+		tail = ring->tail;
+		if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+			continue;
+
+		r = &ring->rec[tail & (ILM_LOG_RING_SLOTS - 1)];
+		if (r->mono_ns < earliest) {
+			earliest = r->mono_ns;
+			found = ring;
+		}
+	}
+
+	return found;
+}
+
+static void log_report_dropped(void)
+{
+	unsigned int dropped;
+	int num, i;
+
+	num = __atomic_load_n(&log_ring_num, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i <= num; i++) {
+		struct log_ring *ring = i < num ? log_rings[i] : log_shared_ring;
+
+		if (!ring || !__atomic_load_n(&ring->dropped, __ATOMIC_RELAXED))
+			continue;
+
+		dropped = __atomic_exchange_n(&ring->dropped, 0,
+					      __ATOMIC_RELAXED);
+		__atomic_add_fetch(&log_dropped, dropped, __ATOMIC_RELAXED);
+		log_write_dropped(LOG_WARNING, dropped);
+	}
+}
+
+static void *log_thd_fn(void *arg __maybe_unused)
+{
+	struct log_ring *ring;
+	struct log_rec *r;
 
 	while (1) {
+		ring = log_next_ring();
+		if (ring) {
+			r = &ring->rec[ring->tail & (ILM_LOG_RING_SLOTS - 1)];
+			log_emit_rec(r);
+			__atomic_store_n(&ring->tail, ring->tail + 1,
+					 __ATOMIC_RELEASE);
+			continue;
+		}
+
+		log_report_dropped();
+
 		pthread_mutex_lock(&log_mutex);
-		while (log_head == log_tail) {
+		__atomic_store_n(&log_thread_waiting, 1, __ATOMIC_SEQ_CST);
+
+		/* Check again so cannot miss the wakeup from a producer */
+		if (!log_next_ring()) {
 			if (log_thread_done) {
+				__atomic_store_n(&log_thread_waiting, 0,
+						 __ATOMIC_SEQ_CST);
 				pthread_mutex_unlock(&log_mutex);
-				goto out;
+				break;
 			}
 			pthread_cond_wait(&log_cond, &log_mutex);
 		}
 
-		e = &log_records[log_tail];
-		level = e->level;
-
-		/*
-		 * Detect the error, replay the log buffer so can give more
-		 * detailed information for debugging.
-		*/
-		if (level <= LOG_ERR) {
-			log_write_record(level, e->str);
-			log_replay_for_error_log();
-		/*
-		 * Otherwise, copy out the string and print the log not in
-		 * the critical condition region.
-		 */
-		} else {
-			memcpy(str, e->str, ILM_LOG_STR_LEN);
-			log_write_record(level, str);
-		}
-
-		log_tail++;
-		log_tail = log_tail % ILM_LOG_ENTRIES;
-		log_pending_ents--;
-
-		prev_dropped = log_dropped;
-		log_dropped = 0;
+		__atomic_store_n(&log_thread_waiting, 0, __ATOMIC_SEQ_CST);
 		pthread_mutex_unlock(&log_mutex);
-
-		if (prev_dropped)
-			log_write_dropped(level, prev_dropped);
 	}
 
-out:
 	pthread_exit(NULL);
 }
 
@@ -388,16 +886,24 @@ int ilm_log_init(void)
 
 	memset(log_records, 0, ILM_LOG_ENTRIES * sizeof(struct log_entry));
 
+	log_shared_ring = calloc(1, sizeof(*log_shared_ring));
+	if (!log_shared_ring)
+		goto ring_fail;
+
 	openlog(ILM_DAEMON_NAME, LOG_CONS | LOG_PID, LOG_DAEMON);
 
 	rv = pthread_create(&log_thd, NULL, log_thd_fn, NULL);
 	if (rv)
 		goto thread_fail;
 
+	__atomic_store_n(&log_thread_running, 1, __ATOMIC_RELEASE);
 	return 0;
 
 thread_fail:
 	closelog();
+	free(log_shared_ring);
+	log_shared_ring = NULL;
+ring_fail:
 	free(log_records);
 	log_records = NULL;
 alloc_fail:
@@ -408,7 +914,10 @@ alloc_fail:
 
 void ilm_log_exit(void)
 {
-	/* Notify log thread to exit */
+	/* Following logs are printed directly */
+	__atomic_store_n(&log_thread_running, 0, __ATOMIC_SEQ_CST);
+
+	/* Notify log thread to exit after draining all rings */
 	pthread_mutex_lock(&log_mutex);
 	log_thread_done = 1;
 	pthread_cond_signal(&log_cond);
@@ -436,3 +945,8 @@ void ilm_log_exit(void)
 
 	pthread_mutex_unlock(&log_mutex);
 }
+
+uint64_t ilm_log_dropped(void)
+{
+	return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
@@ -10,6 +10,7 @@
 #define __LOG_H__
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <syslog.h>
 
@@ -90,5 +91,6 @@ static inline void ilm_log_array(int level, const char *array_name,
 
 extern int ilm_log_init(void);
 extern void ilm_log_exit(void);
+extern uint64_t ilm_log_dropped(void);
 
 #endif
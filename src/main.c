@@ -7,7 +7,6 @@
  */
 
 #include <errno.h>
-#include <poll.h>
 #include <sched.h>
 #include <signal.h>
 #include <stddef.h>
@@ -26,14 +25,28 @@
 #include "drive.h"
 #include "idm_api.h"
 #include "ilm_internal.h"
+#include "journal.h"
+#include "lock.h"
 #include "log.h"
+#include "margin.h"
+#include "metrics.h"
+#include "mutex_gc.h"
+#include "recorder.h"
+#include "stats.h"
+#include "status.h"
 
 #define ILM_MAIN_LOOP_INTERVAL		1000 /* milliseconds */
 
 int ilm_shutdown = 0;
 uuid_t ilm_uuid;
 
-struct ilm_env env;
+struct ilm_env env = {
+	.margin_warn = ILM_MARGIN_WARN,
+	.margin_crit = ILM_MARGIN_CRIT,
+	.gc_high = ILM_MUTEX_GC_HIGH,
+	.gc_low = ILM_MUTEX_GC_LOW,
+	.journal = 1,
+};
 
 static int ilm_read_args(int argc, char *argv[])
 {
@@ -88,6 +101,52 @@ static int ilm_read_args(int argc, char *argv[])
 		case 'R':
 			log_replay_count = atoi(arg);
 			break;
+		case 'w':
+			env.min_workers = atoi(arg);
+			break;
+		case 'W':
+			env.max_workers = atoi(arg);
+			break;
+		case 'A':
+			env.lock_deadline = atoi(arg);
+			break;
+		case 'C':
+			env.lock_cache = atoi(arg);
+			break;
+		case 'T':
+			env.slow_request = atoi(arg);
+			break;
+		case 'M':
+			ret = sscanf(arg, "%d,%d", &env.margin_warn,
+				     &env.margin_crit);
+			if (ret < 1) {
+				fprintf(stderr, "Invalid margin thresholds %s\n",
+					arg);
+				exit(EXIT_FAILURE);
+			}
+
+			/* The critical one is never above the warning */
+			if (ret == 1 && env.margin_crit > env.margin_warn)
+				env.margin_crit = env.margin_warn;
+			break;
+		case 'P':
+			env.metrics = atoi(arg);
+			break;
+		case 'G':
+			ret = sscanf(arg, "%d,%d", &env.gc_high, &env.gc_low);
+			if (ret < 1) {
+				fprintf(stderr, "Invalid mutex watermarks %s\n",
+					arg);
+				exit(EXIT_FAILURE);
+			}
+
+			/* The low one is never above the high one */
+			if (ret == 1 && env.gc_low > env.gc_high)
+				env.gc_low = env.gc_high;
+			break;
+		case 'J':
+			env.journal = atoi(arg);
+			break;
 		default:
 			fprintf(stderr, "Unknown Option '%c'", opt);
 			exit(EXIT_FAILURE);
@@ -96,6 +155,45 @@ static int ilm_read_args(int argc, char *argv[])
 		i++;
 	}
 
+	if (env.min_workers < 0 || env.max_workers < 0 ||
+	    (env.max_workers && env.min_workers > env.max_workers)) {
+		fprintf(stderr, "Invalid worker number %d..%d\n",
+			env.min_workers, env.max_workers);
+		exit(EXIT_FAILURE);
+	}
+
+	if (env.lock_deadline < 0) {
+		fprintf(stderr, "Invalid acquire deadline %d\n",
+			env.lock_deadline);
+		exit(EXIT_FAILURE);
+	}
+
+	if (env.lock_cache < 0) {
+		fprintf(stderr, "Invalid lock cache period %d\n",
+			env.lock_cache);
+		exit(EXIT_FAILURE);
+	}
+
+	if (env.slow_request < 0) {
+		fprintf(stderr, "Invalid slow request threshold %d\n",
+			env.slow_request);
+		exit(EXIT_FAILURE);
+	}
+
+	if (env.margin_crit < 0 || env.margin_warn > 100 ||
+	    env.margin_crit > env.margin_warn) {
+		fprintf(stderr, "Invalid margin thresholds %d,%d\n",
+			env.margin_warn, env.margin_crit);
+		exit(EXIT_FAILURE);
+	}
+
+	if (env.gc_high < 0 || env.gc_low < 0 ||
+	    (env.gc_high && env.gc_low > env.gc_high)) {
+		fprintf(stderr, "Invalid mutex watermarks %d,%d\n",
+			env.gc_high, env.gc_low);
+		exit(EXIT_FAILURE);
+	}
+
 	env.run_dir = getenv("ILM_RUN_DIR");
 	if (!env.run_dir)
 		env.run_dir = ILM_DEFAULT_RUN_DIR;
@@ -169,6 +267,13 @@ static void ilm_sigterm_handler(int sig __maybe_unused,
 	ilm_shutdown = 1;
 }
 
+static void ilm_sigusr1_handler(int sig __maybe_unused,
+				siginfo_t *info __maybe_unused,
+				void *ctx __maybe_unused)
+{
+	ilm_recorder_request_dump();
+}
+
 static int ilm_signal_setup(void)
 {
 	struct sigaction act;
@@ -188,28 +293,27 @@ static int ilm_signal_setup(void)
 		}
 	}
 
+	/* Dump the flight recorder on demand */
+	act.sa_sigaction = ilm_sigusr1_handler;
+	rv = sigaction(SIGUSR1, &act, NULL);
+	if (rv < 0) {
+		ilm_log_err("Cannot set the signal handler for: %i", SIGUSR1);
+		return -1;
+	}
+
 	return 0;
 }
 
 static int ilm_main_loop(void)
 {
-	struct pollfd *pollfd = NULL;
-	int num;
 	int ret;
 
 	while (1) {
-		if (ilm_client_is_updated()) {
-			if (pollfd)
-				free(pollfd);
+		ret = ilm_client_poll(ILM_MAIN_LOOP_INTERVAL);
+		if (ret < 0 && ret != -EINTR)
+			ilm_log_err("Fail to poll clients %d", ret);
 
-			ilm_client_alloc_pollfd(&pollfd, &num);
-		}
-
-		ret = poll(pollfd, num, ILM_MAIN_LOOP_INTERVAL);
-		if (ret == -1 && errno == EINTR)
-			continue;
-
-		ilm_client_handle_request(pollfd, num);
+		ilm_recorder_poll();
 
 		if (ilm_shutdown)
 			break;
@@ -247,6 +351,10 @@ int main(int argc, char *argv[])
 	if (ret < 0)
 		goto signal_setup_fail;
 
+	/* Clients fall back to query the daemon without status region */
+	if (ilm_status_init() < 0)
+		ilm_log_warn("Status region is disabled");
+
 	ret = ilm_client_listener_init();
 	if (ret < 0)
 		goto client_fail;
@@ -261,15 +369,39 @@ int main(int argc, char *argv[])
 
 	uuid_generate(ilm_uuid);
 
+	/* Without the GC a full drive is only reclaimed as acquires fail */
+	if (ilm_mutex_gc_init() < 0)
+		ilm_log_warn("Mutex GC is disabled");
+
+	/* Without the journal the clients acquire the locks from scratch */
+	if (env.journal) {
+		if (ilm_journal_init() < 0)
+			ilm_log_warn("Lock journal is disabled");
+		else
+			ilm_lock_journal_replay();
+	}
+
+	/* The daemon works without metrics, e.g. the socket is occupied */
+	if (env.metrics && ilm_metrics_init() < 0)
+		ilm_log_warn("Metrics exporter is disabled");
+
 	ilm_main_loop();
 
+	ilm_metrics_exit();
+
+	ilm_lock_cache_exit();
+	ilm_lock_shell_exit();
+	ilm_journal_exit();
+	ilm_mutex_gc_exit();
 	idm_environ_destroy();
 idm_setup_fail:
 	ilm_cmd_queue_free();
 queue_fail:
 	ilm_client_listener_exit();
 client_fail:
+	ilm_status_exit();
 	ilm_drive_list_exit();
+	ilm_stats_exit();
 signal_setup_fail:
 	ilm_log_exit();
 	return 0;
@@ -0,0 +1,428 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "client.h"
+#include "cmd.h"
+#include "ilm_internal.h"
+#include "list.h"
+#include "lock.h"
+#include "lockspace.h"
+#include "log.h"
+#include "margin.h"
+#include "stats.h"
+#include "util.h"
+
+/* A drive below a threshold is logged again after this interval */
+#define ILM_MARGIN_LOG_INTERVAL		10000	/* ms */
+
+struct ilm_margin_drive {
+	struct ilm_renew_stats stats;
+	int log_level;
+	uint64_t log_time;
+};
+
+/*
+ * The lockspace thread checks the margin of its locks every second after
+ * renewing them: the lowest margin since the last check is either the one
+ * before the renewal succeeded, i.e. the quiescent period minus the gap, or
+ * the current one if the lock is still not renewed.  A lock or a drive of
+ * a lock is logged when this margin falls to a lower level, and is armed
+ * again once its current margin is back above the thresholds.
+ *
+ * The drives are keyed by WWN which doesn't change with the paths.
+ */
+static struct list_head margin_list = LIST_HEAD_INIT(margin_list);
+static struct ilm_margin_drive margin_drive[ILM_DRIVE_MAX_NUM];
+static int margin_drive_num;
+static pthread_mutex_t margin_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t ilm_margin_calc(uint64_t now, uint64_t last)
+{
+	/* A coalesced lock can be renewed by another thread since @now */
+	if (last >= now)
+		return IDM_QUIESCENT_PERIOD;
+
+	return (int64_t)IDM_QUIESCENT_PERIOD - (int64_t)(now - last);
+}
+
+static int ilm_margin_level(int64_t margin)
+{
+	if (env.margin_crit &&
+	    margin < (int64_t)IDM_QUIESCENT_PERIOD * env.margin_crit / 100)
+		return ILM_RENEW_LEVEL_CRIT;
+
+	if (env.margin_warn &&
+	    margin < (int64_t)IDM_QUIESCENT_PERIOD * env.margin_warn / 100)
+		return ILM_RENEW_LEVEL_WARN;
+
+	return ILM_RENEW_LEVEL_OK;
+}
+
+/* Lowest margin since the last check which has seen a renewal @gap ago */
+static int64_t ilm_margin_low(int64_t cur, uint64_t gap)
+{
+	int64_t low = (int64_t)IDM_QUIESCENT_PERIOD - (int64_t)gap;
+
+	return gap && low < cur ? low : cur;
+}
+
+/* Returns the new level if @low has fallen below the last one, or zero */
+static int ilm_margin_cross(int *level, int64_t low, int64_t cur)
+{
+	int new = ilm_margin_level(low);
+	int old = *level;
+
+	*level = ilm_margin_level(cur);
+	return new > old ? new : 0;
+}
+
+static void ilm_margin_init(struct ilm_renew_stats *stats, int type)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->type = type;
+	stats->period_ms = IDM_QUIESCENT_PERIOD;
+	stats->min_margin_ms = IDM_QUIESCENT_PERIOD;
+}
+
+static void ilm_margin_gap(struct ilm_renew_stats *stats, uint64_t gap)
+{
+	int64_t low = (int64_t)IDM_QUIESCENT_PERIOD - (int64_t)gap;
+
+	stats->count++;
+	stats->hist[ilm_stats_bucket(gap)]++;
+	if (gap > stats->max_gap_ms)
+		stats->max_gap_ms = gap;
+	if (low < stats->min_margin_ms)
+		stats->min_margin_ms = low;
+}
+
+static struct ilm_margin_drive *ilm_margin_drive_find(uint64_t wwn)
+{
+	struct ilm_margin_drive *md;
+	int i;
+
+	for (i = 0; i < margin_drive_num; i++) {
+		if (margin_drive[i].stats.wwn == wwn)
+			return &margin_drive[i];
+	}
+
+	if (margin_drive_num >= ILM_DRIVE_MAX_NUM)
+		return NULL;
+
+	md = &margin_drive[margin_drive_num++];
+	ilm_margin_init(&md->stats, ILM_RENEW_STATS_DRIVE);
+	md->stats.wwn = wwn;
+	return md;
+}
+
+/**
+ * ilm_margin_add - Start monitoring the renewal margin of a held lock
+ * @lock:	Lock whose last renewal success has been set.
+ *
+ * The statistics are kept in the lock, so they carry on when the lock is
+ * added again after a conversion or being taken back from the lock cache.
+ */
+void ilm_margin_add(struct ilm_lock *lock)
+{
+	struct ilm_lock *owner = ilm_lock_owner(lock);
+	struct ilm_drive *drive;
+	int i;
+
+	pthread_mutex_lock(&margin_mutex);
+
+	if (!lock->margin.stats.period_ms) {
+		ilm_margin_init(&lock->margin.stats, ILM_RENEW_STATS_LOCK);
+		memcpy(&lock->margin.stats.id, lock->id, IDM_LOCK_ID_LEN);
+	}
+
+	lock->margin.last = lock->last_renewal_success;
+	lock->margin.level = ILM_RENEW_LEVEL_OK;
+
+	/* The drives are renewed from the acquisition on */
+	for (i = 0; i < owner->good_drive_num; i++) {
+		drive = &owner->drive[i];
+		if (!drive->last_renew)
+			drive->last_renew = lock->last_renewal_success;
+	}
+
+	if (!lock->margin.linked) {
+		list_add_tail(&lock->margin.list, &margin_list);
+		lock->margin.linked = 1;
+	}
+
+	pthread_mutex_unlock(&margin_mutex);
+}
+
+/* Stop monitoring the lock, it's fine to call it for an unmonitored lock */
+void ilm_margin_del(struct ilm_lock *lock)
+{
+	pthread_mutex_lock(&margin_mutex);
+	if (lock->margin.linked) {
+		list_del(&lock->margin.list);
+		lock->margin.linked = 0;
+	}
+	pthread_mutex_unlock(&margin_mutex);
+}
+
+/**
+ * ilm_margin_renew_drive - Account a successful renewal on a drive
+ * @drive:	Drive of the lock which has been renewed.
+ * @now:	Time of the renewal from ilm_curr_time().
+ *
+ * Called with the lock mutex held after every renewal.
+ */
+void ilm_margin_renew_drive(struct ilm_drive *drive, uint64_t now)
+{
+	struct ilm_margin_drive *md;
+	uint64_t gap;
+
+	pthread_mutex_lock(&margin_mutex);
+
+	/* A lock which isn't monitored starts with its first renewal */
+	if (!drive->last_renew || drive->last_renew >= now) {
+		drive->last_renew = now;
+		goto out;
+	}
+
+	gap = now - drive->last_renew;
+	drive->last_renew = now;
+	if (gap > drive->renew_gap)
+		drive->renew_gap = gap;
+
+	md = ilm_margin_drive_find(drive->wwn);
+	if (!md)
+		goto out;
+
+	if (drive->path_num)
+		snprintf(md->stats.path, sizeof(md->stats.path), "%s",
+			 drive->path[0]);
+	ilm_margin_gap(&md->stats, gap);
+
+out:
+	pthread_mutex_unlock(&margin_mutex);
+}
+
+static void ilm_margin_check_drives(struct ilm_lock *owner, uint64_t now)
+{
+	struct ilm_margin_drive *md;
+	struct ilm_drive *drive;
+	int64_t cur, low;
+	int level, i;
+
+	for (i = 0; i < owner->good_drive_num; i++) {
+		drive = &owner->drive[i];
+		if (!drive->last_renew)
+			continue;
+
+		cur = ilm_margin_calc(now, drive->last_renew);
+		low = ilm_margin_low(cur, drive->renew_gap);
+		drive->renew_gap = 0;
+
+		md = ilm_margin_drive_find(drive->wwn);
+		if (!md)
+			continue;
+
+		if (low < md->stats.min_margin_ms)
+			md->stats.min_margin_ms = low;
+
+		level = ilm_margin_cross(&drive->margin_level, low, cur);
+		if (!level)
+			continue;
+
+		md->stats.warnings++;
+
+		/* Many locks on a slow drive are reported once a while */
+		if (level <= md->log_level &&
+		    now < md->log_time + ILM_MARGIN_LOG_INTERVAL)
+			continue;
+
+		md->log_level = level;
+		md->log_time = now;
+
+		if (level == ILM_RENEW_LEVEL_CRIT)
+			ilm_log_err("Renewal margin of drive %s (WWN 0x%lx) "
+				    "drops to %ld ms, below %d%% of %d ms",
+				    md->stats.path, drive->wwn, (long)low,
+				    env.margin_crit, IDM_QUIESCENT_PERIOD);
+		else
+			ilm_log_warn("Renewal margin of drive %s (WWN 0x%lx) "
+				     "drops to %ld ms, below %d%% of %d ms",
+				     md->stats.path, drive->wwn, (long)low,
+				     env.margin_warn, IDM_QUIESCENT_PERIOD);
+	}
+}
+
+/**
+ * ilm_margin_check - Check the renewal margin of a lock
+ * @lock:	Lock in the lockspace, just renewed or not.
+ * @prev:	Last renewal success before the renewal.
+ *
+ * Called by the lockspace thread with the lockspace mutex held.
+ */
+void ilm_margin_check(struct ilm_lock *lock, uint64_t prev)
+{
+	struct ilm_renew_stats *stats = &lock->margin.stats;
+	uint64_t now, last = lock->last_renewal_success;
+	int64_t cur, low;
+	int level;
+
+	now = ilm_curr_time();
+	cur = ilm_margin_calc(now, last);
+	low = ilm_margin_low(cur, last > prev ? last - prev : 0);
+
+	pthread_mutex_lock(&margin_mutex);
+
+	if (!lock->margin.linked)
+		goto out;
+
+	lock->margin.last = last;
+	if (last > prev)
+		ilm_margin_gap(stats, last - prev);
+
+	if (cur < stats->min_margin_ms)
+		stats->min_margin_ms = cur;
+
+	level = ilm_margin_cross(&lock->margin.level, low, cur);
+	if (level) {
+		stats->warnings++;
+
+		if (level == ILM_RENEW_LEVEL_CRIT) {
+			ilm_log_err("Renewal margin of lock drops to %ld ms, "
+				    "below %d%% of %d ms", (long)low,
+				    env.margin_crit, IDM_QUIESCENT_PERIOD);
+			ilm_log_array_err("Lock ID:", lock->id,
+					  IDM_LOCK_ID_LEN);
+		} else {
+			ilm_log_warn("Renewal margin of lock drops to %ld ms, "
+				     "below %d%% of %d ms", (long)low,
+				     env.margin_warn, IDM_QUIESCENT_PERIOD);
+			ilm_log_array_warn("Lock ID:", lock->id,
+					   IDM_LOCK_ID_LEN);
+		}
+	}
+
+	ilm_margin_check_drives(ilm_lock_owner(lock), now);
+
+out:
+	pthread_mutex_unlock(&margin_mutex);
+}
+
+static int ilm_margin_cmp(const void *a, const void *b)
+{
+	const struct ilm_renew_stats *x = a, *y = b;
+
+	if (x->margin_ms != y->margin_ms)
+		return x->margin_ms < y->margin_ms ? -1 : 1;
+
+	return 0;
+}
+
+/* Keep the locks with the lowest margin in @locks */
+static void ilm_margin_collect_lock(struct ilm_renew_stats *locks, int *num,
+				    struct ilm_lock *lock, int64_t margin)
+{
+	int i, max = 0;
+
+	if (*num < ILM_RENEW_STATS_LOCK_NUM) {
+		i = (*num)++;
+	} else {
+		for (i = 1; i < *num; i++) {
+			if (locks[i].margin_ms > locks[max].margin_ms)
+				max = i;
+		}
+
+		if (margin >= locks[max].margin_ms)
+			return;
+		i = max;
+	}
+
+	memcpy(&locks[i], &lock->margin.stats, sizeof(locks[i]));
+	locks[i].margin_ms = margin;
+}
+
+static void ilm_margin_collect_drives(struct ilm_renew_stats *drives,
+				      int num, struct ilm_lock *owner,
+				      uint64_t now)
+{
+	struct ilm_drive *drive;
+	int64_t margin;
+	int i, j;
+
+	for (i = 0; i < owner->good_drive_num; i++) {
+		drive = &owner->drive[i];
+		if (!drive->last_renew)
+			continue;
+
+		for (j = 0; j < num; j++) {
+			if (drives[j].wwn == drive->wwn)
+				break;
+		}
+		if (j == num)
+			continue;
+
+		margin = ilm_margin_calc(now, drive->last_renew);
+		if (margin < drives[j].margin_ms)
+			drives[j].margin_ms = margin;
+	}
+}
+
+int ilm_margin_get(struct ilm_cmd *cmd)
+{
+	struct ilm_renew_stats *stats, *locks;
+	struct ilm_margin *margin;
+	struct ilm_lock *lock;
+	uint64_t now;
+	int drive_num, lock_num = 0, i;
+
+	stats = malloc(sizeof(*stats) *
+		       (ILM_DRIVE_MAX_NUM + ILM_RENEW_STATS_LOCK_NUM));
+	if (!stats) {
+		ilm_send_result(cmd, -ENOMEM, NULL, 0);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&margin_mutex);
+
+	now = ilm_curr_time();
+
+	/* A drive without any held lock has the full margin */
+	drive_num = margin_drive_num;
+	for (i = 0; i < drive_num; i++) {
+		memcpy(&stats[i], &margin_drive[i].stats, sizeof(stats[i]));
+		stats[i].margin_ms = IDM_QUIESCENT_PERIOD;
+	}
+
+	locks = &stats[drive_num];
+	list_for_each_entry(margin, &margin_list, list) {
+		lock = container_of(margin, struct ilm_lock, margin);
+
+		ilm_margin_collect_lock(locks, &lock_num, lock,
+					ilm_margin_calc(now, margin->last));
+		ilm_margin_collect_drives(stats, drive_num,
+					  ilm_lock_owner(lock), now);
+	}
+
+	pthread_mutex_unlock(&margin_mutex);
+
+	for (i = 0; i < drive_num + lock_num; i++) {
+		stats[i].level = ilm_margin_level(stats[i].margin_ms);
+		if (stats[i].margin_ms < stats[i].min_margin_ms)
+			stats[i].min_margin_ms = stats[i].margin_ms;
+	}
+
+	/* The lowest margin first */
+	qsort(locks, lock_num, sizeof(*locks), ilm_margin_cmp);
+
+	ilm_send_result(cmd, drive_num + lock_num, (char *)stats,
+			sizeof(*stats) * (drive_num + lock_num));
+	free(stats);
+	return 0;
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __MARGIN_H__
+#define __MARGIN_H__
+
+#include <stdint.h>
+
+#include "ilm.h"
+#include "list.h"
+
+/* Default thresholds of the renewal margin, in percent of the period */
+#define ILM_MARGIN_WARN			50
+#define ILM_MARGIN_CRIT			25
+
+/* Renewal margin of a held lock, protected by the mutex in margin.c */
+struct ilm_margin {
+	struct list_head list;
+	int linked;		/* On the list while the lock is held */
+	int level;		/* ILM_RENEW_LEVEL_* of the last check */
+	uint64_t last;		/* Last renewal success seen by the check */
+	struct ilm_renew_stats stats;
+};
+
+struct ilm_cmd;
+struct ilm_drive;
+struct ilm_lock;
+
+void ilm_margin_add(struct ilm_lock *lock);
+void ilm_margin_del(struct ilm_lock *lock);
+void ilm_margin_renew_drive(struct ilm_drive *drive, uint64_t now);
+void ilm_margin_check(struct ilm_lock *lock, uint64_t prev);
+int ilm_margin_get(struct ilm_cmd *cmd);
+
+#endif /* __MARGIN_H__ */
@@ -0,0 +1,479 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "cmd.h"
+#include "drive.h"
+#include "ilm.h"
+#include "ilm_internal.h"
+#include "lockspace.h"
+#include "log.h"
+#include "metrics.h"
+#include "mutex_gc.h"
+#include "raid_lock.h"
+#include "stats.h"
+
+#define ILM_METRICS_REQ_TIMEOUT		100	/* milliseconds */
+#define ILM_METRICS_SEND_TIMEOUT	1	/* seconds */
+#define ILM_METRICS_REQ_LEN		1024
+
+/* Upper bounds of the latency buckets are 2^(k+1) us for these k */
+#define ILM_METRICS_LE_MIN		1
+#define ILM_METRICS_LE_MAX		23
+
+static pthread_t metrics_thd;
+static int metrics_fd = -1;
+static int metrics_efd = -1;
+
+static const char *metrics_op[ILM_STATS_OP_NUM] = {
+	"lock", "unlock", "refresh", "break", "destroy", "read_group",
+	"inquiry",
+};
+
+static const char *metrics_err[ILM_STATS_ERR_NUM] = {
+	"busy", "again", "time", "noent", "nomem", "inval", "perm", "other",
+};
+
+static void ilm_metrics_head(FILE *f, const char *name, const char *type,
+			     const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void ilm_metrics_gauge(FILE *f, const char *name, const char *help,
+			      long val)
+{
+	ilm_metrics_head(f, name, "gauge", help);
+	fprintf(f, "%s %ld\n", name, val);
+}
+
+static void ilm_metrics_counter(FILE *f, const char *name, const char *help,
+				uint64_t val)
+{
+	ilm_metrics_head(f, name, "counter", help);
+	fprintf(f, "%s %" PRIu64 "\n", name, val);
+}
+
+/* Label value with backslash, quote and newline escaped */
+static void ilm_metrics_label(FILE *f, const char *val)
+{
+	for (; *val; val++) {
+		if (*val == '\\' || *val == '"')
+			fputc('\\', f);
+
+		if (*val == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*val, f);
+	}
+}
+
+static void ilm_metrics_drive(FILE *f, struct ilm_drive_stats *ds, int op)
+{
+	fputs("{drive=\"", f);
+	ilm_metrics_label(f, ds->path);
+	fprintf(f, "\",wwn=\"0x%lx\",op=\"%s\"", ds->wwn, metrics_op[op]);
+}
+
+static void ilm_metrics_latency(FILE *f, struct ilm_drive_stats *ds, int num)
+{
+	const char *name = "seagate_ilm_drive_command_latency_seconds";
+	uint64_t cum;
+	int i, op, k, b;
+
+	ilm_metrics_head(f, name, "histogram",
+			 "Latency of the drive commands.");
+
+	for (i = 0; i < num; i++) {
+		for (op = 0; op < ILM_STATS_OP_NUM; op++) {
+			if (!ds[i].count[op])
+				continue;
+
+			/* Buckets below 4k hold the latencies < 2^(k+1) */
+			cum = 0;
+			b = 0;
+			for (k = ILM_METRICS_LE_MIN; k <= ILM_METRICS_LE_MAX;
+			     k++) {
+				for (; b < k * 4; b++)
+					cum += ds[i].hist[op][b];
+
+				fprintf(f, "%s_bucket", name);
+				ilm_metrics_drive(f, &ds[i], op);
+				fprintf(f, ",le=\"%.6f\"} %" PRIu64 "\n",
+					(double)(1ULL << (k + 1)) / 1000000,
+					cum);
+			}
+
+			fprintf(f, "%s_bucket", name);
+			ilm_metrics_drive(f, &ds[i], op);
+			fprintf(f, ",le=\"+Inf\"} %" PRIu64 "\n",
+				ds[i].count[op]);
+
+			fprintf(f, "%s_sum", name);
+			ilm_metrics_drive(f, &ds[i], op);
+			fprintf(f, "} %.6f\n",
+				(double)ds[i].total_us[op] / 1000000);
+
+			fprintf(f, "%s_count", name);
+			ilm_metrics_drive(f, &ds[i], op);
+			fprintf(f, "} %" PRIu64 "\n", ds[i].count[op]);
+		}
+	}
+}
+
+static void ilm_metrics_error(FILE *f, struct ilm_drive_stats *ds, int num)
+{
+	const char *name = "seagate_ilm_drive_command_errors_total";
+	int i, op, err;
+
+	ilm_metrics_head(f, name, "counter",
+			 "Failed drive commands by error.");
+
+	for (i = 0; i < num; i++) {
+		for (op = 0; op < ILM_STATS_OP_NUM; op++) {
+			for (err = 0; err < ILM_STATS_ERR_NUM; err++) {
+				if (!ds[i].error[op][err])
+					continue;
+
+				fputs(name, f);
+				ilm_metrics_drive(f, &ds[i], op);
+				fprintf(f, ",error=\"%s\"} %" PRIu64 "\n",
+					metrics_err[err], ds[i].error[op][err]);
+			}
+		}
+	}
+}
+
+static void ilm_metrics_mutex(FILE *f)
+{
+	const char *name = "seagate_ilm_drive_mutexes";
+	struct ilm_stats_mutex *ms;
+	int num, i;
+
+	ms = malloc(sizeof(*ms) * ILM_DRIVE_MAX_NUM);
+	if (!ms)
+		return;
+
+	num = ilm_stats_mutex_get(ms, ILM_DRIVE_MAX_NUM);
+
+	ilm_metrics_head(f, name, "gauge",
+			 "Mutexes on the drive at the last GC sample.");
+
+	for (i = 0; i < num; i++) {
+		fprintf(f, "%s{drive=\"", name);
+		ilm_metrics_label(f, ms[i].path);
+		fprintf(f, "\"} %d\n", ms[i].num);
+	}
+
+	free(ms);
+}
+
+/* Returns the text in a buffer allocated by open_memstream() */
+static int ilm_metrics_build(char **buf, size_t *len)
+{
+	struct ilm_cmd_queue_metrics cq;
+	struct idm_raid_metrics rm;
+	struct ilm_drive_stats *ds = NULL;
+	struct ilm_dev_map_stats dm;
+	uint64_t reclaimed, waits;
+	int ls_num, lock_num, num;
+	FILE *f;
+
+	f = open_memstream(buf, len);
+	if (!f)
+		return -ENOMEM;
+
+	ls_num = ilm_lockspace_count(&lock_num);
+	ilm_cmd_queue_metrics(&cq);
+	idm_raid_metrics(&rm);
+
+	ilm_metrics_gauge(f, "seagate_ilm_clients", "Connected clients.",
+			  ilm_client_count());
+	ilm_metrics_gauge(f, "seagate_ilm_lockspaces", "Lockspaces.", ls_num);
+	ilm_metrics_gauge(f, "seagate_ilm_locks",
+			  "Locks in all lockspaces.", lock_num);
+
+	ilm_metrics_gauge(f, "seagate_ilm_cmd_queue_depth",
+			  "Client commands waiting for a worker.",
+			  cq.pending);
+	ilm_metrics_gauge(f, "seagate_ilm_workers", "Worker threads.",
+			  cq.workers);
+	ilm_metrics_gauge(f, "seagate_ilm_workers_max",
+			  "Limit of the worker threads.", cq.max_workers);
+	ilm_metrics_gauge(f, "seagate_ilm_workers_busy",
+			  "Workers handling a client command.", cq.busy);
+	ilm_metrics_counter(f, "seagate_ilm_cmd_handled_total",
+			    "Client commands handled.", cq.handled);
+	ilm_metrics_head(f, "seagate_ilm_cmd_busy_seconds_total", "counter",
+			 "Time spent by the workers in the command handlers.");
+	fprintf(f, "seagate_ilm_cmd_busy_seconds_total %.6f\n",
+		(double)cq.busy_us / 1000000);
+
+	ilm_metrics_gauge(f, "seagate_ilm_raid_threads",
+			  "Raid threads of the lockspaces.", rm.threads);
+	ilm_metrics_gauge(f, "seagate_ilm_raid_queue_depth",
+			  "Drive requests waiting for a raid thread.",
+			  rm.queued);
+	ilm_metrics_gauge(f, "seagate_ilm_raid_inflight",
+			  "Drive requests sent and not completed.",
+			  rm.inflight);
+
+	ilm_metrics_counter(f, "seagate_ilm_log_dropped_total",
+			    "Log entries dropped on full log rings.",
+			    ilm_log_dropped());
+
+	ilm_mutex_gc_metrics(&reclaimed, &waits);
+	ilm_metrics_counter(f, "seagate_ilm_mutex_gc_reclaimed_total",
+			    "Unlocked mutexes destroyed by the GC.",
+			    reclaimed);
+	ilm_metrics_counter(f, "seagate_ilm_mutex_gc_admit_waits_total",
+			    "Acquires held back for a full drive.", waits);
+
+	ilm_get_device_mapping_stats(&dm);
+	ilm_metrics_gauge(f, "seagate_ilm_dev_map_entries",
+			  "Cached device mappings.", dm.num);
+	ilm_metrics_counter(f, "seagate_ilm_dev_map_hits_total",
+			    "Device mapping cache hits.", dm.hit);
+	ilm_metrics_counter(f, "seagate_ilm_dev_map_misses_total",
+			    "Device mapping cache misses.", dm.miss);
+	ilm_metrics_counter(f, "seagate_ilm_dev_map_evictions_total",
+			    "Device mappings evicted from the cache.",
+			    dm.evict);
+
+	ilm_metrics_mutex(f);
+
+	num = ilm_stats_collect(&ds);
+	if (num > 0) {
+		ilm_metrics_latency(f, ds, num);
+		ilm_metrics_error(f, ds, num);
+	}
+	free(ds);
+
+	if (fclose(f))
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int ilm_metrics_send(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * An HTTP GET of any path is answered with an HTTP response, so the socket
+ * can be scraped directly; a client which doesn't send anything in time,
+ * e.g. "nc -U", gets the plain text.
+ */
+static void ilm_metrics_serve(int fd)
+{
+	struct timeval tv = { .tv_sec = ILM_METRICS_SEND_TIMEOUT };
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char req[ILM_METRICS_REQ_LEN], hdr[128];
+	char *buf = NULL;
+	size_t len = 0;
+	int http = 0, ret;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (poll(&pfd, 1, ILM_METRICS_REQ_TIMEOUT) > 0) {
+		ret = recv(fd, req, sizeof(req) - 1, MSG_DONTWAIT);
+		if (ret <= 0)
+			return;
+
+		req[ret] = '\0';
+		http = !strncmp(req, "GET ", 4);
+	}
+
+	ret = ilm_metrics_build(&buf, &len);
+	if (ret < 0) {
+		ilm_log_err("%s: fail to build metrics %d", __func__, ret);
+		free(buf);
+		return;
+	}
+
+	if (http) {
+		snprintf(hdr, sizeof(hdr),
+			 "HTTP/1.0 200 OK\r\n"
+			 "Content-Type: text/plain; version=0.0.4\r\n"
+			 "Content-Length: %zu\r\n\r\n", len);
+		ret = ilm_metrics_send(fd, hdr, strlen(hdr));
+	}
+
+	if (!ret)
+		ret = ilm_metrics_send(fd, buf, len);
+	if (ret < 0)
+		ilm_log_dbg("%s: fail to send metrics %d", __func__, ret);
+
+	free(buf);
+}
+
+/* Scraping must never compete with the lock renewal for the CPU */
+static void ilm_metrics_lower_priority(void)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	if (!pthread_setschedparam(pthread_self(), SCHED_IDLE, &param))
+		return;
+
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19) < 0)
+		ilm_log_warn("Fail to lower the metrics exporter priority");
+}
+
+static void *ilm_metrics_thread(void *data)
+{
+	struct pollfd pfd[2];
+	int fd, ret;
+
+	ilm_metrics_lower_priority();
+
+	pfd[0].fd = metrics_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = metrics_efd;
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		ret = poll(pfd, 2, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ilm_log_err("%s: fail to poll %d", __func__, -errno);
+			break;
+		}
+
+		if (pfd[1].revents)
+			break;
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		ilm_metrics_serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int ilm_metrics_init(void)
+{
+	struct sockaddr_un addr;
+	int ret;
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_LOCAL;
+	snprintf(addr.sun_path, sizeof(addr.sun_path) - 1, "%s/%s",
+		 env.run_dir, ILM_METRICS_NAME);
+
+	metrics_fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (metrics_fd < 0) {
+		ilm_log_err("Cannot create metrics socket");
+		return -errno;
+	}
+
+	unlink(addr.sun_path);
+	ret = bind(metrics_fd, (struct sockaddr *)&addr,
+		   sizeof(struct sockaddr_un));
+	if (ret < 0) {
+		ret = -errno;
+		ilm_log_err("Cannot bind metrics socket %s", addr.sun_path);
+		goto fail;
+	}
+
+	ret = chmod(addr.sun_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (ret < 0) {
+		ret = -errno;
+		ilm_log_err("Cannot chmod on metrics socket file");
+		goto fail_unlink;
+	}
+
+	ret = listen(metrics_fd, 5);
+	if (ret < 0) {
+		ret = -errno;
+		ilm_log_err("Failed to listen metrics socket");
+		goto fail_unlink;
+	}
+
+	metrics_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (metrics_efd < 0) {
+		ret = -errno;
+		ilm_log_err("Fail to create eventfd for metrics exporter");
+		goto fail_unlink;
+	}
+
+	ret = pthread_create(&metrics_thd, NULL, ilm_metrics_thread, NULL);
+	if (ret) {
+		ret = -ret;
+		ilm_log_err("Fail to create metrics exporter thread");
+		goto fail_efd;
+	}
+
+	ilm_log_dbg("Metrics are served on %s", addr.sun_path);
+	return 0;
+
+fail_efd:
+	close(metrics_efd);
+	metrics_efd = -1;
+fail_unlink:
+	unlink(addr.sun_path);
+fail:
+	close(metrics_fd);
+	metrics_fd = -1;
+	return ret;
+}
+
+void ilm_metrics_exit(void)
+{
+	char path[PATH_MAX];
+
+	if (metrics_efd < 0)
+		return;
+
+	eventfd_write(metrics_efd, 1);
+	pthread_join(metrics_thd, NULL);
+
+	close(metrics_efd);
+	close(metrics_fd);
+	metrics_efd = -1;
+	metrics_fd = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", env.run_dir, ILM_METRICS_NAME);
+	unlink(path);
+}
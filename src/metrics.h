@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/*
+ * Metrics exporter: serves the daemon's counters in the Prometheus text
+ * format on the unix socket ILM_METRICS_NAME in the run directory.  The
+ * exporter runs in its own idle priority thread and only reads counters
+ * which are updated atomically, so a scrape never takes a lock used by
+ * the client commands or the drive commands.
+ */
+int ilm_metrics_init(void);
+void ilm_metrics_exit(void);
+
+#endif /* __METRICS_H__ */
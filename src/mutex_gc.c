@@ -0,0 +1,392 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "idm_api.h"
+#include "ilm.h"
+#include "ilm_internal.h"
+#include "lock.h"
+#include "log.h"
+#include "mutex_gc.h"
+#include "stats.h"
+#include "util.h"
+
+#define ILM_MUTEX_GC_INTERVAL		30000	/* ms between two samples */
+#define ILM_MUTEX_GC_RETRY		1000	/* ms, while reclaiming */
+#define ILM_MUTEX_GC_BATCH		256	/* Destroyed mutexes per pass */
+
+struct ilm_mutex_gc_drive {
+	uint64_t wwn;
+	char *path;		/* Path used by the last acquire */
+	unsigned int num;	/* Mutexes at the last sample */
+	int full;		/* Acquires wait until it's reclaimed */
+	uint64_t next;		/* ilm_curr_time() of the next sample */
+};
+
+/*
+ * The drive firmware has a fixed size mutex table, and an unlocked mutex
+ * stays in it until it's destroyed.  One thread samples the mutex number of
+ * every drive used by the acquires of this host; above the high watermark
+ * it destroys the least recently renewed unlocked mutexes in batches down
+ * to the low watermark.  While a drive is above ILM_MUTEX_GC_ADMIT, or has
+ * failed an acquire with -ENOMEM, new acquires on it wait for the GC.
+ *
+ * The drives are keyed by WWN and never removed, so an entry stays valid
+ * after the mutex is dropped.
+ */
+static struct ilm_mutex_gc_drive gc_drive[ILM_DRIVE_MAX_NUM];
+static int gc_drive_num;
+static pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_cond;		/* Wakes up the GC thread */
+static pthread_cond_t gc_admit_cond;	/* Wakes up the waiting acquires */
+static pthread_t gc_thd;
+static int gc_running;
+static int gc_exit;
+
+/* Read by the metrics exporter without the mutex */
+static uint64_t gc_reclaimed;
+static uint64_t gc_admit_waits;
+
+static void ilm_mutex_gc_ts(uint64_t ms, struct timespec *ts)
+{
+	ts->tv_sec = ms / 1000;
+	ts->tv_nsec = (ms % 1000) * 1000000;
+}
+
+/* Called with gc_mutex held */
+static struct ilm_mutex_gc_drive *ilm_mutex_gc_find(uint64_t wwn, char *path)
+{
+	struct ilm_mutex_gc_drive *gd = NULL;
+	char *dup;
+	int i;
+
+	for (i = 0; i < gc_drive_num; i++) {
+		if (gc_drive[i].wwn == wwn) {
+			gd = &gc_drive[i];
+			break;
+		}
+	}
+
+	/* Follow the path which works for the acquires */
+	if (gd && !strcmp(gd->path, path))
+		return gd;
+
+	dup = strdup(path);
+	if (!dup)
+		return gd;
+
+	if (gd) {
+		free(gd->path);
+		gd->path = dup;
+		return gd;
+	}
+
+	if (gc_drive_num >= ILM_DRIVE_MAX_NUM) {
+		free(dup);
+		return NULL;
+	}
+
+	/* Sample a new drive right away */
+	gd = &gc_drive[gc_drive_num++];
+	gd->wwn = wwn;
+	gd->path = dup;
+	gd->num = 0;
+	gd->full = 0;
+	gd->next = 0;
+	pthread_cond_signal(&gc_cond);
+	return gd;
+}
+
+/**
+ * ilm_mutex_gc_admit - Wait for room in the mutex tables of the drives
+ * @lock:	Lock which is going to be acquired.
+ * @deadline:	ilm_curr_time() when to stop waiting.
+ *
+ * An acquire on a full drive would only fail with -ENOMEM, so it's held
+ * back while the GC reclaims the drive.  After the deadline the acquire is
+ * sent anyway and the drive decides.
+ */
+void ilm_mutex_gc_admit(struct ilm_lock *lock, uint64_t deadline)
+{
+	struct ilm_mutex_gc_drive *gd;
+	struct ilm_drive *drive;
+	struct timespec ts;
+	int i, waited = 0;
+
+	if (!__atomic_load_n(&gc_running, __ATOMIC_ACQUIRE))
+		return;
+
+	ilm_mutex_gc_ts(deadline, &ts);
+
+	pthread_mutex_lock(&gc_mutex);
+
+	for (i = 0; i < lock->good_drive_num && !gc_exit; i++) {
+		drive = &lock->drive[i];
+		if (!drive->wwn || !drive->path_num || !drive->path[0])
+			continue;
+
+		gd = ilm_mutex_gc_find(drive->wwn, drive->path[0]);
+		if (!gd)
+			continue;
+
+		while (gd->full && !gc_exit) {
+			if (!waited++)
+				__atomic_add_fetch(&gc_admit_waits, 1,
+						   __ATOMIC_RELAXED);
+
+			if (pthread_cond_timedwait(&gc_admit_cond, &gc_mutex,
+						   &ts) == ETIMEDOUT)
+				goto out;
+		}
+	}
+
+out:
+	pthread_mutex_unlock(&gc_mutex);
+}
+
+/* The least recently renewed mutex first */
+static int ilm_mutex_gc_cmp(const void *a, const void *b)
+{
+	const struct idm_info *x = a, *y = b;
+
+	if (x->last_renew_time != y->last_renew_time)
+		return x->last_renew_time < y->last_renew_time ? -1 : 1;
+
+	return 0;
+}
+
+/* Destroy at most @want unlocked mutexes, returns the destroyed number */
+static int ilm_mutex_gc_reclaim(char *path, int want)
+{
+	struct idm_info *info_list = NULL, *info;
+	int info_num = 0, num = 0, done = 0;
+	int ret, i;
+
+	ret = idm_drive_read_group(path, &info_list, &info_num);
+	if (ret < 0) {
+		ilm_log_warn("%s: fail to read mutexes on %s %d",
+			     __func__, path, ret);
+		return ret;
+	}
+
+	for (i = 0; i < info_num; i++) {
+		if (info_list[i].state == IDM_MODE_UNLOCK)
+			info_list[num++] = info_list[i];
+	}
+
+	qsort(info_list, num, sizeof(*info_list), ilm_mutex_gc_cmp);
+
+	for (i = 0; i < num && done < want; i++) {
+		info = &info_list[i];
+
+		/* Fails if it has been acquired again in the meantime */
+		ret = idm_drive_destroy_lock(info->id, info->mode,
+					     info->host_id, path);
+		if (!ret)
+			done++;
+	}
+
+	free(info_list);
+	return done;
+}
+
+/**
+ * ilm_mutex_gc_full - Reclaim a drive which failed an acquire with -ENOMEM
+ * @drive:	Drive of the lock.
+ * @path:	Path which the acquire was sent to.
+ *
+ * The drive is reclaimed by the GC thread, the following acquires on it
+ * wait in ilm_mutex_gc_admit() until it's done.  If the GC isn't running,
+ * or cannot track the drive, the least recently renewed unlocked mutex is
+ * destroyed right away, so the retry of the acquire can find room.
+ */
+void ilm_mutex_gc_full(struct ilm_drive *drive, char *path)
+{
+	struct ilm_mutex_gc_drive *gd = NULL;
+	int done;
+
+	if (__atomic_load_n(&gc_running, __ATOMIC_ACQUIRE) && drive->wwn) {
+		pthread_mutex_lock(&gc_mutex);
+
+		gd = gc_exit ? NULL : ilm_mutex_gc_find(drive->wwn, path);
+		if (gd && !gd->full) {
+			gd->full = 1;
+			gd->next = 0;
+			pthread_cond_signal(&gc_cond);
+		}
+
+		pthread_mutex_unlock(&gc_mutex);
+	}
+
+	if (gd)
+		return;
+
+	done = ilm_mutex_gc_reclaim(path, 1);
+	if (done > 0) {
+		__atomic_add_fetch(&gc_reclaimed, done, __ATOMIC_RELAXED);
+		ilm_log_warn("Drive %s: destroyed a mutex for a full drive",
+			     path);
+	}
+}
+
+/* Called with gc_mutex held, which is dropped during the drive I/O */
+static void ilm_mutex_gc_pass(struct ilm_mutex_gc_drive *gd, uint64_t now)
+{
+	char path[PATH_MAX];
+	unsigned int num;
+	int full, want = 0, done = 0, ret;
+
+	snprintf(path, sizeof(path), "%s", gd->path);
+	full = gd->full;
+
+	pthread_mutex_unlock(&gc_mutex);
+
+	ret = idm_drive_read_mutex_num(path, &num);
+	if (ret < 0) {
+		ilm_log_dbg("%s: fail to read mutex number of %s %d",
+			    __func__, path, ret);
+		pthread_mutex_lock(&gc_mutex);
+		goto out;
+	}
+
+	ilm_stats_mutex_num(path, num);
+
+	if (env.gc_high && num >= (unsigned int)env.gc_high)
+		want = num - env.gc_low;
+	else if (full)
+		want = ILM_MUTEX_GC_BATCH;
+	if (want > ILM_MUTEX_GC_BATCH)
+		want = ILM_MUTEX_GC_BATCH;
+
+	/* Hold off the acquires while the drive is being reclaimed */
+	pthread_mutex_lock(&gc_mutex);
+	if (want && num >= ILM_MUTEX_GC_ADMIT)
+		gd->full = full = 1;
+	pthread_mutex_unlock(&gc_mutex);
+
+	if (want) {
+		done = ilm_mutex_gc_reclaim(path, want);
+		if (done > 0) {
+			__atomic_add_fetch(&gc_reclaimed, done,
+					   __ATOMIC_RELAXED);
+			ilm_log_warn("Drive %s: destroyed %d of %u mutexes",
+				     path, done, num);
+
+			if (!idm_drive_read_mutex_num(path, &num))
+				ilm_stats_mutex_num(path, num);
+		} else if (full) {
+			ilm_log_warn("Drive %s: no unlocked mutex to destroy "
+				     "among %u", path, num);
+		}
+	}
+
+	pthread_mutex_lock(&gc_mutex);
+	gd->num = num;
+
+out:
+	/* Keep the acquires waiting only as long as it makes progress */
+	gd->full = full && done > 0 && num >= ILM_MUTEX_GC_ADMIT;
+	if (done > 0 &&
+	    (gd->full || (env.gc_high && num >= (unsigned int)env.gc_high)))
+		gd->next = now + ILM_MUTEX_GC_RETRY;
+	else
+		gd->next = now + ILM_MUTEX_GC_INTERVAL;
+
+	if (!gd->full)
+		pthread_cond_broadcast(&gc_admit_cond);
+}
+
+static void *ilm_mutex_gc_thread(void *data)
+{
+	struct ilm_mutex_gc_drive *gd;
+	struct timespec ts;
+	uint64_t now, next;
+	int i;
+
+	pthread_mutex_lock(&gc_mutex);
+
+	while (!gc_exit) {
+		now = ilm_curr_time();
+		next = now + ILM_MUTEX_GC_INTERVAL;
+		gd = NULL;
+
+		for (i = 0; i < gc_drive_num; i++) {
+			if (gc_drive[i].next <= now) {
+				gd = &gc_drive[i];
+				break;
+			}
+
+			if (gc_drive[i].next < next)
+				next = gc_drive[i].next;
+		}
+
+		if (gd) {
+			ilm_mutex_gc_pass(gd, now);
+			continue;
+		}
+
+		ilm_mutex_gc_ts(next, &ts);
+		pthread_cond_timedwait(&gc_cond, &gc_mutex, &ts);
+	}
+
+	pthread_mutex_unlock(&gc_mutex);
+	return NULL;
+}
+
+int ilm_mutex_gc_init(void)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&gc_cond, &attr);
+	pthread_cond_init(&gc_admit_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&gc_thd, NULL, ilm_mutex_gc_thread, NULL);
+	if (ret) {
+		ilm_log_err("Fail to create mutex GC thread");
+		return -ret;
+	}
+
+	__atomic_store_n(&gc_running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void ilm_mutex_gc_exit(void)
+{
+	int i;
+
+	if (!__atomic_load_n(&gc_running, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&gc_mutex);
+	gc_exit = 1;
+	pthread_cond_signal(&gc_cond);
+	pthread_cond_broadcast(&gc_admit_cond);
+	pthread_mutex_unlock(&gc_mutex);
+
+	pthread_join(gc_thd, NULL);
+
+	pthread_mutex_lock(&gc_mutex);
+	for (i = 0; i < gc_drive_num; i++)
+		free(gc_drive[i].path);
+	gc_drive_num = 0;
+	pthread_mutex_unlock(&gc_mutex);
+}
+
+void ilm_mutex_gc_metrics(uint64_t *reclaimed, uint64_t *waits)
+{
+	*reclaimed = __atomic_load_n(&gc_reclaimed, __ATOMIC_RELAXED);
+	*waits = __atomic_load_n(&gc_admit_waits, __ATOMIC_RELAXED);
+}
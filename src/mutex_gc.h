@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __MUTEX_GC_H__
+#define __MUTEX_GC_H__
+
+#include <stdint.h>
+
+#include "idm_cmd_common.h"
+
+/*
+ * Default watermarks of the mutex table on a drive: above the high one
+ * the oldest unlocked mutexes are destroyed until the low one is reached.
+ */
+#define ILM_MUTEX_GC_HIGH		MAX_MUTEX_NUM_WARNING_LIMIT
+#define ILM_MUTEX_GC_LOW		3000
+
+/* New acquires on a drive with this many mutexes wait for the GC */
+#define ILM_MUTEX_GC_ADMIT		MAX_MUTEX_NUM_ERROR_LIMIT
+
+struct ilm_drive;
+struct ilm_lock;
+
+int ilm_mutex_gc_init(void);
+void ilm_mutex_gc_exit(void);
+void ilm_mutex_gc_admit(struct ilm_lock *lock, uint64_t deadline);
+void ilm_mutex_gc_full(struct ilm_drive *drive, char *path);
+void ilm_mutex_gc_metrics(uint64_t *reclaimed, uint64_t *waits);
+
+#endif /* __MUTEX_GC_H__ */
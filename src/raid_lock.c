@@ -7,18 +7,25 @@
 #include <errno.h>
 #include <poll.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ilm.h"
 
 #include "idm_api.h"
+#include "ilm_internal.h"
 #include "inject_fault.h"
 #include "lock.h"
 #include "log.h"
+#include "margin.h"
+#include "mutex_gc.h"
 #include "raid_lock.h"
+#include "req_trace.h"
+#include "stats.h"
 #include "string.h"
+#include "trace.h"
 #include "util.h"
-#include "uuid.h"
 
 
 #define EALL				0xDEADBEAF
@@ -29,6 +36,13 @@
 /* Poll timeout 1s (1000ms) */
 #define RAID_LOCK_POLL_INTERVAL		1000
 
+/* Backoff range for probing a contended lock (us) */
+#define RAID_LOCK_BACKOFF_MIN		500
+#define RAID_LOCK_BACKOFF_MAX		32000
+
+/* Maximum outstanding requests in one wave for multiple locks */
+#define RAID_WAVE_MAX_REQUESTS		256
+
 enum {
 	ILM_OP_LOCK = 0,
 	ILM_OP_UNLOCK,
@@ -57,8 +71,22 @@ struct _raid_state_transition {
 	int next;
 };
 
+/*
+ * Completion for one wave of requests issued by a caller; every caller
+ * waits on its own wave, so multiple commands can issue requests via the
+ * same raid thread at the same time without picking up the responses of
+ * each other.
+ */
+struct _raid_wave {
+	int count;		/* Outstanding requests, only used by issuer */
+	struct list_head response_list;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
 struct _raid_request {
 	struct list_head list;
+	struct _raid_wave *wave;
 
 	char *path;
 	int path_idx;
@@ -78,6 +106,10 @@ struct _raid_request {
 
 	uint64_t handle;
 	int result;
+
+	uint64_t trace_id;	/* Client request, zero for renewal */
+	uint64_t sent;
+	uint64_t done;
 };
 
 struct _raid_thread {
@@ -92,19 +124,21 @@ struct _raid_thread {
 	pthread_mutex_t request_mutex;
 	pthread_cond_t request_cond;
 
-	struct list_head process_list;
+	/* Wake up the thread when it's polling drives */
+	int efd;
 
-	int count;
-	struct list_head response_list;
-	pthread_mutex_t response_mutex;
-	pthread_cond_t response_cond;
+	struct list_head process_list;
+	int process_num;
 
-	int renew_count;
-	struct list_head renew_list;
-	pthread_mutex_t renew_mutex;
-	pthread_cond_t renew_cond;
+	/* Polling array and the request for every entry */
+	struct pollfd *poll_fd;
+	struct _raid_request **poll_req;
+	int poll_max;
 };
 
+/* Totals of all raid threads, only for the metrics */
+static struct idm_raid_metrics raid_metrics;
+
 /*
  * Every IDM drive's state machine is maintained as below:
  *
@@ -455,6 +489,7 @@ static int _raid_dispatch_request_async(struct _raid_request *req)
 	req->handle = handle;
 	req->result = ret;
 
+	ilm_trace5(raid_dispatch, req, lock->id, req->op, req->path, ret);
 	return ret;
 }
 
@@ -502,10 +537,15 @@ static int _raid_read_result_async(struct _raid_request *req)
 		break;
 	}
 
-	if (ret)
+	/* A failed transfer (e.g. POLLERR) is the request's result */
+	if (ret) {
 		ilm_log_err("%s: ret=%d", __func__, ret);
+		req->result = ret < 0 ? ret : -EIO;
+	}
+
+	ilm_trace5(raid_result, req, req->lock->id, req->op, req->path,
+		   req->result);
 
-	assert(ret == 0);
 	return ret;
 }
 
@@ -629,16 +669,40 @@ static int idm_raid_state_transition(struct _raid_request *req)
 		    _raid_state_str(drive->state), drive->state,
 		    _raid_state_str(next_state), next_state);
 
+	/* Contention on the drive: held by others, duplicate or broken */
+	if (state == IDM_INIT && result == -EBUSY)
+		ilm_stats_lock(req->lock->id, ILM_STATS_LOCK_BUSY, 0);
+	else if (state == IDM_INIT && result == -EAGAIN)
+		ilm_stats_lock(req->lock->id, ILM_STATS_LOCK_AGAIN, 0);
+	else if (state == IDM_BUSY && !result)
+		ilm_stats_lock(req->lock->id, ILM_STATS_LOCK_BREAK, 0);
+
 	drive->state = next_state;
 	return 0;
 }
 
+static void idm_raid_wave_init(struct _raid_wave *wave)
+{
+	wave->count = 0;
+	INIT_LIST_HEAD(&wave->response_list);
+	pthread_mutex_init(&wave->mutex, NULL);
+	pthread_cond_init(&wave->cond, NULL);
+}
+
+static void idm_raid_wave_destroy(struct _raid_wave *wave)
+{
+	pthread_mutex_destroy(&wave->mutex);
+	pthread_cond_destroy(&wave->cond);
+}
+
 static int idm_raid_add_request(struct _raid_thread *raid_th,
+				struct _raid_wave *wave,
 				struct _raid_request *req)
 {
 	struct ilm_drive *drive = req->drive;
 
 	req->op = _raid_state_find_op(drive->state, req->op);
+	req->wave = wave;
 
 	pthread_mutex_lock(&raid_th->request_mutex);
 
@@ -648,19 +712,17 @@ static int idm_raid_add_request(struct _raid_thread *raid_th,
 	}
 
 	list_add_tail(&req->list, &raid_th->request_list);
+	__atomic_add_fetch(&raid_metrics.queued, 1, __ATOMIC_RELAXED);
 
 	pthread_mutex_unlock(&raid_th->request_mutex);
 
-	if (req->renew)
-		raid_th->renew_count++;
-	else
-		raid_th->count++;
+	wave->count++;
 
 	ilm_log_dbg("raid_lock send request: drive=%s state=%s(%d) op=%s(%d) mode=%d renew=%d",
 		    req->path, _raid_state_str(drive->state), drive->state,
 		    _raid_op_str(req->op), req->op, req->mode, req->renew);
-	ilm_log_dbg("  -> raid_thread=%p renew_count=%d count=%d",
-		    raid_th, raid_th->renew_count, raid_th->count);
+	ilm_log_dbg("  -> raid_thread=%p wave=%p count=%d",
+		    raid_th, wave, wave->count);
 
 	return 0;
 }
@@ -670,210 +732,240 @@ static void idm_raid_signal_request(struct _raid_thread *raid_th)
 	pthread_mutex_lock(&raid_th->request_mutex);
 	pthread_cond_signal(&raid_th->request_cond);
 	pthread_mutex_unlock(&raid_th->request_mutex);
+
+	/* Kick the raid thread if it's waiting for drives */
+	eventfd_write(raid_th->efd, 1);
 }
 
-static struct _raid_request *
-idm_raid_wait_response(struct _raid_thread *raid_th)
+static struct _raid_request *idm_raid_wait(struct _raid_wave *wave)
 {
 	struct _raid_request *req;
 
-	if (!raid_th->count)
+	if (!wave->count)
 		return NULL;
 
-	pthread_mutex_lock(&raid_th->response_mutex);
+	pthread_mutex_lock(&wave->mutex);
 
-	if (list_empty(&raid_th->response_list))
-		pthread_cond_wait(&raid_th->response_cond,
-				  &raid_th->response_mutex);
+	while (list_empty(&wave->response_list))
+		pthread_cond_wait(&wave->cond, &wave->mutex);
 
-	req = list_first_entry(&raid_th->response_list,
+	req = list_first_entry(&wave->response_list,
 				struct _raid_request, list);
 	list_del(&req->list);
 
 	ilm_log_dbg("%s: response [drive=%s]", __func__, req->path);
-	pthread_mutex_unlock(&raid_th->response_mutex);
+	pthread_mutex_unlock(&wave->mutex);
 
-	raid_th->count--;
+	wave->count--;
 	return req;
 }
 
-static struct _raid_request *
-idm_raid_wait_renew(struct _raid_thread *raid_th)
+static void idm_raid_notify(struct _raid_thread *raid_th,
+			    struct _raid_request *req)
 {
-	struct _raid_request *req;
-
-	if (!raid_th->renew_count)
-		return NULL;
-
-	pthread_mutex_lock(&raid_th->renew_mutex);
+	struct _raid_wave *wave = req->wave;
 
-	if (list_empty(&raid_th->renew_list))
-		pthread_cond_wait(&raid_th->renew_cond,
-				  &raid_th->renew_mutex);
-
-	req = list_first_entry(&raid_th->renew_list,
-				struct _raid_request, list);
-	list_del(&req->list);
-
-	ilm_log_dbg("%s: renew response [drive=%s]", __func__, req->path);
-	pthread_mutex_unlock(&raid_th->renew_mutex);
-
-	raid_th->renew_count--;
-	return req;
+	/*
+	 * The waiter can free the request and the wave as soon as the
+	 * result is queued, so don't touch them afterwards.
+	 */
+	req->done = ilm_stats_now();
+	ilm_log_dbg("[raid_thread=%p] <- add [drive=%s] result to wave=%p",
+		    raid_th, req->path, wave);
+
+	pthread_mutex_lock(&wave->mutex);
+	list_add_tail(&req->list, &wave->response_list);
+	pthread_cond_signal(&wave->cond);
+	pthread_mutex_unlock(&wave->mutex);
+	return;
 }
 
-static struct _raid_request *
-idm_raid_wait(struct _raid_thread *raid_th, int renew)
+static void idm_raid_dispatch(struct _raid_thread *raid_th,
+			      struct list_head *list)
 {
-	if (!renew)
-		return idm_raid_wait_response(raid_th);
-	else
-		return idm_raid_wait_renew(raid_th);
-}
+	struct _raid_request *req, *tmp;
+	int ret;
 
-static void idm_raid_notify(struct _raid_thread *raid_th,
-			    struct _raid_request *req)
-{
-	if (req->renew) {
-		pthread_mutex_lock(&raid_th->renew_mutex);
-		list_add_tail(&req->list, &raid_th->renew_list);
-		pthread_cond_signal(&raid_th->renew_cond);
-		pthread_mutex_unlock(&raid_th->renew_mutex);
-	} else {
-		pthread_mutex_lock(&raid_th->response_mutex);
-		list_add_tail(&req->list, &raid_th->response_list);
-		pthread_cond_signal(&raid_th->response_cond);
-		pthread_mutex_unlock(&raid_th->response_mutex);
-	}
+	list_for_each_entry_safe(req, tmp, list, list) {
+		list_del(&req->list);
+		__atomic_sub_fetch(&raid_metrics.queued, 1, __ATOMIC_RELAXED);
+
+		/* The transport requests are tagged with the trace ID */
+		ilm_req_trace_set_id(req->trace_id);
+		req->sent = ilm_stats_now();
+		ret = _raid_dispatch_request_async(req);
+		ilm_req_trace_set_id(0);
+
+		ilm_log_dbg("[raid_thread=%p] -> (async) drive=%s op=%s(%d) ret=%d",
+			    raid_th, req->path, _raid_op_str(req->op),
+			    req->op, ret);
+
+		if (ret < 0) {
+			ilm_log_err("[raid_thread=%p] dispatch failed %d",
+				    raid_th, ret);
+			req->result = ret;
+			idm_raid_notify(raid_th, req);
+			continue;
+		}
 
-	ilm_log_dbg("[raid_thread=%p] <- add [drive=%s] result to %s list",
-		    raid_th, req->path, req->renew ? "renew" : "response");
-	return;
+		list_add_tail(&req->list, &raid_th->process_list);
+		raid_th->process_num++;
+		__atomic_add_fetch(&raid_metrics.inflight, 1,
+				   __ATOMIC_RELAXED);
+	}
 }
 
-static void *idm_raid_thread(void *data)
+static int idm_raid_poll(struct _raid_thread *raid_th)
 {
-	struct _raid_thread *raid_th = data;
-	struct _raid_request *req, *tmp;
-	int process_num, num;
+	struct _raid_request *req, **poll_req;
 	struct pollfd *poll_fd;
+	uint64_t event_data;
+	int num, i;
 #ifndef IDM_PTHREAD_EMULATION
 	int ret;
 #endif
-	int i;
 
-	raid_th->init = 1;
+	/* One more entry for eventfd */
+	if (raid_th->process_num + 1 > raid_th->poll_max) {
+		num = (raid_th->process_num + 1) * 2;
+
+		poll_fd = realloc(raid_th->poll_fd,
+				  sizeof(struct pollfd) * num);
+		if (!poll_fd)
+			return -ENOMEM;
+		raid_th->poll_fd = poll_fd;
+
+		poll_req = realloc(raid_th->poll_req,
+				   sizeof(struct _raid_request *) * num);
+		if (!poll_req)
+			return -ENOMEM;
+		raid_th->poll_req = poll_req;
+		raid_th->poll_max = num;
+	}
 
-	pthread_mutex_lock(&raid_th->request_mutex);
+	poll_fd = raid_th->poll_fd;
+	memset(poll_fd, 0x0, sizeof(struct pollfd) * raid_th->poll_max);
 
-	while (1) {
-		while (!raid_th->exit && list_empty(&raid_th->request_list))
-			pthread_cond_wait(&raid_th->request_cond,
-					  &raid_th->request_mutex);
+	/* Prepare for polling file descriptor array */
+	num = 0;
+	list_for_each_entry(req, &raid_th->process_list, list) {
+		poll_fd[num].fd = idm_drive_get_fd(req->path, req->handle);
+		poll_fd[num].events = POLLIN;
+		raid_th->poll_req[num] = req;
+		num++;
+	}
 
-		process_num = 0;
-		while (!list_empty(&raid_th->request_list)) {
-			req = list_first_entry(&raid_th->request_list,
-					       struct _raid_request, list);
-			list_del(&req->list);
-			list_add_tail(&req->list, &raid_th->process_list);
-			process_num++;
-		}
+#ifndef IDM_PTHREAD_EMULATION
+	poll_fd[num].fd = raid_th->efd;
+	poll_fd[num].events = POLLIN;
 
-		pthread_mutex_unlock(&raid_th->request_mutex);
+	/* Wait for drive's response or new requests */
+	ret = poll(poll_fd, num + 1, RAID_LOCK_POLL_INTERVAL);
+	if (ret == -1 && errno == EINTR)
+		return 0;
+#else
+	/*
+	 * Emulate asnyc operation, simply set response for
+	 * all FDs
+	*/
+	for (i = 0; i < num; i++)
+		poll_fd[i].revents = POLLIN;
+#endif
 
-		list_for_each_entry_safe(req, tmp,
-				         &raid_th->process_list, list) {
-			ret = _raid_dispatch_request_async(req);
+	/* Drain the kicks, new requests are picked up by the caller */
+	eventfd_read(raid_th->efd, &event_data);
 
-			ilm_log_dbg("[raid_thread=%p] -> (async) drive=%s op=%s(%d) ret=%d",
-				    raid_th, req->path, _raid_op_str(req->op),
-				    req->op, ret);
+	/*
+	 * Handle for all response; an error or hangup on the drive also
+	 * completes the request, the result read reports the failure.
+	 */
+	for (i = 0; i < num; i++) {
+		if (!poll_fd[i].revents)
+			continue;
 
-			if (ret < 0) {
-				ilm_log_err("[raid_thread=%p] dispatch failed %d",
-					    raid_th, ret);
-				req->result = ret;
-				/* Remove from process list */
-				list_del(&req->list);
-				idm_raid_notify(raid_th, req);
-			}
+		req = raid_th->poll_req[i];
 
-			//_raid_dispatch_request(req);
-		}
+		_raid_read_result_async(req);
 
-		poll_fd = malloc(sizeof(struct pollfd) * process_num);
-		if (!poll_fd) {
-			ilm_log_err("[raid_thread=%p] cannot allcoate pollfd",
-				    raid_th);
-			return NULL;
-		}
+		ilm_log_dbg("[raid_thread=%p] <- (resp) drive=%s op=%s(%d) result=%d",
+			    raid_th, req->path, _raid_op_str(req->op),
+			    req->op, req->result);
 
-		while (!list_empty(&raid_th->process_list)) {
+		list_del(&req->list);
+		raid_th->process_num--;
+		__atomic_sub_fetch(&raid_metrics.inflight, 1,
+				   __ATOMIC_RELAXED);
+		idm_raid_notify(raid_th, req);
+	}
 
-			memset(poll_fd, 0x0, sizeof(struct pollfd) * process_num);
+	return 0;
+}
 
-			/* Prepare for polling file descriptor array */
-			num = 0;
-			list_for_each_entry(tmp, &raid_th->process_list, list) {
-				poll_fd[num].fd = idm_drive_get_fd(tmp->path,
-				                                   tmp->handle);
-				poll_fd[num].events = POLLIN;
-				num++;
-			}
+/*
+ * Without the poll array the outstanding requests can't be waited on,
+ * so fail them back to their waves rather than leaving them hanging;
+ * the thread keeps serving the new requests.  The transfers may still
+ * be in flight, so their handles are left to the drive.
+ */
+static void idm_raid_fail_all(struct _raid_thread *raid_th, int err)
+{
+	struct _raid_request *req, *tmp;
 
-#ifndef IDM_PTHREAD_EMULATION
-			/* Wait for drive's response */
-			ret = poll(poll_fd, num, RAID_LOCK_POLL_INTERVAL);
-			if (ret == -1 && errno == EINTR)
-				continue;
-#else
-			/*
-			 * Emulate asnyc operation, simply set response for
-			 * all FDs
-			*/
-			for (i = 0; i < num; i++)
-				poll_fd[i].revents = POLLIN;
-#endif
+	list_for_each_entry_safe(req, tmp, &raid_th->process_list, list) {
+		list_del(&req->list);
+		raid_th->process_num--;
+		__atomic_sub_fetch(&raid_metrics.inflight, 1,
+				   __ATOMIC_RELAXED);
+		req->result = err;
+		idm_raid_notify(raid_th, req);
+	}
+}
 
-			/* Handle for all response */
-			for (i = 0; i < num; i++) {
-				if (!poll_fd[i].revents & POLLIN)
-					continue;
+/*
+ * The raid thread keeps polling the outstanding requests and picks up
+ * the new requests as soon as they arrive, so a wave issued by one
+ * command doesn't need to wait for the waves of other commands.
+ */
+static void *idm_raid_thread(void *data)
+{
+	struct _raid_thread *raid_th = data;
+	struct list_head list;
+	int ret;
 
-				req = NULL;
-				list_for_each_entry(tmp, &raid_th->process_list, list) {
-					if (idm_drive_get_fd(tmp->path, tmp->handle) ==
-							poll_fd[i].fd) {
-						req = tmp;
-						break;
-					}
-				}
+	INIT_LIST_HEAD(&list);
 
-				/* Should never happen? */
-				if (!req) {
-					ilm_log_err("[raid_thread=%p] fail to find request for polling fd %d",
-						    raid_th, poll_fd[i].fd);
-					continue;
-				}
+	raid_th->init = 1;
+
+	pthread_mutex_lock(&raid_th->request_mutex);
+
+	while (1) {
+		while (!raid_th->exit &&
+		       list_empty(&raid_th->request_list) &&
+		       list_empty(&raid_th->process_list))
+			pthread_cond_wait(&raid_th->request_cond,
+					  &raid_th->request_mutex);
+
+		if (raid_th->exit &&
+		    list_empty(&raid_th->request_list) &&
+		    list_empty(&raid_th->process_list))
+			break;
+
+		list_splice_tail_init(&raid_th->request_list, &list);
 
-				_raid_read_result_async(req);
+		pthread_mutex_unlock(&raid_th->request_mutex);
 
-				ilm_log_dbg("[raid_thread=%p] <- (resp) drive=%s op=%s(%d) result=%d",
-					    raid_th, req->path, _raid_op_str(req->op),
-					    req->op, req->result);
+		idm_raid_dispatch(raid_th, &list);
 
-				list_del(&req->list);
-				idm_raid_notify(raid_th, req);
+		if (!list_empty(&raid_th->process_list)) {
+			ret = idm_raid_poll(raid_th);
+			if (ret < 0) {
+				ilm_log_err("[raid_thread=%p] cannot allcoate pollfd",
+					    raid_th);
+				idm_raid_fail_all(raid_th, ret);
 			}
 		}
 
-		free(poll_fd);
-
 		pthread_mutex_lock(&raid_th->request_mutex);
-
-		if (raid_th->exit)
-			break;
 	}
 
 	pthread_cond_signal(&raid_th->exit_wait);
@@ -891,6 +983,13 @@ void idm_raid_thread_free(struct _raid_thread *raid_th)
 	pthread_cond_broadcast(&raid_th->request_cond);
 	pthread_cond_wait(&raid_th->exit_wait, &raid_th->request_mutex);
 	pthread_mutex_unlock(&raid_th->request_mutex);
+
+	pthread_join(raid_th->th, NULL);
+	__atomic_sub_fetch(&raid_metrics.threads, 1, __ATOMIC_RELAXED);
+	close(raid_th->efd);
+	free(raid_th->poll_fd);
+	free(raid_th->poll_req);
+	free(raid_th);
 }
 
 int idm_raid_thread_create(struct _raid_thread **rth)
@@ -908,21 +1007,21 @@ int idm_raid_thread_create(struct _raid_thread **rth)
 	pthread_cond_init(&raid_th->request_cond, NULL);
 	INIT_LIST_HEAD(&raid_th->request_list);
 
-	INIT_LIST_HEAD(&raid_th->response_list);
-	pthread_mutex_init(&raid_th->response_mutex, NULL);
-	pthread_cond_init(&raid_th->response_cond, NULL);
-
-	INIT_LIST_HEAD(&raid_th->renew_list);
-	pthread_mutex_init(&raid_th->renew_mutex, NULL);
-	pthread_cond_init(&raid_th->renew_cond, NULL);
-
 	INIT_LIST_HEAD(&raid_th->process_list);
 
+	raid_th->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (raid_th->efd < 0) {
+		ilm_log_err("Fail to create eventfd for raid thread");
+		free(raid_th);
+		return -errno;
+	}
+
 	pthread_cond_init(&raid_th->exit_wait, NULL);
 
 	ret = pthread_create(&raid_th->th, NULL, idm_raid_thread, raid_th);
 	if (ret < 0) {
 		ilm_log_err("Fail to create raid thread");
+		close(raid_th->efd);
 		free(raid_th);
 		return ret;
 	}
@@ -936,70 +1035,27 @@ int idm_raid_thread_create(struct _raid_thread **rth)
 	while (!raid_th->init)
 		usleep(10);
 
+	__atomic_add_fetch(&raid_metrics.threads, 1, __ATOMIC_RELAXED);
 	*rth = raid_th;
 	ilm_log_dbg("%s: raid_thread=%p is created", __func__, raid_th);
 	return 0;
 }
 
-static void idm_raid_destroy_lock_stale(char *path)
+void idm_raid_metrics(struct idm_raid_metrics *m)
 {
-	struct idm_info *info_list, *info, *least_renew = NULL;
-	int info_num;
-	int ret, i;
-	uint64_t least_renew_time = -1ULL;
-	char uuid_str[39];	/* uuid string is 39 chars + '\0' */
-
-	ret = idm_drive_read_group(path, &info_list, &info_num);
-	if (ret)
-		return;
-
-	/*
-	 * This is to implement the Least Recently Used (LRU) algorithm by
-	 * traversing all items
-	 */
-	for (i = 0; i < info_num; i++) {
-		info = info_list + i;
-
-		/* If the mutex is not unlock, skip it */
-		if (info->state != IDM_MODE_UNLOCK)
-			continue;
-
-		if (least_renew_time > info->last_renew_time) {
-			least_renew = info;
-			least_renew_time = info->last_renew_time;
-		}
-	}
-
-	if (!least_renew)
-		return;
-
-	ilm_log_array_dbg("raid_destroy: lock ID", least_renew->id, IDM_LOCK_ID_LEN);
-	ilm_id_write_format(least_renew->id, uuid_str, sizeof(uuid_str));
-	if (strlen(uuid_str))
-		ilm_log_dbg("raid_destroy: lock ID (VG): %s", uuid_str);
-	else
-		ilm_log_dbg("raid_destroy: lock ID (VG): Empty string");
-
-	ilm_id_write_format(least_renew->id + 32, uuid_str, sizeof(uuid_str));
-	if (strlen(uuid_str))
-		ilm_log_dbg("raid_destroy: lock ID (LV): %s", uuid_str);
-	else
-		ilm_log_dbg("raid_destroy: lock ID (LV): Empty string");
-
-	ilm_log_dbg("raid_destroy: state=%d mode=%d last_renew_time=%lu",
-		    least_renew->state, least_renew->mode,
-		    least_renew->last_renew_time);
-
-	idm_drive_destroy_lock(least_renew->id, least_renew->mode,
-			       least_renew->host_id, path);
+	m->threads = __atomic_load_n(&raid_metrics.threads, __ATOMIC_RELAXED);
+	m->queued = __atomic_load_n(&raid_metrics.queued, __ATOMIC_RELAXED);
+	m->inflight = __atomic_load_n(&raid_metrics.inflight,
+				      __ATOMIC_RELAXED);
 }
 
-static void idm_raid_multi_issue(struct ilm_lock *lock, char *host_id,
-				 int op, int mode, int renew)
+/* Queue the requests of a lock for all its drives into the wave */
+static void idm_raid_issue(struct _raid_wave *wave, struct ilm_lock *lock,
+			   char *host_id, int op, int mode, int renew)
 {
 	struct ilm_drive *drive;
 	struct _raid_request *req;
-	int i, reverse_mode;
+	int i;
 
 	ilm_log_dbg("%s: start mutex op=%s(%d) mode=%d renew=%d",
 		    __func__, _raid_op_str(op), op, mode, renew);
@@ -1041,6 +1097,7 @@ static void idm_raid_multi_issue(struct ilm_lock *lock, char *host_id,
 		req->mode = (mode != -1) ? mode : lock->mode;
 		req->renew = renew;
 		req->path_idx = 0;
+		req->trace_id = ilm_req_trace_id();
 
 		/*
 		 * Since the drive pathes might be altered by other requesters,
@@ -1065,14 +1122,31 @@ static void idm_raid_multi_issue(struct ilm_lock *lock, char *host_id,
 		req->lvb = drive->vb;
 		req->lvb_size = IDM_VALUE_LEN;
 
-		idm_raid_add_request(lock->raid_th, req);
+		idm_raid_add_request(lock->raid_th, wave, req);
 	}
+}
+
+
+/*
+ * Wait for all requests in the wave and drive every drive's state machine
+ * to the end, the requests of the same wave may belong to different locks.
+ */
+static void idm_raid_wave_complete(struct _raid_wave *wave,
+				   struct _raid_thread *raid_th)
+{
+	struct ilm_drive *drive;
+	struct _raid_request *req;
+	struct ilm_lock *lock;
+	int reverse_mode;
 
-	idm_raid_signal_request(lock->raid_th);
+	idm_raid_signal_request(raid_th);
 
-	while ((req = idm_raid_wait(lock->raid_th, renew))) {
+	while ((req = idm_raid_wait(wave))) {
 
 		drive = req->drive;
+		lock = req->lock;
+
+		ilm_req_trace_drive(req->done - req->sent, req->result);
 
 		/*
 		 * Detect the I/O failure, we can try another path for the same
@@ -1099,9 +1173,9 @@ static void idm_raid_multi_issue(struct ilm_lock *lock, char *host_id,
 
 		idm_raid_state_transition(req);
 
-		/* Drive compliants no free memory, destroy mutex */
+		/* Drive compliants no free memory, let the GC reclaim it */
 		if (drive->state == IDM_INIT && req->result == -ENOMEM)
-			idm_raid_destroy_lock_stale(req->path);
+			ilm_mutex_gc_full(drive, req->path);
 
 		/*
 		 * When release mutex, if returns -EINVAL usually it means
@@ -1150,11 +1224,101 @@ static void idm_raid_multi_issue(struct ilm_lock *lock, char *host_id,
 		}
 
 send_next_request:
-		idm_raid_add_request(lock->raid_th, req);
+		idm_raid_add_request(lock->raid_th, wave, req);
 		idm_raid_signal_request(lock->raid_th);
 	}
+}
 
-	return;
+/*
+ * Generation of the local state changes for every bucket of lock IDs, a
+ * query in flight can be shared only if no local lock operation on the
+ * same lock has completed since the query was started.
+ */
+#define RAID_QUERY_GEN_NUM		256
+
+static uint32_t query_gen[RAID_QUERY_GEN_NUM];
+static pthread_mutex_t query_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t *idm_raid_query_gen(char *id)
+{
+	unsigned int hash = 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < IDM_LOCK_ID_LEN; i++)
+		hash = (hash ^ (unsigned char)id[i]) * 16777619u;
+
+	return &query_gen[hash % RAID_QUERY_GEN_NUM];
+}
+
+static void idm_raid_query_invalidate(struct ilm_lock *lock, int op)
+{
+	if (op == ILM_OP_RENEW || op == ILM_OP_WRITE_LVB ||
+	    op == ILM_OP_READ_LVB || op == ILM_OP_COUNT || op == ILM_OP_MODE)
+		return;
+
+	pthread_mutex_lock(&query_mutex);
+	(*idm_raid_query_gen(lock->id))++;
+	pthread_mutex_unlock(&query_mutex);
+}
+
+static void idm_raid_multi_issue(struct ilm_lock *lock, char *host_id,
+				 int op, int mode, int renew)
+{
+	struct _raid_wave wave;
+
+	ilm_trace3(raid_issue_start, lock->id, op, renew);
+	ilm_req_trace_round_begin(_raid_op_str(op));
+
+	idm_raid_wave_init(&wave);
+	idm_raid_issue(&wave, lock, host_id, op, mode, renew);
+	idm_raid_wave_complete(&wave, lock->raid_th);
+	idm_raid_wave_destroy(&wave);
+
+	ilm_req_trace_round_end();
+	ilm_trace3(raid_issue_done, lock->id, op, renew);
+
+	if (!renew)
+		idm_raid_query_invalidate(lock, op);
+}
+
+/*
+ * Issue the same operation for multiple locks with shared waves, so the
+ * requests for all locks are pipelined to the drives rather than waiting
+ * for every lock's round trip in turn.  Every wave is bounded by
+ * RAID_WAVE_MAX_REQUESTS to limit the outstanding commands on drives.
+ * All locks must use the same raid thread.
+ */
+static void idm_raid_multi_issue_many(struct ilm_lock **locks, int num,
+				      char *host_id, int op, int *modes)
+{
+	struct _raid_wave wave;
+	int start, end, reqs, i;
+
+	for (start = 0; start < num; start = end) {
+		reqs = 0;
+		for (end = start; end < num; end++) {
+			if (end > start && reqs + locks[end]->good_drive_num >
+					RAID_WAVE_MAX_REQUESTS)
+				break;
+			reqs += locks[end]->good_drive_num;
+		}
+
+		ilm_trace2(raid_issue_many_start, end - start, op);
+		ilm_req_trace_round_begin(_raid_op_str(op));
+
+		idm_raid_wave_init(&wave);
+		for (i = start; i < end; i++)
+			idm_raid_issue(&wave, locks[i], host_id, op,
+				       modes ? modes[i] : locks[i]->mode, 0);
+		idm_raid_wave_complete(&wave, locks[start]->raid_th);
+		idm_raid_wave_destroy(&wave);
+
+		ilm_req_trace_round_end();
+		ilm_trace2(raid_issue_many_done, end - start, op);
+
+		for (i = start; i < end; i++)
+			idm_raid_query_invalidate(locks[i], op);
+	}
 }
 
 static void ilm_raid_lock_dump(const char *str, struct ilm_lock *lock)
@@ -1172,59 +1336,38 @@ static void ilm_raid_lock_dump(const char *str, struct ilm_lock *lock)
 	ilm_log_dbg(">>>>> RAID lock dump: %s >>>>>", str);
 }
 
-int idm_raid_lock(struct ilm_lock *lock, char *host_id)
+/* Count the drives which have been locked and the drives with I/O error */
+static int idm_raid_lock_score(struct ilm_lock *lock, int *io_err)
 {
-	uint64_t timeout = ilm_curr_time() + ILM_MAJORITY_TIMEOUT;
 	struct ilm_drive *drive;
-	int rand_sleep;
-	int io_err;
-	int score, i;
-
-	/* Initialize all drives state to NO_ACCESS */
-	for (i = 0; i < lock->good_drive_num; i++)
-		lock->drive[i].state = IDM_INIT;
-
-	ilm_raid_lock_dump("raid_lock", lock);
-
-	do {
-		idm_raid_multi_issue(lock, host_id, ILM_OP_LOCK, lock->mode, 0);
-
-		score = 0;
-		io_err = 0;
-		for (i = 0; i < lock->good_drive_num; i++) {
-			drive = &lock->drive[i];
+	int score = 0, i;
 
-			if (!drive->result && drive->state == IDM_LOCK)
-				score++;
+	*io_err = 0;
+	for (i = 0; i < lock->good_drive_num; i++) {
+		drive = &lock->drive[i];
 
-			if (drive->result == -EIO)
-				io_err++;
-		}
+		if (!drive->result && drive->state == IDM_LOCK)
+			score++;
 
-		/* Acquired majoirty */
-		if (score >= ((lock->total_drive_num >> 1) + 1)) {
-			ilm_log_dbg("%s: success", __func__);
-			return 0;
-		}
+		if (drive->result == -EIO)
+			(*io_err)++;
+	}
 
-		/*
-                 * Fail to achieve majority, release IDMs has been
-		 * acquired; race for next round.
-		 */
-		idm_raid_multi_issue(lock, host_id, ILM_OP_UNLOCK, lock->mode, 0);
+	return score;
+}
 
-		/*
-		 * Sleep for random interval for sleep, the interval range
-		 * is [500 .. 1000] us; this can avoid the multiple hosts keeping
-		 * the same pace thus every one cannot acquire majority (e.g.
-		 * two hosts, every host only can acquire successfully half
-		 * drives, and finally no host can achieve the majority).
-		 */
-		rand_sleep = ilm_rand(500, 1000);
-		usleep(rand_sleep);
+static int idm_raid_lock_majority(struct ilm_lock *lock, int score)
+{
+	int granted = score >= ((lock->total_drive_num >> 1) + 1);
 
-	} while (ilm_curr_time() < timeout);
+	ilm_trace5(quorum, lock->id, ILM_OP_LOCK, score,
+		   lock->total_drive_num, granted);
+	ilm_req_trace_quorum(score, lock->total_drive_num);
+	return granted;
+}
 
+static int idm_raid_lock_fail_result(struct ilm_lock *lock, int io_err)
+{
 	ilm_raid_lock_dump("raid_lock failed", lock);
 
 	/*
@@ -1245,21 +1388,727 @@ int idm_raid_lock(struct ilm_lock *lock, char *host_id)
 	return -1;
 }
 
-int idm_raid_unlock(struct ilm_lock *lock, char *host_id)
-{
-	struct ilm_drive *drive;
-	int io_err = 0, timeout = 0;
-	int i, ret = 0;
+/*
+ * Host-local queue of the requesters racing for the same lock ID.  Only
+ * the head of the queue probes drives, others wait for their turn, so the
+ * local requesters don't hammer drives in parallel.  The head is woken up
+ * as soon as a local holder releases the lock.
+ */
+struct _lock_queue {
+	struct list_head list;
+	char id[IDM_LOCK_ID_LEN];
+	struct list_head waiters;
+	int released;		/* A local holder has released the lock */
+};
 
-	ilm_raid_lock_dump("raid_unlock", lock);
+struct _lock_waiter {
+	struct list_head list;
+	pthread_cond_t *cond;	/* Shared by the members of a batch */
+	struct ilm_lock *lock;
+};
 
-	idm_raid_multi_issue(lock, host_id, ILM_OP_UNLOCK, lock->mode, 0);
+static struct list_head lock_queue_list = LIST_HEAD_INIT(lock_queue_list);
+static pthread_mutex_t lock_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-	for (i = 0; i < lock->good_drive_num; i++) {
-		drive = &lock->drive[i];
+static struct _lock_queue *idm_lock_queue_find(char *id)
+{
+	struct _lock_queue *queue;
 
-		if (drive->result == -EIO)
-			io_err++;
+	list_for_each_entry(queue, &lock_queue_list, list) {
+		if (!memcmp(queue->id, id, IDM_LOCK_ID_LEN))
+			return queue;
+	}
+
+	return NULL;
+}
+
+static int idm_lock_queue_is_head(struct _lock_queue *queue,
+				  struct _lock_waiter *waiter)
+{
+	return list_first_entry(&queue->waiters, struct _lock_waiter, list) ==
+		waiter;
+}
+
+/* Wait for @usec, return -ETIMEDOUT if nobody wakes up the waiter */
+static int idm_lock_queue_wait(pthread_cond_t *cond, uint64_t usec)
+{
+	uint64_t start = ilm_stats_now();
+	struct timespec ts;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	usec += ts.tv_nsec / 1000;
+	ts.tv_sec += usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+
+	ret = -pthread_cond_timedwait(cond, &lock_queue_mutex, &ts);
+	ilm_req_trace_wait(start);
+	return ret;
+}
+
+/*
+ * Join the queue for the lock ID.  If @create is false the waiter is only
+ * queued when there are local requesters racing for the lock already.
+ * Returns the queue or NULL.
+ */
+static struct _lock_queue *idm_lock_queue_join(char *id,
+					       struct _lock_waiter *waiter,
+					       int create)
+{
+	struct _lock_queue *queue;
+
+	queue = idm_lock_queue_find(id);
+	if (!queue) {
+		if (!create)
+			return NULL;
+
+		queue = malloc(sizeof(struct _lock_queue));
+		if (!queue)
+			return NULL;
+
+		memcpy(queue->id, id, IDM_LOCK_ID_LEN);
+		INIT_LIST_HEAD(&queue->waiters);
+		queue->released = 0;
+		list_add(&queue->list, &lock_queue_list);
+	}
+
+	list_add_tail(&waiter->list, &queue->waiters);
+	return queue;
+}
+
+static void idm_lock_queue_leave(struct _lock_queue *queue,
+				 struct _lock_waiter *waiter)
+{
+	struct _lock_waiter *head;
+	int is_head = idm_lock_queue_is_head(queue, waiter);
+
+	list_del(&waiter->list);
+
+	if (list_empty(&queue->waiters)) {
+		list_del(&queue->list);
+		free(queue);
+		return;
+	}
+
+	/* Hand over the probing to the next waiter */
+	if (is_head) {
+		head = list_first_entry(&queue->waiters, struct _lock_waiter,
+					list);
+		pthread_cond_signal(head->cond);
+	}
+}
+
+/*
+ * Wait until the waiter becomes the head of queue, if it's still not the
+ * head when the deadline expires it leaves the queue and returns
+ * -ETIMEDOUT, or -ECANCELED if the acquisition is cancelled.
+ */
+static int idm_lock_queue_wait_turn(struct _lock_queue *queue,
+				    struct _lock_waiter *waiter,
+				    uint64_t timeout)
+{
+	uint64_t now;
+
+	while (!idm_lock_queue_is_head(queue, waiter)) {
+		if (waiter->lock->cancelled) {
+			idm_lock_queue_leave(queue, waiter);
+			return -ECANCELED;
+		}
+
+		now = ilm_curr_time();
+		if (now >= timeout) {
+			idm_lock_queue_leave(queue, waiter);
+			return -ETIMEDOUT;
+		}
+
+		idm_lock_queue_wait(waiter->cond, (timeout - now) * 1000);
+	}
+
+	return 0;
+}
+
+/* A local holder has released the lock, let the head probe it */
+static void idm_lock_queue_wake(char *id)
+{
+	struct _lock_queue *queue;
+	struct _lock_waiter *head;
+
+	pthread_mutex_lock(&lock_queue_mutex);
+
+	queue = idm_lock_queue_find(id);
+	if (queue) {
+		queue->released = 1;
+		head = list_first_entry(&queue->waiters, struct _lock_waiter,
+					list);
+		pthread_cond_signal(head->cond);
+	}
+
+	pthread_mutex_unlock(&lock_queue_mutex);
+}
+
+/*
+ * Backoff before the next probe, in microseconds.  If the lock has been
+ * acquired on some drives, another host is racing for the majority at the
+ * same time, so retry after a short random interval to break the tie;
+ * otherwise the lock is held by other hosts and the backoff is doubled
+ * on every round.
+ */
+static int idm_raid_lock_backoff(int score, int *backoff)
+{
+	int interval;
+
+	if (score)
+		return ilm_rand(RAID_LOCK_BACKOFF_MIN, RAID_LOCK_BACKOFF_MIN * 2);
+
+	interval = ilm_rand(*backoff >> 1, *backoff);
+	*backoff = *backoff << 1;
+	if (*backoff > RAID_LOCK_BACKOFF_MAX)
+		*backoff = RAID_LOCK_BACKOFF_MAX;
+
+	return interval;
+}
+
+/*
+ * A host which caches a released lock (see the option "-C") gives it up
+ * as soon as another host holds the companion mutex, whose ID differs
+ * from the lock ID in the last byte.  LVM uses printable IDs, so the
+ * companion never clashes with a real lock.
+ */
+static struct ilm_lock *idm_raid_companion_alloc(struct ilm_lock *lock)
+{
+	struct ilm_lock *comp;
+	struct ilm_drive *drive;
+	int i, j;
+
+	comp = malloc(sizeof(struct ilm_lock));
+	if (!comp)
+		return NULL;
+
+	memcpy(comp, lock, sizeof(struct ilm_lock));
+	INIT_LIST_HEAD(&comp->list);
+	pthread_mutex_init(&comp->mutex, NULL);
+	memset(&comp->margin, 0, sizeof(comp->margin));
+	comp->id[IDM_LOCK_ID_LEN - 1] ^= 0xff;
+	comp->mode = IDM_MODE_SHAREABLE;
+
+	/* The paths of @lock can be replaced, so don't share them */
+	for (i = 0; i < comp->good_drive_num; i++) {
+		drive = &comp->drive[i];
+		drive->state = IDM_INIT;
+		for (j = 0; j < drive->path_num; j++)
+			drive->path[j] = strdup(lock->drive[i].path[j]);
+	}
+
+	return comp;
+}
+
+static void idm_raid_companion_free(struct ilm_lock *comp)
+{
+	struct ilm_drive *drive;
+	int i, j;
+
+	for (i = 0; i < comp->good_drive_num; i++) {
+		drive = &comp->drive[i];
+		for (j = 0; j < drive->path_num; j++)
+			free(drive->path[j]);
+	}
+
+	pthread_mutex_destroy(&comp->mutex);
+	free(comp);
+}
+
+/* Ask the host which caches the lock to release it */
+static struct ilm_lock *idm_raid_request_release(struct ilm_lock *lock,
+						 char *host_id)
+{
+	struct ilm_lock *comp;
+
+	comp = idm_raid_companion_alloc(lock);
+	if (!comp)
+		return NULL;
+
+	idm_raid_multi_issue(comp, host_id, ILM_OP_LOCK, comp->mode, 0);
+	return comp;
+}
+
+static void idm_raid_request_done(struct ilm_lock *comp, char *host_id)
+{
+	idm_raid_multi_issue(comp, host_id, ILM_OP_UNLOCK, comp->mode, 0);
+	/* Blind destroy, other requesters might still hold it */
+	idm_raid_multi_issue(comp, host_id, ILM_OP_DESTROY, comp->mode, 0);
+	idm_raid_companion_free(comp);
+}
+
+/**
+ * idm_raid_release_requested - Check if other hosts wait for a cached lock
+ * @lock:	The cached lock.
+ * @host_id:	Host ID.
+ *
+ * Returns 1 if any other host holds the companion mutex, otherwise 0.
+ */
+int idm_raid_release_requested(struct ilm_lock *lock, char *host_id)
+{
+	struct ilm_lock *comp;
+	int requested = 0, i;
+
+	comp = idm_raid_companion_alloc(lock);
+	if (!comp)
+		return 0;
+
+	idm_raid_multi_issue(comp, host_id, ILM_OP_COUNT, comp->mode, 0);
+
+	for (i = 0; i < comp->good_drive_num; i++) {
+		if (!comp->drive[i].result && comp->drive[i].count > 0) {
+			requested = 1;
+			break;
+		}
+	}
+
+	idm_raid_companion_free(comp);
+	return requested;
+}
+
+/* Acquire deadline in milliseconds, negative @deadline means the default */
+uint64_t idm_raid_lock_deadline(int deadline)
+{
+	if (deadline >= 0)
+		return deadline;
+
+	if (env.lock_deadline)
+		return env.lock_deadline;
+
+	return ILM_MAJORITY_TIMEOUT;
+}
+
+/**
+ * idm_raid_lock - Acquire the lock with majority of drives
+ * @lock:	Lock to acquire.
+ * @host_id:	Host ID.
+ * @deadline:	Milliseconds to keep retrying if the lock is contended, zero
+ *		to try only once, negative for the default deadline.
+ *
+ * Returns 0 on success, -ECANCELED if the acquisition is cancelled by
+ * idm_raid_lock_cancel(), otherwise the failure when the deadline expires.
+ */
+int idm_raid_lock(struct ilm_lock *lock, char *host_id, int deadline)
+{
+	uint64_t timeout = ilm_curr_time() + idm_raid_lock_deadline(deadline);
+	struct ilm_lock *request = NULL;
+	struct _lock_queue *queue = NULL;
+	struct _lock_waiter waiter;
+	pthread_condattr_t attr;
+	pthread_cond_t cond;
+	int backoff = RAID_LOCK_BACKOFF_MIN << 1;
+	int interval, io_err = 0, cancelled;
+	uint64_t start = ilm_stats_now(), now, wait;
+	int score, ret, i;
+
+	/* Initialize all drives state to NO_ACCESS */
+	for (i = 0; i < lock->good_drive_num; i++)
+		lock->drive[i].state = IDM_INIT;
+
+	ilm_raid_lock_dump("raid_lock", lock);
+	ilm_stats_lock(lock->id, ILM_STATS_LOCK_ATTEMPT, 0);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+	waiter.cond = &cond;
+	waiter.lock = lock;
+
+	/* Wait for the turn if other local requesters are racing already */
+	pthread_mutex_lock(&lock_queue_mutex);
+	ret = lock->cancelled ? -ECANCELED : 0;
+	if (!ret) {
+		queue = idm_lock_queue_join(lock->id, &waiter, 0);
+		if (queue) {
+			ret = idm_lock_queue_wait_turn(queue, &waiter, timeout);
+			if (ret < 0)
+				queue = NULL;
+		}
+	}
+	pthread_mutex_unlock(&lock_queue_mutex);
+
+	if (ret == -ECANCELED)
+		goto out;
+
+	do {
+		/* Don't add mutexes to a drive which is being reclaimed */
+		ilm_mutex_gc_admit(lock, timeout);
+
+		idm_raid_multi_issue(lock, host_id, ILM_OP_LOCK, lock->mode, 0);
+
+		score = idm_raid_lock_score(lock, &io_err);
+
+		/* Acquired majoirty */
+		if (idm_raid_lock_majority(lock, score)) {
+			ilm_log_dbg("%s: success", __func__);
+			ilm_stats_lock(lock->id, ILM_STATS_LOCK_ACQUIRED,
+				       ilm_stats_now() - start);
+			ret = 0;
+			goto out;
+		}
+
+		ilm_stats_lock(lock->id, ILM_STATS_LOCK_RETRY, 0);
+
+		/*
+                 * Fail to achieve majority, release IDMs has been
+		 * acquired; race for next round.
+		 */
+		idm_raid_multi_issue(lock, host_id, ILM_OP_UNLOCK, lock->mode, 0);
+
+		now = ilm_curr_time();
+		if (now >= timeout)
+			break;
+
+		/* The holder might only cache the lock, request it once */
+		if (env.lock_cache && !request)
+			request = idm_raid_request_release(lock, host_id);
+
+		/* Don't sleep beyond the deadline */
+		interval = idm_raid_lock_backoff(score, &backoff);
+		if ((uint64_t)interval > (timeout - now) * 1000)
+			interval = (timeout - now) * 1000;
+
+		pthread_mutex_lock(&lock_queue_mutex);
+
+		if (!queue) {
+			queue = idm_lock_queue_join(lock->id, &waiter, 1);
+			if (!queue) {
+				pthread_mutex_unlock(&lock_queue_mutex);
+				wait = ilm_stats_now();
+				usleep(interval);
+				ilm_req_trace_wait(wait);
+				continue;
+			}
+
+			/* Other requesters have queued up in the meantime */
+			if (!idm_lock_queue_is_head(queue, &waiter)) {
+				ret = idm_lock_queue_wait_turn(queue, &waiter,
+							       timeout);
+				if (ret < 0)
+					queue = NULL;
+				pthread_mutex_unlock(&lock_queue_mutex);
+
+				if (ret == -ECANCELED)
+					goto out;
+				continue;
+			}
+		}
+
+		if (!queue->released && !lock->cancelled)
+			idm_lock_queue_wait(&cond, interval);
+
+		/* Probe immediately after the lock is released locally */
+		if (queue->released) {
+			queue->released = 0;
+			backoff = RAID_LOCK_BACKOFF_MIN << 1;
+		}
+
+		cancelled = lock->cancelled;
+		pthread_mutex_unlock(&lock_queue_mutex);
+
+		if (cancelled) {
+			ret = -ECANCELED;
+			goto out;
+		}
+	} while (ilm_curr_time() < timeout);
+
+	ret = idm_raid_lock_fail_result(lock, io_err);
+out:
+	pthread_mutex_lock(&lock_queue_mutex);
+	if (queue)
+		idm_lock_queue_leave(queue, &waiter);
+	lock->acquiring = 0;
+	pthread_mutex_unlock(&lock_queue_mutex);
+
+	if (request)
+		idm_raid_request_done(request, host_id);
+
+	pthread_cond_destroy(&cond);
+	return ret;
+}
+
+/**
+ * idm_raid_lock_cancel - Cancel the acquisition of a lock
+ * @lock:	Lock being acquired.
+ *
+ * The acquisition stops retrying and fails with -ECANCELED as soon as the
+ * current round on drives has completed, the IDMs acquired in the round
+ * are released.
+ *
+ * Returns 0 on success, -EALREADY if the lock isn't being acquired.
+ */
+int idm_raid_lock_cancel(struct ilm_lock *lock)
+{
+	struct _lock_queue *queue;
+	struct _lock_waiter *waiter;
+
+	pthread_mutex_lock(&lock_queue_mutex);
+
+	if (!lock->acquiring) {
+		pthread_mutex_unlock(&lock_queue_mutex);
+		return -EALREADY;
+	}
+
+	lock->cancelled = 1;
+
+	queue = idm_lock_queue_find(lock->id);
+	if (queue) {
+		list_for_each_entry(waiter, &queue->waiters, list) {
+			if (waiter->lock == lock)
+				pthread_cond_signal(waiter->cond);
+		}
+	}
+
+	pthread_mutex_unlock(&lock_queue_mutex);
+	return 0;
+}
+
+/* Member of a batch acquisition, see idm_raid_lock_many() */
+struct _lock_member {
+	struct _lock_waiter waiter;
+	struct _lock_queue *queue;
+	int io_err;
+	int probed;		/* Probed in the last round */
+};
+
+/*
+ * Whether the batch has to go on without waiting: a member has been
+ * cancelled, or it has become the head of its queue, or its lock has been
+ * released locally.  Must be called with lock_queue_mutex held.
+ */
+static int idm_lock_many_ready(struct ilm_lock **locks,
+			       struct _lock_member *member, int *results,
+			       int num)
+{
+	struct _lock_member *m;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (results[i] != -1)
+			continue;
+
+		if (locks[i]->cancelled)
+			return 1;
+
+		m = &member[i];
+		if (m->queue && idm_lock_queue_is_head(m->queue, &m->waiter) &&
+		    (m->queue->released || !m->probed))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * idm_raid_lock_many - Acquire multiple locks with shared drive waves
+ * @locks:	Locks to acquire, which use the same raid thread.
+ * @num:	Number of locks.
+ * @host_id:	Host ID.
+ * @results:	Per-lock result array.
+ *
+ * Same as calling idm_raid_lock() for every lock, except the lock
+ * requests of all locks still racing for majority go to the drives in one
+ * wave per round.  Every member queues up with the local requesters of
+ * its lock and is only probed at the head of the queue, the batch waits
+ * for the turn or the backoff of the members on one condition.
+ *
+ * Returns 0 if all locks are acquired, otherwise the first failure.
+ */
+int idm_raid_lock_many(struct ilm_lock **locks, int num, char *host_id,
+		       int *results)
+{
+	uint64_t timeout = ilm_curr_time() + idm_raid_lock_deadline(-1);
+	uint64_t start = ilm_stats_now(), now, usec, wait;
+	struct _lock_member *member, *m;
+	struct ilm_lock **probe;
+	pthread_condattr_t attr;
+	pthread_cond_t cond;
+	int backoff = RAID_LOCK_BACKOFF_MIN << 1;
+	int pending_num, probe_num, fail_num, raced, score, ret = 0;
+	int *index, interval, i, j;
+
+	probe = malloc(sizeof(struct ilm_lock *) * num);
+	index = malloc(sizeof(int) * num);
+	member = calloc(num, sizeof(struct _lock_member));
+	if (!probe || !index || !member) {
+		free(probe);
+		free(index);
+		free(member);
+		for (i = 0; i < num; i++)
+			results[i] = -ENOMEM;
+		return -ENOMEM;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < locks[i]->good_drive_num; j++)
+			locks[i]->drive[j].state = IDM_INIT;
+		member[i].waiter.cond = &cond;
+		member[i].waiter.lock = locks[i];
+		results[i] = -1;
+		ilm_stats_lock(locks[i]->id, ILM_STATS_LOCK_ATTEMPT, 0);
+	}
+	pending_num = num;
+
+	/* Wait for the turn if other local requesters are racing already */
+	pthread_mutex_lock(&lock_queue_mutex);
+	for (i = 0; i < num; i++)
+		member[i].queue = idm_lock_queue_join(locks[i]->id,
+						      &member[i].waiter, 0);
+
+	while (1) {
+		/* Drop the cancelled locks, and pick the ones at their turn */
+		probe_num = 0;
+		for (i = 0; i < num; i++) {
+			if (results[i] != -1)
+				continue;
+
+			if (locks[i]->cancelled) {
+				results[i] = -ECANCELED;
+				pending_num--;
+				continue;
+			}
+
+			m = &member[i];
+			m->probed = 0;
+			if (m->queue) {
+				if (!idm_lock_queue_is_head(m->queue,
+							    &m->waiter))
+					continue;
+
+				/* Probe at once after the lock is released */
+				if (m->queue->released) {
+					m->queue->released = 0;
+					backoff = RAID_LOCK_BACKOFF_MIN << 1;
+				}
+			}
+
+			m->probed = 1;
+			probe[probe_num] = locks[i];
+			index[probe_num] = i;
+			probe_num++;
+		}
+
+		if (!pending_num)
+			break;
+
+		pthread_mutex_unlock(&lock_queue_mutex);
+
+		for (i = 0; i < probe_num; i++)
+			ilm_mutex_gc_admit(probe[i], timeout);
+
+		if (probe_num)
+			idm_raid_multi_issue_many(probe, probe_num, host_id,
+						  ILM_OP_LOCK, NULL);
+
+		raced = 0;
+		for (i = 0, fail_num = 0; i < probe_num; i++) {
+			j = index[i];
+
+			score = idm_raid_lock_score(probe[i],
+						    &member[j].io_err);
+			if (idm_raid_lock_majority(probe[i], score)) {
+				ilm_stats_lock(probe[i]->id,
+					       ILM_STATS_LOCK_ACQUIRED,
+					       ilm_stats_now() - start);
+				results[j] = 0;
+				pending_num--;
+				continue;
+			}
+
+			ilm_stats_lock(probe[i]->id, ILM_STATS_LOCK_RETRY, 0);
+
+			if (score)
+				raced = 1;
+			probe[fail_num++] = probe[i];
+		}
+
+		/* Release the partial acquisitions and race for next round */
+		if (fail_num)
+			idm_raid_multi_issue_many(probe, fail_num, host_id,
+						  ILM_OP_UNLOCK, NULL);
+
+		pthread_mutex_lock(&lock_queue_mutex);
+
+		if (!pending_num)
+			break;
+
+		now = ilm_curr_time();
+		if (now >= timeout)
+			break;
+
+		/*
+		 * The acquired members leave their queues, the failed ones
+		 * join, so the later local requesters wait behind them.
+		 */
+		for (i = 0; i < num; i++) {
+			m = &member[i];
+
+			if (results[i] != -1 && m->queue) {
+				idm_lock_queue_leave(m->queue, &m->waiter);
+				m->queue = NULL;
+			} else if (results[i] == -1 && m->probed && !m->queue) {
+				m->queue = idm_lock_queue_join(locks[i]->id,
+							       &m->waiter, 1);
+			}
+		}
+
+		/* Don't sleep beyond the deadline */
+		usec = (timeout - now) * 1000;
+		if (fail_num) {
+			interval = idm_raid_lock_backoff(raced, &backoff);
+			if ((uint64_t)interval < usec)
+				usec = interval;
+		}
+
+		if (!idm_lock_many_ready(locks, member, results, num)) {
+			wait = ilm_stats_now();
+			idm_lock_queue_wait(&cond, usec);
+			ilm_req_trace_wait(wait);
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		if (member[i].queue)
+			idm_lock_queue_leave(member[i].queue,
+					     &member[i].waiter);
+		locks[i]->acquiring = 0;
+	}
+	pthread_mutex_unlock(&lock_queue_mutex);
+
+	for (i = 0; i < num; i++) {
+		if (results[i] && results[i] != -ECANCELED)
+			results[i] = idm_raid_lock_fail_result(locks[i],
+							member[i].io_err);
+		if (results[i] && !ret)
+			ret = results[i];
+	}
+
+	pthread_cond_destroy(&cond);
+	free(probe);
+	free(index);
+	free(member);
+	return ret;
+}
+
+static int idm_raid_unlock_result(struct ilm_lock *lock)
+{
+	struct ilm_drive *drive;
+	int io_err = 0, timeout = 0;
+	int i, ret = 0;
+
+	for (i = 0; i < lock->good_drive_num; i++) {
+		drive = &lock->drive[i];
+
+		if (drive->result == -EIO)
+			io_err++;
 
 		if (drive->result == -ETIME)
 			timeout++;
@@ -1279,6 +2128,42 @@ int idm_raid_unlock(struct ilm_lock *lock, char *host_id)
 	return ret;
 }
 
+int idm_raid_unlock(struct ilm_lock *lock, char *host_id)
+{
+	ilm_raid_lock_dump("raid_unlock", lock);
+
+	idm_raid_multi_issue(lock, host_id, ILM_OP_UNLOCK, lock->mode, 0);
+	idm_lock_queue_wake(lock->id);
+
+	return idm_raid_unlock_result(lock);
+}
+
+/**
+ * idm_raid_unlock_many - Release multiple locks with shared drive waves
+ * @locks:	Locks to release, which use the same raid thread.
+ * @num:	Number of locks.
+ * @host_id:	Host ID.
+ * @results:	Per-lock result array.
+ *
+ * Returns 0 if all locks are released, otherwise the first failure.
+ */
+int idm_raid_unlock_many(struct ilm_lock **locks, int num, char *host_id,
+			 int *results)
+{
+	int i, ret = 0;
+
+	idm_raid_multi_issue_many(locks, num, host_id, ILM_OP_UNLOCK, NULL);
+
+	for (i = 0; i < num; i++) {
+		idm_lock_queue_wake(locks[i]->id);
+		results[i] = idm_raid_unlock_result(locks[i]);
+		if (results[i] && !ret)
+			ret = results[i];
+	}
+
+	return ret;
+}
+
 int idm_raid_destroy_lock(struct ilm_lock *lock, char *host_id)
 {
 	// struct ilm_drive *drive;
@@ -1313,26 +2198,33 @@ int idm_raid_destroy_lock(struct ilm_lock *lock, char *host_id)
 	return 0;
 }
 
-int idm_raid_convert_lock(struct ilm_lock *lock, char *host_id, int mode)
+/**
+ * idm_raid_destroy_lock_many - Destroy multiple mutexes with shared waves
+ * @locks:	Locks to destroy, which use the same raid thread.
+ * @num:	Number of locks.
+ * @host_id:	Host ID.
+ *
+ * Like idm_raid_destroy_lock(), this is a blind cleanup and always
+ * returns 0.
+ */
+int idm_raid_destroy_lock_many(struct ilm_lock **locks, int num,
+			       char *host_id)
+{
+	idm_raid_multi_issue_many(locks, num, host_id, ILM_OP_DESTROY, NULL);
+	return 0;
+}
+
+/*
+ * Check the result after the convert requests have been issued, revert to
+ * the old mode if the new mode doesn't achieve majority.
+ */
+static int idm_raid_convert_result(struct ilm_lock *lock, char *host_id,
+				   int mode)
 {
 	struct ilm_drive *drive;
 	int io_err = 0;
 	int i, score, timeout = 0;
 
-	ilm_raid_lock_dump("raid_convert_lock", lock);
-
-	/*
-	 * If fail to convert mode previously, afterwards cannot convert
-	 * mode anymore.
-	 */
-	if (lock->convert_failed == 1) {
-		ilm_log_err("%s: failed to convert mode previously, directly bail out",
-			    __func__);
-		return -1;
-	}
-
-	idm_raid_multi_issue(lock, host_id, ILM_OP_CONVERT, mode, 0);
-
 	score = 0;
 	for (i = 0; i < lock->good_drive_num; i++) {
 		drive = &lock->drive[i];
@@ -1354,6 +2246,7 @@ int idm_raid_convert_lock(struct ilm_lock *lock, char *host_id, int mode)
 	}
 
 	ilm_raid_lock_dump("raid_convert_lock failed", lock);
+	ilm_stats_lock(lock->id, ILM_STATS_LOCK_CONVERT_FAIL, 0);
 
 	/* Majority drives have been timeout */
 	if (timeout >= (lock->total_drive_num - (lock->total_drive_num >> 1)))
@@ -1396,6 +2289,115 @@ int idm_raid_convert_lock(struct ilm_lock *lock, char *host_id, int mode)
 	return -1;
 }
 
+static int idm_raid_convert_check(struct ilm_lock *lock)
+{
+	/*
+	 * If fail to convert mode previously, afterwards cannot convert
+	 * mode anymore.
+	 */
+	if (lock->convert_failed == 1) {
+		ilm_log_err("%s: failed to convert mode previously, directly bail out",
+			    __func__);
+		return -1;
+	}
+
+	return 0;
+}
+
+int idm_raid_convert_lock(struct ilm_lock *lock, char *host_id, int mode)
+{
+	int ret;
+
+	ilm_raid_lock_dump("raid_convert_lock", lock);
+
+	ret = idm_raid_convert_check(lock);
+	if (ret)
+		return ret;
+
+	idm_raid_multi_issue(lock, host_id, ILM_OP_CONVERT, mode, 0);
+
+	ret = idm_raid_convert_result(lock, host_id, mode);
+
+	/* Demoting to shareable mode may let local waiters go */
+	if (!ret && mode == IDM_MODE_SHAREABLE)
+		idm_lock_queue_wake(lock->id);
+
+	return ret;
+}
+
+/**
+ * idm_raid_convert_many - Convert multiple locks with shared drive waves
+ * @locks:	Locks to convert, which use the same raid thread.
+ * @num:	Number of locks.
+ * @host_id:	Host ID.
+ * @modes:	New mode for every lock.
+ * @results:	Per-lock result array.
+ *
+ * The conversion is issued for all locks in shared waves, a lock which
+ * fails to achieve majority is reverted individually.
+ *
+ * Returns 0 if all locks are converted, otherwise the first failure.
+ */
+int idm_raid_convert_many(struct ilm_lock **locks, int num, char *host_id,
+			  int *modes, int *results)
+{
+	struct ilm_lock **issue;
+	int *issue_modes;
+	int i, n, ret = 0;
+
+	issue = malloc(sizeof(struct ilm_lock *) * num);
+	issue_modes = malloc(sizeof(int) * num);
+	if (!issue || !issue_modes) {
+		free(issue);
+		free(issue_modes);
+		for (i = 0; i < num; i++)
+			results[i] = -ENOMEM;
+		return -ENOMEM;
+	}
+
+	for (i = 0, n = 0; i < num; i++) {
+		results[i] = idm_raid_convert_check(locks[i]);
+		if (results[i])
+			continue;
+
+		issue[n] = locks[i];
+		issue_modes[n] = modes[i];
+		n++;
+	}
+
+	idm_raid_multi_issue_many(issue, n, host_id, ILM_OP_CONVERT,
+				  issue_modes);
+
+	for (i = 0; i < num; i++) {
+		if (!results[i])
+			results[i] = idm_raid_convert_result(locks[i], host_id,
+							     modes[i]);
+		if (!results[i] && modes[i] == IDM_MODE_SHAREABLE)
+			idm_lock_queue_wake(locks[i]->id);
+		if (results[i] && !ret)
+			ret = results[i];
+	}
+
+	free(issue);
+	free(issue_modes);
+	return ret;
+}
+
+/* Account the drives renewed by the last round into the renewal margin */
+static void idm_raid_renew_margin(struct ilm_lock *lock)
+{
+	struct ilm_drive *drive;
+	uint64_t now = ilm_curr_time();
+	int i;
+
+	for (i = 0; i < lock->good_drive_num; i++) {
+		drive = &lock->drive[i];
+
+		if (!drive->result && drive->state == IDM_LOCK)
+			ilm_margin_renew_drive(drive, now);
+	}
+}
+
 int idm_raid_renew_lock(struct ilm_lock *lock, char *host_id)
 {
 	struct ilm_drive *drive;
@@ -1403,6 +2405,7 @@ int idm_raid_renew_lock(struct ilm_lock *lock, char *host_id)
 	int score, i;
 
 	ilm_raid_lock_dump("raid_renew_lock", lock);
+	ilm_trace2(renew_start, lock->id, lock->mode);
 
 	do {
 		idm_raid_multi_issue(lock, host_id, ILM_OP_RENEW, lock->mode, 1);
@@ -1419,6 +2422,10 @@ int idm_raid_renew_lock(struct ilm_lock *lock, char *host_id)
 		if (!(lock->total_drive_num & 1) &&
 		    (score >= (lock->total_drive_num >> 1))) {
 			ilm_log_dbg("%s: success", __func__);
+			ilm_trace5(quorum, lock->id, ILM_OP_RENEW, score,
+				   lock->total_drive_num, 1);
+			ilm_trace2(renew_done, lock->id, 0);
+			idm_raid_renew_margin(lock);
 			return 0;
 		}
 
@@ -1426,17 +2433,63 @@ int idm_raid_renew_lock(struct ilm_lock *lock, char *host_id)
 		if ((lock->total_drive_num & 1) &&
 		    (score >= ((lock->total_drive_num >> 1) + 1))) {
 			ilm_log_dbg("%s: success", __func__);
+			ilm_trace5(quorum, lock->id, ILM_OP_RENEW, score,
+				   lock->total_drive_num, 1);
+			ilm_trace2(renew_done, lock->id, 0);
+			idm_raid_renew_margin(lock);
 			return 0;
 		}
 
+		ilm_trace5(quorum, lock->id, ILM_OP_RENEW, score,
+			   lock->total_drive_num, 0);
+
 	} while (ilm_curr_time() < timeout);
 
 	ilm_raid_lock_dump("raid_renew_lock failed", lock);
+	ilm_stats_lock(lock->id, ILM_STATS_LOCK_RENEW_FAIL, 0);
+	ilm_trace2(renew_done, lock->id, -1);
+
+	/* The drives in the minority are renewed all the same */
+	idm_raid_renew_margin(lock);
 
 	/* Timeout, fail to acquire lock with majoirty */
 	return -1;
 }
 
+/*
+ * Renew multiple locks with a single round, which is used to adopt the
+ * locks held before the daemon is restarted, so all drives are assumed to
+ * be locked.  A lock is only adopted with the majority like an acquisition,
+ * the failed drives aren't retried.
+ */
+int idm_raid_renew_many(struct ilm_lock **locks, int num, char *host_id,
+			int *results)
+{
+	int score, io_err, ret = 0, i, j;
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < locks[i]->good_drive_num; j++)
+			locks[i]->drive[j].state = IDM_LOCK;
+	}
+
+	idm_raid_multi_issue_many(locks, num, host_id, ILM_OP_RENEW, NULL);
+
+	for (i = 0; i < num; i++) {
+		score = idm_raid_lock_score(locks[i], &io_err);
+		if (idm_raid_lock_majority(locks[i], score)) {
+			results[i] = 0;
+			idm_raid_renew_margin(locks[i]);
+			continue;
+		}
+
+		ilm_raid_lock_dump("raid_renew_many failed", locks[i]);
+		results[i] = -ETIME;
+		ret = -ETIME;
+	}
+
+	return ret;
+}
+
 int idm_raid_read_lvb(struct ilm_lock *lock, char *host_id,
 		      char *lvb, int lvb_size)
 {
@@ -1517,7 +2570,145 @@ int idm_raid_read_lvb(struct ilm_lock *lock, char *host_id,
  * - stat[1]: the number of drives which its idm has one user count;
  * - stat[2]: the number of drives which its idm has user count >= 2.
  */
-int idm_raid_count(struct ilm_lock *lock, char *host_id, int *count, int *self)
+/*
+ * Monitoring tools and lvmlockd often ask for the count or mode of the
+ * same lock at the same time, so identical queries in flight share one
+ * round on drives.  The later requesters only wait for the result.
+ */
+struct _query_flight {
+	struct list_head list;
+	int op;
+	int mode;
+	char id[IDM_LOCK_ID_LEN];
+	char host_id[IDM_HOST_ID_LEN];
+	uint64_t drive_sig;
+	uint32_t gen;
+
+	int refcount;
+	int done;
+	int ret;
+	int result[2];
+};
+
+static struct list_head query_list = LIST_HEAD_INIT(query_list);
+static pthread_cond_t query_cond = PTHREAD_COND_INITIALIZER;
+
+/* Signature of the drives which a query is sent to */
+static uint64_t idm_raid_drive_sig(struct ilm_lock *lock)
+{
+	uint64_t sig = 14695981039346656037ULL;		/* FNV-1a */
+	int i;
+
+	for (i = 0; i < lock->good_drive_num; i++)
+		sig = (sig ^ lock->drive[i].wwn) * 1099511628211ULL;
+
+	return (sig ^ lock->total_drive_num) * 1099511628211ULL;
+}
+
+static struct _query_flight *idm_raid_query_find(struct ilm_lock *lock,
+						 char *host_id, int op,
+						 uint64_t drive_sig,
+						 uint32_t gen)
+{
+	struct _query_flight *flight;
+
+	list_for_each_entry(flight, &query_list, list) {
+		if (flight->op != op || flight->mode != lock->mode ||
+		    flight->gen != gen || flight->drive_sig != drive_sig)
+			continue;
+
+		if (memcmp(flight->id, lock->id, IDM_LOCK_ID_LEN))
+			continue;
+
+		if (host_id &&
+		    memcmp(flight->host_id, host_id, IDM_HOST_ID_LEN))
+			continue;
+
+		return flight;
+	}
+
+	return NULL;
+}
+
+static void idm_raid_query_put(struct _query_flight *flight, int *result)
+{
+	memcpy(result, flight->result, sizeof(flight->result));
+
+	if (!--flight->refcount)
+		free(flight);
+}
+
+static int _idm_raid_count(struct ilm_lock *lock, char *host_id, int *result);
+static int _idm_raid_mode(struct ilm_lock *lock, int *result);
+
+/*
+ * Run the query or wait for the identical one in flight, @host_id is NULL
+ * for the queries which don't depend on the host.  The caller holds the
+ * lock's mutex.
+ */
+static int idm_raid_query(struct ilm_lock *lock, char *host_id, int op,
+			  int *result)
+{
+	struct _query_flight *flight;
+	uint64_t drive_sig = idm_raid_drive_sig(lock);
+	uint32_t gen;
+	int ret;
+
+	pthread_mutex_lock(&query_mutex);
+
+	gen = *idm_raid_query_gen(lock->id);
+	flight = idm_raid_query_find(lock, host_id, op, drive_sig, gen);
+	if (flight) {
+		flight->refcount++;
+		while (!flight->done)
+			pthread_cond_wait(&query_cond, &query_mutex);
+
+		ret = flight->ret;
+		idm_raid_query_put(flight, result);
+		pthread_mutex_unlock(&query_mutex);
+
+		ilm_log_dbg("%s: shared %s result %d", __func__,
+			    _raid_op_str(op), ret);
+		return ret;
+	}
+
+	flight = calloc(1, sizeof(struct _query_flight));
+	if (flight) {
+		flight->op = op;
+		flight->mode = lock->mode;
+		memcpy(flight->id, lock->id, IDM_LOCK_ID_LEN);
+		if (host_id)
+			memcpy(flight->host_id, host_id, IDM_HOST_ID_LEN);
+		flight->drive_sig = drive_sig;
+		flight->gen = gen;
+		flight->refcount = 1;
+		list_add(&flight->list, &query_list);
+	}
+
+	pthread_mutex_unlock(&query_mutex);
+
+	if (op == ILM_OP_COUNT)
+		ret = _idm_raid_count(lock, host_id, result);
+	else
+		ret = _idm_raid_mode(lock, result);
+
+	/* Run the query alone if fail to allocate */
+	if (!flight)
+		return ret;
+
+	pthread_mutex_lock(&query_mutex);
+	list_del(&flight->list);
+	flight->ret = ret;
+	memcpy(flight->result, result, sizeof(flight->result));
+	flight->done = 1;
+	pthread_cond_broadcast(&query_cond);
+	idm_raid_query_put(flight, result);
+	pthread_mutex_unlock(&query_mutex);
+
+	return ret;
+}
+
+static int _idm_raid_count(struct ilm_lock *lock, char *host_id, int *result)
 {
 	int i;
 	int cnt = 0, slf = 0, no_ent = 0;
@@ -1549,8 +2740,22 @@ int idm_raid_count(struct ilm_lock *lock, char *host_id, int *count, int *self)
 		return -ENOENT;
 	}
 
-	*count = cnt;
-	*self = slf;
+	result[0] = cnt;
+	result[1] = slf;
+	return 0;
+}
+
+int idm_raid_count(struct ilm_lock *lock, char *host_id, int *count, int *self)
+{
+	int result[2] = { 0 };
+	int ret;
+
+	ret = idm_raid_query(lock, host_id, ILM_OP_COUNT, result);
+	if (ret)
+		return ret;
+
+	*count = result[0];
+	*self = result[1];
 	return 0;
 }
 
@@ -1561,7 +2766,7 @@ int idm_raid_count(struct ilm_lock *lock, char *host_id, int *count, int *self)
  * the majority, this means the lock mode can be trusted and return to upper
  * user.  Otherwise, return failure.
  */
-int idm_raid_mode(struct ilm_lock *lock, int *mode)
+static int _idm_raid_mode(struct ilm_lock *lock, int *result)
 {
 	int i, m;
 	int stat_mode[3] = { 0 }, mode_max = 0, no_ent = 0;
@@ -1602,10 +2807,23 @@ int idm_raid_mode(struct ilm_lock *lock, int *mode)
 	}
 
 	if (stat_mode[mode_max] >= ((lock->total_drive_num >> 1) + 1)) {
-		*mode = mode_max;
+		result[0] = mode_max;
 		return 0;
 	}
 
 	ilm_raid_lock_dump("raid_mode failed", lock);
 	return -1;
 }
+
+int idm_raid_mode(struct ilm_lock *lock, int *mode)
+{
+	int result[2] = { 0 };
+	int ret;
+
+	ret = idm_raid_query(lock, NULL, ILM_OP_MODE, result);
+	if (ret)
+		return ret;
+
+	*mode = result[0];
+	return 0;
+}
@@ -8,7 +8,16 @@
 
 #include "lock.h"
 
-int idm_raid_lock(struct ilm_lock *lock, char *host_id);
+/* Requests of all raid threads, see idm_raid_metrics() */
+struct idm_raid_metrics {
+	int threads;
+	int queued;		/* Waiting to be sent to the drives */
+	int inflight;		/* Sent and polled for the completion */
+};
+
+uint64_t idm_raid_lock_deadline(int deadline);
+int idm_raid_lock(struct ilm_lock *lock, char *host_id, int deadline);
+int idm_raid_lock_cancel(struct ilm_lock *lock);
 int idm_raid_unlock(struct ilm_lock *lock, char *host_id);
 int idm_raid_convert_lock(struct ilm_lock *lock, char *host_id, int mode);
 int idm_raid_renew_lock(struct ilm_lock *lock, char *host_id);
@@ -19,8 +28,21 @@ int idm_raid_read_lvb(struct ilm_lock *lock, char *host_id,
 		      char *lvb, int lvb_size);
 int idm_raid_count(struct ilm_lock *lock, char *host_id, int *count, int *self);
 int idm_raid_mode(struct ilm_lock *lock, int *mode);
+int idm_raid_release_requested(struct ilm_lock *lock, char *host_id);
+
+int idm_raid_lock_many(struct ilm_lock **locks, int num, char *host_id,
+		       int *results);
+int idm_raid_unlock_many(struct ilm_lock **locks, int num, char *host_id,
+			 int *results);
+int idm_raid_destroy_lock_many(struct ilm_lock **locks, int num,
+			       char *host_id);
+int idm_raid_convert_many(struct ilm_lock **locks, int num, char *host_id,
+			  int *modes, int *results);
+int idm_raid_renew_many(struct ilm_lock **locks, int num, char *host_id,
+			int *results);
 
 int idm_raid_thread_create(struct _raid_thread **rth);
 void idm_raid_thread_free(struct _raid_thread *raid_th);
+void idm_raid_metrics(struct idm_raid_metrics *m);
 
 #endif
@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drive.h"
+#include "idm_api.h"
+#include "ilm_internal.h"
+#include "log.h"
+#include "recorder.h"
+#include "stats.h"
+
+#define ILM_RECORDER_PATH_NONE		0xffff
+
+/*
+ * The ring lives in BSS rather than the heap, so it's locked into memory
+ * together with the rest of the daemon by mlockall() and recording never
+ * allocates.  Writers claim a slot with one atomic add; the slot sequence
+ * is cleared while it's filled, so the dump skips a torn record.
+ */
+static struct ilm_recorder_rec recorder_ring[ILM_RECORDER_REC_NUM];
+static uint64_t recorder_head;
+
+/*
+ * Drive paths are interned once so a record only stores the index.  The
+ * path is published before its hash slot, lookups are lock free and only
+ * the insertion takes the mutex.
+ */
+static struct ilm_recorder_path recorder_path[ILM_RECORDER_PATH_NUM];
+static uint16_t recorder_path_hash[ILM_RECORDER_PATH_NUM];	/* Index + 1 */
+static int recorder_path_num;
+
+static pthread_mutex_t recorder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t recorder_dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t recorder_dump_pending;
+
+static uint64_t ilm_recorder_hash(const char *buf, int len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t)buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static unsigned long ilm_recorder_find_wwn(char *drive)
+{
+	struct ilm_drive_snapshot *snap;
+	unsigned long wwn;
+	int idx;
+
+	snap = ilm_drive_snapshot_get(&idx);
+	wwn = ilm_drive_snapshot_find_wwn(snap, drive);
+	ilm_drive_snapshot_put(idx);
+	return wwn;
+}
+
+static int ilm_recorder_path_insert(char *drive, int slot)
+{
+	struct ilm_recorder_path *path;
+	int idx, pos;
+
+	pthread_mutex_lock(&recorder_mutex);
+
+	/* Someone else may have inserted it in the meantime */
+	for (pos = slot; recorder_path_hash[pos];
+	     pos = (pos + 1) & (ILM_RECORDER_PATH_NUM - 1)) {
+		idx = recorder_path_hash[pos] - 1;
+		if (!strncmp(recorder_path[idx].path, drive,
+			     ILM_RECORDER_PATH_LEN - 1))
+			goto out;
+	}
+
+	if (recorder_path_num >= ILM_RECORDER_PATH_NUM - 1) {
+		idx = ILM_RECORDER_PATH_NONE;
+		goto out;
+	}
+
+	idx = recorder_path_num;
+	path = &recorder_path[idx];
+	path->wwn = ilm_recorder_find_wwn(drive);
+	snprintf(path->path, sizeof(path->path), "%s", drive);
+
+	__atomic_store_n(&recorder_path_num, idx + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&recorder_path_hash[pos], idx + 1, __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&recorder_mutex);
+	return idx;
+}
+
+static int ilm_recorder_path_get(char *drive)
+{
+	int len, slot, pos, idx;
+
+	len = strnlen(drive, ILM_RECORDER_PATH_LEN - 1);
+	slot = ilm_recorder_hash(drive, len) & (ILM_RECORDER_PATH_NUM - 1);
+
+	for (pos = slot; ; pos = (pos + 1) & (ILM_RECORDER_PATH_NUM - 1)) {
+		idx = __atomic_load_n(&recorder_path_hash[pos],
+				      __ATOMIC_ACQUIRE);
+		if (!idx)
+			break;
+
+		idx--;
+		if (!strncmp(recorder_path[idx].path, drive,
+			     ILM_RECORDER_PATH_LEN - 1))
+			return idx;
+	}
+
+	return ilm_recorder_path_insert(drive, slot);
+}
+
+static uint64_t ilm_recorder_path_wwn(int idx, char *drive)
+{
+	uint64_t wwn;
+
+	if (idx == ILM_RECORDER_PATH_NONE)
+		return 0;
+
+	/* The drive may be scanned after its first command */
+	wwn = __atomic_load_n(&recorder_path[idx].wwn, __ATOMIC_RELAXED);
+	if (!wwn) {
+		wwn = ilm_recorder_find_wwn(drive);
+		__atomic_store_n(&recorder_path[idx].wwn, wwn,
+				 __ATOMIC_RELAXED);
+	}
+
+	return wwn;
+}
+
+/**
+ * ilm_recorder_add - Record a completed drive command
+ * @drive:	Drive path which the command is sent to.
+ * @transport:	ILM_RECORDER_SCSI or ILM_RECORDER_NVME.
+ * @op:		Statistics opcode, see ilm_stats_op().
+ * @lock_id:	Lock ID of the command, NULL if it has none.
+ * @start:	Timestamp from ilm_stats_now() when the command is sent.
+ * @result:	Zero or a negative error of the command.
+ * @status:	SCSI sense key or NVMe status, zero if there is none.
+ * @trace_id:	Trace ID of the client request.
+ *
+ * Never blocks once the drive path has been seen.
+ */
+void ilm_recorder_add(char *drive, int transport, int op, char *lock_id,
+		      uint64_t start, int result, int status,
+		      uint64_t trace_id)
+{
+	struct ilm_recorder_rec *rec;
+	struct timespec ts;
+	uint64_t seq, lat;
+	int idx;
+
+	lat = ilm_stats_now() - start;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	idx = ilm_recorder_path_get(drive);
+
+	seq = __atomic_fetch_add(&recorder_head, 1, __ATOMIC_RELAXED);
+	rec = &recorder_ring[seq & (ILM_RECORDER_REC_NUM - 1)];
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	rec->wwn = ilm_recorder_path_wwn(idx, drive);
+	rec->lock_hash = lock_id ?
+		ilm_recorder_hash(lock_id, IDM_LOCK_ID_LEN) : 0;
+	rec->trace_id = trace_id;
+	rec->latency_us = lat > UINT32_MAX ? UINT32_MAX : lat;
+	rec->result = result;
+	rec->path_idx = idx;
+	rec->op = op;
+	rec->transport = transport;
+	rec->status = status;
+
+	/* Sequence starts from 1, zero marks the slot being written */
+	__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy out the slot, returns zero if it's torn or empty */
+static int ilm_recorder_read(struct ilm_recorder_rec *rec, uint64_t seq)
+{
+	struct ilm_recorder_rec *src;
+	uint64_t before;
+
+	src = &recorder_ring[(seq - 1) & (ILM_RECORDER_REC_NUM - 1)];
+
+	before = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+	if (before != seq)
+		return 0;
+
+	memcpy(rec, src, sizeof(*rec));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&src->seq, __ATOMIC_RELAXED) == before;
+}
+
+static int ilm_recorder_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * ilm_recorder_dump - Dump the flight recorder into the log directory
+ * @reason:	Short reason which is saved in the dump and its file name.
+ *
+ * Commands keep being recorded during the dump, a record overwritten
+ * while it's copied is left out.
+ *
+ * Returns zero or a negative error.
+ */
+int ilm_recorder_dump(const char *reason)
+{
+	struct ilm_recorder_header header;
+	struct ilm_recorder_rec *recs;
+	struct timespec ts;
+	struct tm tm;
+	char path[PATH_MAX], stamp[32];
+	uint64_t head, first, seq;
+	int fd, num = 0, ret;
+
+	recs = malloc(sizeof(*recs) * ILM_RECORDER_REC_NUM);
+	if (!recs)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&recorder_dump_mutex);
+
+	head = __atomic_load_n(&recorder_head, __ATOMIC_ACQUIRE);
+	first = head > ILM_RECORDER_REC_NUM ? head - ILM_RECORDER_REC_NUM : 0;
+
+	for (seq = first + 1; seq <= head; seq++) {
+		if (ilm_recorder_read(&recs[num], seq))
+			num++;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = ILM_RECORDER_MAGIC;
+	header.version = ILM_RECORDER_VERSION;
+	header.rec_size = sizeof(struct ilm_recorder_rec);
+	header.path_size = sizeof(struct ilm_recorder_path);
+	header.path_num = __atomic_load_n(&recorder_path_num,
+					  __ATOMIC_ACQUIRE);
+	header.rec_num = num;
+	header.pid = getpid();
+	header.time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	header.dropped = first;
+	snprintf(header.reason, sizeof(header.reason), "%s", reason);
+
+	localtime_r(&ts.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(path, sizeof(path), "%s/seagate_ilm-recorder-%s-%s.%06ld.bin",
+		 env.log_dir, reason, stamp, ts.tv_nsec / 1000);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		ilm_log_err("%s: fail to create %s %d", __func__, path, ret);
+		goto out;
+	}
+
+	ret = ilm_recorder_write(fd, &header, sizeof(header));
+	if (!ret)
+		ret = ilm_recorder_write(fd, recorder_path,
+					 sizeof(struct ilm_recorder_path) *
+					 header.path_num);
+	if (!ret)
+		ret = ilm_recorder_write(fd, recs, sizeof(*recs) * num);
+	close(fd);
+
+	if (ret)
+		ilm_log_err("%s: fail to write %s %d", __func__, path, ret);
+	else
+		ilm_log_warn("Flight recorder: dumped %d commands to %s",
+			     num, path);
+
+out:
+	pthread_mutex_unlock(&recorder_dump_mutex);
+	free(recs);
+	return ret;
+}
+
+/* Called from the signal handler, the dump is done by ilm_recorder_poll() */
+void ilm_recorder_request_dump(void)
+{
+	recorder_dump_pending = 1;
+}
+
+void ilm_recorder_poll(void)
+{
+	if (!recorder_dump_pending)
+		return;
+
+	recorder_dump_pending = 0;
+	ilm_recorder_dump("signal");
+}
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdint.h>
+
+/*
+ * Flight recorder of drive commands: the last ILM_RECORDER_REC_NUM
+ * commands completed by the transport layer are kept in a ring, which is
+ * dumped into a binary file in the log directory when a lockspace fails
+ * to renew its locks or on SIGUSR1.  See test/trace/recorder_decode.py
+ * for the decoder of the dump.
+ */
+#define ILM_RECORDER_REC_NUM		8192	/* Power of 2 */
+#define ILM_RECORDER_PATH_NUM		1024	/* Power of 2 */
+#define ILM_RECORDER_PATH_LEN		64
+
+#define ILM_RECORDER_MAGIC		0x314352464d4c49ULL /* "ILMFRC1" */
+#define ILM_RECORDER_VERSION		1
+
+#define ILM_RECORDER_SCSI		0
+#define ILM_RECORDER_NVME		1
+
+/* All fields are in the host byte order */
+struct ilm_recorder_rec {
+	uint64_t seq;			/* Zero while the slot is written */
+	uint64_t time_us;		/* Completion time, CLOCK_REALTIME */
+	uint64_t wwn;
+	uint64_t lock_hash;		/* FNV-1a of the lock ID */
+	uint64_t trace_id;		/* Client request, see req_trace.h */
+	uint32_t latency_us;
+	int32_t result;
+	uint16_t path_idx;		/* Index into the dumped path table */
+	uint8_t op;			/* ILM_STATS_OP_* */
+	uint8_t transport;		/* ILM_RECORDER_SCSI or _NVME */
+	uint16_t status;		/* SCSI sense key or NVMe SCT/SC */
+	uint16_t reserved0;
+	uint64_t reserved1;
+};
+
+struct ilm_recorder_path {
+	uint64_t wwn;
+	char path[ILM_RECORDER_PATH_LEN];
+};
+
+/*
+ * Layout of the dump: the header, then path_num paths and rec_num records
+ * in the order they were completed.
+ */
+struct ilm_recorder_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t path_size;
+	uint32_t path_num;
+	uint32_t rec_num;
+	uint32_t pid;
+	uint64_t time_us;		/* Dump time, CLOCK_REALTIME */
+	uint64_t dropped;		/* Records overwritten before the dump */
+	char reason[32];
+};
+
+#ifndef TEST
+void ilm_recorder_add(char *drive, int transport, int op, char *lock_id,
+		      uint64_t start, int result, int status,
+		      uint64_t trace_id);
+int ilm_recorder_dump(const char *reason);
+void ilm_recorder_request_dump(void);
+void ilm_recorder_poll(void);
+#else
+static inline void ilm_recorder_add(char *drive, int transport, int op,
+				    char *lock_id, uint64_t start, int result,
+				    int status, uint64_t trace_id) { }
+#endif
+
+#endif /* __RECORDER_H__ */
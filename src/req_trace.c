@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ilm_internal.h"
+#include "log.h"
+#include "req_trace.h"
+#include "stats.h"
+
+static uint64_t req_trace_seq;
+
+/* Request handled by this worker thread */
+static __thread struct ilm_req_trace *req_trace_cur;
+
+/* Trace ID of the drive request dispatched by this RAID thread */
+static __thread uint64_t req_trace_thread_id;
+
+/* Called when the request is received */
+void ilm_req_trace_init(struct ilm_req_trace *trace)
+{
+	memset(trace, 0, sizeof(*trace));
+	trace->id = __atomic_add_fetch(&req_trace_seq, 1, __ATOMIC_RELAXED);
+	trace->recv = ilm_stats_now();
+}
+
+/* Called by the worker thread before handling the request */
+void ilm_req_trace_begin(struct ilm_req_trace *trace)
+{
+	trace->dispatch = ilm_stats_now();
+	req_trace_cur = trace;
+}
+
+/* Called when the reply is sent, only the first reply counts */
+void ilm_req_trace_reply(struct ilm_req_trace *trace)
+{
+	if (!trace->reply)
+		trace->reply = ilm_stats_now();
+}
+
+uint64_t ilm_req_trace_id(void)
+{
+	if (req_trace_cur)
+		return req_trace_cur->id;
+
+	return req_trace_thread_id;
+}
+
+void ilm_req_trace_set_id(uint64_t id)
+{
+	req_trace_thread_id = id;
+}
+
+/* Account the time waiting since @start for the lock */
+void ilm_req_trace_wait(uint64_t start)
+{
+	if (req_trace_cur)
+		req_trace_cur->wait_us += ilm_stats_now() - start;
+}
+
+void ilm_req_trace_round_begin(const char *op)
+{
+	struct ilm_req_trace *trace = req_trace_cur;
+
+	if (!trace)
+		return;
+
+	memset(&trace->cur, 0, sizeof(trace->cur));
+	trace->cur.op = op;
+	trace->cur.start = ilm_stats_now();
+}
+
+void ilm_req_trace_round_end(void)
+{
+	struct ilm_req_trace *trace = req_trace_cur;
+
+	if (!trace)
+		return;
+
+	trace->cur.issue_us = ilm_stats_now() - trace->cur.start;
+	ilm_stats_stage(ILM_STAGE_ISSUE, trace->cur.issue_us);
+
+	if (trace->rounds < ILM_REQ_TRACE_ROUNDS)
+		trace->round[trace->rounds] = trace->cur;
+	trace->rounds++;
+}
+
+/* A request of the current round has completed on a drive */
+void ilm_req_trace_drive(uint64_t lat, int result)
+{
+	struct ilm_req_trace *trace = req_trace_cur;
+
+	if (!trace)
+		return;
+
+	ilm_stats_stage(ILM_STAGE_DRIVE, lat);
+
+	trace->cur.drives++;
+	if (result < 0)
+		trace->cur.errors++;
+	if (lat > trace->cur.drive_max_us)
+		trace->cur.drive_max_us = lat;
+}
+
+void ilm_req_trace_quorum(int score, int total)
+{
+	struct ilm_req_trace *trace = req_trace_cur;
+
+	if (!trace)
+		return;
+
+	trace->quorum = ilm_stats_now();
+	trace->quorum_score = score;
+	trace->quorum_total = total;
+}
+
+static void ilm_req_trace_dump(struct ilm_req_trace *trace, const char *name,
+			       uint64_t total)
+{
+	struct ilm_req_round *round;
+	int i;
+
+	ilm_log_warn("slow request %lu %s: total %lu us queue %lu wait %lu "
+		     "quorum %lu (%d/%d) reply %lu rounds %d",
+		     trace->id, name, total, trace->dispatch - trace->recv,
+		     trace->wait_us,
+		     trace->quorum ? trace->quorum - trace->dispatch : 0,
+		     trace->quorum_score, trace->quorum_total,
+		     trace->reply ? trace->reply - trace->dispatch : 0,
+		     trace->rounds);
+
+	for (i = 0; i < trace->rounds && i < ILM_REQ_TRACE_ROUNDS; i++) {
+		round = &trace->round[i];
+		ilm_log_warn("slow request %lu round %d %s: start %lu issue %lu "
+			     "drives %d errors %d slowest %lu",
+			     trace->id, i, round->op,
+			     round->start - trace->dispatch, round->issue_us,
+			     round->drives, round->errors,
+			     round->drive_max_us);
+	}
+
+	if (trace->rounds > ILM_REQ_TRACE_ROUNDS)
+		ilm_log_warn("slow request %lu: %d more rounds", trace->id,
+			     trace->rounds - ILM_REQ_TRACE_ROUNDS);
+}
+
+/**
+ * ilm_req_trace_end - Account the stages of a handled request
+ * @trace:	Trace of the request.
+ * @name:	Command name for the slow request log.
+ *
+ * The request taking longer than the slow threshold is logged with its
+ * full breakdown.
+ */
+void ilm_req_trace_end(struct ilm_req_trace *trace, const char *name)
+{
+	uint64_t end, total;
+
+	req_trace_cur = NULL;
+
+	end = trace->reply ? trace->reply : ilm_stats_now();
+	total = end - trace->recv;
+
+	ilm_stats_stage(ILM_STAGE_QUEUE, trace->dispatch - trace->recv);
+	if (trace->rounds || trace->wait_us)
+		ilm_stats_stage(ILM_STAGE_LOCK_WAIT, trace->wait_us);
+	if (trace->quorum)
+		ilm_stats_stage(ILM_STAGE_QUORUM,
+				trace->quorum - trace->dispatch);
+	if (trace->reply)
+		ilm_stats_stage(ILM_STAGE_REPLY,
+				trace->reply - trace->dispatch);
+	ilm_stats_stage(ILM_STAGE_TOTAL, total);
+
+	if (env.slow_request && total >= (uint64_t)env.slow_request * 1000) {
+		ilm_stats_slow();
+		ilm_req_trace_dump(trace, name, total);
+	}
+}
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __REQ_TRACE_H__
+#define __REQ_TRACE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/* Rounds on drives kept for the breakdown of a slow request */
+#define ILM_REQ_TRACE_ROUNDS		8
+
+struct ilm_req_round {
+	const char *op;			/* RAID operation */
+	int drives;			/* Requests sent to drives */
+	int errors;			/* Requests failed */
+	uint64_t start;
+	uint64_t issue_us;
+	uint64_t drive_max_us;		/* The slowest request */
+};
+
+/*
+ * Breakdown of a client request, all timestamps are from ilm_stats_now().
+ * It's only accessed by the thread handling the request, the drive
+ * requests carry the trace ID and report their latency back to it.
+ */
+struct ilm_req_trace {
+	uint64_t id;
+	uint64_t recv;
+	uint64_t dispatch;
+	uint64_t quorum;		/* Last quorum decision */
+	uint64_t reply;
+	uint64_t wait_us;		/* Lock mutex and local queue */
+	int quorum_score;
+	int quorum_total;
+	int rounds;
+	struct ilm_req_round cur;	/* Round in progress */
+	struct ilm_req_round round[ILM_REQ_TRACE_ROUNDS];
+};
+
+#ifndef TEST
+void ilm_req_trace_init(struct ilm_req_trace *trace);
+void ilm_req_trace_begin(struct ilm_req_trace *trace);
+void ilm_req_trace_end(struct ilm_req_trace *trace, const char *name);
+void ilm_req_trace_reply(struct ilm_req_trace *trace);
+uint64_t ilm_req_trace_id(void);
+void ilm_req_trace_set_id(uint64_t id);
+void ilm_req_trace_wait(uint64_t start);
+void ilm_req_trace_round_begin(const char *op);
+void ilm_req_trace_round_end(void);
+void ilm_req_trace_drive(uint64_t lat, int result);
+void ilm_req_trace_quorum(int score, int total);
+#else
+static inline uint64_t ilm_req_trace_id(void) { return 0; }
+static inline void ilm_req_trace_wait(uint64_t start) { }
+#endif
+
+/* Lock the mutex, the time blocked is accounted as the lock wait */
+static inline void ilm_req_trace_mutex_lock(pthread_mutex_t *mutex)
+{
+	uint64_t start;
+
+	if (!pthread_mutex_trylock(mutex))
+		return;
+
+	start = ilm_stats_now();
+	pthread_mutex_lock(mutex);
+	ilm_req_trace_wait(start);
+}
+
+#endif /* __REQ_TRACE_H__ */
@@ -0,0 +1,559 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "client.h"
+#include "cmd.h"
+#include "drive.h"
+#include "log.h"
+#include "stats.h"
+
+#define ILM_STATS_SUB_BITS		2
+#define ILM_STATS_SUB_NUM		(1 << ILM_STATS_SUB_BITS)
+
+/*
+ * Statistics recorded by a thread.  Only the owner thread writes into it,
+ * so recording needs neither lock nor atomic read-modify-write; counters
+ * are stored atomically so the reader never sees a torn value.  When the
+ * thread exits, the table is kept and adopted by the next new thread.
+ *
+ * Tables are only freed at exit, so they are kept in a chain which is
+ * only prepended to and the readers walk it without the mutex.
+ */
+struct ilm_stats_thread {
+	struct ilm_stats_thread *next;	/* Published with release ordering */
+	int in_use;
+	int drive_num;			/* Published with release ordering */
+	struct ilm_drive_stats *drive[ILM_DRIVE_MAX_NUM];
+};
+
+static struct ilm_stats_thread *stats_head;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread struct ilm_stats_thread *stats_self;
+
+/*
+ * Mutexes found on every drive by the last group read, also read without
+ * the mutex: an entry is filled before the number is published and only
+ * the insertion takes stats_mutex.
+ */
+static struct ilm_stats_mutex mutex_stats[ILM_DRIVE_MAX_NUM];
+static int mutex_stats_num;
+
+/* Stages of client requests, updated once per stage of a request */
+static struct ilm_stage_stats stage_stats;
+
+/*
+ * Contention of lock IDs, kept with the space-saving algorithm: at most
+ * ILM_LOCK_STATS_NUM lock IDs are tracked, a contention event of another
+ * lock ID replaces the least contended one and inherits its contention as
+ * the error.  So any lock ID contended more than the least contended entry
+ * is tracked, and the memory doesn't grow with the number of LVs.  Other
+ * events only update a tracked lock ID or fill a free entry.
+ */
+static struct ilm_lock_stats lock_stats[ILM_LOCK_STATS_NUM];
+static int lock_stats_num;
+static pthread_mutex_t lock_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define ilm_stats_add(p, v)						\
+	__atomic_store_n((p), *(p) + (v), __ATOMIC_RELAXED)
+#define ilm_stats_read(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+
+/* Histogram bucket of a value, see ILM_STATS_BUCKET_NUM */
+int ilm_stats_bucket(uint64_t us)
+{
+	int order, idx;
+
+	if (us < ILM_STATS_SUB_NUM)
+		return us;
+
+	order = 63 - __builtin_clzll(us);
+	idx = (order - ILM_STATS_SUB_BITS + 1) * ILM_STATS_SUB_NUM +
+	      ((us >> (order - ILM_STATS_SUB_BITS)) & (ILM_STATS_SUB_NUM - 1));
+	if (idx >= ILM_STATS_BUCKET_NUM)
+		idx = ILM_STATS_BUCKET_NUM - 1;
+
+	return idx;
+}
+
+static int ilm_stats_err(int result)
+{
+	switch (result) {
+	case -EBUSY:
+		return ILM_STATS_ERR_BUSY;
+	case -EAGAIN:
+		return ILM_STATS_ERR_AGAIN;
+	case -ETIME:
+		return ILM_STATS_ERR_TIME;
+	case -ENOENT:
+		return ILM_STATS_ERR_NOENT;
+	case -ENOMEM:
+		return ILM_STATS_ERR_NOMEM;
+	case -EINVAL:
+		return ILM_STATS_ERR_INVAL;
+	case -EPERM:
+		return ILM_STATS_ERR_PERM;
+	default:
+		return ILM_STATS_ERR_OTHER;
+	}
+}
+
+/* Release the table for reuse when its thread exits */
+static void ilm_stats_thread_exit(void *data)
+{
+	struct ilm_stats_thread *st = data;
+
+	pthread_mutex_lock(&stats_mutex);
+	st->in_use = 0;
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+static void ilm_stats_key_init(void)
+{
+	pthread_key_create(&stats_key, ilm_stats_thread_exit);
+}
+
+static struct ilm_stats_thread *ilm_stats_thread_get(void)
+{
+	struct ilm_stats_thread *st;
+
+	if (stats_self)
+		return stats_self;
+
+	pthread_once(&stats_once, ilm_stats_key_init);
+
+	pthread_mutex_lock(&stats_mutex);
+	for (st = stats_head; st; st = st->next) {
+		if (!st->in_use)
+			goto found;
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		pthread_mutex_unlock(&stats_mutex);
+		return NULL;
+	}
+	st->next = stats_head;
+	__atomic_store_n(&stats_head, st, __ATOMIC_RELEASE);
+
+found:
+	st->in_use = 1;
+	pthread_mutex_unlock(&stats_mutex);
+
+	pthread_setspecific(stats_key, st);
+	stats_self = st;
+	return st;
+}
+
+static struct ilm_drive_stats *ilm_stats_drive_get(struct ilm_stats_thread *st,
+						   char *drive)
+{
+	struct ilm_drive_stats *ds;
+	int i;
+
+	for (i = 0; i < st->drive_num; i++) {
+		if (!strncmp(st->drive[i]->path, drive,
+			     ILM_STATS_PATH_LEN - 1))
+			return st->drive[i];
+	}
+
+	if (st->drive_num >= ILM_DRIVE_MAX_NUM)
+		return NULL;
+
+	ds = calloc(1, sizeof(*ds));
+	if (!ds)
+		return NULL;
+
+	snprintf(ds->path, sizeof(ds->path), "%s", drive);
+	st->drive[st->drive_num] = ds;
+	__atomic_store_n(&st->drive_num, st->drive_num + 1, __ATOMIC_RELEASE);
+	return ds;
+}
+
+/**
+ * ilm_stats_record - Account a completed drive command
+ * @drive:	Drive path which the command is sent to.
+ * @op:		Statistics opcode, see ilm_stats_op().
+ * @start:	Timestamp from ilm_stats_now() when the command is sent.
+ * @result:	Zero or a negative error of the command.
+ */
+void ilm_stats_record(char *drive, int op, uint64_t start, int result)
+{
+	struct ilm_stats_thread *st;
+	struct ilm_drive_stats *ds;
+	uint64_t lat;
+
+	if (op < 0 || op >= ILM_STATS_OP_NUM)
+		return;
+
+	st = ilm_stats_thread_get();
+	if (!st)
+		return;
+
+	ds = ilm_stats_drive_get(st, drive);
+	if (!ds)
+		return;
+
+	lat = ilm_stats_now() - start;
+
+	ilm_stats_add(&ds->count[op], 1);
+	ilm_stats_add(&ds->total_us[op], lat);
+	ilm_stats_add(&ds->hist[op][ilm_stats_bucket(lat)], 1);
+	if (lat > ds->max_us[op])
+		__atomic_store_n(&ds->max_us[op], lat, __ATOMIC_RELAXED);
+
+	if (result < 0)
+		ilm_stats_add(&ds->error[op][ilm_stats_err(result)], 1);
+}
+
+/**
+ * ilm_stats_stage - Account a stage of a client request
+ * @stage:	ILM_STAGE_* of the request.
+ * @us:		Latency of the stage in microseconds.
+ */
+void ilm_stats_stage(int stage, uint64_t us)
+{
+	uint64_t max;
+
+	__atomic_add_fetch(&stage_stats.count[stage], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stage_stats.total_us[stage], us, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stage_stats.hist[stage][ilm_stats_bucket(us)], 1,
+			   __ATOMIC_RELAXED);
+
+	max = ilm_stats_read(&stage_stats.max_us[stage]);
+	while (us > max &&
+	       !__atomic_compare_exchange_n(&stage_stats.max_us[stage], &max,
+					    us, 1, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+void ilm_stats_slow(void)
+{
+	__atomic_add_fetch(&stage_stats.slow, 1, __ATOMIC_RELAXED);
+}
+
+static struct ilm_lock_stats *ilm_stats_lock_find(char *id, int event)
+{
+	struct ilm_lock_stats *st, *min = NULL;
+	uint64_t error;
+	int i;
+
+	for (i = 0; i < lock_stats_num; i++) {
+		st = &lock_stats[i];
+		if (!memcmp(&st->id, id, sizeof(st->id)))
+			return st;
+
+		if (!min || st->contention < min->contention)
+			min = st;
+	}
+
+	if (lock_stats_num < ILM_LOCK_STATS_NUM) {
+		st = &lock_stats[lock_stats_num++];
+		error = 0;
+	} else if (event >= ILM_STATS_LOCK_RETRY) {
+		st = min;
+		error = min->contention;
+	} else {
+		return NULL;
+	}
+
+	memset(st, 0, sizeof(*st));
+	memcpy(&st->id, id, sizeof(st->id));
+	st->contention = error;
+	st->error = error;
+	return st;
+}
+
+/**
+ * ilm_stats_lock - Account an event of a lock ID
+ * @id:		Lock ID.
+ * @event:	ILM_STATS_LOCK_*.
+ * @us:		Time to majority for ILM_STATS_LOCK_ACQUIRED.
+ */
+void ilm_stats_lock(char *id, int event, uint64_t us)
+{
+	struct ilm_lock_stats *st;
+
+	pthread_mutex_lock(&lock_stats_mutex);
+
+	st = ilm_stats_lock_find(id, event);
+	if (!st)
+		goto out;
+
+	switch (event) {
+	case ILM_STATS_LOCK_ATTEMPT:
+		st->attempts++;
+		break;
+	case ILM_STATS_LOCK_ACQUIRED:
+		st->acquired++;
+		st->majority_total_us += us;
+		if (us > st->majority_max_us)
+			st->majority_max_us = us;
+		break;
+	case ILM_STATS_LOCK_RETRY:
+		st->retries++;
+		break;
+	case ILM_STATS_LOCK_BUSY:
+		st->busy++;
+		break;
+	case ILM_STATS_LOCK_AGAIN:
+		st->again++;
+		break;
+	case ILM_STATS_LOCK_BREAK:
+		st->breaks++;
+		break;
+	case ILM_STATS_LOCK_CONVERT_FAIL:
+		st->convert_fail++;
+		break;
+	case ILM_STATS_LOCK_RENEW_FAIL:
+		st->renew_fail++;
+		break;
+	}
+
+	if (event >= ILM_STATS_LOCK_RETRY)
+		st->contention++;
+
+out:
+	pthread_mutex_unlock(&lock_stats_mutex);
+}
+
+static void ilm_stats_merge(struct ilm_drive_stats *dst,
+			    struct ilm_drive_stats *src)
+{
+	uint64_t val;
+	int i, j;
+
+	for (i = 0; i < ILM_STATS_OP_NUM; i++) {
+		dst->count[i] += ilm_stats_read(&src->count[i]);
+		dst->total_us[i] += ilm_stats_read(&src->total_us[i]);
+
+		val = ilm_stats_read(&src->max_us[i]);
+		if (val > dst->max_us[i])
+			dst->max_us[i] = val;
+
+		for (j = 0; j < ILM_STATS_ERR_NUM; j++)
+			dst->error[i][j] += ilm_stats_read(&src->error[i][j]);
+
+		for (j = 0; j < ILM_STATS_BUCKET_NUM; j++)
+			dst->hist[i][j] += ilm_stats_read(&src->hist[i][j]);
+	}
+}
+
+/**
+ * ilm_stats_collect - Sum up the statistics of all threads per drive
+ * @out:	Returns the statistics, only allocated when any drive has
+ *		been accessed.  Freed by the caller.
+ *
+ * Doesn't take any lock which is used by the drive commands.
+ *
+ * Returns the drive number or a negative error.
+ */
+int ilm_stats_collect(struct ilm_drive_stats **out)
+{
+	struct ilm_drive_stats *stats = NULL, *tmp, *src;
+	struct ilm_drive_snapshot *snap;
+	struct ilm_stats_thread *st;
+	int num = 0, drive_num, i, j, idx;
+
+	for (st = __atomic_load_n(&stats_head, __ATOMIC_ACQUIRE); st;
+	     st = __atomic_load_n(&st->next, __ATOMIC_ACQUIRE)) {
+		drive_num = __atomic_load_n(&st->drive_num, __ATOMIC_ACQUIRE);
+
+		for (i = 0; i < drive_num; i++) {
+			src = st->drive[i];
+
+			for (j = 0; j < num; j++) {
+				if (!strcmp(stats[j].path, src->path))
+					break;
+			}
+
+			if (j == num) {
+				tmp = realloc(stats, sizeof(*stats) * (num + 1));
+				if (!tmp) {
+					free(stats);
+					return -ENOMEM;
+				}
+
+				stats = tmp;
+				memset(&stats[num], 0, sizeof(*stats));
+				memcpy(stats[num].path, src->path,
+				       ILM_STATS_PATH_LEN);
+				num++;
+			}
+
+			ilm_stats_merge(&stats[j], src);
+		}
+	}
+
+	snap = ilm_drive_snapshot_get(&idx);
+	for (i = 0; i < num; i++)
+		stats[i].wwn = ilm_drive_snapshot_find_wwn(snap,
+							   stats[i].path);
+	ilm_drive_snapshot_put(idx);
+
+	*out = stats;
+	return num;
+}
+
+/**
+ * ilm_stats_mutex_num - Save the mutex number of a drive
+ * @drive:	Drive path.
+ * @num:	Mutexes found by the group read of the drive.
+ */
+void ilm_stats_mutex_num(char *drive, int num)
+{
+	struct ilm_stats_mutex *ms;
+	int i, n;
+
+	n = __atomic_load_n(&mutex_stats_num, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++) {
+		ms = &mutex_stats[i];
+		if (!strncmp(ms->path, drive, ILM_STATS_PATH_LEN - 1))
+			goto found;
+	}
+
+	pthread_mutex_lock(&stats_mutex);
+
+	/* Someone else may have inserted it in the meantime */
+	for (; i < mutex_stats_num; i++) {
+		ms = &mutex_stats[i];
+		if (!strncmp(ms->path, drive, ILM_STATS_PATH_LEN - 1))
+			goto unlock;
+	}
+
+	if (mutex_stats_num >= ILM_DRIVE_MAX_NUM) {
+		pthread_mutex_unlock(&stats_mutex);
+		return;
+	}
+
+	ms = &mutex_stats[mutex_stats_num];
+	snprintf(ms->path, sizeof(ms->path), "%s", drive);
+	__atomic_store_n(&mutex_stats_num, mutex_stats_num + 1,
+			 __ATOMIC_RELEASE);
+
+unlock:
+	pthread_mutex_unlock(&stats_mutex);
+found:
+	__atomic_store_n(&ms->num, num, __ATOMIC_RELAXED);
+}
+
+/* Copy out the mutex numbers of at most @max drives, returns the number */
+int ilm_stats_mutex_get(struct ilm_stats_mutex *out, int max)
+{
+	int i, n;
+
+	n = __atomic_load_n(&mutex_stats_num, __ATOMIC_ACQUIRE);
+	if (n > max)
+		n = max;
+
+	for (i = 0; i < n; i++) {
+		memcpy(out[i].path, mutex_stats[i].path, ILM_STATS_PATH_LEN);
+		out[i].num = __atomic_load_n(&mutex_stats[i].num,
+					     __ATOMIC_RELAXED);
+	}
+
+	return n;
+}
+
+int ilm_stats_get(struct ilm_cmd *cmd)
+{
+	struct ilm_drive_stats *stats = NULL;
+	int num;
+
+	num = ilm_stats_collect(&stats);
+	if (num < 0) {
+		ilm_send_result(cmd, num, NULL, 0);
+		return num;
+	}
+
+	ilm_send_result(cmd, num, (char *)stats,
+			sizeof(struct ilm_drive_stats) * num);
+	free(stats);
+	return 0;
+}
+
+int ilm_stats_get_stage(struct ilm_cmd *cmd)
+{
+	struct ilm_stage_stats *stats;
+	uint64_t *dst, *src;
+	int i;
+
+	stats = malloc(sizeof(*stats));
+	if (!stats) {
+		ilm_send_result(cmd, -ENOMEM, NULL, 0);
+		return -ENOMEM;
+	}
+
+	/* The stats only consist of counters, read them one by one */
+	dst = (uint64_t *)stats;
+	src = (uint64_t *)&stage_stats;
+	for (i = 0; i < (int)(sizeof(*stats) / sizeof(uint64_t)); i++)
+		dst[i] = ilm_stats_read(&src[i]);
+
+	ilm_send_result(cmd, 0, (char *)stats, sizeof(*stats));
+	free(stats);
+	return 0;
+}
+
+static int ilm_stats_lock_cmp(const void *a, const void *b)
+{
+	const struct ilm_lock_stats *x = a, *y = b;
+
+	if (x->contention != y->contention)
+		return x->contention < y->contention ? 1 : -1;
+
+	if (x->attempts != y->attempts)
+		return x->attempts < y->attempts ? 1 : -1;
+
+	return 0;
+}
+
+int ilm_stats_get_lock(struct ilm_cmd *cmd)
+{
+	struct ilm_lock_stats *stats;
+	int num;
+
+	stats = malloc(sizeof(lock_stats));
+	if (!stats) {
+		ilm_send_result(cmd, -ENOMEM, NULL, 0);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&lock_stats_mutex);
+	num = lock_stats_num;
+	memcpy(stats, lock_stats, sizeof(*stats) * num);
+	pthread_mutex_unlock(&lock_stats_mutex);
+
+	/* The most contended first */
+	qsort(stats, num, sizeof(*stats), ilm_stats_lock_cmp);
+
+	ilm_send_result(cmd, num, (char *)stats, sizeof(*stats) * num);
+	free(stats);
+	return 0;
+}
+
+void ilm_stats_exit(void)
+{
+	struct ilm_stats_thread *st, *next;
+	int i;
+
+	pthread_mutex_lock(&stats_mutex);
+	for (st = stats_head; st; st = next) {
+		next = st->next;
+		for (i = 0; i < st->drive_num; i++)
+			free(st->drive[i]);
+		free(st);
+	}
+	stats_head = NULL;
+	stats_self = NULL;
+	pthread_mutex_unlock(&stats_mutex);
+}
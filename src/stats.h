@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "idm_cmd_common.h"
+#include "ilm.h"
+
+struct ilm_cmd;
+
+/* Timestamp for the drive command latency, in microseconds */
+static inline uint64_t ilm_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Map an IDM command to the statistics opcode: a write command is keyed
+ * by its mutex opcode and a read command by its mutex group.  Returns -1
+ * for the commands which are not accounted.
+ */
+static inline int ilm_stats_op(int write, int mutex_op, int group)
+{
+	if (!write)
+		return group == IDM_GROUP_INQUIRY ?
+			ILM_STATS_OP_INQUIRY : ILM_STATS_OP_READ_GROUP;
+
+	switch (mutex_op) {
+	case IDM_OPCODE_TRYLOCK:
+	case IDM_OPCODE_LOCK:
+		return ILM_STATS_OP_LOCK;
+	case IDM_OPCODE_UNLOCK:
+		return ILM_STATS_OP_UNLOCK;
+	case IDM_OPCODE_REFRESH:
+		return ILM_STATS_OP_REFRESH;
+	case IDM_OPCODE_BREAK:
+		return ILM_STATS_OP_BREAK;
+	case IDM_OPCODE_DESTROY:
+		return ILM_STATS_OP_DESTROY;
+	default:
+		return -1;
+	}
+}
+
+/* Events of a lock ID, see ilm_stats_lock() */
+enum {
+	ILM_STATS_LOCK_ATTEMPT = 0,
+	ILM_STATS_LOCK_ACQUIRED,	/* With the time to majority */
+	ILM_STATS_LOCK_RETRY,		/* Contention events from here on */
+	ILM_STATS_LOCK_BUSY,
+	ILM_STATS_LOCK_AGAIN,
+	ILM_STATS_LOCK_BREAK,
+	ILM_STATS_LOCK_CONVERT_FAIL,
+	ILM_STATS_LOCK_RENEW_FAIL,
+};
+
+/* Mutex table occupancy of a drive, see ilm_stats_mutex_num() */
+struct ilm_stats_mutex {
+	char path[ILM_STATS_PATH_LEN];
+	int num;
+};
+
+#ifndef TEST
+int ilm_stats_bucket(uint64_t us);
+void ilm_stats_record(char *drive, int op, uint64_t start, int result);
+void ilm_stats_stage(int stage, uint64_t us);
+void ilm_stats_slow(void);
+void ilm_stats_lock(char *id, int event, uint64_t us);
+void ilm_stats_mutex_num(char *drive, int num);
+int ilm_stats_mutex_get(struct ilm_stats_mutex *out, int max);
+int ilm_stats_collect(struct ilm_drive_stats **out);
+int ilm_stats_get(struct ilm_cmd *cmd);
+int ilm_stats_get_stage(struct ilm_cmd *cmd);
+int ilm_stats_get_lock(struct ilm_cmd *cmd);
+void ilm_stats_exit(void);
+#else
+static inline void ilm_stats_record(char *drive, int op, uint64_t start,
+				    int result) { }
+#endif
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,251 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "cmd.h"
+#include "ilm_internal.h"
+#include "lock.h"
+#include "lockspace.h"
+#include "log.h"
+#include "status.h"
+#include "util.h"
+
+static struct ilm_status_header *status_hdr;
+static struct ilm_status_slot *status_slot;
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t status_token_seq;
+
+static void ilm_status_path(char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%s", env.run_dir, ILM_STATUS_NAME);
+}
+
+/**
+ * ilm_status_init - Create the status region
+ *
+ * The file is always created anew, so the clients which still map the
+ * file of a previous daemon never see it being truncated.  Without the
+ * status region the clients send all queries to the daemon.
+ *
+ * Returns zero or a negative error (errno).
+ */
+int ilm_status_init(void)
+{
+	char path[PATH_MAX];
+	void *addr;
+	int fd, ret;
+
+	ilm_status_path(path);
+	unlink(path);
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR | S_IRGRP);
+	if (fd < 0) {
+		ret = -errno;
+		ilm_log_err("Fail to create status file %s %d", path, ret);
+		return ret;
+	}
+
+	/* Same permission as the socket file */
+	fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP);
+
+	if (ftruncate(fd, ilm_status_size()) < 0) {
+		ret = -errno;
+		ilm_log_err("Fail to size status file %d", ret);
+		goto fail;
+	}
+
+	addr = mmap(NULL, ilm_status_size(), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		ret = -errno;
+		ilm_log_err("Fail to map status file %d", ret);
+		goto fail;
+	}
+	close(fd);
+
+	status_slot = (struct ilm_status_slot *)((char *)addr +
+						sizeof(struct ilm_status_header));
+
+	/* Clients check the magic at last */
+	status_hdr = addr;
+	status_hdr->version = ILM_STATUS_VERSION;
+	status_hdr->bucket_num = ILM_STATUS_BUCKET_NUM;
+	status_hdr->bucket_slots = ILM_STATUS_BUCKET_SLOTS;
+	status_hdr->slot_size = sizeof(struct ilm_status_slot);
+	__atomic_store_n(&status_hdr->magic, ILM_STATUS_MAGIC,
+			 __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	close(fd);
+	unlink(path);
+	return ret;
+}
+
+void ilm_status_exit(void)
+{
+	char path[PATH_MAX];
+
+	if (!status_hdr)
+		return;
+
+	ilm_status_path(path);
+	unlink(path);
+
+	munmap(status_hdr, ilm_status_size());
+	status_hdr = NULL;
+	status_slot = NULL;
+}
+
+/* The token identifies a lockspace's locks in the status region */
+uint64_t ilm_status_token(void)
+{
+	uint64_t token;
+
+	pthread_mutex_lock(&status_mutex);
+	token = ++status_token_seq;
+	pthread_mutex_unlock(&status_mutex);
+
+	return token;
+}
+
+int ilm_status_get_token(struct ilm_cmd *cmd, struct ilm_lockspace *ls)
+{
+	if (!status_hdr) {
+		ilm_send_result(cmd, -EOPNOTSUPP, NULL, 0);
+		return -EOPNOTSUPP;
+	}
+
+	ilm_send_result(cmd, 0, (char *)&ls->status_token,
+			sizeof(ls->status_token));
+	return 0;
+}
+
+/*
+ * The cached LVB and host count are only trusted while the lock is held
+ * in exclusive mode, since a shareable lock can be unlocked with a new
+ * LVB or joined by other hosts at any time.  A pending LVB is always the
+ * latest one, it's what the daemon replies as well.
+ */
+static uint32_t ilm_status_flags(struct ilm_lock *lock)
+{
+	uint32_t flags = 0;
+
+	if (lock->vb_pending ||
+	    (lock->mode == IDM_MODE_EXCLUSIVE && lock->vb_valid))
+		flags |= ILM_STATUS_VB;
+
+	if (lock->mode == IDM_MODE_EXCLUSIVE && lock->host_count_valid)
+		flags |= ILM_STATUS_COUNT;
+
+	return flags;
+}
+
+/* Called with status_mutex held */
+static void ilm_status_write_unsafe(struct ilm_status_slot *slot,
+				    uint64_t token, struct ilm_lock *lock)
+{
+	uint32_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->token = token;
+	if (lock) {
+		memcpy(slot->lock_id, lock->id, IDM_LOCK_ID_LEN);
+		slot->mode = lock->mode;
+		slot->flags = ilm_status_flags(lock);
+		slot->count = lock->host_count;
+		slot->self = lock->host_self;
+		memcpy(slot->vb, lock->vb, IDM_VALUE_LEN);
+		slot->expire = lock->last_renewal_success +
+			       ILM_STATUS_FRESH_PERIOD;
+	} else {
+		slot->flags = 0;
+		slot->expire = 0;
+	}
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * ilm_status_publish - Publish a lock which has been acquired
+ * @ls:		Lockspace holding the lock.
+ * @lock:	Lock, its mode and renewal time are up to date.
+ *
+ * The locks coalesced between lockspaces aren't published, the queries
+ * for them are always sent to the daemon.
+ */
+void ilm_status_publish(struct ilm_lockspace *ls, struct ilm_lock *lock)
+{
+	struct ilm_status_slot *slot;
+	uint32_t bucket;
+	int i;
+
+	if (!status_hdr || lock->shared)
+		return;
+
+	if (lock->mode != IDM_MODE_EXCLUSIVE) {
+		lock->vb_valid = 0;
+		lock->host_count_valid = 0;
+	}
+
+	pthread_mutex_lock(&status_mutex);
+
+	if (!lock->status_slot) {
+		bucket = ilm_status_bucket(ls->status_token, lock->id);
+		slot = &status_slot[bucket * ILM_STATUS_BUCKET_SLOTS];
+
+		for (i = 0; i < ILM_STATUS_BUCKET_SLOTS; i++) {
+			if (!slot[i].token)
+				break;
+		}
+
+		if (i == ILM_STATUS_BUCKET_SLOTS) {
+			pthread_mutex_unlock(&status_mutex);
+			ilm_log_dbg("%s: bucket %u is full", __func__, bucket);
+			return;
+		}
+
+		lock->status_slot = bucket * ILM_STATUS_BUCKET_SLOTS + i + 1;
+		lock->status_token = ls->status_token;
+	}
+
+	ilm_status_write_unsafe(&status_slot[lock->status_slot - 1],
+				lock->status_token, lock);
+	pthread_mutex_unlock(&status_mutex);
+}
+
+/* Refresh the published state after the lock is renewed or accessed */
+void ilm_status_update(struct ilm_lock *lock)
+{
+	pthread_mutex_lock(&status_mutex);
+	if (lock->status_slot)
+		ilm_status_write_unsafe(&status_slot[lock->status_slot - 1],
+					lock->status_token, lock);
+	pthread_mutex_unlock(&status_mutex);
+}
+
+void ilm_status_remove(struct ilm_lock *lock)
+{
+	pthread_mutex_lock(&status_mutex);
+	if (lock->status_slot) {
+		ilm_status_write_unsafe(&status_slot[lock->status_slot - 1],
+					0, NULL);
+		lock->status_slot = 0;
+	}
+	pthread_mutex_unlock(&status_mutex);
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __STATUS_H__
+#define __STATUS_H__
+
+#include <stdint.h>
+
+#include "lock.h"
+
+/*
+ * Status region: the daemon publishes the state of the held locks into a
+ * file under the run directory, clients map it read-only and answer the
+ * queries for their own locks without a round trip to the daemon.
+ *
+ * A lock is hashed into a bucket by the lockspace token and lock ID, and
+ * takes any free slot in the bucket; a lock is not published if its
+ * bucket is full.  Every slot is protected by a sequence count, which is
+ * odd while the daemon is updating the slot.
+ */
+#define ILM_STATUS_NAME			"status"	/* Under run directory */
+#define ILM_STATUS_MAGIC		0x494C4D53	/* "ILMS" */
+#define ILM_STATUS_VERSION		1
+
+#define ILM_STATUS_BUCKET_NUM		1024
+#define ILM_STATUS_BUCKET_SLOTS		4
+
+/* The published state is trusted for this long after a renewal */
+#define ILM_STATUS_FRESH_PERIOD		3000	/* ms */
+
+#define ILM_STATUS_VB			0x1	/* LVB is valid */
+#define ILM_STATUS_COUNT		0x2	/* Host count is valid */
+
+struct ilm_status_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t bucket_num;
+	uint32_t bucket_slots;
+	uint32_t slot_size;
+	uint32_t pad;
+};
+
+struct ilm_status_slot {
+	uint32_t seq;
+	uint32_t flags;
+	uint64_t token;			/* Zero if the slot is free */
+	char lock_id[IDM_LOCK_ID_LEN];
+	uint32_t mode;
+	int count;
+	int self;
+	char vb[IDM_VALUE_LEN];
+	uint64_t expire;		/* CLOCK_MONOTONIC in ms */
+};
+
+static inline uint32_t ilm_status_bucket(uint64_t token, char *lock_id)
+{
+	uint32_t hash = 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < (int)sizeof(token); i++)
+		hash = (hash ^ ((token >> (i * 8)) & 0xff)) * 16777619u;
+
+	for (i = 0; i < IDM_LOCK_ID_LEN; i++)
+		hash = (hash ^ (unsigned char)lock_id[i]) * 16777619u;
+
+	return hash % ILM_STATUS_BUCKET_NUM;
+}
+
+static inline size_t ilm_status_size(void)
+{
+	return sizeof(struct ilm_status_header) +
+	       sizeof(struct ilm_status_slot) *
+	       ILM_STATUS_BUCKET_NUM * ILM_STATUS_BUCKET_SLOTS;
+}
+
+struct ilm_cmd;
+struct ilm_lockspace;
+
+int ilm_status_init(void);
+void ilm_status_exit(void);
+uint64_t ilm_status_token(void);
+int ilm_status_get_token(struct ilm_cmd *cmd, struct ilm_lockspace *ls);
+void ilm_status_publish(struct ilm_lockspace *ls, struct ilm_lock *lock);
+void ilm_status_update(struct ilm_lock *lock);
+void ilm_status_remove(struct ilm_lock *lock);
+
+#endif /* __STATUS_H__ */
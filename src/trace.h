@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * Static tracepoints of the provider "seagate_ilm".
+ *
+ * When <sys/sdt.h> is available (systemtap-sdt-dev or systemtap-sdt-devel),
+ * every probe is compiled into a single nop plus an ELF note, tracers like
+ * bpftrace attach to it as "usdt:<binary>:seagate_ilm:<name>" and only then
+ * the nop is patched.  Otherwise, or with ILM_NO_TRACE defined, the probes
+ * compile to nothing and their arguments aren't evaluated.
+ *
+ * See test/trace/ for the scripts using the probes.
+ */
+#if !defined(ILM_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ILM_TRACE_ENABLED
+#endif
+#endif
+
+#ifdef ILM_TRACE_ENABLED
+
+#define ilm_trace1(name, a)						\
+	DTRACE_PROBE1(seagate_ilm, name, a)
+#define ilm_trace2(name, a, b)						\
+	DTRACE_PROBE2(seagate_ilm, name, a, b)
+#define ilm_trace3(name, a, b, c)					\
+	DTRACE_PROBE3(seagate_ilm, name, a, b, c)
+#define ilm_trace4(name, a, b, c, d)					\
+	DTRACE_PROBE4(seagate_ilm, name, a, b, c, d)
+#define ilm_trace5(name, a, b, c, d, e)					\
+	DTRACE_PROBE5(seagate_ilm, name, a, b, c, d, e)
+
+#else
+
+#define ilm_trace1(name, a)						\
+	do { if (0) { (void)(a); } } while (0)
+#define ilm_trace2(name, a, b)						\
+	do { if (0) { (void)(a); (void)(b); } } while (0)
+#define ilm_trace3(name, a, b, c)					\
+	do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#define ilm_trace4(name, a, b, c, d)					\
+	do {								\
+		if (0) { (void)(a); (void)(b); (void)(c); (void)(d); }	\
+	} while (0)
+#define ilm_trace5(name, a, b, c, d, e)					\
+	do {								\
+		if (0) {						\
+			(void)(a); (void)(b); (void)(c); (void)(d);	\
+			(void)(e);					\
+		}							\
+	} while (0)
+
+#endif
+
+#endif /* __TRACE_H__ */
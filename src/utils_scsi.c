@@ -46,7 +46,8 @@ int ilm_scsi_dir_select(const struct dirent *s)
 	return 0;
 }
 
-int ilm_scsi_change_sg_folder(const char *dir_name)
+/* Resolve the SCSI generic folder without changing the working directory */
+int ilm_scsi_get_sg_folder(const char *dir_name, char *sg_dir)
 {
         const char *old_name = "generic";
         char b[PATH_MAX];
@@ -60,7 +61,7 @@ int ilm_scsi_change_sg_folder(const char *dir_name)
 	}
 
         if ((stat(b, &a_stat) >= 0) && S_ISDIR(a_stat.st_mode)) {
-                if (chdir(b) < 0)
+                if (!realpath(b, sg_dir))
                         return -1;
 
                 return 0;
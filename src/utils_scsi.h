@@ -9,7 +9,7 @@
 #include <dirent.h>
 
 int ilm_scsi_dir_select(const struct dirent *s);
-int ilm_scsi_change_sg_folder(const char *dir_name);
+int ilm_scsi_get_sg_folder(const char *dir_name, char *sg_dir);
 int ilm_scsi_parse_sg_node(unsigned int maj, unsigned int min,
 			   char *dev);
 int ilm_scsi_block_node_select(const struct dirent *s);
@@ -207,6 +207,46 @@ def test_lock__lvb_write(ilm_daemon, reset_devices):
     ret = ilm.ilm_disconnect(s)
     assert ret == 0
 
+def test_lock__lvb_write_read_before_unlock(ilm_daemon, reset_devices):
+    ret, s = ilm.ilm_connect()
+    assert ret == 0
+    assert s > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s, lock_id, lock_op)
+    assert ret == 0
+
+    a = ilm.charArray(8)
+
+    ret = ilm.ilm_read_lvb(s, lock_id, a, 8)
+    assert ret == 0
+
+    # The written LVB is visible before it's flushed into IDM by unlock
+    a[0] = 'b'
+    ret = ilm.ilm_write_lvb(s, lock_id, a, 8)
+    assert ret == 0
+
+    a[0] = '0'
+    ret = ilm.ilm_read_lvb(s, lock_id, a, 8)
+    assert ret == 0
+    assert a[0] == 'b'
+
+    ret = ilm.ilm_unlock(s, lock_id)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s)
+    assert ret == 0
+
 def test_lock__lvb_write_two_hosts(ilm_daemon, reset_devices):
     ret, s1 = ilm.ilm_connect()
     assert ret == 0
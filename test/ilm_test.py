@@ -5,12 +5,14 @@
 import errno
 import io
 import os
+import select
 import time
 import uuid
 
 import pytest
 
 import ilm
+import ilm_util
 from test_conf import *     # Normally bad practice, but only importing 'constants' here
 
 def test_lockspace(ilm_daemon, reset_devices):
@@ -1058,6 +1060,379 @@ def test_lock__timeout_convert2(ilm_daemon, reset_devices):
     ret = ilm.ilm_disconnect(s)
     assert ret == 0
 
+def test_lock__many(ilm_daemon, reset_devices):
+    ret, s = ilm.ilm_connect()
+    assert ret == 0
+    assert s > 0
+
+    lock_id1 = ilm.idm_lock_id()
+    lock_id1.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id1.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_id2 = ilm.idm_lock_id()
+    lock_id2.set_vg_uuid(LOCK2_VG_UUID)
+    lock_id2.set_lv_uuid(LOCK2_LV_UUID)
+
+    ids = ilm.idmLockIdArray(2)
+    ids[0] = lock_id1
+    ids[1] = lock_id2
+
+    modes = ilm.uint32Array(2)
+    modes[0] = ilm.IDM_MODE_SHAREABLE
+    modes[1] = ilm.IDM_MODE_EXCLUSIVE
+
+    results = ilm.intArray(2)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_SHAREABLE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock_many(s, ids, modes, 2, lock_op, results)
+    assert ret == 0
+    assert results[0] == 0
+    assert results[1] == 0
+
+    ret, mode = ilm.ilm_get_mode(s, lock_id1, lock_op)
+    assert ret == 0
+    assert mode == ilm.IDM_MODE_SHAREABLE
+
+    ret, mode = ilm.ilm_get_mode(s, lock_id2, lock_op)
+    assert ret == 0
+    assert mode == ilm.IDM_MODE_EXCLUSIVE
+
+    # The locks have been acquired, the second acquisition fails
+    ret = ilm.ilm_lock_many(s, ids, modes, 2, lock_op, results)
+    assert ret == -errno.EBUSY
+    assert results[0] == -errno.EBUSY
+    assert results[1] == -errno.EBUSY
+
+    modes[0] = ilm.IDM_MODE_EXCLUSIVE
+    modes[1] = ilm.IDM_MODE_SHAREABLE
+
+    ret = ilm.ilm_convert_many(s, ids, modes, 2, results)
+    assert ret == 0
+    assert results[0] == 0
+    assert results[1] == 0
+
+    ret, mode = ilm.ilm_get_mode(s, lock_id1, lock_op)
+    assert ret == 0
+    assert mode == ilm.IDM_MODE_EXCLUSIVE
+
+    ret, mode = ilm.ilm_get_mode(s, lock_id2, lock_op)
+    assert ret == 0
+    assert mode == ilm.IDM_MODE_SHAREABLE
+
+    ret = ilm.ilm_unlock_many(s, ids, 2, results)
+    assert ret == 0
+    assert results[0] == 0
+    assert results[1] == 0
+
+    ret = ilm.ilm_unlock(s, lock_id1)
+    assert ret != 0
+
+    ret = ilm.ilm_disconnect(s)
+    assert ret == 0
+
+def test_lock__async(ilm_daemon, reset_devices):
+    ret, s = ilm.ilm_connect()
+    assert ret == 0
+    assert s > 0
+
+    fd = ilm.ilm_async_fd(s)
+    assert fd > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_SHAREABLE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret, ticket1 = ilm.ilm_lock_submit(s, lock_id, lock_op)
+    assert ret == 0
+
+    ret, ticket2 = ilm.ilm_convert_submit(s, lock_id, ilm.IDM_MODE_EXCLUSIVE)
+    assert ret == 0
+
+    ret, ticket3 = ilm.ilm_unlock_submit(s, lock_id)
+    assert ret == 0
+
+    # The requests for the same lock complete in order
+    tickets = []
+    comps = ilm.ilmCompletionArray(4)
+    while len(tickets) < 3:
+        r, w, x = select.select([fd], [], [], 60)
+        assert fd in r
+
+        num = ilm.ilm_reap(s, comps, 4)
+        assert num >= 0
+        for i in range(num):
+            assert comps[i].result == 0
+            tickets.append(comps[i].ticket)
+
+    assert tickets == [ticket1, ticket2, ticket3]
+
+    ret = ilm.ilm_disconnect(s)
+    assert ret == 0
+
+def test_lock__two_hosts_exclusive_wait_release(ilm_daemon, reset_devices):
+    ret, s1 = ilm.ilm_connect()
+    assert ret == 0
+    assert s1 > 0
+
+    host_id = HOST1
+    ret = ilm.ilm_set_host_id(s1, host_id, 32)
+
+    ret, s2 = ilm.ilm_connect()
+    assert ret == 0
+    assert s2 > 0
+
+    host_id = HOST2
+    ret = ilm.ilm_set_host_id(s2, host_id, 32)
+
+    fd = ilm.ilm_async_fd(s2)
+    assert fd > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s1, lock_id, lock_op)
+    assert ret == 0
+
+    # The second host waits in the local queue for the lock
+    ret, ticket = ilm.ilm_lock_submit(s2, lock_id, lock_op)
+    assert ret == 0
+
+    time.sleep(1)
+
+    ret = ilm.ilm_unlock(s1, lock_id)
+    assert ret == 0
+
+    comps = ilm.ilmCompletionArray(1)
+    r, w, x = select.select([fd], [], [], 60)
+    assert fd in r
+
+    num = ilm.ilm_reap(s2, comps, 1)
+    assert num == 1
+    assert comps[0].ticket == ticket
+    assert comps[0].result == 0
+
+    ret = ilm.ilm_unlock(s2, lock_id)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s1)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s2)
+    assert ret == 0
+
+def test_lock__deadline_and_cancel(ilm_daemon, reset_devices):
+    ret, s1 = ilm.ilm_connect()
+    assert ret == 0
+    assert s1 > 0
+
+    host_id = HOST1
+    ret = ilm.ilm_set_host_id(s1, host_id, 32)
+
+    ret, s2 = ilm.ilm_connect()
+    assert ret == 0
+    assert s2 > 0
+
+    host_id = HOST2
+    ret = ilm.ilm_set_host_id(s2, host_id, 32)
+
+    fd = ilm.ilm_async_fd(s2)
+    assert fd > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s1, lock_id, lock_op)
+    assert ret == 0
+
+    # Try once, it fails without waiting for the default deadline
+    start = time.time()
+    ret = ilm.ilm_lock_deadline(s2, lock_id, lock_op, 0)
+    assert ret != 0
+    assert time.time() - start < 2
+
+    # Cancel the pending acquisition
+    ret, ticket = ilm.ilm_lock_submit(s2, lock_id, lock_op)
+    assert ret == 0
+
+    time.sleep(1)
+
+    ret = ilm.ilm_lock_cancel(s2, lock_id)
+    assert ret == 0
+
+    comps = ilm.ilmCompletionArray(1)
+    r, w, x = select.select([fd], [], [], 60)
+    assert fd in r
+
+    num = ilm.ilm_reap(s2, comps, 1)
+    assert num == 1
+    assert comps[0].ticket == ticket
+    assert comps[0].result == -125      # -ECANCELED
+
+    # Nothing left to cancel
+    ret = ilm.ilm_lock_cancel(s2, lock_id)
+    assert ret == -2                    # -ENOENT
+
+    ret = ilm.ilm_unlock(s1, lock_id)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s1)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s2)
+    assert ret == 0
+
+def test_lock__exclusive_relock_then_other_host(ilm_daemon, reset_devices):
+    ret, s1 = ilm.ilm_connect()
+    assert ret == 0
+    assert s1 > 0
+
+    host_id = HOST1
+    ret = ilm.ilm_set_host_id(s1, host_id, 32)
+
+    ret, s2 = ilm.ilm_connect()
+    assert ret == 0
+    assert s2 > 0
+
+    host_id = HOST2
+    ret = ilm.ilm_set_host_id(s2, host_id, 32)
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    # Release and acquire again, the lock might be handed back from cache
+    for i in range(10):
+        ret = ilm.ilm_lock(s1, lock_id, lock_op)
+        assert ret == 0
+
+        ret = ilm.ilm_unlock(s1, lock_id)
+        assert ret == 0
+
+    ret = ilm.ilm_lock(s1, lock_id, lock_op)
+    assert ret == 0
+
+    ret, count, self = ilm.ilm_get_host_count(s1, lock_id, lock_op)
+    assert ret == 0
+    assert count == 0
+    assert self == 1
+
+    ret = ilm.ilm_unlock(s1, lock_id)
+    assert ret == 0
+
+    # A cached lock must not stop other hosts to acquire it
+    ret = ilm.ilm_lock(s2, lock_id, lock_op)
+    assert ret == 0
+
+    ret = ilm.ilm_unlock(s2, lock_id)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s1)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s2)
+    assert ret == 0
+
+def test_lock__local_shareable_coalesced(ilm_daemon, reset_devices):
+    ret, s1 = ilm.ilm_connect()
+    assert ret == 0
+    assert s1 > 0
+
+    ret, s2 = ilm.ilm_connect()
+    assert ret == 0
+    assert s2 > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_SHAREABLE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s1, lock_id, lock_op)
+    assert ret == 0
+
+    ret = ilm.ilm_lock(s2, lock_id, lock_op)
+    assert ret == 0
+
+    # Both local holders share the single holder on drives
+    ret, count, self = ilm.ilm_get_host_count(s1, lock_id, lock_op)
+    assert ret == 0
+    assert count == 0
+    assert self == 1
+
+    # Cannot convert the mode for the other local holder
+    ret = ilm.ilm_convert(s1, lock_id, ilm.IDM_MODE_EXCLUSIVE)
+    assert ret == -errno.EBUSY
+
+    ret = ilm.ilm_unlock(s1, lock_id)
+    assert ret == 0
+
+    ret, count, self = ilm.ilm_get_host_count(s2, lock_id, lock_op)
+    assert ret == 0
+    assert count == 0
+    assert self == 1
+
+    # The last holder is allowed to convert the mode
+    ret = ilm.ilm_convert(s2, lock_id, ilm.IDM_MODE_EXCLUSIVE)
+    assert ret == 0
+
+    ret = ilm.ilm_lock(s1, lock_id, lock_op)
+    assert ret == -errno.EBUSY
+
+    ret = ilm.ilm_unlock(s2, lock_id)
+    assert ret == 0
+
+    ret, count, self = ilm.ilm_get_host_count(s1, lock_id, lock_op)
+    assert ret == 0
+    assert count == 0
+    assert self == 0
+
+    ret = ilm.ilm_disconnect(s1)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s2)
+    assert ret == 0
+
 def test_lock__get_mode(ilm_daemon, reset_devices):
     ret, s = ilm.ilm_connect()
     assert ret == 0
@@ -1179,6 +1554,361 @@ def test_lock__two_hosts_get_mode(ilm_daemon, reset_devices):
     ret = ilm.ilm_disconnect(s2)
     assert ret == 0
 
+def test_lock__two_hosts_get_mode_after_convert(ilm_daemon, reset_devices):
+    ret, s1 = ilm.ilm_connect()
+    assert ret == 0
+    assert s1 > 0
+
+    host_id = HOST1
+    ret = ilm.ilm_set_host_id(s1, host_id, 32)
+
+    ret, s2 = ilm.ilm_connect()
+    assert ret == 0
+    assert s2 > 0
+
+    host_id = HOST2
+    ret = ilm.ilm_set_host_id(s2, host_id, 32)
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s1, lock_id, lock_op)
+    assert ret == 0
+
+    # Host2 doesn't hold the lock, the queries reuse the resolved drives
+    for i in range(3):
+        ret, mode = ilm.ilm_get_mode(s2, lock_id, lock_op)
+        assert ret == 0
+        assert mode == ilm.IDM_MODE_EXCLUSIVE
+
+    ret = ilm.ilm_convert(s1, lock_id, ilm.IDM_MODE_SHAREABLE)
+    assert ret == 0
+
+    # Must not get the result from before the conversion
+    ret, mode = ilm.ilm_get_mode(s2, lock_id, lock_op)
+    assert ret == 0
+    assert mode == ilm.IDM_MODE_SHAREABLE
+
+    # The queries don't leave the lock in host2's lockspace
+    lock_op.mode = ilm.IDM_MODE_SHAREABLE
+    ret = ilm.ilm_lock(s2, lock_id, lock_op)
+    assert ret == 0
+
+    ret = ilm.ilm_unlock(s1, lock_id)
+    assert ret == 0
+
+    ret = ilm.ilm_unlock(s2, lock_id)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s1)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s2)
+    assert ret == 0
+
+def test_lock__held_lock_repeat_queries(ilm_daemon, reset_devices):
+    ret, s = ilm.ilm_connect()
+    assert ret == 0
+    assert s > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s, lock_id, lock_op)
+    assert ret == 0
+
+    # The repeated queries are answered from the status region
+    for i in range(10):
+        ret, mode = ilm.ilm_get_mode(s, lock_id, lock_op)
+        assert ret == 0
+        assert mode == ilm.IDM_MODE_EXCLUSIVE
+
+        ret, count, self = ilm.ilm_get_host_count(s, lock_id, lock_op)
+        assert ret == 0
+        assert count == 0
+        assert self == 1
+
+    ret = ilm.ilm_convert(s, lock_id, ilm.IDM_MODE_SHAREABLE)
+    assert ret == 0
+
+    # Must not get the published state from before the conversion
+    ret, mode = ilm.ilm_get_mode(s, lock_id, lock_op)
+    assert ret == 0
+    assert mode == ilm.IDM_MODE_SHAREABLE
+
+    ret = ilm.ilm_unlock(s, lock_id)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s)
+    assert ret == 0
+
+def test_lock__stats(ilm_daemon, reset_devices):
+    ret, s = ilm.ilm_connect()
+    assert ret == 0
+    assert s > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s, lock_id, lock_op)
+    assert ret == 0
+
+    ret = ilm.ilm_unlock(s, lock_id)
+    assert ret == 0
+
+    stats = ilm.ilmDriveStatsArray(16)
+    num = ilm.ilm_get_stats(s, stats.cast(), 16)
+    assert num >= 2
+
+    # Every drive has been locked and unlocked at least once
+    locked = 0
+    for i in range(min(num, 16)):
+        entry = stats[i]
+        if entry.get_count(ilm.ILM_STATS_OP_LOCK) == 0:
+            continue
+
+        locked += 1
+        assert entry.get_count(ilm.ILM_STATS_OP_UNLOCK) > 0
+
+        total = 0
+        for b in range(ilm.ILM_STATS_BUCKET_NUM):
+            total += entry.get_hist(ilm.ILM_STATS_OP_LOCK, b)
+        assert total == entry.get_count(ilm.ILM_STATS_OP_LOCK)
+
+    assert locked >= 2
+
+    ret = ilm.ilm_disconnect(s)
+    assert ret == 0
+
+def test_lock__stage_stats(ilm_daemon, reset_devices):
+    ret, s = ilm.ilm_connect()
+    assert ret == 0
+    assert s > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s, lock_id, lock_op)
+    assert ret == 0
+
+    ret = ilm.ilm_unlock(s, lock_id)
+    assert ret == 0
+
+    stats = ilm.ilm_stage_stats()
+    ret = ilm.ilm_get_stage_stats(s, stats)
+    assert ret == 0
+
+    # The lock and unlock have been sent to both drives
+    assert stats.get_count(ilm.ILM_STAGE_ISSUE) >= 2
+    assert stats.get_count(ilm.ILM_STAGE_DRIVE) >= 4
+    assert stats.get_count(ilm.ILM_STAGE_QUORUM) >= 1
+    assert stats.get_count(ilm.ILM_STAGE_TOTAL) >= \
+        stats.get_count(ilm.ILM_STAGE_QUORUM)
+
+    total = 0
+    for b in range(ilm.ILM_STATS_BUCKET_NUM):
+        total += stats.get_hist(ilm.ILM_STAGE_TOTAL, b)
+    assert total == stats.get_count(ilm.ILM_STAGE_TOTAL)
+
+    ret = ilm.ilm_disconnect(s)
+    assert ret == 0
+
+def test_lock__lock_stats(ilm_daemon, reset_devices):
+    ret, s1 = ilm.ilm_connect()
+    assert ret == 0
+    assert s1 > 0
+
+    ret, s2 = ilm.ilm_connect()
+    assert ret == 0
+    assert s2 > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    host_id = HOST1
+    ret = ilm.ilm_set_host_id(s1, host_id, 32)
+
+    host_id = HOST2
+    ret = ilm.ilm_set_host_id(s2, host_id, 32)
+
+    ret = ilm.ilm_lock(s1, lock_id, lock_op)
+    assert ret == 0
+
+    # The other host is rejected by the drives holding the lock
+    ret = ilm.ilm_lock_deadline(s2, lock_id, lock_op, 0)
+    assert ret != 0
+
+    ret = ilm.ilm_unlock(s1, lock_id)
+    assert ret == 0
+
+    stats = ilm.ilmLockStatsArray(ilm.ILM_LOCK_STATS_NUM)
+    num = ilm.ilm_get_lock_stats(s1, stats.cast(), ilm.ILM_LOCK_STATS_NUM)
+    assert num >= 1
+
+    # The contended lock is the first, and sorted by contention
+    entry = stats[0]
+    assert entry.attempts >= 2
+    assert entry.acquired >= 1
+    assert entry.retries >= 1
+    assert entry.busy >= 1
+    assert entry.contention >= entry.retries + entry.busy
+
+    for i in range(1, min(num, ilm.ILM_LOCK_STATS_NUM)):
+        assert stats[i - 1].contention >= stats[i].contention
+
+    ret = ilm.ilm_disconnect(s1)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s2)
+    assert ret == 0
+
+def test_lock__renew_stats(ilm_daemon, reset_devices):
+    ret, s = ilm.ilm_connect()
+    assert ret == 0
+    assert s > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s, lock_id, lock_op)
+    assert ret == 0
+
+    # Let the lockspace renew the lock a few times, then stall it
+    time.sleep(5)
+
+    ret = ilm.ilm_stop_renew(s)
+    assert ret == 0
+
+    time.sleep(5)
+
+    num_max = ilm.ILM_DRIVE_MAX_NUM + ilm.ILM_RENEW_STATS_LOCK_NUM
+    stats = ilm.ilmRenewStatsArray(num_max)
+    num = ilm.ilm_get_renew_stats(s, stats.cast(), num_max)
+    assert num >= 3
+
+    drives = [stats[i] for i in range(num)
+              if stats[i].type == ilm.ILM_RENEW_STATS_DRIVE]
+    locks = [stats[i] for i in range(num)
+             if stats[i].type == ilm.ILM_RENEW_STATS_LOCK]
+    assert len(drives) >= 2
+    assert len(locks) == 1
+
+    # The stalled lock has lost at least the time since renewal stopped
+    entry = locks[0]
+    assert entry.count >= 1
+    assert entry.margin_ms <= entry.period_ms - 4000
+    assert entry.min_margin_ms <= entry.margin_ms
+    assert sum(entry.hist[i] for i in range(ilm.ILM_STATS_BUCKET_NUM)) \
+        == entry.count
+
+    for entry in drives:
+        assert entry.count >= 1
+        assert entry.max_gap_ms >= 1
+
+    ret = ilm.ilm_start_renew(s)
+    assert ret == 0
+
+    ret = ilm.ilm_unlock(s, lock_id)
+    assert ret == 0
+
+    # A released lock is not reported anymore
+    num = ilm.ilm_get_renew_stats(s, stats.cast(), num_max)
+    assert all(stats[i].type == ilm.ILM_RENEW_STATS_DRIVE
+               for i in range(num))
+
+    ret = ilm.ilm_disconnect(s)
+    assert ret == 0
+
+def test_lock__metrics(ilm_daemon, reset_devices):
+    ret, s = ilm.ilm_connect()
+    assert ret == 0
+    assert s > 0
+
+    lock_id = ilm.idm_lock_id()
+    lock_id.set_vg_uuid(LOCK1_VG_UUID)
+    lock_id.set_lv_uuid(LOCK1_LV_UUID)
+
+    lock_op = ilm.idm_lock_op()
+    lock_op.mode = ilm.IDM_MODE_EXCLUSIVE
+    lock_op.drive_num = 2
+    lock_op.set_drive_names(0, BLK_DEVICE1)
+    lock_op.set_drive_names(1, BLK_DEVICE2)
+    lock_op.timeout = 60000     # Timeout: 60s
+
+    ret = ilm.ilm_lock(s, lock_id, lock_op)
+    assert ret == 0
+
+    metrics = ilm_util.read_metrics()
+    assert metrics["seagate_ilm_clients"] >= 1
+    assert metrics["seagate_ilm_lockspaces"] >= 1
+    assert metrics["seagate_ilm_locks"] >= 1
+    assert metrics["seagate_ilm_workers"] <= \
+        metrics["seagate_ilm_workers_max"]
+    assert metrics["seagate_ilm_cmd_handled_total"] >= 2
+
+    # Every histogram with samples ends up with all of them in +Inf
+    name = "seagate_ilm_drive_command_latency_seconds"
+    counts = [k for k in metrics if k.startswith(name + "_count")]
+    assert counts
+    for k in counts:
+        labels = k[k.index("{") + 1:-1]
+        inf = '%s_bucket{%s,le="+Inf"}' % (name, labels)
+        assert metrics[inf] == metrics[k]
+
+    ret = ilm.ilm_unlock(s, lock_id)
+    assert ret == 0
+
+    ret = ilm.ilm_disconnect(s)
+    assert ret == 0
+
 def test_lock__get_host_count(ilm_daemon, reset_devices):
     ret, s = ilm.ilm_connect()
     assert ret == 0
@@ -26,7 +26,9 @@ def start_daemon():
            # Log level is LOG_WARNING for log file
            "-L", "4",
            # stderr level is disabled
-           "-E", "0",]
+           "-E", "0",
+           # serve metrics for test_lock__metrics
+           "-P", "1",]
     return subprocess.Popen(cmd)
 
 def wait_for_daemon(timeout):
@@ -49,3 +51,32 @@ def wait_for_daemon(timeout):
             time.sleep(0.05)
     finally:
         s.close()
+
+def read_metrics():
+    """
+    Scrape the metrics socket, returns {"name{labels}": value}
+    """
+    path = os.path.join(os.environ["ILM_RUN_DIR"], "metrics.sock")
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        s.connect(path)
+        s.sendall(b"GET /metrics HTTP/1.0\r\n\r\n")
+        data = b""
+        while True:
+            buf = s.recv(65536)
+            if not buf:
+                break
+            data += buf
+    finally:
+        s.close()
+
+    header, body = data.decode().split("\r\n\r\n", 1)
+    assert header.startswith("HTTP/1.0 200")
+
+    metrics = {}
+    for line in body.splitlines():
+        if not line or line.startswith("#"):
+            continue
+        name, value = line.rsplit(" ", 1)
+        metrics[name] = float(value)
+    return metrics
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: LGPL-2.1-only
+# Copyright (C) 2023 Seagate Technology LLC and/or its Affiliates.
+
+"""
+Decode a flight recorder dump of the daemon (see src/recorder.h), which is
+written into the log directory as seagate_ilm-recorder-REASON-TIME.bin when
+a lockspace fails to renew or the daemon receives SIGUSR1.
+
+    recorder_decode.py [-d DRIVE] [-l LOCK_ID] [-e] DUMP
+
+Prints one drive command per line in completion order.  -d keeps the
+commands of a drive path or WWN, -l the commands of a lock ID given in hex
+as passed to ilm_lock(), -e only the failed commands.
+"""
+
+import argparse
+import datetime
+import signal
+import struct
+import sys
+
+MAGIC = 0x314352464d4c49
+VERSION = 1
+
+HEADER = struct.Struct("=QIIIIIIQQ32s")
+PATH = struct.Struct("=Q64s")
+REC = struct.Struct("=QQQQQIiHBBHHQ")
+
+LOCK_ID_LEN = 64
+
+OPS = ["lock", "unlock", "refresh", "break", "destroy", "read_group",
+       "inquiry"]
+TRANSPORTS = ["scsi", "nvme"]
+SENSE_KEYS = ["NO_SENSE", "RECOVERED_ERROR", "NOT_READY", "MEDIUM_ERROR",
+              "HARDWARE_ERROR", "ILLEGAL_REQUEST", "UNIT_ATTENTION",
+              "DATA_PROTECT", "BLANK_CHECK", "VENDOR_SPECIFIC",
+              "COPY_ABORTED", "ABORTED_COMMAND", "0xc", "VOLUME_OVERFLOW",
+              "MISCOMPARE", "0xf"]
+
+
+def lock_hash(lock_id):
+    """ FNV-1a of the lock ID, the same as ilm_recorder_hash() """
+    h = 0xcbf29ce484222325
+    for b in lock_id.ljust(LOCK_ID_LEN, b"\0")[:LOCK_ID_LEN]:
+        h ^= b
+        h = (h * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+
+def fmt_time(us):
+    t = datetime.datetime.fromtimestamp(us // 1000000)
+    return "%s.%06d" % (t.strftime("%Y-%m-%d %H:%M:%S"), us % 1000000)
+
+
+def fmt_status(transport, status):
+    if not status:
+        return "-"
+    if transport == 0:
+        return SENSE_KEYS[status & 0xf]
+    return "sct=%d sc=0x%02x" % (status >> 8, status & 0xff)
+
+
+def read_dump(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if len(data) < HEADER.size:
+        raise ValueError("truncated header")
+
+    (magic, version, rec_size, path_size, path_num, rec_num, pid, time_us,
+     dropped, reason) = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        raise ValueError("bad magic 0x%x" % magic)
+    if version != VERSION or rec_size != REC.size or path_size != PATH.size:
+        raise ValueError("unsupported version %d" % version)
+
+    header = {
+        "pid": pid,
+        "time_us": time_us,
+        "dropped": dropped,
+        "reason": reason.rstrip(b"\0").decode(errors="replace"),
+    }
+
+    off = HEADER.size
+    paths = []
+    for _ in range(path_num):
+        wwn, p = PATH.unpack_from(data, off)
+        paths.append((wwn, p.rstrip(b"\0").decode(errors="replace")))
+        off += PATH.size
+
+    recs = []
+    for _ in range(rec_num):
+        if off + REC.size > len(data):
+            raise ValueError("truncated records")
+        recs.append(REC.unpack_from(data, off))
+        off += REC.size
+
+    return header, paths, recs
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a flight recorder "
+                                     "dump of seagate_ilm")
+    parser.add_argument("dump")
+    parser.add_argument("-d", "--drive", help="drive path or WWN")
+    parser.add_argument("-l", "--lock", help="lock ID in hex")
+    parser.add_argument("-e", "--errors", action="store_true",
+                        help="only failed commands")
+    args = parser.parse_args()
+
+    signal.signal(signal.SIGPIPE, signal.SIG_DFL)
+
+    try:
+        header, paths, recs = read_dump(args.dump)
+    except (OSError, ValueError) as e:
+        print("%s: %s" % (args.dump, e), file=sys.stderr)
+        return 1
+
+    print("# pid %d reason %s dumped at %s, %d commands, %d older "
+          "overwritten" % (header["pid"], header["reason"],
+                           fmt_time(header["time_us"]), len(recs),
+                           header["dropped"]))
+    print("# %-26s %-16s %-16s %-4s %-10s %-16s %10s %6s %-16s %s" %
+          ("time", "path", "wwn", "xprt", "op", "lock", "latency_us",
+           "result", "status", "request"))
+
+    want_hash = lock_hash(bytes.fromhex(args.lock)) if args.lock else None
+
+    for (seq, time_us, wwn, lhash, trace_id, lat, result, path_idx, op,
+         transport, status, _, _) in recs:
+        path = paths[path_idx][1] if path_idx < len(paths) else "?"
+
+        if args.drive and args.drive not in (path, "%x" % wwn,
+                                             "0x%x" % wwn):
+            continue
+        if want_hash is not None and lhash != want_hash:
+            continue
+        if args.errors and result >= 0:
+            continue
+
+        print("%-28s %-16s %016x %-4s %-10s %-16s %10d %6d %-16s %s" %
+              (fmt_time(time_us), path, wwn,
+               TRANSPORTS[transport] if transport < 2 else transport,
+               OPS[op] if op < len(OPS) else op,
+               "%016x" % lhash if lhash else "-", lat, result,
+               fmt_status(transport, status),
+               trace_id if trace_id else "-"))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())